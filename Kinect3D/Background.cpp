@@ -0,0 +1,110 @@
+#include "Background.h"
+
+#include <emmintrin.h>
+#include <algorithm>
+
+using namespace std;
+
+// variance of a new pixel model in square millimetres, the model tightens as frames arrive
+static const float initial_variance = 20.0f * 20.0f;
+
+// number of bits set in a byte
+static inline unsigned bitCount8( unsigned bits ){
+    bits = bits - ((bits >> 1) & 0x55);
+    bits = (bits & 0x33) + ((bits >> 2) & 0x33);
+    return (bits + (bits >> 4)) & 0x0f;
+}
+
+BackgroundModel::BackgroundModel( float rate, float fg_rate, float k, float difference ) :
+    learning_rate(rate), foreground_rate(fg_rate), deviations(k), min_difference(difference), update_time(0) {}
+
+void BackgroundModel::reset(){
+    mean.clear();
+    variance.clear();
+}
+
+unsigned BackgroundModel::update( const uint16_t * depth, const Intrinsics & intrinsics, vector<uint8_t> & mask ){
+    const double start = getTime();
+    const int count = intrinsics.width * intrinsics.height;
+    if(int(mean.size()) != count){
+        mean.assign(count, 0.0f);
+        variance.assign(count, 0.0f);
+    }
+    mask.resize(count);
+
+    const float k2 = deviations * deviations, relative2 = min_difference * min_difference;
+    const __m128 rate = _mm_set1_ps(learning_rate), slow_rate = _mm_set1_ps(foreground_rate);
+    const __m128 deviations2 = _mm_set1_ps(k2), min_difference2 = _mm_set1_ps(relative2);
+    const __m128 fresh_variance = _mm_set1_ps(initial_variance);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i shift = _mm_cvtsi32_si128(intrinsics.depth_shift);
+    const int blocks = count / 8;
+    unsigned foreground = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:foreground)
+    for(int block = 0; block < blocks; ++block){
+        const int i = block * 8;
+        const __m128i raw = _mm_srl_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + i)), shift);
+        const __m128i halves[2] = { _mm_unpacklo_epi16(raw, _mm_setzero_si128()), _mm_unpackhi_epi16(raw, _mm_setzero_si128()) };
+        __m128i is_foreground[2];
+        for(int h = 0; h < 2; ++h){
+            float * m = &mean[i + 4 * h];
+            float * v = &variance[i + 4 * h];
+            const __m128 d = _mm_cvtepi32_ps(halves[h]);
+            const __m128 old_mean = _mm_loadu_ps(m), old_variance = _mm_loadu_ps(v);
+            const __m128 valid = _mm_cmpgt_ps(d, zero);
+            const __m128 known = _mm_cmpgt_ps(old_mean, zero);
+
+            // outside of k standard deviations, but at least a fraction of the depth away
+            const __m128 diff = _mm_sub_ps(d, old_mean);
+            const __m128 diff2 = _mm_mul_ps(diff, diff);
+            const __m128 threshold2 = _mm_max_ps(_mm_mul_ps(deviations2, old_variance), _mm_mul_ps(min_difference2, _mm_mul_ps(old_mean, old_mean)));
+            const __m128 outside = _mm_and_ps(_mm_cmpgt_ps(diff2, threshold2), _mm_and_ps(valid, known));
+            const __m128 closer = _mm_and_ps(outside, _mm_cmplt_ps(diff, zero));
+            // new pixels and surfaces behind the background restart the model
+            const __m128 restart = _mm_and_ps(valid, _mm_or_ps(_mm_andnot_ps(known, valid), _mm_andnot_ps(closer, outside)));
+            const __m128 blend = _mm_andnot_ps(restart, _mm_and_ps(valid, known));
+
+            // foreground pixels only nudge the mean, background pixels update mean and variance
+            const __m128 weight = _mm_or_ps(_mm_and_ps(closer, slow_rate), _mm_andnot_ps(closer, rate));
+            __m128 new_mean = _mm_add_ps(old_mean, _mm_mul_ps(weight, diff));
+            __m128 new_variance = _mm_add_ps(old_variance, _mm_andnot_ps(closer, _mm_mul_ps(rate, _mm_sub_ps(diff2, old_variance))));
+            new_mean = _mm_or_ps(_mm_and_ps(blend, new_mean), _mm_andnot_ps(blend, old_mean));
+            new_variance = _mm_or_ps(_mm_and_ps(blend, new_variance), _mm_andnot_ps(blend, old_variance));
+            new_mean = _mm_or_ps(_mm_and_ps(restart, d), _mm_andnot_ps(restart, new_mean));
+            new_variance = _mm_or_ps(_mm_and_ps(restart, fresh_variance), _mm_andnot_ps(restart, new_variance));
+            _mm_storeu_ps(m, new_mean);
+            _mm_storeu_ps(v, new_variance);
+
+            is_foreground[h] = _mm_castps_si128(closer);
+        }
+        // all ones lanes saturate to 0xff bytes
+        const __m128i words = _mm_packs_epi32(is_foreground[0], is_foreground[1]);
+        const __m128i bytes = _mm_packs_epi16(words, words);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(&mask[i]), bytes);
+        foreground += bitCount8(_mm_movemask_epi8(bytes) & 0xff);
+    }
+
+    // the same for pixels left over at the end
+    for(int i = blocks * 8; i < count; ++i){
+        const float d = float(depth[i] >> intrinsics.depth_shift);
+        mask[i] = 0;
+        if(d == 0)
+            continue;
+        const float diff = d - mean[i];
+        const bool outside = mean[i] > 0 && diff * diff > max(k2 * variance[i], relative2 * mean[i] * mean[i]);
+        if(outside && diff < 0){
+            mask[i] = 255;
+            ++foreground;
+            mean[i] += foreground_rate * diff;
+        } else if(mean[i] == 0 || outside){
+            mean[i] = d;
+            variance[i] = initial_variance;
+        } else {
+            mean[i] += learning_rate * diff;
+            variance[i] += learning_rate * (diff * diff - variance[i]);
+        }
+    }
+    update_time = getTime() - start;
+    return foreground;
+}
@@ -0,0 +1,40 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Per pixel statistical model of the background depth, to find foreground objects at any
+// depth resolution without the player index of the skeleton mode. Every pixel keeps a
+// running mean and variance of its depth, updated with an exponential moving average. A
+// pixel is foreground if it is closer than the background by more than a few standard
+// deviations. Pixels that turn out farther than the background show a surface that was
+// hidden so far and restart their model from the new depth, since the farthest surface
+// seen is the background. Classification and update run in one SSE2 pass over the image,
+// 8 pixels at a time, split across threads with OpenMP.
+class BackgroundModel {
+public:
+    BackgroundModel( float learning_rate = 0.02f, float foreground_rate = 0.001f, float deviations = 3.0f, float min_difference = 0.03f );
+
+    // forgets the background, the next frame becomes the initial model
+    void reset();
+
+    // Classifies every pixel of a depth frame and updates the model with it. The mask is
+    // set to 255 for foreground pixels and 0 otherwise, returns the number of foreground pixels.
+    unsigned update( const uint16_t * depth, const Intrinsics & intrinsics, std::vector<uint8_t> & mask );
+
+    // time taken by the last update in seconds
+    double updateTime() const { return update_time; }
+
+protected:
+    float learning_rate;        // weight of a new background depth in the running averages
+    float foreground_rate;      // the same for foreground depths, stationary objects slowly become background
+    float deviations;           // standard deviations from the mean depth that are still background
+    float min_difference;       // smallest foreground distance relative to the background depth, for noise free pixels
+    std::vector<float> mean;    // millimetres, 0 for pixels without a model yet
+    std::vector<float> variance;
+    double update_time;
+};
+
+#endif // BACKGROUND_H
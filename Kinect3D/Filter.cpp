@@ -0,0 +1,104 @@
+#include "Filter.h"
+
+#include <emmintrin.h>
+#include <algorithm>
+
+using namespace std;
+
+DepthFilter::DepthFilter( int difference, int support ) : max_difference(difference), min_support(support), filter_time(0) {}
+
+// millimetres of a raw value, values with the top bit set are invalid
+static inline int millimetres( const uint16_t raw, const int shift ){
+    const int value = raw >> shift;
+    return value & 0x8000 ? 0 : value;
+}
+
+void DepthFilter::applyReference( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, int shift, int max_difference, int min_support ){
+    const int W = in.size().x, H = in.size().y;
+    const uint16_t low_bits = uint16_t((1 << shift) - 1);
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x){
+            const int center = millimetres(in[y][x], shift);
+            int sum = 0, count = 0;
+            if(center)
+                for(int dy = max(y - 1, 0); dy <= min(y + 1, H - 1); ++dy)
+                    for(int dx = max(x - 1, 0); dx <= min(x + 1, W - 1); ++dx){
+                        const int d = millimetres(in[dy][dx], shift);
+                        if(d && abs(d - center) < max_difference){
+                            sum += d;
+                            ++count;
+                        }
+                    }
+            // the center counts itself
+            const int value = count > min_support ? (sum + count / 2) / count : 0;
+            out[y][x] = uint16_t((value << shift) | (in[y][x] & low_bits));
+        }
+}
+
+void DepthFilter::apply( SubImage<uint16_t> depth, int shift ){
+    const double start = getTime();
+    const int W = depth.size().x, H = depth.size().y;
+    // every block of 8 pixels reads 8 values from one column left to one column right of it
+    const int blocks = (W + 7) / 8, stride = blocks * 8 + 8;
+    padded.assign(stride * (H + 2), 0);
+    const __m128i bits = _mm_cvtsi32_si128(shift);
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        const uint16_t * in = depth[y];
+        uint16_t * out = &padded[(y + 1) * stride + 1];
+        int x = 0;
+        for(; x + 8 <= W; x += 8){
+            const __m128i value = _mm_srl_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x)), bits);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), _mm_andnot_si128(_mm_srai_epi16(value, 15), value));
+        }
+        for(; x < W; ++x)
+            out[x] = uint16_t(millimetres(in[x], shift));
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i threshold = _mm_set1_epi16(short(min(max_difference, 32767)));
+    const __m128i support = _mm_set1_epi16(short(min_support));
+    const __m128i low_bits = _mm_set1_epi16(short((1 << shift) - 1));
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        uint16_t * row = depth[y];
+        for(int block = 0; block < blocks; ++block){
+            const int x = block * 8;
+            const uint16_t * center_row = &padded[(y + 1) * stride + x + 1];
+            const __m128i center = _mm_loadu_si128(reinterpret_cast<const __m128i *>(center_row));
+            const __m128i center_valid = _mm_andnot_si128(_mm_cmpeq_epi16(center, zero), _mm_set1_epi16(-1));
+            __m128i count = zero, sum_low = zero, sum_high = zero;
+            for(int dy = -1; dy <= 1; ++dy)
+                for(int dx = -1; dx <= 1; ++dx){
+                    // the depths are below 32768, so their differences fit signed 16 bits
+                    const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(center_row + dy * stride + dx));
+                    const __m128i difference = _mm_max_epi16(_mm_sub_epi16(d, center), _mm_sub_epi16(center, d));
+                    const __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi16(d, zero), _mm_and_si128(center_valid, _mm_cmplt_epi16(difference, threshold)));
+                    const __m128i value = _mm_and_si128(d, valid);
+                    count = _mm_sub_epi16(count, valid);
+                    sum_low = _mm_add_epi32(sum_low, _mm_unpacklo_epi16(value, zero));
+                    sum_high = _mm_add_epi32(sum_high, _mm_unpackhi_epi16(value, zero));
+                }
+
+            // (sum + count / 2) / count is exact in floats, as in DepthPyramid
+            const __m128i divisor = _mm_max_epi16(count, _mm_set1_epi16(1));
+            const __m128i rounding = _mm_srli_epi16(count, 1);
+            const __m128 low = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(sum_low, _mm_unpacklo_epi16(rounding, zero))), _mm_cvtepi32_ps(_mm_unpacklo_epi16(divisor, zero)));
+            const __m128 high = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(sum_high, _mm_unpackhi_epi16(rounding, zero))), _mm_cvtepi32_ps(_mm_unpackhi_epi16(divisor, zero)));
+            __m128i average = _mm_packs_epi32(_mm_cvttps_epi32(low), _mm_cvttps_epi32(high));
+            // invalid centers count nothing, isolated ones only themselves
+            average = _mm_and_si128(average, _mm_cmpgt_epi16(count, support));
+
+            if(x + 8 <= W){
+                const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(row + x), _mm_or_si128(_mm_sll_epi16(average, bits), _mm_and_si128(raw, low_bits)));
+            } else {
+                uint16_t values[8];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(values), average);
+                for(int i = 0; x + i < W; ++i)
+                    row[x + i] = uint16_t((values[i] << shift) | (row[x + i] & ((1 << shift) - 1)));
+            }
+        }
+    }
+    filter_time = getTime() - start;
+}
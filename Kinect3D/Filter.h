@@ -0,0 +1,36 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Edge preserving smoothing of a depth frame, the first step of processing before normals,
+// points and tracking use it. Every valid pixel becomes the average of the valid pixels of its
+// 3x3 neighbourhood within max_difference millimetres of it, which reduces the noise of the
+// sensor on surfaces without mixing the depths on both sides of an edge. Pixels with fewer
+// than min_support such neighbours are speckles or flying pixels between two surfaces and
+// become invalid. Holes are not filled, and the image border only uses the neighbours inside
+// the image. Rows are filtered in parallel with OpenMP, 8 pixels at a time with SSE2.
+class DepthFilter {
+public:
+    DepthFilter( int max_difference = 30, int min_support = 2 );
+
+    // Filters a depth image in place. Values shifted right by shift are millimetres, as with
+    // Intrinsics::depth_shift, and the bits below shift, the player index, are kept.
+    void apply( SubImage<uint16_t> depth, int shift = 0 );
+
+    // time taken by the last call to apply in seconds
+    double filterTime() const { return filter_time; }
+
+    // the same one pixel at a time from in to out, as the reference for tests and benchmarks
+    static void applyReference( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, int shift, int max_difference, int min_support );
+
+protected:
+    int max_difference, min_support;
+    // the input in millimetres with a border of invalid pixels, rows padded to blocks of 8
+    std::vector<uint16_t> padded;
+    double filter_time;
+};
+
+#endif // FILTER_H
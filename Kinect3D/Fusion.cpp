@@ -0,0 +1,382 @@
+#include "Fusion.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <emmintrin.h>
+
+using namespace std;
+
+// voxels keep averaging over this many frames, older observations fade out beyond
+static const int max_weight = 64;
+// range of depth measurements fused and searched by the raycast, in metres
+static const float near_depth = 0.4f;
+static const float far_depth = 4.0f;
+static const uint64_t empty_key = ~uint64_t(0);
+
+// floor for the coordinate ranges used here, much cheaper than the library call
+static inline int fastFloor( const float x ){
+    const int i = int(x);
+    return i - (x < i);
+}
+
+TsdfVolume::TsdfVolume( float voxel, float trunc, unsigned max ) : voxel_size(voxel), truncation(trunc), brick_size(voxel * BRICK), max_bricks(max), frame(0), overflow(false) {
+    // a hash table at most half full keeps probe sequences short
+    unsigned bits = 1;
+    while((1u << bits) < 2 * max_bricks)
+        ++bits;
+    hash_shift = 64 - bits;
+    keys.assign(size_t(1) << bits, empty_key);
+    slots.assign(keys.size(), -1);
+}
+
+void TsdfVolume::reset(){
+    bricks.clear();
+    fill(keys.begin(), keys.end(), empty_key);
+    fill(slots.begin(), slots.end(), -1);
+    visible.clear();
+    overflow = false;
+}
+
+uint64_t TsdfVolume::brickKey( int x, int y, int z ){
+    const uint64_t mask = (1 << 21) - 1;
+    return (uint64_t(x) & mask) | ((uint64_t(y) & mask) << 21) | ((uint64_t(z) & mask) << 42);
+}
+
+int TsdfVolume::findBrick( int x, int y, int z ) const {
+    const uint64_t key = brickKey(x, y, z);
+    const size_t mask = keys.size() - 1;
+    for(size_t slot = size_t((key * 0x9E3779B97F4A7C15ull) >> hash_shift);; slot = (slot + 1) & mask){
+        if(keys[slot] == key)
+            return slots[slot];
+        if(keys[slot] == empty_key)
+            return -1;
+    }
+}
+
+int TsdfVolume::allocateBrick( int x, int y, int z ){
+    const uint64_t key = brickKey(x, y, z);
+    const size_t mask = keys.size() - 1;
+    size_t slot = size_t((key * 0x9E3779B97F4A7C15ull) >> hash_shift);
+    for(; keys[slot] != empty_key; slot = (slot + 1) & mask){
+        if(keys[slot] == key)
+            return slots[slot];
+    }
+    if(bricks.size() >= max_bricks){
+        overflow = true;
+        return -1;
+    }
+    keys[slot] = key;
+    slots[slot] = int(bricks.size());
+    bricks.resize(bricks.size() + 1);
+    Brick & brick = bricks.back();
+    fill(brick.sdf, brick.sdf + BRICK_VOXELS, int16_t(32767));
+    fill(brick.weight, brick.weight + BRICK_VOXELS, uint16_t(0));
+    brick.x = x;
+    brick.y = y;
+    brick.z = z;
+    brick.frame = 0;
+    return slots[slot];
+}
+
+void TsdfVolume::integrate( const uint16_t * depth, const Intrinsics & intrinsics, const Pose & pose ){
+    ++frame;
+    visible.clear();
+
+    // allocate the bricks around the measured surface, every second pixel is dense enough for bricks of several centimetres
+    const float inverse_brick = 1.0f / brick_size;
+    for(int v = 0; v < intrinsics.height; v += 2)
+        for(int u = 0; u < intrinsics.width; u += 2){
+            const float z = intrinsics.depthInMetres(depth[v * intrinsics.width + u]);
+            if(z < near_depth || z > far_depth)
+                continue;
+            for(int s = -1; s <= 1; ++s){
+                float camera[3], world[3];
+                camera[2] = z + s * truncation;
+                intrinsics.unproject(float(u), float(v), camera[2], camera[0], camera[1]);
+                pose.apply(camera, world);
+                const int index = allocateBrick(fastFloor(world[0] * inverse_brick), fastFloor(world[1] * inverse_brick), fastFloor(world[2] * inverse_brick));
+                if(index >= 0 && bricks[index].frame != frame){
+                    bricks[index].frame = frame;
+                    visible.push_back(index);
+                }
+            }
+        }
+
+    const Pose world_to_camera = pose.inverse();
+    const int count = int(visible.size());
+#pragma omp parallel for schedule(dynamic, 16)
+    for(int i = 0; i < count; ++i)
+        updateBrick(bricks[visible[i]], depth, intrinsics, world_to_camera);
+}
+
+void TsdfVolume::updateBrick( Brick & brick, const uint16_t * depth, const Intrinsics & intrinsics, const Pose & world_to_camera ) const {
+    // camera coordinates of the first voxel center and the steps along the brick axes
+    const float origin[3] = { (brick.x * BRICK + 0.5f) * voxel_size, (brick.y * BRICK + 0.5f) * voxel_size, (brick.z * BRICK + 0.5f) * voxel_size };
+    float base[3];
+    world_to_camera.apply(origin, base);
+    const float * R = world_to_camera.R;
+
+    const __m128 index_low = _mm_set_ps(3, 2, 1, 0);
+    const __m128 index_high = _mm_set_ps(7, 6, 5, 4);
+    const __m128 step_x = _mm_set1_ps(R[0] * voxel_size);
+    const __m128 step_y = _mm_set1_ps(R[3] * voxel_size);
+    const __m128 step_z = _mm_set1_ps(R[6] * voxel_size);
+    const __m128 fx = _mm_set1_ps(intrinsics.mirror_x * intrinsics.fx);
+    const __m128 fy = _mm_set1_ps(intrinsics.fy);
+    const __m128 cx = _mm_set1_ps(intrinsics.cx);
+    const __m128 cy = _mm_set1_ps(intrinsics.cy);
+    const __m128 near_plane = _mm_set1_ps(near_depth);
+    const __m128 minus_truncation = _mm_set1_ps(-truncation);
+    const __m128 inverse_truncation = _mm_set1_ps(1.0f / truncation);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sdf_scale = _mm_set1_ps(32767.0f);
+    const __m128 inverse_sdf_scale = _mm_set1_ps(1.0f / 32767.0f);
+    const __m128 weight_limit = _mm_set1_ps(float(max_weight));
+
+    for(int z = 0; z < BRICK; ++z)
+        for(int y = 0; y < BRICK; ++y){
+            float row[3];
+            for(int r = 0; r < 3; ++r)
+                row[r] = base[r] + (R[r*3 + 1] * y + R[r*3 + 2] * z) * voxel_size;
+            const int offset = (z * BRICK + y) * BRICK;
+
+            for(int half = 0; half < 2; ++half){
+                const __m128 index = half ? index_high : index_low;
+                const __m128 px = _mm_add_ps(_mm_set1_ps(row[0]), _mm_mul_ps(index, step_x));
+                const __m128 py = _mm_add_ps(_mm_set1_ps(row[1]), _mm_mul_ps(index, step_y));
+                const __m128 pz = _mm_add_ps(_mm_set1_ps(row[2]), _mm_mul_ps(index, step_z));
+                const __m128 in_front = _mm_cmpgt_ps(pz, near_plane);
+                // keep the division finite for voxels behind the camera, they are masked out anyway
+                const __m128 inverse_z = _mm_div_ps(one, _mm_max_ps(pz, near_plane));
+                const __m128 u = _mm_add_ps(cx, _mm_mul_ps(_mm_mul_ps(fx, px), inverse_z));
+                const __m128 v = _mm_sub_ps(cy, _mm_mul_ps(_mm_mul_ps(fy, py), inverse_z));
+
+                // gather the measured depth, SSE2 has no gather instruction
+                int iu[4], iv[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(iu), _mm_cvtps_epi32(u));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), _mm_cvtps_epi32(v));
+                const int front = _mm_movemask_ps(in_front);
+                float measured[4];
+                for(int l = 0; l < 4; ++l){
+                    measured[l] = 0;
+                    if(iu[l] >= 0 && iu[l] < intrinsics.width && iv[l] >= 0 && iv[l] < intrinsics.height && (front & (1 << l)))
+                        measured[l] = intrinsics.depthInMetres(depth[iv[l] * intrinsics.width + iu[l]]);
+                }
+                const __m128 d = _mm_loadu_ps(measured);
+                const __m128 sdf = _mm_sub_ps(d, pz);
+                const __m128 update = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_cmpgt_ps(sdf, minus_truncation));
+                if(_mm_movemask_ps(update) == 0)
+                    continue;
+                const __m128 tsdf = _mm_min_ps(_mm_mul_ps(sdf, inverse_truncation), one);
+
+                // running weighted average with the stored values
+                int16_t * sdf_out = brick.sdf + offset + half * 4;
+                uint16_t * weight_out = brick.weight + offset + half * 4;
+                const __m128i stored_sdf = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(sdf_out));
+                const __m128i stored_weight = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(weight_out));
+                const __m128 old_sdf = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(stored_sdf, stored_sdf), 16)), inverse_sdf_scale);
+                const __m128 old_weight = _mm_cvtepi32_ps(_mm_unpacklo_epi16(stored_weight, _mm_setzero_si128()));
+                const __m128 new_weight = _mm_add_ps(old_weight, one);
+                const __m128 new_sdf = _mm_div_ps(_mm_add_ps(_mm_mul_ps(old_sdf, old_weight), tsdf), new_weight);
+
+                const __m128 blended_sdf = _mm_or_ps(_mm_and_ps(update, new_sdf), _mm_andnot_ps(update, old_sdf));
+                const __m128 blended_weight = _mm_or_ps(_mm_and_ps(update, _mm_min_ps(new_weight, weight_limit)), _mm_andnot_ps(update, old_weight));
+                const __m128i sdf_int = _mm_cvtps_epi32(_mm_mul_ps(blended_sdf, sdf_scale));
+                const __m128i weight_int = _mm_cvtps_epi32(blended_weight);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(sdf_out), _mm_packs_epi32(sdf_int, sdf_int));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(weight_out), _mm_packs_epi32(weight_int, weight_int));
+            }
+        }
+}
+
+bool TsdfVolume::sample( const float p[3], float & value, int & brick_cache ) const {
+    const float inverse_voxel = 1.0f / voxel_size;
+    const int gx = fastFloor(p[0] * inverse_voxel), gy = fastFloor(p[1] * inverse_voxel), gz = fastFloor(p[2] * inverse_voxel);
+    const int bx = gx >> 3, by = gy >> 3, bz = gz >> 3;
+    if(brick_cache < 0 || bricks[brick_cache].x != bx || bricks[brick_cache].y != by || bricks[brick_cache].z != bz){
+        brick_cache = findBrick(bx, by, bz);
+        if(brick_cache < 0)
+            return false;
+    }
+    const int voxel = ((gz & 7) * BRICK + (gy & 7)) * BRICK + (gx & 7);
+    const Brick & brick = bricks[brick_cache];
+    if(brick.weight[voxel] == 0)
+        return false;
+    value = brick.sdf[voxel] * (1.0f / 32767.0f);
+    return true;
+}
+
+bool TsdfVolume::interpolate( const float p[3], float & value, float gradient[3], int & brick_cache ) const {
+    // voxel values are stored at voxel centers
+    const float inverse_voxel = 1.0f / voxel_size;
+    const float g[3] = { p[0] * inverse_voxel - 0.5f, p[1] * inverse_voxel - 0.5f, p[2] * inverse_voxel - 0.5f };
+    const int base[3] = { fastFloor(g[0]), fastFloor(g[1]), fastFloor(g[2]) };
+    const float f[3] = { g[0] - base[0], g[1] - base[1], g[2] - base[2] };
+
+    // the corners span up to 2 bricks along each axis, each of them is looked up once
+    const int first[3] = { base[0] >> 3, base[1] >> 3, base[2] >> 3 };
+    int neighbours[8] = { -2, -2, -2, -2, -2, -2, -2, -2 };
+    if(brick_cache >= 0 && bricks[brick_cache].x == first[0] && bricks[brick_cache].y == first[1] && bricks[brick_cache].z == first[2])
+        neighbours[0] = brick_cache;
+    float c[8];
+    for(int i = 0; i < 8; ++i){
+        const int x = base[0] + (i & 1), y = base[1] + ((i >> 1) & 1), z = base[2] + (i >> 2);
+        const int bx = x >> 3, by = y >> 3, bz = z >> 3;
+        int & index = neighbours[(bx - first[0]) | ((by - first[1]) << 1) | ((bz - first[2]) << 2)];
+        if(index == -2)
+            index = findBrick(bx, by, bz);
+        if(index < 0)
+            return false;
+        brick_cache = index;
+        const int voxel = ((z & 7) * BRICK + (y & 7)) * BRICK + (x & 7);
+        const Brick & brick = bricks[index];
+        if(brick.weight[voxel] == 0)
+            return false;
+        c[i] = brick.sdf[voxel] * (1.0f / 32767.0f);
+    }
+
+    // interpolate along x, then y, then z
+    const float x00 = c[0] + (c[1] - c[0]) * f[0], x10 = c[2] + (c[3] - c[2]) * f[0];
+    const float x01 = c[4] + (c[5] - c[4]) * f[0], x11 = c[6] + (c[7] - c[6]) * f[0];
+    const float y0 = x00 + (x10 - x00) * f[1], y1 = x01 + (x11 - x01) * f[1];
+    value = y0 + (y1 - y0) * f[2];
+
+    // gradient of the trilinear interpolant, only the direction is used
+    gradient[0] = ((c[1] - c[0]) * (1 - f[1]) + (c[3] - c[2]) * f[1]) * (1 - f[2]) + ((c[5] - c[4]) * (1 - f[1]) + (c[7] - c[6]) * f[1]) * f[2];
+    gradient[1] = (x10 - x00) * (1 - f[2]) + (x11 - x01) * f[2];
+    gradient[2] = y1 - y0;
+    return true;
+}
+
+void TsdfVolume::raycast( const Intrinsics & intrinsics, const Pose & pose, vector<float> & vertices, vector<float> & normals ) const {
+    const int W = intrinsics.width, H = intrinsics.height;
+    vertices.resize(3 * W * H);
+    normals.resize(3 * W * H);
+    const float nan = numeric_limits<float>::quiet_NaN();
+
+    // Most of a ray runs through empty space without bricks, where every step costs a hash
+    // lookup. As in the ray interval splatting of Niessner et al., the bricks are projected
+    // into tiles of the image first, and each ray only searches the depth range of the bricks
+    // covering its tile.
+    const int tiles_x = (W + TILE - 1) / TILE, tiles_y = (H + TILE - 1) / TILE;
+    vector<float> tile_near(tiles_x * tiles_y, far_depth), tile_far(tiles_x * tiles_y, 0.0f);
+    const Pose world_to_camera = pose.inverse();
+    for(unsigned b = 0; b < bricks.size(); ++b){
+        const Brick & brick = bricks[b];
+        float near_z = far_depth, far_z = 0, min_u = float(W), max_u = -1, min_v = float(H), max_v = -1;
+        bool behind = false;
+        for(int c = 0; c < 8; ++c){
+            const float corner[3] = { (brick.x + (c & 1)) * brick_size, (brick.y + ((c >> 1) & 1)) * brick_size, (brick.z + (c >> 2)) * brick_size };
+            float p[3], u, v;
+            world_to_camera.apply(corner, p);
+            near_z = min(near_z, p[2]);
+            far_z = max(far_z, p[2]);
+            if(p[2] < near_depth){
+                behind = true;
+                continue;
+            }
+            intrinsics.project(p[0], p[1], p[2], u, v);
+            min_u = min(min_u, u);
+            max_u = max(max_u, u);
+            min_v = min(min_v, v);
+            max_v = max(max_v, v);
+        }
+        if(far_z < near_depth || near_z > far_depth)
+            continue;
+        // a brick reaching behind the near plane may cover any pixel
+        if(behind){
+            min_u = min_v = 0;
+            max_u = float(W);
+            max_v = float(H);
+        }
+        const int x0 = max(0, fastFloor(min_u) / TILE), x1 = min(tiles_x - 1, (fastFloor(max_u) + 1) / TILE);
+        const int y0 = max(0, fastFloor(min_v) / TILE), y1 = min(tiles_y - 1, (fastFloor(max_v) + 1) / TILE);
+        for(int y = y0; y <= y1; ++y)
+            for(int x = x0; x <= x1; ++x){
+                float & tile_min = tile_near[y * tiles_x + x], & tile_max = tile_far[y * tiles_x + x];
+                tile_min = min(tile_min, near_z);
+                tile_max = max(tile_max, far_z);
+            }
+    }
+
+#pragma omp parallel for schedule(dynamic, 4)
+    for(int v = 0; v < H; ++v){
+        int brick_cache = -1;
+        for(int u = 0; u < W; ++u){
+            float * vertex = &vertices[3 * (v * W + u)];
+            float * normal = &normals[3 * (v * W + u)];
+            vertex[0] = vertex[1] = vertex[2] = nan;
+            normal[0] = normal[1] = normal[2] = 0;
+
+            // ray direction scaled to unit depth, so that t is the depth along the camera axis
+            float camera[3] = { 0, 0, 1 }, direction[3];
+            intrinsics.unproject(float(u), float(v), 1.0f, camera[0], camera[1]);
+            pose.rotate(camera, direction);
+            const float length = sqrt(direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2]);
+
+            const int tile = (v / TILE) * tiles_x + u / TILE;
+            const float end = min(far_depth, tile_far[tile]);
+            float t = max(near_depth, tile_near[tile]), previous_t = 0, previous_value = 0;
+            bool have_previous = false;
+            while(t < end){
+                const float p[3] = { pose.t[0] + t * direction[0], pose.t[1] + t * direction[1], pose.t[2] + t * direction[2] };
+                float value;
+                if(!sample(p, value, brick_cache)){
+                    // empty space, skip ahead by half a brick
+                    have_previous = false;
+                    t += (brick_cache < 0 ? 0.5f * brick_size : voxel_size) / length;
+                    continue;
+                }
+                if(value < 0){
+                    // a zero crossing from the front, refine it with the interpolated field
+                    if(have_previous && previous_value > 0){
+                        const float q[3] = { pose.t[0] + previous_t * direction[0], pose.t[1] + previous_t * direction[1], pose.t[2] + previous_t * direction[2] };
+                        float before, after, gradient[3];
+                        if(interpolate(q, before, gradient, brick_cache) && interpolate(p, after, gradient, brick_cache) && before > after){
+                            const float hit = previous_t + (t - previous_t) * before / (before - after);
+                            const float s[3] = { pose.t[0] + hit * direction[0], pose.t[1] + hit * direction[1], pose.t[2] + hit * direction[2] };
+                            float ignored;
+                            if(interpolate(s, ignored, gradient, brick_cache)){
+                                const float norm = sqrt(gradient[0]*gradient[0] + gradient[1]*gradient[1] + gradient[2]*gradient[2]);
+                                if(norm > 0){
+                                    for(int i = 0; i < 3; ++i){
+                                        vertex[i] = s[i];
+                                        normal[i] = gradient[i] / norm;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    // either found or looking at the back of a surface
+                    break;
+                }
+                previous_t = t;
+                previous_value = value;
+                have_previous = true;
+                // the distance field bounds the distance to the surface
+                t += max(voxel_size, 0.8f * value * truncation) / length;
+            }
+        }
+    }
+}
+
+void TsdfVolume::makePoints( const vector<float> & vertices, const vector<float> & normals, const Pose & pose, vector<Point> & points ){
+    points.clear();
+    const Pose world_to_camera = pose.inverse();
+    const unsigned count = unsigned(vertices.size() / 3);
+    for(unsigned i = 0; i < count; ++i){
+        if(vertices[3 * i] != vertices[3 * i])
+            continue;
+        // the points of depth frames are drawn in camera coordinates, so are these
+        float vertex[3], normal[3];
+        world_to_camera.apply(&vertices[3 * i], vertex);
+        world_to_camera.rotate(&normals[3 * i], normal);
+        // headlight shading, the normal points away from the surface towards the camera at the origin
+        const float distance = sqrt(vertex[0]*vertex[0] + vertex[1]*vertex[1] + vertex[2]*vertex[2]);
+        const float shade = max(0.0f, -(normal[0]*vertex[0] + normal[1]*vertex[1] + normal[2]*vertex[2]) / distance);
+        const uint32_t grey = uint32_t(40 + 215 * shade);
+        points.push_back(Point(vertex[0], vertex[1], vertex[2], grey | (grey << 8) | (grey << 16) | 0xff000000, normal));
+    }
+}
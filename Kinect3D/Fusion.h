@@ -0,0 +1,71 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Truncated signed distance volume fusing depth frames into one surface model, in the
+// style of KinectFusion (Newcombe et al., ISMAR 2011). The volume is stored sparsely in
+// bricks of 8x8x8 voxels that are only allocated around observed surfaces and found
+// through a hash table (Niessner et al., "Real-time 3D Reconstruction at Scale using
+// Voxel Hashing", 2013), so memory is bounded by the number of bricks instead of the
+// extent of the scene. Integration runs over the bricks seen by a frame in parallel with
+// OpenMP and updates 4 voxels at a time with SSE2.
+class TsdfVolume {
+public:
+    TsdfVolume( float voxel_size = 0.01f, float truncation = 0.04f, unsigned max_bricks = 32768 );
+
+    // removes all bricks
+    void reset();
+
+    // fuses a depth frame seen from the given camera pose, mapping camera to world coordinates
+    void integrate( const uint16_t * depth, const Intrinsics & intrinsics, const Pose & pose );
+
+    // Casts a ray through every pixel of the camera and stores the first zero crossing of the
+    // distance field and its normal in world coordinates, 3 floats per pixel. Pixels without a
+    // surface have a vertex of NaN.
+    void raycast( const Intrinsics & intrinsics, const Pose & pose, std::vector<float> & vertices, std::vector<float> & normals ) const;
+
+    // turns maps raycast from the camera pose into points with normals in the coordinates of that
+    // camera, like the points of a depth frame, shaded by a light at the camera
+    static void makePoints( const std::vector<float> & vertices, const std::vector<float> & normals, const Pose & pose, std::vector<Point> & points );
+
+    unsigned brickCount() const { return unsigned(bricks.size()); }
+    unsigned visibleBricks() const { return unsigned(visible.size()); }
+    // true if a brick could not be allocated because max_bricks was reached
+    bool full() const { return overflow; }
+
+protected:
+    enum { BRICK = 8, BRICK_VOXELS = BRICK * BRICK * BRICK };
+    enum { TILE = 8 };                  // pixels per side of the tiles that bound the raycast
+
+    struct Brick {
+        int16_t sdf[BRICK_VOXELS];      // truncated distance scaled to [-32767, 32767]
+        uint16_t weight[BRICK_VOXELS];  // 0 for unobserved voxels
+        int x, y, z;                    // brick coordinates
+        unsigned frame;                 // last frame that saw this brick
+    };
+
+    static uint64_t brickKey( int x, int y, int z );
+    int findBrick( int x, int y, int z ) const;
+    int allocateBrick( int x, int y, int z );
+    void updateBrick( Brick & brick, const uint16_t * depth, const Intrinsics & intrinsics, const Pose & world_to_camera ) const;
+
+    // nearest voxel value at a world position, returns false if unobserved
+    bool sample( const float p[3], float & value, int & brick_cache ) const;
+    // trilinear value and gradient at a world position, returns false if any voxel is unobserved
+    bool interpolate( const float p[3], float & value, float gradient[3], int & brick_cache ) const;
+
+    float voxel_size, truncation, brick_size;
+    unsigned max_bricks;
+    std::vector<Brick> bricks;
+    std::vector<uint64_t> keys;         // open addressing hash table of brick coordinates
+    std::vector<int> slots;             // brick index for every key
+    unsigned hash_shift;
+    std::vector<int> visible;           // bricks seen by the last integrated frame
+    unsigned frame;
+    bool overflow;
+};
+
+#endif // FUSION_H
@@ -2,16 +2,20 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 #include <vector>
 
 using namespace std;
 
-Kinect3DDevice::Kinect3DDevice(bool skeleton) : use_skeleton(skeleton), m_hThNuiProcess(INVALID_HANDLE_VALUE), m_hEvNuiProcessStop(INVALID_HANDLE_VALUE) {
+Kinect3DDevice::Kinect3DDevice(bool skeleton, bool high_resolution) : use_skeleton(skeleton),
+    video_resolution(high_resolution ? NUI_IMAGE_RESOLUTION_1280x960 : NUI_IMAGE_RESOLUTION_640x480), m_hThNuiProcess(INVALID_HANDLE_VALUE), m_hEvNuiProcessStop(INVALID_HANDLE_VALUE) {
     HRESULT hr;
 
     m_hNextDepthFrameEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
     m_hNextVideoFrameEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
     m_hNextSkeletonEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+    m_hFrameReady = CreateEvent( NULL, FALSE, FALSE, NULL );
+    InitializeCriticalSection( &m_csFrame );
 
     hr =  use_skeleton ? NuiInitialize( NUI_INITIALIZE_FLAG_USES_COLOR | NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX | NUI_INITIALIZE_FLAG_USES_SKELETON ) 
                        : NuiInitialize( NUI_INITIALIZE_FLAG_USES_COLOR | NUI_INITIALIZE_FLAG_USES_DEPTH );
@@ -23,7 +27,7 @@ Kinect3DDevice::Kinect3DDevice(bool skeleton) : use_skeleton(skeleton), m_hThNui
      hr = NuiSkeletonTrackingEnable( m_hNextSkeletonEvent, 0 );
      hr = NuiImageStreamOpen(
         NUI_IMAGE_TYPE_COLOR,
-        NUI_IMAGE_RESOLUTION_640x480,
+        video_resolution,
         0,
         2,
         m_hNextVideoFrameEvent,
@@ -74,6 +78,21 @@ Kinect3DDevice::~Kinect3DDevice(){
         CloseHandle( m_hNextVideoFrameEvent );
         m_hNextVideoFrameEvent = NULL;
     }
+    CloseHandle( m_hFrameReady );
+    DeleteCriticalSection( &m_csFrame );
+}
+
+Intrinsics Kinect3DDevice::getDepthIntrinsics() const {
+    Intrinsics intrinsics;
+    getDepthSize(intrinsics.width, intrinsics.height);
+    // the nominal focal length is given for 320x240 and scales with the resolution
+    intrinsics.fx = intrinsics.fy = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * intrinsics.width / 320.0f;
+    intrinsics.cx = intrinsics.width * 0.5f;
+    intrinsics.cy = intrinsics.height * 0.5f;
+    // same conventions as make3DPoints, mirrored and plain millimetres without the skeleton
+    intrinsics.mirror_x = use_skeleton ? 1.0f : -1.0f;
+    intrinsics.depth_shift = use_skeleton ? 3 : 0;
+    return intrinsics;
 }
 
 DWORD WINAPI Kinect3DDevice::run(LPVOID pParam)
@@ -129,8 +148,9 @@ void Kinect3DDevice::callVideoCallback(){
     NUI_LOCKED_RECT LockedRect;
     pTexture->LockRect( 0, &LockedRect, NULL, 0 );
     if( LockedRect.Pitch != 0 ) {
-        BYTE * pBuffer = (BYTE*) LockedRect.pBits;
-        this->VideoCallback(pBuffer);
+        int w, h;
+        getVideoSize(w, h);
+        this->VideoCallback(SubImage<const uint32_t>(reinterpret_cast<const uint32_t *>(LockedRect.pBits), ImageRef(w, h), LockedRect.Pitch / sizeof(uint32_t)));
     } else {
         cout << "Buffer length of received texture is bogus\r\n" << endl;
     }
@@ -151,8 +171,9 @@ void Kinect3DDevice::callDepthCallback( )
     NUI_LOCKED_RECT LockedRect;
     pTexture->LockRect( 0, &LockedRect, NULL, 0 );
     if( LockedRect.Pitch != 0 ) {
-        BYTE * pBuffer = (BYTE*) LockedRect.pBits;
-        this->DepthCallback(pBuffer);
+        int w, h;
+        getDepthSize(w, h);
+        this->DepthCallback(SubImage<const uint16_t>(reinterpret_cast<const uint16_t *>(LockedRect.pBits), ImageRef(w, h), LockedRect.Pitch / sizeof(uint16_t)));
     } else {
         cout << "Buffer length of received texture is bogus\r\n" << endl;
     }
@@ -172,60 +193,106 @@ void Kinect3DDevice::callSkeletonCallback(){
     // cout << "Skelframe \t" << m_SkeletonFrame.dwFrameNumber << endl;
 }
 
-MyKinect::MyKinect(bool use_skel) : Kinect3DDevice(use_skel) {
+MyKinect::MyKinect(bool use_skel, bool high_resolution) : Kinect3DDevice(use_skel, high_resolution), auto_range(true), frame_number(0), frame_time(0) {
     int w, h;
 
     getVideoSize(w,h);
-    rgb.resize(w*h);
+    rgb.resize(ImageRef(w,h));
         
     getDepthSize(w,h);
-    depth.resize(w*h);
-    depth_texture.resize(w*h);
+    depth.resize(ImageRef(w,h));
+    depth_texture.resize(ImageRef(w,h));
+    if(isUsingSkeleton())
+        players.resize(ImageRef(w,h));
+    setupIngest();
 }
 
-void MyKinect::VideoCallback(void *video){
+void MyKinect::setupIngest(){
+    // millimetres above the player index in the skeleton mode, 1024 bins of 8 mm, and the
+    // texture shows 16 mm per level up to 4 m
+    ingest.setFormat(isUsingSkeleton() ? 3 : 0, 8192, 3, 4);
+}
+
+void MyKinect::enableAutoRange( bool enable ){
+    EnterCriticalSection(&m_csFrame);
+    auto_range = enable;
+    range.reset();
+    if(!enable)
+        setupIngest();
+    LeaveCriticalSection(&m_csFrame);
+}
+
+void MyKinect::VideoCallback(const SubImage<const uint32_t> & video){
     // cout << "rgb" << endl;
-    const uint32_t * data = static_cast<uint32_t *>(video);
-    copy(data, data + rgb.size(), rgb.data());
+    EnterCriticalSection(&m_csFrame);
+    copy(video, rgb);
+    LeaveCriticalSection(&m_csFrame);
     rgb_valid = true;
 }
 
-void MyKinect::DepthCallback(void *depth){
+void MyKinect::DepthCallback(const SubImage<const uint16_t> & depth){
     // cout << "depth" << endl;
-    const uint16_t * data = static_cast<uint16_t *>(depth);
-    // copy raw depth data for saving later
-    copy(data, data + this->depth.size(), this->depth.data());
-    // and transform to 8 bit for rendering, this depends on skeleton data being used
-    transform(data, data + this->depth_texture.size(), this->depth_texture.data(), shift_right<uint16_t>(isUsingSkeleton()?7:4));
-    // this creates a color map representing the texture for rendering
-    // transformDepth2Rgb(data, this->getDepthTexture());
+    EnterCriticalSection(&m_csFrame);
+    // copy raw depth data for saving later, with the 8 bit texture for rendering, the player
+    // index and the histogram in the same pass over the locked frame
+    ingest.process(depth, this->depth, depth_texture, SubImage<Rgb8>(), players);
+    // the texture range follows the histogram of this frame from the next one on
+    if(auto_range && range.update(ingest))
+        range.apply(ingest);
+    ++frame_number;
+    frame_time = getTime();
+    LeaveCriticalSection(&m_csFrame);
     depth_valid = true;
+    SetEvent(m_hFrameReady);
 }
 
 void MyKinect::SkeletonCallback(NUI_SKELETON_DATA  * data){
 }
 
+void MyKinect::copyFrame( Frame & frame ){
+    EnterCriticalSection(&m_csFrame);
+    frame.depth.copy_from(depth);
+    frame.rgb.copy_from(rgb);
+    frame.number = frame_number;
+    frame.captured = frame_time;
+    LeaveCriticalSection(&m_csFrame);
+}
+
 void MyKinect::make3DPoints( vector<Point> & points ) const {
+    make3DPoints(depth.contiguous_data(), rgb.contiguous_data(), points);
+}
+
+void MyKinect::make3DPoints( const uint16_t * depth, const uint32_t * rgb, vector<Point> & points, const float * normals, const uint8_t * mask, vector<uint32_t> * pixels ) const {
     points.clear();
+    if(pixels)
+        pixels->clear();
 
-    int W, H;
+    int W, H, videoW, videoH;
     getDepthSize(W,H);
+    getVideoSize(videoW,videoH);
 
     for(int y = 0; y < H; ++y)
         for( int x = 0; x < W; ++x){
             const uint16_t d = depth[W*y + x]; 
-            if( d == 0)
+            if( d == 0 || (mask && mask[W*y + x] == 0))
                 continue;
             LONG colorX, colorY;
+            // without the skeleton the mirrored depth pixel is given at 320x240, as the API expects
             HRESULT res = isUsingSkeleton() 
-                    ? NuiImageGetColorPixelCoordinatesFromDepthPixel( NUI_IMAGE_RESOLUTION_640x480, NULL, x, y, d, &colorX, &colorY)
-                    : NuiImageGetColorPixelCoordinatesFromDepthPixel( NUI_IMAGE_RESOLUTION_640x480, NULL, (640-x)/2, y/2, d << 3, &colorX, &colorY);
+                    ? NuiImageGetColorPixelCoordinatesFromDepthPixel( video_resolution, NULL, x, y, d, &colorX, &colorY)
+                    : NuiImageGetColorPixelCoordinatesFromDepthPixel( video_resolution, NULL, (W-x)*320/W, y*240/H, d << 3, &colorX, &colorY);
             if(FAILED(res))
                 continue;
-            if(colorX < 0 || colorX > 639 || colorY < 0 || colorY > 479)
+            if(colorX < 0 || colorX >= videoW || colorY < 0 || colorY >= videoH)
                 continue;
             const Vector4 pos = NuiTransformDepthImageToSkeleton(x, y, isUsingSkeleton() ? d : d << 3);
-            points.push_back(Point(isUsingSkeleton()?pos.x:-pos.x, pos.y, pos.z, flipColors(rgb[640*colorY + colorX])));
+            const uint32_t color = flipColors(rgb[videoW*colorY + colorX]);
+            if(normals)
+                points.push_back(Point(isUsingSkeleton()?pos.x:-pos.x, pos.y, pos.z, color, normals + 3*(W*y + x)));
+            else
+                points.push_back(Point(isUsingSkeleton()?pos.x:-pos.x, pos.y, pos.z, color));
+            if(pixels)
+                pixels->push_back(W*y + x);
         }
 }
 
@@ -237,23 +304,24 @@ void MyKinect::make3DSkeletonPoints( vector<Point> & background, vector<Point> &
     player1.clear();
     player2.clear();
 
-    int W, H;
+    int W, H, videoW, videoH;
     getDepthSize(W,H);
+    getVideoSize(videoW,videoH);
 
     for(int y = 0; y < H; ++y)
         for( int x = 0; x < W; ++x){
-            const uint16_t d = depth[W*y + x]; 
+            const uint16_t d = depth[y][x]; 
             if( d == 0)
                 continue;
             LONG colorX, colorY;
-            HRESULT res = NuiImageGetColorPixelCoordinatesFromDepthPixel( NUI_IMAGE_RESOLUTION_640x480, NULL, x, y, d, &colorX, &colorY);
+            HRESULT res = NuiImageGetColorPixelCoordinatesFromDepthPixel( video_resolution, NULL, x, y, d, &colorX, &colorY);
             if(FAILED(res))
                 continue;
-            if(colorX < 0 || colorX > 639 || colorY < 0 || colorY > 479)
+            if(colorX < 0 || colorX >= videoW || colorY < 0 || colorY >= videoH)
                 continue;
             const Vector4 pos = NuiTransformDepthImageToSkeleton(x, y, d );
-            Point p(pos.x, pos.y, pos.z, flipColors(rgb[640*colorY + colorX]));
-            switch(d & 7){
+            Point p(pos.x, pos.y, pos.z, flipColors(rgb[colorY][colorX]));
+            switch(players[y][x]){
             case 0: 
                 background.push_back(p);
                 break;
@@ -270,3 +338,53 @@ void MyKinect::make3DSkeletonPoints( vector<Point> & background, vector<Point> &
 const Vector4 * MyKinect::getSkeleton(const int number) const{
     return m_SkeletonFrame.SkeletonData[number].SkeletonPositions;
 }
+
+void FakeDevice::renderScene( const Intrinsics & intrinsics, const Pose & pose, Image<uint16_t> & depth ){
+    // center and radius of the balls in world coordinates
+    static const float balls[2][4] = { { 0.0f, 0.0f, 1.6f, 0.35f }, { -0.5f, -0.4f, 1.9f, 0.25f } };
+    const float wall = 2.5f, floor = -0.7f, max_distance = 8.0f;
+
+    depth.resize(ImageRef(intrinsics.width, intrinsics.height));
+    const float * origin = pose.t;
+    for(int y = 0; y < intrinsics.height; ++y)
+        for(int x = 0; x < intrinsics.width; ++x){
+            // the ray origin + z * direction reaches depth z in the camera
+            float ray[3], direction[3];
+            intrinsics.unproject(float(x), float(y), 1.0f, ray[0], ray[1]);
+            ray[2] = 1;
+            pose.rotate(ray, direction);
+
+            float z = max_distance;
+            if(direction[2] > 1e-6f)
+                z = min(z, (wall - origin[2]) / direction[2]);
+            if(direction[1] < -1e-6f)
+                z = min(z, (floor - origin[1]) / direction[1]);
+            for(int i = 0; i < 2; ++i){
+                const float o[3] = { origin[0] - balls[i][0], origin[1] - balls[i][1], origin[2] - balls[i][2] };
+                const float a = direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2];
+                const float b = 2 * (o[0]*direction[0] + o[1]*direction[1] + o[2]*direction[2]);
+                const float c = o[0]*o[0] + o[1]*o[1] + o[2]*o[2] - balls[i][3]*balls[i][3];
+                const float discriminant = b*b - 4*a*c;
+                if(discriminant >= 0){
+                    const float hit = (-b - sqrt(discriminant)) / (2*a);
+                    if(hit > 0)
+                        z = min(z, hit);
+                }
+            }
+            depth[y][x] = z < max_distance ? uint16_t(z * 1000) : 0;
+        }
+}
+
+Pose FakeDevice::cameraPose( unsigned frame ){
+    // at 30 Hz the camera moves up to 25 mm and 0.4 degrees per frame
+    const float yaw = 0.1f * sin(frame * 0.07f);
+    Pose pose;
+    pose.R[0] = cos(yaw);
+    pose.R[2] = sin(yaw);
+    pose.R[6] = -sin(yaw);
+    pose.R[8] = cos(yaw);
+    pose.t[0] = 0.25f * sin(frame * 0.1f);
+    pose.t[1] = 0.05f * sin(frame * 0.13f);
+    pose.t[2] = 0.1f * sin(frame * 0.05f);
+    return pose;
+}
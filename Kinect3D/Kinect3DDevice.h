@@ -5,6 +5,8 @@
 #include <NuiApi.h>
 
 #include "helpers.h"
+#include "depth_ingest.h"
+#include "depth_range.h"
 
 class DepthDevice {
 public:
@@ -23,20 +25,40 @@ public:
 
     virtual void make3DPoints( std::vector<Point> & points ) const = 0;
     virtual void make3DSkeletonPoints( std::vector<Point> & background, std::vector<Point> & player1, std::vector<Point> & player2) const = 0;
+
+    // blocks until a new depth frame arrived or the timeout elapsed, returns true for a new frame
+    virtual bool waitForFrame( DWORD timeout ) = 0;
+    // copies the current depth and video buffers consistently into the frame
+    virtual void copyFrame( Frame & frame ) = 0;
+    // creates 3D points from the given depth and video buffers instead of the current ones,
+    // with the normals of the depth pixels if given, 3 floats per pixel as NormalEstimator computes
+    // them, and only for the pixels set in mask if given. pixels, if given, receives the index
+    // y * width + x of the depth pixel of every point.
+    virtual void make3DPoints( const uint16_t * depth, const uint32_t * rgb, std::vector<Point> & points, const float * normals = NULL, const uint8_t * mask = NULL, std::vector<uint32_t> * pixels = NULL ) const = 0;
+    // the camera model of the depth buffer, for algorithms working on the depth image directly
+    virtual Intrinsics getDepthIntrinsics() const = 0;
+
+    // ranges the depth texture to the depths of the scene instead of a fixed scale, if the device supports it
+    virtual void enableAutoRange( bool /*enable*/ ) {}
+    virtual bool autoRangeEnabled() const { return false; }
 };
 
 class Kinect3DDevice : public DepthDevice {
 public:
-    Kinect3DDevice(bool skeleton = false);
+    // high_resolution opens the color stream at 1280x960 instead of 640x480, at 12 instead of 30 Hz
+    Kinect3DDevice(bool skeleton = false, bool high_resolution = false);
     virtual ~Kinect3DDevice();
 
-    virtual void VideoCallback(void *video) = 0;
-    virtual void DepthCallback(void *depth) = 0;
+    // views of the locked frames of the driver with their pitch, valid during the call
+    virtual void VideoCallback(const SubImage<const uint32_t> & video) = 0;
+    virtual void DepthCallback(const SubImage<const uint16_t> & depth) = 0;
     virtual void SkeletonCallback( NUI_SKELETON_DATA  * data) = 0;
 
     void getVideoSize( int & width, int & height ) const {
-        width = 640;
-        height = 480;
+        DWORD w, h;
+        NuiImageResolutionToSize(video_resolution, w, h);
+        width = int(w);
+        height = int(h);
     }
 
     void getDepthSize( int & width, int & height ) const {
@@ -53,6 +75,12 @@ public:
         return use_skeleton;
     }
 
+    Intrinsics getDepthIntrinsics() const;
+
+    bool waitForFrame( DWORD timeout ){
+        return WaitForSingleObject(m_hFrameReady, timeout) == WAIT_OBJECT_0;
+    }
+
 protected:
     static DWORD WINAPI run(LPVOID pParam);
     void callVideoCallback();
@@ -60,6 +88,7 @@ protected:
     void callSkeletonCallback();
 
     bool use_skeleton;
+    NUI_IMAGE_RESOLUTION video_resolution;
 
     HANDLE        m_hNextDepthFrameEvent;
     HANDLE        m_hNextVideoFrameEvent;
@@ -69,6 +98,11 @@ protected:
 
     NUI_SKELETON_FRAME m_SkeletonFrame;
 
+    // guards the frame buffers of subclasses against the processing thread
+    CRITICAL_SECTION m_csFrame;
+    // signalled by subclasses when a new depth frame is available
+    HANDLE        m_hFrameReady;
+
     // thread handling
     HANDLE        m_hThNuiProcess;
     HANDLE        m_hEvNuiProcessStop;
@@ -76,18 +110,24 @@ protected:
 
 class MyKinect : public Kinect3DDevice {
 public:
-    MyKinect(bool use_skel = false);
+    MyKinect(bool use_skel = false, bool high_resolution = false);
 
-    void VideoCallback(void *video);
-    void DepthCallback(void *depth);
+    void VideoCallback(const SubImage<const uint32_t> & video);
+    void DepthCallback(const SubImage<const uint16_t> & depth);
     void SkeletonCallback(NUI_SKELETON_DATA  * data);
 
     bool haveVideoBuffer() const { return rgb_valid; }
     bool haveDepthBuffer() const { return depth_valid; }
 
-    uint32_t * getVideoBuffer() { rgb_valid = false; return rgb.data();  }
-    uint16_t * getDepthBuffer() { depth_valid = false; return depth.data(); }
-    uint8_t * getDepthTexture() { depth_valid = false; return depth_texture.data(); }
+    uint32_t * getVideoBuffer() { rgb_valid = false; return rgb.contiguous_data();  }
+    uint16_t * getDepthBuffer() { depth_valid = false; return depth.contiguous_data(); }
+    uint8_t * getDepthTexture() { depth_valid = false; return depth_texture.contiguous_data(); }
+    // player index of every pixel in the skeleton mode, 0 for the background
+    const Image<uint8_t> & getPlayerMask() const { return players; }
+    // histogram and range of the last depth frame in millimetres
+    const DepthIngest & depthIngest() const { return ingest; }
+    void enableAutoRange( bool enable );
+    bool autoRangeEnabled() const { return auto_range; }
     void getTrackedSkeletons(std::vector<int> & valid_skeletons) { 
         valid_skeletons.clear();
         for(unsigned i = 0; i < NUI_SKELETON_COUNT; ++i){
@@ -100,42 +140,54 @@ public:
     void make3DPoints( std::vector<Point> & points ) const;
     void make3DSkeletonPoints( std::vector<Point> & background, std::vector<Point> & player1, std::vector<Point> & player2) const;
 
+    void copyFrame( Frame & frame );
+    void make3DPoints( const uint16_t * depth, const uint32_t * rgb, std::vector<Point> & points, const float * normals = NULL, const uint8_t * mask = NULL, std::vector<uint32_t> * pixels = NULL ) const;
+
 protected:
-    std::vector<uint32_t> rgb;
-    std::vector<uint16_t> depth;
-    std::vector<uint8_t> depth_texture;
+    // the fixed scale of the depth texture
+    void setupIngest();
+
+    Image<uint32_t> rgb;
+    Image<uint16_t> depth;
+    Image<uint8_t> depth_texture;
+    Image<uint8_t> players;     // empty without the skeleton mode
+    DepthIngest ingest;
+    DepthAutoRange range;
+    bool auto_range;
     bool rgb_valid, depth_valid;
+    unsigned frame_number;
+    double frame_time;
 };
 
 class FakeDevice : public DepthDevice {
 public:
-    FakeDevice() {
+    FakeDevice( int depth_width = 640, int depth_height = 480, int video_width = 640, int video_height = 480 )
+        : depth_width(depth_width), depth_height(depth_height), video_width(video_width), video_height(video_height), frame_number(0) {
         int w, h;
 
         getVideoSize(w,h);
-        rgb.resize(w*h);
+        rgb.resize(ImageRef(w,h));
         
         for(int y = 0; y < h; ++y)
             for(int x = 0; x < w; ++x){
-                rgb[y*w+x] = RGB(x,y,x+y);
+                rgb[y][x] = RGB(x,y,x+y);
             }
 
         getDepthSize(w,h);
-        depth_texture.resize(w*h);
-        for(int y = 0; y < h; ++y)
-            for(int x = 0; x < w; ++x){
-                depth_texture[y*w+x] = 128;
-            }
+        depth_texture.resize(ImageRef(w,h));
+        depth_texture.fill(128);
+
+        renderScene(getDepthIntrinsics(), cameraPose(0), depth);
     }
 
     void getVideoSize( int & width, int & height ) const {
-        width = 640;
-        height = 480;
+        width = video_width;
+        height = video_height;
     }
     
     void getDepthSize( int & width, int & height ) const  {
-        width = 640;
-        height = 480;
+        width = depth_width;
+        height = depth_height;
     }
 
     bool isUsingSkeleton() const { return false; }
@@ -143,27 +195,63 @@ public:
     bool haveVideoBuffer() const { return true; }
     bool haveDepthBuffer() const { return true; }
 
-    uint32_t * getVideoBuffer() { return rgb.data(); }
-    uint16_t * getDepthBuffer() { return NULL; }
-    uint8_t * getDepthTexture() { return depth_texture.data(); }
+    uint32_t * getVideoBuffer() { return rgb.contiguous_data(); }
+    uint16_t * getDepthBuffer() { return depth.contiguous_data(); }
+    uint8_t * getDepthTexture() { return depth_texture.contiguous_data(); }
     void getTrackedSkeletons(std::vector<int> & valid_skeletons) { valid_skeletons.clear(); };
     const Vector4 * getSkeleton(const int number) const { return NULL; };
 
     void make3DPoints( std::vector<Point> & points ) const {
-        int w, h;
-        getVideoSize(w, h);
-
-        if(points.size() < unsigned(w*h)){
-            points.clear();
-            const float f = 0.003f;
-            for(int y = 0; y < h; ++y)
-                for(int x = 0; x < w; ++x){
-                    float xx = (x-w/2)*f;
-                    float yy = (y-h/2)*f;
-                    float z = 4 - 2*sqrt(xx*xx + yy*yy);
-                    points.push_back(Point(xx*z, yy*z, z, rgb[y*w+x])); 
-                }
-        }
+        make3DPoints(NULL, rgb.contiguous_data(), points);
+    }
+
+    bool waitForFrame( DWORD timeout ){
+        // pretend to run at 30 Hz
+        Sleep(timeout < 33 ? timeout : 33);
+        return true;
+    }
+
+    void copyFrame( Frame & frame ){
+        renderScene(getDepthIntrinsics(), cameraPose(frame_number), depth);
+        frame.rgb.copy_from(rgb);
+        frame.depth.resize(depth.size());
+        // add a few millimetres of sensor noise to every frame
+        uint32_t state = frame_number * 2654435761u + 1;
+        for(int y = 0; y < depth.size().y; ++y)
+            for(int x = 0; x < depth.size().x; ++x){
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                frame.depth[y][x] = depth[y][x] ? depth[y][x] + (state % 9) - 4 : 0;
+            }
+        frame.number = ++frame_number;
+        frame.captured = getTime();
+    }
+
+    void make3DPoints( const uint16_t * depth, const uint32_t * rgb, std::vector<Point> & points, const float * normals = NULL, const uint8_t * mask = NULL, std::vector<uint32_t> * pixels = NULL ) const {
+        if(depth == NULL)
+            depth = this->depth.contiguous_data();
+        const Intrinsics intrinsics = getDepthIntrinsics();
+        points.clear();
+        if(pixels)
+            pixels->clear();
+        for(int y = 0; y < intrinsics.height; ++y)
+            for(int x = 0; x < intrinsics.width; ++x){
+                const int i = y * intrinsics.width + x;
+                if(depth[i] == 0 || (mask && mask[i] == 0))
+                    continue;
+                const float z = intrinsics.depthInMetres(depth[i]);
+                float px, py;
+                intrinsics.unproject(float(x), float(y), z, px, py);
+                // the video covers the same view at its own resolution
+                const uint32_t color = rgb[(y * video_height / depth_height) * video_width + x * video_width / depth_width];
+                if(normals)
+                    points.push_back(Point(px, py, z, color, normals + 3 * i));
+                else
+                    points.push_back(Point(px, py, z, color));
+                if(pixels)
+                    pixels->push_back(i);
+            }
     }
 
     void make3DSkeletonPoints( std::vector<Point> & background, std::vector<Point> & player1, std::vector<Point> & player2) const {
@@ -171,9 +259,31 @@ public:
         player2.clear();
     }
 
+    Intrinsics getDepthIntrinsics() const {
+        Intrinsics intrinsics;
+        getDepthSize(intrinsics.width, intrinsics.height);
+        intrinsics.fx = intrinsics.fy = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * intrinsics.width / 320.0f;
+        intrinsics.cx = intrinsics.width * 0.5f;
+        intrinsics.cy = intrinsics.height * 0.5f;
+        intrinsics.mirror_x = 1.0f;
+        intrinsics.depth_shift = 0;
+        return intrinsics;
+    }
+
+    // Synthetic depth in millimetres of a room with a wall at 2.5 m, a floor 0.7 m below the
+    // camera and two balls in front of the wall, seen from the given camera pose. Pixels
+    // without a surface within 8 m are 0.
+    static void renderScene( const Intrinsics & intrinsics, const Pose & pose, Image<uint16_t> & depth );
+    // the camera sways sideways and turns slowly, so the motion can be tracked
+    static Pose cameraPose( unsigned frame );
+
 protected:
-    std::vector<uint32_t> rgb;
-    std::vector<uint8_t> depth_texture;
+    int depth_width, depth_height;
+    int video_width, video_height;
+    Image<uint32_t> rgb;
+    Image<uint16_t> depth;
+    Image<uint8_t> depth_texture;
+    unsigned frame_number;
 };
 
 #endif // KINECT3DDEVICE_H
@@ -0,0 +1,203 @@
+#include "Mesh.h"
+
+#include <Windows.h>
+#include <gl/GL.h>
+#include <cstddef>
+#include <algorithm>
+
+using namespace std;
+
+// flat grey, the mesh is shaded by lighting
+static const uint32_t mesh_color = 0xffc0c0c0;
+
+GridMesh::GridMesh( float change ) : max_depth_change(change), version(0), width(0), height(0), reused_indices(false), build_time(0) {}
+
+// true if three depths in millimetres are valid and close enough to belong to one surface
+static inline bool connected( const uint32_t a, const uint32_t b, const uint32_t c, const float max_change ){
+    if(a == 0 || b == 0 || c == 0)
+        return false;
+    const uint32_t low = min(a, min(b, c)), high = max(a, max(b, c));
+    return high - low <= max_change * low;
+}
+
+void GridMesh::build( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals, MeshData & mesh ){
+    const double start = getTime();
+    const int W = intrinsics.width, H = intrinsics.height, shift = intrinsics.depth_shift;
+    if(W != width || H != height){
+        width = W;
+        height = H;
+        previous_pattern.clear();
+        row_triangles.assign(H - 1, 0);
+    }
+    pattern.resize((W - 1) * (H - 1));
+    mesh.vertices.resize(W * H, Point(0, 0, 0, 0));
+
+    // vertices for every pixel, and which triangles of the blocks below them to keep
+    static const float toward_camera[3] = { 0, 0, -1 };
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        for(int x = 0; x < W; ++x){
+            const int i = y * W + x;
+            const float z = intrinsics.depthInMetres(depth[i]);
+            float px, py;
+            intrinsics.unproject(float(x), float(y), z, px, py);
+            const float * normal = normals ? normals + 3 * i : toward_camera;
+            // pixels without a normal are lit as if facing the camera
+            if(normal[0] == 0 && normal[1] == 0 && normal[2] == 0)
+                normal = toward_camera;
+            mesh.vertices[i] = Point(px, py, z, mesh_color, normal);
+        }
+        if(y + 1 == H)
+            continue;
+        const uint16_t * row = depth + y * W;
+        const uint16_t * next = row + W;
+        uint8_t * blocks = &pattern[y * (W - 1)];
+        unsigned count = 0;
+        for(int x = 0; x + 1 < W; ++x){
+            const uint32_t a = row[x] >> shift, b = row[x + 1] >> shift;
+            const uint32_t c = next[x] >> shift, d = next[x + 1] >> shift;
+            const uint8_t bits = (connected(a, c, b, max_depth_change) ? 1 : 0) | (connected(b, c, d, max_depth_change) ? 2 : 0);
+            blocks[x] = bits;
+            count += (bits & 1) + (bits >> 1);
+        }
+        row_triangles[y] = count;
+    }
+
+    // the indices only depend on the pattern, rebuild them if it changed since the last frame
+    reused_indices = !previous_pattern.empty() && pattern == previous_pattern;
+    if(!reused_indices){
+        unsigned total = 0;
+        for(int y = 0; y + 1 < H; ++y){
+            const unsigned count = row_triangles[y];
+            row_triangles[y] = total;
+            total += count;
+        }
+        indices.resize(3 * total);
+#pragma omp parallel for schedule(static)
+        for(int y = 0; y < H - 1; ++y){
+            uint32_t * out = indices.empty() ? NULL : &indices[3 * row_triangles[y]];
+            const uint8_t * blocks = &pattern[y * (W - 1)];
+            for(int x = 0; x + 1 < W; ++x){
+                const uint32_t a = y * W + x, b = a + 1, c = a + W, d = c + 1;
+                if(blocks[x] & 1){
+                    out[0] = a; out[1] = c; out[2] = b;
+                    out += 3;
+                }
+                if(blocks[x] & 2){
+                    out[0] = b; out[1] = c; out[2] = d;
+                    out += 3;
+                }
+            }
+        }
+        pattern.swap(previous_pattern);
+        ++version;
+    }
+
+    if(mesh.version != version){
+        mesh.indices = indices;
+        mesh.version = version;
+    }
+    build_time = getTime() - start;
+}
+
+// queried once, the same for every context of the driver
+typedef void (APIENTRY * GenBuffersFunction)( GLsizei n, GLuint * buffers );
+typedef void (APIENTRY * DeleteBuffersFunction)( GLsizei n, const GLuint * buffers );
+typedef void (APIENTRY * BindBufferFunction)( GLenum target, GLuint buffer );
+typedef void (APIENTRY * BufferDataFunction)( GLenum target, ptrdiff_t size, const void * data, GLenum usage );
+
+static GenBuffersFunction genBuffers = NULL;
+static DeleteBuffersFunction deleteBuffers = NULL;
+static BindBufferFunction bindBuffer = NULL;
+static BufferDataFunction bufferData = NULL;
+
+bool GLBuffers::load(){
+    if(!genBuffers){
+        genBuffers = (GenBuffersFunction) wglGetProcAddress("glGenBuffers");
+        deleteBuffers = (DeleteBuffersFunction) wglGetProcAddress("glDeleteBuffers");
+        bindBuffer = (BindBufferFunction) wglGetProcAddress("glBindBuffer");
+        bufferData = (BufferDataFunction) wglGetProcAddress("glBufferData");
+    }
+    return genBuffers && deleteBuffers && bindBuffer && bufferData;
+}
+
+void GLBuffers::generate( int count, unsigned * buffers ){
+    genBuffers(count, buffers);
+}
+
+void GLBuffers::release( int count, const unsigned * buffers ){
+    deleteBuffers(count, buffers);
+}
+
+void GLBuffers::bind( unsigned target, unsigned buffer ){
+    bindBuffer(target, buffer);
+}
+
+void GLBuffers::upload( unsigned target, size_t bytes, const void * data, unsigned usage ){
+    bufferData(target, ptrdiff_t(bytes), data, usage);
+}
+
+MeshRenderer::MeshRenderer() : initialized(false), use_buffers(false), vertex_buffer(0), index_buffer(0), uploaded_version(0), index_count(0), uploaded_bytes(0) {}
+
+MeshRenderer::~MeshRenderer(){
+    if(use_buffers){
+        const unsigned buffers[2] = { vertex_buffer, index_buffer };
+        GLBuffers::release(2, buffers);
+    }
+}
+
+unsigned MeshRenderer::render( const MeshData & mesh ){
+    uploaded_bytes = 0;
+    if(mesh.vertices.empty() || mesh.indices.empty())
+        return 0;
+
+    if(!initialized){
+        // the entry points can only be queried with a current context
+        initialized = true;
+        use_buffers = GLBuffers::load();
+        if(use_buffers){
+            unsigned buffers[2];
+            GLBuffers::generate(2, buffers);
+            vertex_buffer = buffers[0];
+            index_buffer = buffers[1];
+        }
+    }
+
+    const GLsizei vertex_bytes = GLsizei(mesh.vertices.size() * sizeof(Point));
+    // with buffers bound, the pointers are offsets into them
+    const char * base = reinterpret_cast<const char *>(mesh.vertices.data());
+    const uint32_t * indices = mesh.indices.data();
+    if(use_buffers){
+        // new storage every frame, so the driver does not wait for the last frame to finish drawing
+        GLBuffers::bind(GLBuffers::ARRAY, vertex_buffer);
+        GLBuffers::upload(GLBuffers::ARRAY, vertex_bytes, base, GLBuffers::STREAM_DRAW);
+        uploaded_bytes += vertex_bytes;
+        GLBuffers::bind(GLBuffers::ELEMENT_ARRAY, index_buffer);
+        if(mesh.version != uploaded_version){
+            GLBuffers::upload(GLBuffers::ELEMENT_ARRAY, mesh.indices.size() * sizeof(uint32_t), indices, GLBuffers::STATIC_DRAW);
+            uploaded_bytes += unsigned(mesh.indices.size() * sizeof(uint32_t));
+            uploaded_version = mesh.version;
+            index_count = unsigned(mesh.indices.size());
+        }
+        base = NULL;
+        indices = NULL;
+    } else
+        index_count = unsigned(mesh.indices.size());
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Point), base + offsetof(Point, x));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Point), base + offsetof(Point, color));
+    glNormalPointer(GL_FLOAT, sizeof(Point), base + offsetof(Point, nx));
+    glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, indices);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    if(use_buffers){
+        GLBuffers::bind(GLBuffers::ARRAY, 0);
+        GLBuffers::bind(GLBuffers::ELEMENT_ARRAY, 0);
+    }
+    return index_count / 3;
+}
@@ -0,0 +1,83 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Triangulates the organized grid of a depth frame directly: every 2x2 block of pixels
+// becomes up to two triangles, skipping triangles with invalid pixels or spanning a depth
+// discontinuity. The pattern of kept triangles is compared with the previous frame and
+// the index buffer is only rebuilt when it changed, so renderers can keep the uploaded
+// indices and only stream the vertices. Both passes run over the rows with OpenMP.
+class GridMesh {
+public:
+    // max_depth_change is the largest depth difference within a triangle relative to its depth
+    GridMesh( float max_depth_change = 0.05f );
+
+    // Builds the mesh of a depth frame into mesh. Normals are 3 floats per pixel as
+    // NormalEstimator computes them, or NULL. The indices of mesh are only copied if
+    // its version differs from the current one.
+    void build( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals, MeshData & mesh );
+
+    unsigned triangles() const { return unsigned(indices.size() / 3); }
+    // true if the last build kept the index buffer of the previous one
+    bool reused() const { return reused_indices; }
+    // time taken by the last build in seconds
+    double buildTime() const { return build_time; }
+
+protected:
+    float max_depth_change;
+    // 2 bits per pixel block for the upper left and lower right triangles
+    std::vector<uint8_t> pattern, previous_pattern;
+    std::vector<unsigned> row_triangles;
+    std::vector<uint32_t> indices;
+    unsigned version;
+    int width, height;
+    bool reused_indices;
+    double build_time;
+};
+
+// The buffer object functions of OpenGL 1.5, which opengl32.dll does not export, so they are
+// queried with wglGetProcAddress. load() needs a current context and returns false if the
+// driver has no buffer objects, the other functions may only be called after it succeeded.
+class GLBuffers {
+public:
+    enum {
+        ARRAY = 0x8892,             // GL_ARRAY_BUFFER
+        ELEMENT_ARRAY = 0x8893,     // GL_ELEMENT_ARRAY_BUFFER
+        STREAM_DRAW = 0x88E0,       // GL_STREAM_DRAW
+        STATIC_DRAW = 0x88E4        // GL_STATIC_DRAW
+    };
+
+    static bool load();
+    static void generate( int count, unsigned * buffers );
+    static void release( int count, const unsigned * buffers );
+    static void bind( unsigned target, unsigned buffer );
+    static void upload( unsigned target, size_t bytes, const void * data, unsigned usage );
+};
+
+// Draws MeshData from vertex buffer objects where the driver supports them: the vertices
+// are streamed every frame into an orphaned buffer, the indices are only uploaded when
+// their version changes. Without buffer objects it falls back to client vertex arrays.
+// Must be used from the thread owning the OpenGL context.
+class MeshRenderer {
+public:
+    MeshRenderer();
+    ~MeshRenderer();
+
+    // renders the mesh with normals and colors, returns the number of triangles drawn
+    unsigned render( const MeshData & mesh );
+
+    // bytes uploaded by the last call to render
+    unsigned uploadedBytes() const { return uploaded_bytes; }
+
+protected:
+    bool initialized, use_buffers;
+    unsigned vertex_buffer, index_buffer;
+    unsigned uploaded_version;
+    unsigned index_count;
+    unsigned uploaded_bytes;
+};
+
+#endif // MESH_H
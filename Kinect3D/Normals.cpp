@@ -0,0 +1,161 @@
+#include "Normals.h"
+
+#include <emmintrin.h>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// columns added up per thread when summing the integral images down the rows
+static const int column_block = 64;
+
+NormalEstimator::NormalEstimator( int r, float change ) : radius(r), max_depth_change(change), compute_time(0) {}
+
+void NormalEstimator::buildIntegrals( const uint16_t * depth, const Intrinsics & intrinsics ){
+    const int W = intrinsics.width, H = intrinsics.height, stride = W + 1;
+    depth_sum.resize(stride * (H + 1));
+    count_sum.resize(stride * (H + 1));
+    fill(depth_sum.begin(), depth_sum.begin() + stride, 0u);
+    fill(count_sum.begin(), count_sum.begin() + stride, 0u);
+
+    // sums along every row first, rows are independent
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        const uint16_t * in = depth + y * W;
+        uint32_t * sum = &depth_sum[(y + 1) * stride];
+        uint32_t * count = &count_sum[(y + 1) * stride];
+        uint32_t row_sum = 0, row_count = 0;
+        sum[0] = count[0] = 0;
+        for(int x = 0; x < W; ++x){
+            const uint32_t d = in[x] >> intrinsics.depth_shift;
+            row_sum += d;
+            row_count += d != 0;
+            sum[x + 1] = row_sum;
+            count[x + 1] = row_count;
+        }
+    }
+
+    // then down the columns, every thread owns a block of columns and adds 4 at a time
+    const int blocks = (stride + column_block - 1) / column_block;
+#pragma omp parallel for schedule(static)
+    for(int block = 0; block < blocks; ++block){
+        const int begin = block * column_block, end = min(begin + column_block, stride);
+        for(int y = 1; y <= H; ++y){
+            uint32_t * sum = &depth_sum[y * stride];
+            uint32_t * count = &count_sum[y * stride];
+            int x = begin;
+            for(; x + 4 <= end; x += 4){
+                __m128i * s = reinterpret_cast<__m128i *>(sum + x);
+                __m128i * c = reinterpret_cast<__m128i *>(count + x);
+                _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_loadu_si128(reinterpret_cast<const __m128i *>(sum + x - stride))));
+                _mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_loadu_si128(reinterpret_cast<const __m128i *>(count + x - stride))));
+            }
+            for(; x < end; ++x){
+                sum[x] += sum[x - stride];
+                count[x] += count[x - stride];
+            }
+        }
+    }
+}
+
+// sum over a box of an integral image for 4 consecutive pixels, given the offsets of its corners
+static inline __m128i boxSum( const uint32_t * integral, const int top_left, const int top_right, const int bottom_left, const int bottom_right ){
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(integral + top_left));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(integral + top_right));
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(integral + bottom_left));
+    const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(integral + bottom_right));
+    return _mm_add_epi32(_mm_sub_epi32(d, _mm_add_epi32(b, c)), a);
+}
+
+void NormalEstimator::compute( const uint16_t * depth, const Intrinsics & intrinsics, vector<float> & normals ){
+    const double start = getTime();
+    const int W = intrinsics.width, H = intrinsics.height, stride = W + 1, r = radius;
+    normals.assign(3 * W * H, 0.0f);
+    // the interior where the window fits must be at least one block of 4 pixels wide
+    if(W - 2 * r < 4 || H - 2 * r < 1){
+        compute_time = getTime() - start;
+        return;
+    }
+    buildIntegrals(depth, intrinsics);
+
+    // the boxes left and right of a pixel are r wide and 2r+1 high, above and below the other way round
+    const int area = r * (2 * r + 1);
+    // differences of box averages are taken r+1 pixels apart
+    const float scale = 1.0f / (area * (r + 1));
+    const __m128i full = _mm_set1_epi32(area);
+    const __m128 half_area = _mm_set1_ps(0.5f / area);
+    const __m128 gradient_scale = _mm_set1_ps(scale);
+    const __m128 change = _mm_set1_ps(max_depth_change);
+    const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 x_step = _mm_set1_ps(intrinsics.mirror_x / intrinsics.fx);
+    const __m128 inv_fy = _mm_set1_ps(1.0f / intrinsics.fy);
+    const __m128 lane = _mm_set_ps(3, 2, 1, 0);
+    const int last = W - r - 4;
+
+#pragma omp parallel for schedule(static)
+    for(int v = r; v < H - r; ++v){
+        const int top = (v - r) * stride, middle = v * stride, below = (v + 1) * stride, bottom = (v + r + 1) * stride;
+        const __m128 b = _mm_set1_ps(-(v - intrinsics.cy) / intrinsics.fy);
+        for(int block = r; block <= last + 3; block += 4){
+            // the last block is moved left to end at the border, recomputing a few pixels
+            const int u = min(block, last);
+            const __m128i left_count = boxSum(&count_sum[u], top - r, top, bottom - r, bottom);
+            const __m128i right_count = boxSum(&count_sum[u], top + 1, top + r + 1, bottom + 1, bottom + r + 1);
+            const __m128i up_count = boxSum(&count_sum[u], top - r, top + r + 1, middle - r, middle + r + 1);
+            const __m128i down_count = boxSum(&count_sum[u], below - r, below + r + 1, bottom - r, bottom + r + 1);
+            const __m128i complete = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi32(left_count, full), _mm_cmpeq_epi32(right_count, full)),
+                                                   _mm_and_si128(_mm_cmpeq_epi32(up_count, full), _mm_cmpeq_epi32(down_count, full)));
+            const __m128i center = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(depth + v * W + u)), _mm_setzero_si128());
+            __m128 valid = _mm_castsi128_ps(_mm_andnot_si128(_mm_cmpeq_epi32(center, _mm_setzero_si128()), complete));
+            if(_mm_movemask_ps(valid) == 0)
+                continue;
+
+            const __m128 left = _mm_cvtepi32_ps(boxSum(&depth_sum[u], top - r, top, bottom - r, bottom));
+            const __m128 right = _mm_cvtepi32_ps(boxSum(&depth_sum[u], top + 1, top + r + 1, bottom + 1, bottom + r + 1));
+            const __m128 up = _mm_cvtepi32_ps(boxSum(&depth_sum[u], top - r, top + r + 1, middle - r, middle + r + 1));
+            const __m128 down = _mm_cvtepi32_ps(boxSum(&depth_sum[u], below - r, below + r + 1, bottom - r, bottom + r + 1));
+
+            // boxes on different sides of a depth edge are not the same surface
+            const __m128 du = _mm_sub_ps(right, left), dv = _mm_sub_ps(down, up);
+            valid = _mm_and_ps(valid, _mm_cmplt_ps(_mm_andnot_ps(sign_mask, du), _mm_mul_ps(change, _mm_add_ps(left, right))));
+            valid = _mm_and_ps(valid, _mm_cmplt_ps(_mm_andnot_ps(sign_mask, dv), _mm_mul_ps(change, _mm_add_ps(up, down))));
+            if(_mm_movemask_ps(valid) == 0)
+                continue;
+
+            // smoothed depth and its derivatives along the image axes, in millimetres
+            const __m128 z = _mm_mul_ps(_mm_add_ps(left, right), half_area);
+            const __m128 zu = _mm_mul_ps(du, gradient_scale);
+            const __m128 zv = _mm_mul_ps(dv, gradient_scale);
+            // the point is z * (a, b, 1), its tangents are the derivatives along u and v
+            const __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_set1_ps(float(u)), lane), _mm_set1_ps(intrinsics.cx)), x_step);
+            const __m128 tu[3] = { _mm_add_ps(_mm_mul_ps(z, x_step), _mm_mul_ps(a, zu)), _mm_mul_ps(b, zu), zu };
+            const __m128 tv[3] = { _mm_mul_ps(a, zv), _mm_sub_ps(_mm_mul_ps(b, zv), _mm_mul_ps(z, inv_fy)), zv };
+            __m128 n[3] = {
+                _mm_sub_ps(_mm_mul_ps(tu[1], tv[2]), _mm_mul_ps(tu[2], tv[1])),
+                _mm_sub_ps(_mm_mul_ps(tu[2], tv[0]), _mm_mul_ps(tu[0], tv[2])),
+                _mm_sub_ps(_mm_mul_ps(tu[0], tv[1]), _mm_mul_ps(tu[1], tv[0]))
+            };
+
+            // normalize with a refined reciprocal square root, and flip normals facing away from the camera
+            const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], n[0]), _mm_mul_ps(n[1], n[1])), _mm_mul_ps(n[2], n[2]));
+            valid = _mm_and_ps(valid, _mm_cmpgt_ps(length2, zero));
+            __m128 inverse = _mm_rsqrt_ps(length2);
+            inverse = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), inverse), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(length2, inverse), inverse)));
+            const __m128 facing = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], a), _mm_mul_ps(n[1], b)), n[2]);
+            inverse = _mm_xor_ps(inverse, _mm_and_ps(_mm_cmpgt_ps(facing, zero), sign_mask));
+            inverse = _mm_and_ps(inverse, valid);
+
+            float out[3][4];
+            for(int k = 0; k < 3; ++k)
+                _mm_storeu_ps(out[k], _mm_mul_ps(n[k], inverse));
+            float * normal = &normals[3 * (v * W + u)];
+            for(int i = 0; i < 4; ++i, normal += 3){
+                normal[0] = out[0][i];
+                normal[1] = out[1][i];
+                normal[2] = out[2][i];
+            }
+        }
+    }
+    compute_time = getTime() - start;
+}
@@ -0,0 +1,42 @@
+#ifndef NORMALS_H
+#define NORMALS_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Surface normals for every pixel of a depth image in constant time per pixel, using
+// integral images of the depth and of the valid pixels (Holzer et al., "Adaptive
+// Neighborhood Selection for Real-Time Surface Normal Estimation from Organized Point
+// Cloud Data Using Integral Images", IROS 2012). The depth gradients are the differences
+// of box averages left and right, and above and below every pixel, so the cost does not
+// depend on the size of the smoothing window. Integral images are built and evaluated
+// in parallel with OpenMP, and the normals of 4 pixels are computed at a time with SSE2.
+class NormalEstimator {
+public:
+    // radius of the smoothing window in pixels, max_depth_change is the largest difference of
+    // the box averages relative to the depth before a pixel is treated as a depth edge
+    NormalEstimator( int radius = 4, float max_depth_change = 0.05f );
+
+    // Computes the normals of a depth image in the coordinates of Intrinsics::unproject,
+    // 3 floats per pixel facing the camera. Pixels near depth edges, invalid depth or the
+    // image border get a normal of 0.
+    void compute( const uint16_t * depth, const Intrinsics & intrinsics, std::vector<float> & normals );
+
+    // time taken by the last call to compute in seconds
+    double computeTime() const { return compute_time; }
+
+protected:
+    void buildIntegrals( const uint16_t * depth, const Intrinsics & intrinsics );
+
+    int radius;
+    float max_depth_change;
+    // (width+1) x (height+1) sums of depth in millimetres and of valid pixels, with a row and
+    // column of zeros in front. The depth sums wrap around, but every box sum fits 32 bits
+    // and unsigned differences stay exact.
+    std::vector<uint32_t> depth_sum;
+    std::vector<uint32_t> count_sum;
+    double compute_time;
+};
+
+#endif // NORMALS_H
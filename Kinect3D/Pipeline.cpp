@@ -0,0 +1,342 @@
+#include "Pipeline.h"
+
+using namespace std;
+
+FrameQueue::FrameQueue( unsigned capacity ) : max_size(capacity) {
+    InitializeCriticalSection(&lock);
+}
+
+FrameQueue::~FrameQueue(){
+    DeleteCriticalSection(&lock);
+}
+
+Frame * FrameQueue::push( Frame * frame ){
+    Frame * dropped = NULL;
+    EnterCriticalSection(&lock);
+    if(frames.size() == max_size){
+        dropped = frames.front();
+        frames.pop_front();
+    }
+    frames.push_back(frame);
+    LeaveCriticalSection(&lock);
+    return dropped;
+}
+
+Frame * FrameQueue::pop(){
+    Frame * frame = NULL;
+    EnterCriticalSection(&lock);
+    if(!frames.empty()){
+        frame = frames.front();
+        frames.pop_front();
+    }
+    LeaveCriticalSection(&lock);
+    return frame;
+}
+
+Frame * FrameQueue::popNewest( FrameQueue & dropped, unsigned & count ){
+    Frame * frame = NULL;
+    count = 0;
+    EnterCriticalSection(&lock);
+    if(!frames.empty()){
+        frame = frames.back();
+        frames.pop_back();
+        for(unsigned i = 0; i < frames.size(); ++i)
+            dropped.push(frames[i]);
+        count = unsigned(frames.size());
+        frames.clear();
+    }
+    LeaveCriticalSection(&lock);
+    return frame;
+}
+
+unsigned FrameQueue::size() const {
+    EnterCriticalSection(&lock);
+    unsigned result = unsigned(frames.size());
+    LeaveCriticalSection(&lock);
+    return result;
+}
+
+ostream & operator<<( ostream & out, const PipelineStats & stats ){
+    out << "processing\t" << stats.processed << " frames\t" << int(stats.processing_occupancy * 100) << "% busy\t" << stats.processing_time * 1000 << " ms per frame\t"
+        << stats.copy_time * 1000 << " ms copy\n"
+        << "render\t\t" << stats.rendered << " frames\t" << int(stats.render_occupancy * 100) << "% busy\n"
+        << "queue\t\t" << stats.queue_occupancy << " frames\n"
+        << "dropped\t\t" << stats.dropped_capture << " capture\t" << stats.dropped_render << " render\n"
+        << "latency\t\t" << stats.latency * 1000 << " ms\n";
+    if(stats.filter > 0)
+        out << "filter\t\t" << stats.filter * 1000 << " ms\n";
+    if(stats.normals > 0)
+        out << "normals\t\t" << stats.normals * 1000 << " ms\n";
+    out << "octree\t\t" << stats.octree_build * 1000 << " ms build\n"
+        << "tracking\t" << stats.tracking * 1000 << " ms\t" << stats.tracking_lost << " lost";
+    if(stats.background > 0)
+        out << "\nbackground\t" << stats.background * 1000 << " ms\t" << stats.foreground << " foreground points";
+    if(stats.planes > 0)
+        out << "\nplanes\t\t" << stats.planes * 1000 << " ms\t" << stats.plane_count << " planes\t" << stats.plane_hypotheses << " hypotheses";
+    if(stats.meshed > 0){
+        out << "\nmesh\t\t" << stats.meshed << " frames\t" << stats.mesh_build * 1000 << " ms build\t" << stats.mesh_triangles << " triangles\t"
+            << stats.mesh_reused << " indices reused";
+    }
+    if(stats.fused > 0){
+        out << "\nfusion\t\t" << stats.fused << " frames\t" << stats.fusion_integrate * 1000 << " ms integrate\t" << stats.fusion_raycast * 1000 << " ms raycast\n"
+            << "\t\t" << stats.fusion_bricks << " bricks" << (stats.fusion_full ? ", volume full" : "");
+    }
+    return out;
+}
+
+// one frame being processed, up to two waiting to be rendered and one held by the render stage
+static const unsigned pool_size = 4;
+static const unsigned ready_capacity = 2;
+
+FramePipeline::FramePipeline( DepthDevice & dev ) :
+    device(dev), pool(pool_size), free_frames(pool_size), ready_frames(ready_capacity),
+    current(&pool[0]), current_presented(true),
+    thread(INVALID_HANDLE_VALUE), stop_event(INVALID_HANDLE_VALUE), filter_enabled(1), normals_enabled(0), mesh_enabled(0), background_enabled(0), background_reset(0), planes_enabled(0), fusion_enabled(0), fusion_reset(0),
+    stats_start(getTime()), processing_busy(0), copy_sum(0), render_busy(0), render_start(0), queue_sum(0), latency_sum(0), filter_sum(0), octree_sum(0), normals_sum(0), background_sum(0), planes_sum(0), mesh_sum(0),
+    track_sum(0), integrate_sum(0), raycast_sum(0), queue_samples(0),
+    processed(0), rendered(0), dropped_capture(0), dropped_render(0), filtered(0), estimated(0), fused(0), lost(0), meshed(0), mesh_reused(0), separated(0), detected(0), mesh_triangles(0), foreground(0), plane_count(0), plane_hypotheses(0), fusion_bricks(0), fusion_full(false), last_number(0)
+{
+    for(unsigned i = 1; i < pool.size(); ++i)
+        free_frames.push(&pool[i]);
+    InitializeCriticalSection(&stats_lock);
+}
+
+FramePipeline::~FramePipeline(){
+    stop();
+    DeleteCriticalSection(&stats_lock);
+}
+
+void FramePipeline::start(){
+    if(thread != INVALID_HANDLE_VALUE)
+        return;
+    stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    thread = CreateThread(NULL, 0, run, this, 0, NULL);
+}
+
+void FramePipeline::stop(){
+    if(thread == INVALID_HANDLE_VALUE)
+        return;
+    SetEvent(stop_event);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CloseHandle(stop_event);
+    thread = INVALID_HANDLE_VALUE;
+    stop_event = INVALID_HANDLE_VALUE;
+}
+
+DWORD WINAPI FramePipeline::run(LPVOID pParam){
+    FramePipeline * pthis = (FramePipeline *) pParam;
+    while(WaitForSingleObject(pthis->stop_event, 0) != WAIT_OBJECT_0){
+        // wait for the capture stage, the timeout keeps the stop event responsive
+        if(pthis->device.waitForFrame(100))
+            pthis->process();
+    }
+    return 0;
+}
+
+void FramePipeline::process(){
+    Frame * frame = free_frames.pop();
+    if(frame == NULL)
+        return;
+
+    const double start = getTime();
+    device.copyFrame(*frame);
+    const double copied = getTime();
+    // the settings are read once, the render thread may change them while the frame is processed
+    const bool filtering = filter_enabled != 0;
+    const bool fusing = fusion_enabled != 0;
+    // the fused surface is not organized, only depth frames are separated, searched for planes and meshed
+    const bool separating = !fusing && background_enabled != 0;
+    const bool detecting = !fusing && planes_enabled != 0;
+    const bool meshing = !fusing && mesh_enabled != 0;
+    // normals are only estimated for the steps that use them
+    const bool estimating = !fusing && (normals_enabled != 0 || detecting || meshing);
+    if(filtering)
+        depth_filter.apply(frame->depth, device.getDepthIntrinsics().depth_shift);
+    // every frame is tracked, the fusion integrates at the tracked pose
+    if(InterlockedExchange(&fusion_reset, 0)){
+        fusion.reset();
+        tracker.reset();
+    }
+    frame->tracked = tracker.track(frame->depth.contiguous_data(), device.getDepthIntrinsics());
+    frame->pose = tracker.pose();
+    if(estimating)
+        normal_estimator.compute(frame->depth.contiguous_data(), device.getDepthIntrinsics(), pixel_normals);
+    const float * normals = estimating ? pixel_normals.data() : NULL;
+    if(fusing)
+        fuse(*frame);
+    else
+        device.make3DPoints(frame->depth.contiguous_data(), frame->rgb.contiguous_data(), frame->points, normals, NULL, &frame->pixels);
+    if(separating){
+        if(InterlockedExchange(&background_reset, 0))
+            background.reset();
+        background.update(frame->depth.contiguous_data(), device.getDepthIntrinsics(), frame->foreground);
+        // the foreground points are the points of foreground pixels, taken from those already made
+        frame->foreground_points.clear();
+        for(size_t i = 0; i < frame->points.size(); ++i)
+            if(frame->foreground[frame->pixels[i]])
+                frame->foreground_points.push_back(frame->points[i]);
+    } else {
+        frame->foreground.clear();
+        frame->foreground_points.clear();
+    }
+    if(detecting)
+        plane_detector.detect(frame->depth.contiguous_data(), device.getDepthIntrinsics(), pixel_normals.data(), frame->planes, frame->plane_mask);
+    else {
+        frame->planes.clear();
+        frame->plane_mask.clear();
+    }
+    if(meshing)
+        mesh_builder.build(frame->depth.contiguous_data(), device.getDepthIntrinsics(), pixel_normals.data(), frame->mesh);
+    else
+        frame->mesh.vertices.clear();
+    frame->octree.build(frame->points);
+    frame->processed = getTime();
+
+    Frame * dropped = ready_frames.push(frame);
+    if(dropped != NULL)
+        free_frames.push(dropped);
+    ready_signal.notify();
+
+    EnterCriticalSection(&stats_lock);
+    processing_busy += frame->processed - start;
+    copy_sum += copied - start;
+    track_sum += tracker.trackTime();
+    if(!frame->tracked)
+        ++lost;
+    if(filtering){
+        filter_sum += depth_filter.filterTime();
+        ++filtered;
+    }
+    octree_sum += frame->octree.buildTime();
+    if(estimating){
+        normals_sum += normal_estimator.computeTime();
+        ++estimated;
+    }
+    if(separating){
+        background_sum += background.updateTime();
+        ++separated;
+        foreground = unsigned(frame->foreground_points.size());
+    }
+    if(detecting){
+        planes_sum += plane_detector.detectTime();
+        ++detected;
+        plane_count = unsigned(frame->planes.size());
+        plane_hypotheses = plane_detector.hypotheses();
+    }
+    if(meshing){
+        mesh_sum += mesh_builder.buildTime();
+        ++meshed;
+        if(mesh_builder.reused())
+            ++mesh_reused;
+        mesh_triangles = mesh_builder.triangles();
+    }
+    ++processed;
+    if(dropped != NULL)
+        ++dropped_render;
+    // the device only keeps the newest frame, gaps in the sequence were overwritten before processing
+    if(last_number != 0 && frame->number > last_number + 1)
+        dropped_capture += frame->number - last_number - 1;
+    last_number = frame->number;
+    LeaveCriticalSection(&stats_lock);
+}
+
+void FramePipeline::fuse( Frame & frame ){
+    // the first frame after a reset defines the world coordinates, later ones are fused at the tracked pose
+    const Intrinsics intrinsics = device.getDepthIntrinsics();
+    const double start = getTime();
+    fusion.integrate(frame.depth.contiguous_data(), intrinsics, frame.pose);
+    const double integrated = getTime();
+
+    // the surface is raycast at 320x240 at most, plenty for display
+    Intrinsics view = intrinsics;
+    while(view.width > 320)
+        view = view.downsampled();
+    fusion.raycast(view, frame.pose, fusion_vertices, fusion_normals);
+    TsdfVolume::makePoints(fusion_vertices, fusion_normals, frame.pose, frame.points);
+    frame.pixels.clear();
+    const double raycast = getTime();
+
+    EnterCriticalSection(&stats_lock);
+    integrate_sum += integrated - start;
+    raycast_sum += raycast - integrated;
+    ++fused;
+    fusion_bricks = fusion.brickCount();
+    fusion_full = fusion.full();
+    LeaveCriticalSection(&stats_lock);
+}
+
+bool FramePipeline::update(){
+    const double now = getTime();
+    const unsigned waiting = ready_frames.size();
+    unsigned skipped;
+    Frame * frame = ready_frames.popNewest(free_frames, skipped);
+
+    EnterCriticalSection(&stats_lock);
+    queue_sum += waiting;
+    ++queue_samples;
+    dropped_render += skipped;
+    render_start = now;
+    LeaveCriticalSection(&stats_lock);
+
+    if(frame == NULL)
+        return false;
+    free_frames.push(current);
+    current = frame;
+    current_presented = false;
+    return true;
+}
+
+void FramePipeline::presented(){
+    const double now = getTime();
+    EnterCriticalSection(&stats_lock);
+    render_busy += now - render_start;
+    if(!current_presented){
+        latency_sum += now - current->captured;
+        ++rendered;
+        current_presented = true;
+    }
+    LeaveCriticalSection(&stats_lock);
+}
+
+PipelineStats FramePipeline::getStats(){
+    PipelineStats stats;
+    const double now = getTime();
+    EnterCriticalSection(&stats_lock);
+    const double elapsed = now - stats_start;
+    stats.processing_occupancy = elapsed > 0 ? processing_busy / elapsed : 0;
+    stats.render_occupancy = elapsed > 0 ? render_busy / elapsed : 0;
+    stats.queue_occupancy = queue_samples > 0 ? queue_sum / queue_samples : 0;
+    stats.latency = rendered > 0 ? latency_sum / rendered : 0;
+    stats.filter = filtered > 0 ? filter_sum / filtered : 0;
+    stats.octree_build = processed > 0 ? octree_sum / processed : 0;
+    stats.processing_time = processed > 0 ? (processing_busy - copy_sum) / processed : 0;
+    stats.copy_time = processed > 0 ? copy_sum / processed : 0;
+    stats.normals = estimated > 0 ? normals_sum / estimated : 0;
+    stats.background = separated > 0 ? background_sum / separated : 0;
+    stats.foreground = foreground;
+    stats.planes = detected > 0 ? planes_sum / detected : 0;
+    stats.plane_count = plane_count;
+    stats.plane_hypotheses = plane_hypotheses;
+    stats.mesh_build = meshed > 0 ? mesh_sum / meshed : 0;
+    stats.meshed = meshed;
+    stats.mesh_reused = mesh_reused;
+    stats.mesh_triangles = mesh_triangles;
+    stats.tracking = processed > 0 ? track_sum / processed : 0;
+    stats.fusion_integrate = fused > 0 ? integrate_sum / fused : 0;
+    stats.fusion_raycast = fused > 0 ? raycast_sum / fused : 0;
+    stats.fused = fused;
+    stats.tracking_lost = lost;
+    stats.fusion_bricks = fusion_bricks;
+    stats.fusion_full = fusion_full;
+    stats.processed = processed;
+    stats.rendered = rendered;
+    stats.dropped_capture = dropped_capture;
+    stats.dropped_render = dropped_render;
+
+    stats_start = now;
+    processing_busy = copy_sum = render_busy = queue_sum = latency_sum = filter_sum = octree_sum = normals_sum = background_sum = planes_sum = mesh_sum = track_sum = integrate_sum = raycast_sum = 0;
+    queue_samples = processed = rendered = dropped_capture = dropped_render = filtered = estimated = fused = lost = meshed = mesh_reused = separated = detected = 0;
+    LeaveCriticalSection(&stats_lock);
+    return stats;
+}
@@ -0,0 +1,176 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <Windows.h>
+#include <deque>
+#include <iostream>
+
+#include "Kinect3DDevice.h"
+#include "Background.h"
+#include "Filter.h"
+#include "Fusion.h"
+#include "Mesh.h"
+#include "Normals.h"
+#include "Planes.h"
+#include "Tracking.h"
+#include "frame_signal.h"
+
+// A bounded queue of frames between two pipeline stages. Pushing into a full
+// queue drops the oldest frame, so consumers always see the freshest data.
+class FrameQueue {
+public:
+    FrameQueue( unsigned capacity );
+    ~FrameQueue();
+
+    // adds a frame, returns the frame dropped to make space or NULL
+    Frame * push( Frame * frame );
+    // removes the oldest frame, returns NULL if the queue is empty
+    Frame * pop();
+    // removes all frames but the newest, which is returned, the others are appended to dropped
+    Frame * popNewest( FrameQueue & dropped, unsigned & count );
+
+    unsigned size() const;
+    unsigned capacity() const { return max_size; }
+
+protected:
+    std::deque<Frame *> frames;
+    unsigned max_size;
+    mutable CRITICAL_SECTION lock;
+};
+
+// Statistics of the pipeline, averaged since the last call to FramePipeline::getStats
+struct PipelineStats {
+    double processing_occupancy;    // fraction of time the processing stage was busy
+    double processing_time;         // average time to process a frame after copying it in seconds, the inverse of the throughput
+    double copy_time;               // average time to copy a frame from the device in seconds
+    double render_occupancy;        // fraction of time the render stage was busy
+    double queue_occupancy;         // average fill level of the render queue
+    double latency;                 // average time from capture to presentation in seconds
+    double filter;                  // average time to filter the depth of a frame in seconds
+    double octree_build;            // average time to build the point octree in seconds
+    double normals;                 // average time to estimate the normals of a depth frame in seconds, when they were needed
+    double background;              // average time to classify and learn the background in seconds
+    unsigned foreground;            // foreground points of the last frame
+    double planes;                  // average time to detect the dominant planes in seconds
+    unsigned plane_count;           // planes found in the last frame
+    unsigned plane_hypotheses;      // plane hypotheses scored in the last frame
+    double mesh_build;              // average time to build the depth mesh in seconds
+    unsigned meshed;                // frames with a mesh
+    unsigned mesh_reused;           // meshes that kept the index buffer of the previous frame
+    unsigned mesh_triangles;        // triangles of the last mesh
+    double tracking;                // average time to track the camera pose of a frame in seconds
+    double fusion_integrate;        // average time to fuse a frame into the volume in seconds
+    double fusion_raycast;          // average time to raycast the fused surface in seconds
+    unsigned fused;                 // frames fused into the volume
+    unsigned tracking_lost;         // frames where tracking failed and the previous pose was kept
+    unsigned fusion_bricks;         // bricks allocated in the volume
+    bool fusion_full;               // the volume ran out of bricks
+    unsigned processed, rendered;
+    unsigned dropped_capture;       // frames overwritten on the device before processing
+    unsigned dropped_render;        // processed frames replaced before rendering
+};
+
+std::ostream & operator<<( std::ostream & out, const PipelineStats & stats );
+
+// A three stage frame pipeline. The device capture thread produces frames,
+// a processing thread copies and filters them, tracks the camera pose and
+// generates the 3D points and their octree, plus the normals, the foreground,
+// the planes and the mesh if enabled, and the render thread consumes the
+// newest processed frame. Stages are joined by bounded queues that drop stale
+// frames instead of queuing them. Normals are only estimated when something
+// uses them: lighting, plane detection or the mesh.
+class FramePipeline {
+public:
+    FramePipeline( DepthDevice & device );
+    ~FramePipeline();
+
+    void start();
+    void stop();
+
+    // called by the render stage, takes the newest processed frame and returns true if there was one
+    bool update();
+    // the frame currently held by the render stage
+    const Frame & latest() const { return *current; }
+    // called by the render stage after the frame was presented
+    void presented();
+    // notified whenever a processed frame is ready for the render stage
+    FrameSignal & signal() { return ready_signal; }
+
+    // smooths the depth of processed frames and removes speckles before anything else uses it
+    void enableFilter( bool enable ) { InterlockedExchange(&filter_enabled, enable ? 1 : 0); }
+    bool filterEnabled() const { return filter_enabled != 0; }
+    // adds normals to the points for lighting, plane detection and the mesh estimate them anyway
+    void enableNormals( bool enable ) { InterlockedExchange(&normals_enabled, enable ? 1 : 0); }
+    bool normalsEnabled() const { return normals_enabled != 0; }
+    // switches processed frames between the points of the current depth frame and the fused surface
+    void enableFusion( bool enable ) { InterlockedExchange(&fusion_enabled, enable ? 1 : 0); }
+    bool fusionEnabled() const { return fusion_enabled != 0; }
+    // starts the fusion and the tracked pose from scratch with the next frame, whose camera
+    // becomes the world coordinates
+    void resetFusion() { InterlockedExchange(&fusion_reset, 1); }
+    // adds the foreground mask and points to processed frames, not while fusing. Enabling
+    // starts learning the background from scratch, the sensor should not move while enabled.
+    void enableBackground( bool enable ){
+        if(enable)
+            InterlockedExchange(&background_reset, 1);
+        InterlockedExchange(&background_enabled, enable ? 1 : 0);
+    }
+    bool backgroundEnabled() const { return background_enabled != 0; }
+    // adds the dominant planes and their pixel mask to processed frames, not while fusing
+    void enablePlanes( bool enable ) { InterlockedExchange(&planes_enabled, enable ? 1 : 0); }
+    bool planesEnabled() const { return planes_enabled != 0; }
+    // adds a triangle mesh of the depth pixels to processed frames, not while fusing
+    void enableMesh( bool enable ) { InterlockedExchange(&mesh_enabled, enable ? 1 : 0); }
+    bool meshEnabled() const { return mesh_enabled != 0; }
+
+    PipelineStats getStats();
+
+protected:
+    static DWORD WINAPI run(LPVOID pParam);
+    void process();
+    void fuse( Frame & frame );
+
+    DepthDevice & device;
+    std::vector<Frame> pool;
+    FrameQueue free_frames;
+    FrameQueue ready_frames;
+    Frame * current;
+    bool current_presented;
+    FrameSignal ready_signal;
+
+    HANDLE thread;
+    HANDLE stop_event;
+
+    // depth filtering, normal estimation and meshing, only used by the processing thread
+    DepthFilter depth_filter;
+    volatile LONG filter_enabled;
+    NormalEstimator normal_estimator;
+    std::vector<float> pixel_normals;
+    volatile LONG normals_enabled;
+    GridMesh mesh_builder;
+    volatile LONG mesh_enabled;
+    BackgroundModel background;
+    volatile LONG background_enabled, background_reset;
+    PlaneDetector plane_detector;
+    volatile LONG planes_enabled;
+
+    // camera tracking of every frame and volumetric fusion, only used by the processing thread
+    IcpTracker tracker;
+    TsdfVolume fusion;
+    std::vector<float> fusion_vertices, fusion_normals;
+    volatile LONG fusion_enabled, fusion_reset;
+
+    // statistics, guarded by stats_lock
+    CRITICAL_SECTION stats_lock;
+    double stats_start;
+    double processing_busy, copy_sum, render_busy, render_start;
+    double queue_sum, latency_sum, filter_sum, octree_sum, normals_sum, background_sum, planes_sum, mesh_sum, track_sum, integrate_sum, raycast_sum;
+    unsigned queue_samples;
+    unsigned processed, rendered, dropped_capture, dropped_render, filtered, estimated, fused, lost, meshed, mesh_reused, separated, detected;
+    unsigned mesh_triangles, foreground, plane_count, plane_hypotheses;
+    unsigned fusion_bricks;
+    bool fusion_full;
+    unsigned last_number;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,283 @@
+#include "Planes.h"
+
+#include <emmintrin.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// hypotheses scored in parallel at a time, and at most per plane
+static const unsigned batch_size = 16;
+static const unsigned max_iterations = 256;
+// probability of finding a plane that is there
+static const double confidence = 0.99;
+
+PlaneDetector::PlaneDetector( unsigned planes, float distance, float inliers, int c ) :
+    max_planes(min(planes, 255u)), max_distance(distance), min_inliers(inliers), columns(c), min_cosine(0.95f),
+    seed(12345), scored(0), detect_time(0) {}
+
+// the eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix, with Jacobi rotations
+static void smallestEigenvector( double A[3][3], float result[3] ){
+    double V[3][3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+    for(int sweep = 0; sweep < 16; ++sweep){
+        const double off = A[0][1] * A[0][1] + A[0][2] * A[0][2] + A[1][2] * A[1][2];
+        if(off < 1e-30)
+            break;
+        for(int p = 0; p < 2; ++p){
+            for(int q = p + 1; q < 3; ++q){
+                if(A[p][q] == 0)
+                    continue;
+                const double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+                const double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                const double c = 1 / sqrt(t * t + 1), s = t * c;
+                for(int k = 0; k < 3; ++k){
+                    const double akp = A[k][p], akq = A[k][q];
+                    A[k][p] = c * akp - s * akq;
+                    A[k][q] = s * akp + c * akq;
+                }
+                for(int k = 0; k < 3; ++k){
+                    const double apk = A[p][k], aqk = A[q][k];
+                    A[p][k] = c * apk - s * aqk;
+                    A[q][k] = s * apk + c * aqk;
+                }
+                for(int k = 0; k < 3; ++k){
+                    const double vkp = V[k][p], vkq = V[k][q];
+                    V[k][p] = c * vkp - s * vkq;
+                    V[k][q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+    int smallest = 0;
+    for(int i = 1; i < 3; ++i)
+        if(A[i][i] < A[smallest][smallest])
+            smallest = i;
+    for(int i = 0; i < 3; ++i)
+        result[i] = float(V[i][smallest]);
+}
+
+uint32_t PlaneDetector::random(){
+    seed = seed * 1664525u + 1013904223u;
+    return seed >> 8;
+}
+
+inline bool PlaneDetector::inlier( const Plane & plane, const Sample & sample ) const {
+    return fabs(plane.distance(sample.x, sample.y, sample.z)) < max_distance * sample.z
+        && plane.normal[0] * sample.nx + plane.normal[1] * sample.ny + plane.normal[2] * sample.nz > min_cosine;
+}
+
+unsigned PlaneDetector::score( const Plane & plane ) const {
+    unsigned count = 0;
+    for(unsigned i = 0; i < samples.size(); ++i)
+        if(inlier(plane, samples[i]))
+            ++count;
+    return count;
+}
+
+bool PlaneDetector::refine( Plane & plane ) const {
+    double sum[3] = { 0, 0, 0 }, products[6] = { 0, 0, 0, 0, 0, 0 };
+    unsigned count = 0;
+    for(unsigned i = 0; i < samples.size(); ++i){
+        const Sample & s = samples[i];
+        if(!inlier(plane, s))
+            continue;
+        sum[0] += s.x; sum[1] += s.y; sum[2] += s.z;
+        products[0] += s.x * s.x; products[1] += s.x * s.y; products[2] += s.x * s.z;
+        products[3] += s.y * s.y; products[4] += s.y * s.z; products[5] += s.z * s.z;
+        ++count;
+    }
+    if(count < 3)
+        return false;
+
+    const double mean[3] = { sum[0] / count, sum[1] / count, sum[2] / count };
+    double covariance[3][3];
+    covariance[0][0] = products[0] / count - mean[0] * mean[0];
+    covariance[0][1] = covariance[1][0] = products[1] / count - mean[0] * mean[1];
+    covariance[0][2] = covariance[2][0] = products[2] / count - mean[0] * mean[2];
+    covariance[1][1] = products[3] / count - mean[1] * mean[1];
+    covariance[1][2] = covariance[2][1] = products[4] / count - mean[1] * mean[2];
+    covariance[2][2] = products[5] / count - mean[2] * mean[2];
+    float normal[3];
+    smallestEigenvector(covariance, normal);
+
+    // keep facing the same way as the hypothesis
+    if(normal[0] * plane.normal[0] + normal[1] * plane.normal[1] + normal[2] * plane.normal[2] < 0)
+        for(int i = 0; i < 3; ++i)
+            normal[i] = -normal[i];
+    for(int i = 0; i < 3; ++i)
+        plane.normal[i] = normal[i];
+    plane.d = -float(normal[0] * mean[0] + normal[1] * mean[1] + normal[2] * mean[2]);
+    return true;
+}
+
+void PlaneDetector::detect( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals,
+                            vector<Plane> & planes, vector<uint8_t> & mask ){
+    const double start = getTime();
+    const int W = intrinsics.width, H = intrinsics.height;
+
+    // pixels with a normal on a sparse grid, as fine at any resolution
+    const int step = max(1, W / columns);
+    samples.clear();
+    for(int y = step / 2; y < H; y += step){
+        for(int x = step / 2; x < W; x += step){
+            const int i = y * W + x;
+            const float * n = normals + 3 * i;
+            if(depth[i] == 0 || (n[0] == 0 && n[1] == 0 && n[2] == 0))
+                continue;
+            Sample s;
+            s.z = intrinsics.depthInMetres(depth[i]);
+            intrinsics.unproject(float(x), float(y), s.z, s.x, s.y);
+            s.nx = n[0]; s.ny = n[1]; s.nz = n[2];
+            samples.push_back(s);
+        }
+    }
+
+    planes.clear();
+    scored = 0;
+    const unsigned needed = max(3u, unsigned(min_inliers * samples.size()));
+    vector<Plane> hypotheses(batch_size);
+    while(planes.size() < max_planes && samples.size() >= needed){
+        Plane best;
+        best.inliers = 0;
+        unsigned iterations = 0, required = max_iterations, next_previous = 0;
+        while(iterations < required){
+            // last frame's planes first, then planes through random pixels
+            for(unsigned h = 0; h < batch_size; ++h){
+                Plane & plane = hypotheses[h];
+                if(next_previous < previous.size()){
+                    plane = previous[next_previous++];
+                    continue;
+                }
+                const Sample & s = samples[random() % samples.size()];
+                plane.normal[0] = s.nx; plane.normal[1] = s.ny; plane.normal[2] = s.nz;
+                plane.d = -(s.nx * s.x + s.ny * s.y + s.nz * s.z);
+            }
+#pragma omp parallel for schedule(dynamic)
+            for(int h = 0; h < int(batch_size); ++h)
+                hypotheses[h].inliers = score(hypotheses[h]);
+            for(unsigned h = 0; h < batch_size; ++h)
+                if(hypotheses[h].inliers > best.inliers)
+                    best = hypotheses[h];
+            iterations += batch_size;
+            scored += batch_size;
+
+            // enough hypotheses to hit a plane at least as large as the best one with the given confidence
+            const double fraction = double(best.inliers) / samples.size();
+            if(fraction >= 1)
+                break;
+            if(fraction > 0)
+                required = unsigned(min(double(max_iterations), ceil(log(1 - confidence) / log(1 - fraction))));
+        }
+        if(best.inliers < needed)
+            break;
+
+        // fit to the inliers, which may gain a few more
+        for(int i = 0; i < 2 && refine(best); ++i)
+            best.inliers = score(best);
+        if(best.d < 0){
+            for(int i = 0; i < 3; ++i)
+                best.normal[i] = -best.normal[i];
+            best.d = -best.d;
+        }
+        // the next planes are searched among the remaining samples, also dropping those close
+        // to the plane with a noisy normal, which would otherwise pull planes nearby toward it
+        unsigned kept = 0;
+        for(unsigned i = 0; i < samples.size(); ++i){
+            const Sample & s = samples[i];
+            if(fabs(best.distance(s.x, s.y, s.z)) >= max_distance * s.z)
+                samples[kept++] = s;
+        }
+        samples.resize(kept);
+        planes.push_back(best);
+    }
+    previous = planes;
+
+    label(depth, intrinsics, normals, planes, mask);
+    detect_time = getTime() - start;
+}
+
+void PlaneDetector::label( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals,
+                           const vector<Plane> & planes, vector<uint8_t> & mask ) const {
+    const int W = intrinsics.width, H = intrinsics.height;
+    mask.resize(W * H);
+    const int plane_count = int(planes.size());
+    if(plane_count == 0){
+        fill(mask.begin(), mask.end(), 0);
+        return;
+    }
+
+    // The distance of the point at depth z of pixel (u, v) from a plane is z (a u + b v + c) + d,
+    // with the normal multiplied into the unprojection, so it is within reach of the plane if
+    // |a u + b v + c + d / z| is below max_distance.
+    vector<float> coefficients(3 * plane_count);
+    for(int p = 0; p < plane_count; ++p){
+        const float * n = planes[p].normal;
+        float * c = &coefficients[3 * p];
+        c[0] = n[0] * intrinsics.mirror_x / intrinsics.fx;
+        c[1] = -n[1] / intrinsics.fy;
+        c[2] = n[2] - c[0] * intrinsics.cx - c[1] * intrinsics.cy;
+    }
+
+    const int blocks = W / 4;
+    const __m128 zero = _mm_setzero_ps(), scale = _mm_set1_ps(0.001f);
+    const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 limit = _mm_set1_ps(max_distance), cosine = _mm_set1_ps(min_cosine);
+    const __m128i shift = _mm_cvtsi32_si128(intrinsics.depth_shift);
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        for(int block = 0; block < blocks; ++block){
+            // 4 pixels at a time, the normals transposed into one vector per coordinate
+            const int x = block * 4, i = y * W + x;
+            const __m128i raw = _mm_srl_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(depth + i)), shift);
+            const __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, _mm_setzero_si128())), scale);
+            const __m128 valid = _mm_cmpgt_ps(z, zero);
+            const __m128 inverse_z = _mm_div_ps(_mm_set1_ps(1.0f), _mm_or_ps(_mm_and_ps(valid, z), _mm_andnot_ps(valid, _mm_set1_ps(1.0f))));
+            const __m128 v0 = _mm_loadu_ps(normals + 3 * i), v1 = _mm_loadu_ps(normals + 3 * i + 4), v2 = _mm_loadu_ps(normals + 3 * i + 8);
+            const __m128 nx = _mm_shuffle_ps(v0, _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+            const __m128 ny = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+            const __m128 nz = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+            // pixels at edges have no normal, their distance has to do
+            const __m128 no_normal = _mm_and_ps(_mm_cmpeq_ps(nx, zero), _mm_and_ps(_mm_cmpeq_ps(ny, zero), _mm_cmpeq_ps(nz, zero)));
+            const __m128 u = _mm_add_ps(_mm_set1_ps(float(x)), _mm_set_ps(3, 2, 1, 0));
+
+            __m128 open = valid;
+            __m128i labels = _mm_setzero_si128();
+            for(int p = 0; p < plane_count; ++p){
+                const Plane & plane = planes[p];
+                const float * c = &coefficients[3 * p];
+                const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[0]), u), _mm_set1_ps(c[1] * y + c[2])),
+                                                   _mm_mul_ps(_mm_set1_ps(plane.d), inverse_z));
+                const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.normal[0]), nx), _mm_mul_ps(_mm_set1_ps(plane.normal[1]), ny)),
+                                              _mm_mul_ps(_mm_set1_ps(plane.normal[2]), nz));
+                const __m128 hit = _mm_and_ps(_mm_and_ps(open, _mm_cmplt_ps(_mm_and_ps(distance, sign), limit)),
+                                              _mm_or_ps(no_normal, _mm_cmpgt_ps(dot, cosine)));
+                labels = _mm_or_si128(labels, _mm_and_si128(_mm_castps_si128(hit), _mm_set1_epi32(p + 1)));
+                open = _mm_andnot_ps(hit, open);
+            }
+            const __m128i words = _mm_packs_epi32(labels, labels);
+            const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+            memcpy(&mask[i], &bytes, 4);
+        }
+        // the same for pixels left over at the end of the row
+        for(int x = blocks * 4; x < W; ++x){
+            const int i = y * W + x;
+            mask[i] = 0;
+            if(depth[i] == 0)
+                continue;
+            const float inverse_z = 1.0f / intrinsics.depthInMetres(depth[i]);
+            const float * n = normals + 3 * i;
+            const bool has_normal = n[0] != 0 || n[1] != 0 || n[2] != 0;
+            for(int p = 0; p < plane_count; ++p){
+                const Plane & plane = planes[p];
+                const float * c = &coefficients[3 * p];
+                if(fabs(c[0] * x + c[1] * y + c[2] + plane.d * inverse_z) >= max_distance)
+                    continue;
+                if(has_normal && plane.normal[0] * n[0] + plane.normal[1] * n[1] + plane.normal[2] * n[2] <= min_cosine)
+                    continue;
+                mask[i] = uint8_t(p + 1);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef PLANES_H
+#define PLANES_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Finds the dominant planes of a depth frame, such as floor, walls and table tops, with
+// RANSAC over a subsampled grid of pixels. As every pixel has a surface normal, a single
+// pixel already defines a plane hypothesis, so far fewer hypotheses are needed than with
+// triples of points. The planes of the previous frame are tried first and usually win
+// within the first batch, which ends the search early. Hypotheses are scored in batches
+// in parallel with OpenMP, the best one is refined by a least squares fit to its inliers,
+// and then the inlier mask of the full image is labelled in parallel over the rows.
+class PlaneDetector {
+public:
+    // distance is the largest distance of an inlier from its plane per metre of depth, as
+    // the depth noise grows with the distance. min_inliers is the smallest fraction of the
+    // sampled pixels a plane needs, columns is the number of pixels sampled per row.
+    PlaneDetector( unsigned max_planes = 3, float distance = 0.015f, float min_inliers = 0.05f, int columns = 160 );
+
+    // Detects the planes in a depth frame with the normals as NormalEstimator computes them,
+    // largest first. The mask is set to the index of the plane + 1 for the pixels on it and
+    // to 0 for all other pixels.
+    void detect( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals,
+                 std::vector<Plane> & planes, std::vector<uint8_t> & mask );
+
+    // forgets the planes of the previous frame
+    void reset() { previous.clear(); }
+
+    // hypotheses scored during the last detect
+    unsigned hypotheses() const { return scored; }
+    // time taken by the last detect in seconds
+    double detectTime() const { return detect_time; }
+
+protected:
+    struct Sample {
+        float x, y, z;
+        float nx, ny, nz;
+    };
+
+    // counts the samples on a plane
+    unsigned score( const Plane & plane ) const;
+    // least squares fit to the samples on a plane, returns false if there are too few
+    bool refine( Plane & plane ) const;
+    bool inlier( const Plane & plane, const Sample & sample ) const;
+    // sets the mask of the pixels on the planes with SSE2, 4 pixels at a time
+    void label( const uint16_t * depth, const Intrinsics & intrinsics, const float * normals,
+                const std::vector<Plane> & planes, std::vector<uint8_t> & mask ) const;
+    uint32_t random();
+
+    unsigned max_planes;
+    float max_distance;
+    float min_inliers;
+    int columns;
+    float min_cosine;           // of the angle between the normal of an inlier and its plane
+    std::vector<Sample> samples;   // not yet on one of the planes found
+    std::vector<Plane> previous;
+    uint32_t seed;
+    unsigned scored;
+    double detect_time;
+};
+
+#endif // PLANES_H
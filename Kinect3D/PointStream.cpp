@@ -0,0 +1,600 @@
+#include <winsock2.h>
+
+#include "PointStream.h"
+
+#include <algorithm>
+
+using namespace std;
+
+struct PointStreamServer::Subscriber {
+    SOCKET socket;
+    vector<uint8_t> buffer;     // message being sent
+    size_t offset;              // bytes of buffer already sent
+    unsigned last_sequence;     // sequence number of the last frame queued
+    bool closed;
+};
+
+ostream & operator<<( ostream & out, const StreamStats & stats ){
+    out << "stream\t\t" << stats.subscribers << " subscribers\t" << stats.published << " published\t" << stats.skipped << " skipped\t" << stats.encoded << " encoded\n"
+        << "\t\t" << stats.sent << " sent\t" << stats.dropped << " dropped\t" << stats.bytes / 1024 << " kB\n"
+        << "\t\tkey " << stats.key_size / 1024 << " kB\tdelta " << stats.delta_size / 1024 << " kB\tencode " << stats.encode_time * 1000 << " ms";
+    return out;
+}
+
+static const uint32_t stream_magic = 'P' | ('C' << 8) | ('L' << 16) | ('D' << 24);
+static const unsigned header_size = 8 * 4;
+static const unsigned joints_per_skeleton = NUI_SKELETON_POSITION_COUNT * 3;
+
+static void put_uint32( vector<uint8_t> & out, const uint32_t value ){
+    const uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+static void set_uint32( vector<uint8_t> & out, const size_t offset, const uint32_t value ){
+    out[offset] = uint8_t(value);
+    out[offset + 1] = uint8_t(value >> 8);
+    out[offset + 2] = uint8_t(value >> 16);
+    out[offset + 3] = uint8_t(value >> 24);
+}
+
+static uint32_t get_uint32( const uint8_t * in ){
+    return uint32_t(in[0]) | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16) | (uint32_t(in[3]) << 24);
+}
+
+// LEB128, 7 bits per byte with the top bit set on all but the last
+static void put_uvarint( vector<uint8_t> & out, uint32_t v ){
+    while(v >= 0x80){
+        out.push_back(uint8_t(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+// zigzag LEB128, small differences of either sign take a single byte
+static void put_varint( vector<uint8_t> & out, const int value ){
+    put_uvarint(out, (uint32_t(value) << 1) ^ uint32_t(value >> 31));
+}
+
+// reads a LEB128 varint at in, returns false beyond end
+static bool get_uvarint( const uint8_t * & in, const uint8_t * end, uint32_t & value ){
+    value = 0;
+    for(int shift = 0; shift < 35 && in < end; shift += 7){
+        const uint8_t byte = *in++;
+        value |= uint32_t(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool get_varint( const uint8_t * & in, const uint8_t * end, int & value ){
+    uint32_t v;
+    if(!get_uvarint(in, end, v))
+        return false;
+    value = int(v >> 1) ^ -int(v & 1);
+    return true;
+}
+
+static short quantize( const float value ){
+    const float mm = value * 1000.0f;
+    return short(max(-32768.0f, min(32767.0f, mm < 0 ? mm - 0.5f : mm + 0.5f)));
+}
+
+PointStreamServer::PointStreamServer( unsigned short p ) :
+    port(p), listen_socket(INVALID_SOCKET), subscriber_count(0), have_pending(false), last_organized(0), sequence(0), delta_base(0),
+    thread(INVALID_HANDLE_VALUE), stop_event(INVALID_HANDLE_VALUE), frame_event(INVALID_HANDLE_VALUE),
+    key_sum(0), delta_sum(0), encode_sum(0), key_count(0), delta_count(0)
+{
+    InitializeCriticalSection(&lock);
+    memset(&stats, 0, sizeof(stats));
+}
+
+PointStreamServer::~PointStreamServer(){
+    stop();
+    DeleteCriticalSection(&lock);
+}
+
+bool PointStreamServer::start(){
+    if(thread != INVALID_HANDLE_VALUE)
+        return true;
+
+    WSADATA data;
+    if(WSAStartup(MAKEWORD(2,2), &data) != 0){
+        cout << "PointStreamServer: Could not initialize winsock" << endl;
+        return false;
+    }
+
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    u_long non_blocking = 1;
+    if(s == INVALID_SOCKET || ::bind(s, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || ::listen(s, SOMAXCONN) == SOCKET_ERROR || ioctlsocket(s, FIONBIO, &non_blocking) == SOCKET_ERROR){
+        cout << "PointStreamServer: Could not listen on port " << port << endl;
+        if(s != INVALID_SOCKET)
+            closesocket(s);
+        WSACleanup();
+        return false;
+    }
+    listen_socket = s;
+
+    stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    frame_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    thread = CreateThread(NULL, 0, run, this, 0, NULL);
+    return true;
+}
+
+void PointStreamServer::stop(){
+    if(thread == INVALID_HANDLE_VALUE)
+        return;
+    SetEvent(stop_event);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CloseHandle(stop_event);
+    CloseHandle(frame_event);
+    thread = stop_event = frame_event = INVALID_HANDLE_VALUE;
+
+    for(unsigned i = 0; i < subscribers.size(); ++i){
+        closesocket(subscribers[i]->socket);
+        delete subscribers[i];
+    }
+    subscribers.clear();
+    InterlockedExchange(&subscriber_count, 0);
+    closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+    WSACleanup();
+}
+
+void PointStreamServer::publish( const Frame & frame, DepthDevice & kinect ){
+    if(subscriber_count == 0){
+        EnterCriticalSection(&lock);
+        ++stats.published;
+        ++stats.skipped;
+        LeaveCriticalSection(&lock);
+        return;
+    }
+
+    vector<int> skeletons;
+    kinect.getTrackedSkeletons(skeletons);
+
+    EnterCriticalSection(&lock);
+    pending_points.assign(frame.points.begin(), frame.points.end());
+    pending_pixels.assign(frame.pixels.begin(), frame.pixels.end());
+    pending_grid = frame.pixels.empty() ? ImageRef(0, 0) : frame.depth.size();
+    pending_joints.clear();
+    for(unsigned i = 0; i < skeletons.size(); ++i){
+        const Vector4 * skeleton = kinect.getSkeleton(skeletons[i]);
+        for(unsigned j = 0; j < NUI_SKELETON_POSITION_COUNT; ++j){
+            pending_joints.push_back(skeleton[j].x);
+            pending_joints.push_back(skeleton[j].y);
+            pending_joints.push_back(skeleton[j].z);
+        }
+    }
+    have_pending = true;
+    ++stats.published;
+    LeaveCriticalSection(&lock);
+    SetEvent(frame_event);
+}
+
+DWORD WINAPI PointStreamServer::run(LPVOID pParam){
+    PointStreamServer * pthis = (PointStreamServer *) pParam;
+    pthis->serve();
+    return 0;
+}
+
+void PointStreamServer::serve(){
+    HANDLE events[2] = { stop_event, frame_event };
+    while(1){
+        // the timeout accepts new subscribers and continues partial sends between frames
+        const DWORD result = WaitForMultipleObjects(2, events, FALSE, 10);
+        if(result == WAIT_OBJECT_0)
+            break;
+
+        acceptSubscribers();
+        for(unsigned i = 0; i < subscribers.size(); ++i)
+            flush(*subscribers[i]);
+
+        if(result == WAIT_OBJECT_0 + 1 && encode())
+            distribute();
+
+        for(unsigned i = 0; i < subscribers.size();){
+            if(subscribers[i]->closed){
+                closesocket(subscribers[i]->socket);
+                delete subscribers[i];
+                subscribers.erase(subscribers.begin() + i);
+            } else
+                ++i;
+        }
+        InterlockedExchange(&subscriber_count, LONG(subscribers.size()));
+    }
+}
+
+void PointStreamServer::acceptSubscribers(){
+    while(1){
+        SOCKET s = ::accept(listen_socket, NULL, NULL);
+        if(s == INVALID_SOCKET)
+            break;
+        u_long non_blocking = 1;
+        ioctlsocket(s, FIONBIO, &non_blocking);
+        Subscriber * subscriber = new Subscriber;
+        subscriber->socket = s;
+        subscriber->offset = 0;
+        subscriber->last_sequence = 0;
+        subscriber->closed = false;
+        subscribers.push_back(subscriber);
+    }
+}
+
+// true if the pixels increase and lie within a grid of size pixels
+static bool increasing( const vector<uint32_t> & pixels, const size_t size ){
+    for(size_t i = 1; i < pixels.size(); ++i)
+        if(pixels[i] <= pixels[i - 1])
+            return false;
+    return pixels.empty() || pixels.back() < size;
+}
+
+bool PointStreamServer::encode(){
+    EnterCriticalSection(&lock);
+    const bool have_frame = have_pending;
+    if(have_frame){
+        points.swap(pending_points);
+        pixels.swap(pending_pixels);
+        joints.swap(pending_joints);
+        grid_size = pending_grid;
+        have_pending = false;
+    }
+    LeaveCriticalSection(&lock);
+    if(!have_frame)
+        return false;
+
+    const double start = getTime();
+    const bool organized = grid_size.x > 0 && pixels.size() == points.size() && increasing(pixels, size_t(grid_size.x) * grid_size.y);
+    const size_t grid_pixels = organized ? size_t(grid_size.x) * grid_size.y : 0;
+    if(grid.size() != grid_pixels){
+        grid.resize(grid_pixels);
+        grid_sequence.assign(grid_pixels, 0);
+        last_organized = 0;
+    }
+    // subscribers holding the last organized frame get a delta frame against it, the others
+    // waiting for a frame a key frame. Busy subscribers skip this frame.
+    const unsigned base = organized ? last_organized : 0;
+    bool need_key = false, need_delta = false;
+    unsigned busy = 0;
+    for(unsigned i = 0; i < subscribers.size(); ++i){
+        const Subscriber & subscriber = *subscribers[i];
+        if(subscriber.closed)
+            continue;
+        if(!subscriber.buffer.empty())
+            ++busy;
+        else if(base != 0 && subscriber.last_sequence == base)
+            need_delta = true;
+        else
+            need_key = true;
+    }
+    if(!need_key && !need_delta){
+        // nobody takes the frame, the subscribers keep their deltas against the last one sent
+        EnterCriticalSection(&lock);
+        stats.dropped += busy;
+        LeaveCriticalSection(&lock);
+        return false;
+    }
+
+    ++sequence;
+    vector<uint8_t> * frames[2] = { &key_frame, &delta_frame };
+    const bool needed[2] = { need_key, need_delta };
+    for(int type = 0; type < 2; ++type){
+        vector<uint8_t> & out = *frames[type];
+        out.clear();
+        if(!needed[type])
+            continue;
+        put_uint32(out, stream_magic);
+        put_uint32(out, 0);
+        put_uint32(out, sequence);
+        put_uint32(out, type);
+        put_uint32(out, uint32_t(points.size()));
+        put_uint32(out, uint32_t(joints.size() / joints_per_skeleton));
+        put_uint32(out, organized ? grid_size.x : 0);
+        put_uint32(out, organized ? grid_size.y : 0);
+        if(!joints.empty()){
+            const uint8_t * bytes = reinterpret_cast<const uint8_t *>(joints.data());
+            out.insert(out.end(), bytes, bytes + joints.size() * sizeof(float));
+        }
+    }
+
+    // one pass writes both frames and keeps the points of the pixels for the next delta frame
+    Quantized last = { 0, 0, 0, 0 };
+    uint32_t next_pixel = 0, cursor = 0;
+    unsigned run = 0;           // unchanged points of the delta frame not written yet
+    for(unsigned i = 0; i < points.size(); ++i){
+        Quantized point;
+        point.x = quantize(points[i].x);
+        point.y = quantize(points[i].y);
+        point.z = quantize(points[i].z);
+        point.color = points[i].color;
+        if(organized){
+            const uint32_t pixel = pixels[i];
+            if(need_key)
+                put_uvarint(key_frame, pixel - next_pixel);
+            if(need_delta){
+                // the next pixel with a point in the base frame, which a run would copy next
+                cursor = max(cursor, next_pixel);
+                while(cursor < grid_pixels && grid_sequence[cursor] != base)
+                    ++cursor;
+                const Quantized & before = grid[pixel];
+                if(cursor == pixel && before.x == point.x && before.y == point.y && before.z == point.z && ((before.color ^ point.color) & 0xffffff) == 0)
+                    ++run;
+                else {
+                    if(run){
+                        put_uvarint(delta_frame, ((run - 1) << 1) | 1);
+                        run = 0;
+                    }
+                    const Quantized & prediction = grid_sequence[pixel] == base ? grid[pixel] : last;
+                    const bool recolored = ((point.color ^ prediction.color) & 0xffffff) != 0;
+                    put_uvarint(delta_frame, ((pixel - next_pixel) << 2) | (recolored ? 2 : 0));
+                    put_varint(delta_frame, point.x - prediction.x);
+                    put_varint(delta_frame, point.y - prediction.y);
+                    put_varint(delta_frame, point.z - prediction.z);
+                    if(recolored)
+                        for(int shift = 0; shift < 24; shift += 8)
+                            put_varint(delta_frame, int((point.color >> shift) & 0xff) - int((prediction.color >> shift) & 0xff));
+                }
+            }
+            grid[pixel] = point;
+            grid_sequence[pixel] = sequence;
+            next_pixel = pixel + 1;
+        }
+        if(need_key){
+            put_varint(key_frame, point.x - last.x);
+            put_varint(key_frame, point.y - last.y);
+            put_varint(key_frame, point.z - last.z);
+            key_frame.push_back(uint8_t(point.color));
+            key_frame.push_back(uint8_t(point.color >> 8));
+            key_frame.push_back(uint8_t(point.color >> 16));
+        }
+        last = point;
+    }
+    if(run)
+        put_uvarint(delta_frame, ((run - 1) << 1) | 1);
+    for(int type = 0; type < 2; ++type)
+        if(needed[type])
+            set_uint32(*frames[type], 4, uint32_t(frames[type]->size() - header_size));
+    delta_base = need_delta ? base : 0;
+    last_organized = organized ? sequence : 0;
+
+    const double elapsed = getTime() - start;
+    EnterCriticalSection(&lock);
+    ++stats.encoded;
+    encode_sum += elapsed;
+    if(need_key){
+        key_sum += key_frame.size();
+        ++key_count;
+    }
+    if(need_delta){
+        delta_sum += delta_frame.size();
+        ++delta_count;
+    }
+    LeaveCriticalSection(&lock);
+    return true;
+}
+
+void PointStreamServer::distribute(){
+    unsigned sent = 0, dropped = 0;
+    double bytes = 0;
+    for(unsigned i = 0; i < subscribers.size(); ++i){
+        Subscriber & subscriber = *subscribers[i];
+        if(subscriber.closed)
+            continue;
+        if(!subscriber.buffer.empty()){
+            // still busy with an older frame, skip this one and resync with a key frame
+            ++dropped;
+            continue;
+        }
+        const bool can_delta = delta_base != 0 && subscriber.last_sequence == delta_base;
+        subscriber.buffer = can_delta ? delta_frame : key_frame;
+        subscriber.offset = 0;
+        subscriber.last_sequence = sequence;
+        bytes += subscriber.buffer.size();
+        ++sent;
+        flush(subscriber);
+    }
+
+    EnterCriticalSection(&lock);
+    stats.sent += sent;
+    stats.dropped += dropped;
+    stats.bytes += bytes;
+    LeaveCriticalSection(&lock);
+}
+
+void PointStreamServer::flush( Subscriber & subscriber ){
+    while(subscriber.offset < subscriber.buffer.size()){
+        const int result = ::send(subscriber.socket, reinterpret_cast<const char *>(&subscriber.buffer[subscriber.offset]), int(subscriber.buffer.size() - subscriber.offset), 0);
+        if(result == SOCKET_ERROR){
+            if(WSAGetLastError() != WSAEWOULDBLOCK)
+                subscriber.closed = true;
+            return;
+        }
+        subscriber.offset += result;
+    }
+    subscriber.buffer.clear();
+    subscriber.offset = 0;
+}
+
+StreamStats PointStreamServer::getStats(){
+    EnterCriticalSection(&lock);
+    StreamStats result = stats;
+    result.subscribers = unsigned(subscribers.size());
+    result.key_size = key_count > 0 ? key_sum / key_count : 0;
+    result.delta_size = delta_count > 0 ? delta_sum / delta_count : 0;
+    result.encode_time = stats.encoded > 0 ? encode_sum / stats.encoded : 0;
+    memset(&stats, 0, sizeof(stats));
+    key_sum = delta_sum = encode_sum = 0;
+    key_count = delta_count = 0;
+    LeaveCriticalSection(&lock);
+    return result;
+}
+
+PointStreamClient::PointStreamClient() : socket(INVALID_SOCKET), last_sequence(0), last_delta(false) {}
+
+PointStreamClient::~PointStreamClient(){
+    close();
+}
+
+bool PointStreamClient::connect( unsigned short port ){
+    close();
+    WSADATA data;
+    if(WSAStartup(MAKEWORD(2,2), &data) != 0)
+        return false;
+    SOCKET s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if(s == INVALID_SOCKET || ::connect(s, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR){
+        if(s != INVALID_SOCKET)
+            closesocket(s);
+        WSACleanup();
+        return false;
+    }
+    socket = s;
+    last_sequence = 0;
+    return true;
+}
+
+void PointStreamClient::close(){
+    if(socket == INVALID_SOCKET)
+        return;
+    closesocket(socket);
+    socket = INVALID_SOCKET;
+    WSACleanup();
+}
+
+bool PointStreamClient::read( void * data, size_t size ){
+    char * out = static_cast<char *>(data);
+    while(size > 0){
+        const int result = ::recv(socket, out, int(size), 0);
+        if(result <= 0)
+            return false;
+        out += result;
+        size -= result;
+    }
+    return true;
+}
+
+bool PointStreamClient::receive( vector<Point> & points, vector<float> & joints, vector<uint32_t> & pixels ){
+    if(socket == INVALID_SOCKET)
+        return false;
+    uint8_t header[header_size];
+    if(!read(header, header_size) || get_uint32(header) != stream_magic)
+        return false;
+    message.resize(get_uint32(header + 4));
+    if(!message.empty() && !read(&message[0], message.size()))
+        return false;
+    const unsigned sequence = get_uint32(header + 8);
+    const bool delta = get_uint32(header + 12) == 1;
+    const unsigned count = get_uint32(header + 16), skeletons = get_uint32(header + 20);
+    const size_t grid_pixels = size_t(get_uint32(header + 24)) * get_uint32(header + 28);
+    // delta frames need the organized frame before them
+    if(delta && (grid_pixels == 0 || grid.size() != 3 * grid_pixels || last_sequence + 1 != sequence))
+        return false;
+    if(grid.size() != 3 * grid_pixels){
+        grid.assign(3 * grid_pixels, 0);
+        grid_color.assign(grid_pixels, 0);
+        grid_sequence.assign(grid_pixels, 0);
+    }
+
+    const uint8_t * in = message.empty() ? NULL : &message[0];
+    const uint8_t * end = in + message.size();
+    const size_t joint_bytes = size_t(skeletons) * joints_per_skeleton * sizeof(float);
+    if(joint_bytes > message.size())
+        return false;
+    joints.resize(skeletons * joints_per_skeleton);
+    if(joint_bytes)
+        memcpy(&joints[0], in, joint_bytes);
+    in += joint_bytes;
+
+    points.clear();
+    pixels.clear();
+    short last[3] = { 0, 0, 0 };
+    uint32_t last_color = 0;
+    uint32_t next_pixel = 0, cursor = 0;
+    while(points.size() < count){
+        uint32_t token = 0, pixel = 0, run = 1;
+        if(delta){
+            if(!get_uvarint(in, end, token))
+                return false;
+            if(token & 1){
+                // unchanged points at the next pixels that had a point in the frame before
+                run = (token >> 1) + 1;
+                if(run > count - points.size())
+                    return false;
+                for(uint32_t k = 0; k < run; ++k){
+                    cursor = max(cursor, next_pixel);
+                    while(cursor < grid_pixels && grid_sequence[cursor] != last_sequence)
+                        ++cursor;
+                    if(cursor == grid_pixels)
+                        return false;
+                    pixel = cursor;
+                    const short * position = &grid[3 * pixel];
+                    points.push_back(Point(position[0] * 0.001f, position[1] * 0.001f, position[2] * 0.001f, grid_color[pixel]));
+                    pixels.push_back(pixel);
+                    grid_sequence[pixel] = sequence;
+                    copy(position, position + 3, last);
+                    last_color = grid_color[pixel];
+                    next_pixel = pixel + 1;
+                }
+                continue;
+            }
+        }
+        const short * prediction = last;
+        uint32_t predicted_color = last_color;
+        if(grid_pixels){
+            uint32_t gap = token >> 2;
+            if(!delta && !get_uvarint(in, end, gap))
+                return false;
+            if(gap >= grid_pixels - next_pixel)
+                return false;
+            pixel = next_pixel + gap;
+            next_pixel = pixel + 1;
+            if(delta && grid_sequence[pixel] == last_sequence){
+                prediction = &grid[3 * pixel];
+                predicted_color = grid_color[pixel];
+            }
+            pixels.push_back(pixel);
+        }
+        int difference[3];
+        if(!get_varint(in, end, difference[0]) || !get_varint(in, end, difference[1]) || !get_varint(in, end, difference[2]))
+            return false;
+        short position[3];
+        for(int k = 0; k < 3; ++k)
+            position[k] = short(prediction[k] + difference[k]);
+        uint32_t color = predicted_color & 0xffffff;
+        if(!delta){
+            if(end - in < 3)
+                return false;
+            color = uint32_t(in[0]) | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16);
+            in += 3;
+        } else if(token & 2){
+            color = 0;
+            for(int shift = 0; shift < 24; shift += 8){
+                int channel;
+                if(!get_varint(in, end, channel))
+                    return false;
+                color |= uint32_t((int((predicted_color >> shift) & 0xff) + channel) & 0xff) << shift;
+            }
+        }
+        points.push_back(Point(position[0] * 0.001f, position[1] * 0.001f, position[2] * 0.001f, color));
+        if(grid_pixels){
+            copy(position, position + 3, &grid[3 * pixel]);
+            grid_color[pixel] = color;
+            grid_sequence[pixel] = sequence;
+        }
+        copy(position, position + 3, last);
+        last_color = color;
+    }
+    last_sequence = sequence;
+    last_delta = delta;
+    return in == end;
+}
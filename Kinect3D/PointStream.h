@@ -0,0 +1,154 @@
+#ifndef POINTSTREAM_H
+#define POINTSTREAM_H
+
+#include <Windows.h>
+#include <vector>
+#include <iostream>
+
+#include "Kinect3DDevice.h"
+
+// Statistics of the stream server, counted since the last call to PointStreamServer::getStats
+struct StreamStats {
+    unsigned published;         // frames handed to the server
+    unsigned skipped;           // published frames not copied for lack of subscribers
+    unsigned encoded;           // frames encoded, published frames can be replaced before encoding
+    unsigned sent;              // frames sent to all subscribers together
+    unsigned dropped;           // frames skipped for subscribers that were still busy
+    unsigned subscribers;
+    double bytes;               // payload bytes sent
+    double key_size, delta_size;// average encoded frame sizes in bytes, of the frames encoded of each type
+    double encode_time;         // average encoding time in seconds
+};
+
+std::ostream & operator<<( std::ostream & out, const StreamStats & stats );
+
+// Publishes point clouds and skeleton joints to other processes on the same machine
+// over a TCP socket bound to the loopback interface.
+//
+// Each message starts with a header of little endian 32 bit words:
+//   magic 'PCLD', payload size in bytes, sequence number, type (0 key, 1 delta),
+//   point count, skeleton count, grid width, grid height
+// The payload holds 20 joints of 3 floats per skeleton, followed by the points.
+// Points made from a depth frame are organized on its grid of width x height pixels,
+// other point clouds such as the fused surface have a grid of 0 x 0. Organized points
+// start with the index of their pixel as an unsigned LEB128 varint of the gap to the
+// pixel of the point before, the pixels are increasing. Point positions are quantized
+// to millimetres. In key frames every coordinate is stored as a zigzag LEB128 varint of
+// the difference to the previous point of the same frame, followed by the color as
+// 3 bytes BGR.
+//
+// Delta frames are only sent for organized points and hold a sequence of unsigned
+// varint tokens. A token with bit 0 set copies (token >> 1) + 1 points unchanged from
+// the previous frame, at the next pixels that had a point there. Any other token starts
+// a point at a gap of token >> 2 pixels, whose coordinates are zigzag varints of the
+// difference to the point at the same pixel in the previous frame, or to the previous
+// point where that pixel had no point. The color of that prediction is kept unless
+// bit 1 of the token is set, then 3 zigzag varints of the difference per channel follow.
+//
+// Publishing never blocks and costs nothing without subscribers. Sockets are
+// non-blocking, and a subscriber that has not consumed the last frame yet skips frames
+// and receives a key frame once it caught up. Only the frame types that the waiting
+// subscribers need are encoded.
+class PointStreamServer {
+public:
+    PointStreamServer( unsigned short port = 5432 );
+    ~PointStreamServer();
+
+    bool start();
+    void stop();
+
+    // hands the points of the frame to the server thread, replacing a frame not yet encoded.
+    // Without subscribers the frame is not copied.
+    void publish( const Frame & frame, DepthDevice & kinect );
+
+    // subscribers connected as of the last pass of the server thread
+    unsigned subscriberCount() const { return unsigned(subscriber_count); }
+
+    StreamStats getStats();
+
+protected:
+    struct Quantized {
+        short x, y, z;
+        uint32_t color;
+    };
+    struct Subscriber;
+
+    static DWORD WINAPI run(LPVOID pParam);
+    void serve();
+    void acceptSubscribers();
+    // encodes the pending frame for the waiting subscribers, returns false if there was none
+    bool encode();
+    void distribute();
+    // sends as much of the queued message as the socket takes without blocking
+    void flush( Subscriber & subscriber );
+
+    unsigned short port;
+    UINT_PTR listen_socket;     // a winsock SOCKET, kept opaque to avoid winsock2.h in the header
+    std::vector<Subscriber *> subscribers;
+    volatile LONG subscriber_count;
+
+    // frame handed over by publish, guarded by lock
+    CRITICAL_SECTION lock;
+    std::vector<Point> pending_points;
+    std::vector<uint32_t> pending_pixels;
+    ImageRef pending_grid;
+    std::vector<float> pending_joints;
+    bool have_pending;
+
+    // encoder state, only used by the server thread
+    std::vector<Point> points;
+    std::vector<uint32_t> pixels;
+    ImageRef grid_size;
+    std::vector<float> joints;
+    // the last point of every pixel, and the sequence number of the frame it is from
+    std::vector<Quantized> grid;
+    std::vector<uint32_t> grid_sequence;
+    unsigned last_organized;    // sequence number of the last organized frame, 0 if none
+    std::vector<uint8_t> key_frame, delta_frame;
+    unsigned sequence;
+    unsigned delta_base;        // the frame delta_frame predicts from, 0 without a delta frame
+
+    HANDLE thread;
+    HANDLE stop_event;
+    HANDLE frame_event;
+
+    // statistics, guarded by lock
+    StreamStats stats;
+    double key_sum, delta_sum, encode_sum;
+    unsigned key_count, delta_count;
+};
+
+// Receives and decodes the messages of a PointStreamServer over a blocking socket, as the
+// reference for the format above and for tests.
+class PointStreamClient {
+public:
+    PointStreamClient();
+    ~PointStreamClient();
+
+    bool connect( unsigned short port = 5432 );
+    void close();
+
+    // Blocks until the next message arrived and decodes it, returns false if the connection
+    // closed or the message was invalid. Points are in metres, quantized to millimetres, and
+    // joints hold 20 joints of 3 floats per skeleton. pixels receives the grid pixel of every
+    // point, empty for points without a grid.
+    bool receive( std::vector<Point> & points, std::vector<float> & joints, std::vector<uint32_t> & pixels );
+
+    // of the last message received
+    unsigned sequence() const { return last_sequence; }
+    bool wasDelta() const { return last_delta; }
+    unsigned messageSize() const { return unsigned(message.size()); }
+
+protected:
+    bool read( void * data, size_t size );
+
+    UINT_PTR socket;
+    std::vector<uint8_t> message;
+    std::vector<short> grid;            // 3 coordinates per pixel of the last frame
+    std::vector<uint32_t> grid_color;
+    std::vector<uint32_t> grid_sequence;
+    unsigned last_sequence;
+    bool last_delta;
+};
+
+#endif // POINTSTREAM_H
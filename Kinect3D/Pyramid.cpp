@@ -0,0 +1,159 @@
+#include "Pyramid.h"
+
+#include <emmintrin.h>
+#include <algorithm>
+
+using namespace std;
+
+DepthPyramid::DepthPyramid( int levels, Method m, int difference ) : level_count(levels), built_levels(0), method(m), max_difference(difference), build_time(0) {}
+
+void DepthPyramid::build( const SubImage<const uint16_t> & depth, int shift ){
+    const double start = getTime();
+    if(int(pyramid.size()) < level_count)
+        pyramid.resize(level_count);
+
+    // level 0 in millimetres, values with the top bit set become invalid
+    const ImageRef size = depth.size();
+    pyramid[0].resize(size);
+    const __m128i bits = _mm_cvtsi32_si128(shift);
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < size.y; ++y){
+        const uint16_t * in = depth[y];
+        uint16_t * out = pyramid[0][y];
+        int x = 0;
+        for(; x + 8 <= size.x; x += 8){
+            const __m128i value = _mm_srl_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x)), bits);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), _mm_andnot_si128(_mm_srai_epi16(value, 15), value));
+        }
+        for(; x < size.x; ++x){
+            const uint16_t value = uint16_t(in[x] >> shift);
+            out[x] = value & 0x8000 ? 0 : value;
+        }
+    }
+
+    built_levels = 1;
+    for(int level = 1; level < level_count; ++level){
+        const ImageRef half = pyramid[level - 1].size() >> 1;
+        if(half.x < 1 || half.y < 1)
+            break;
+        pyramid[level].resize(half);
+        downsample(pyramid[level - 1], pyramid[level], method, max_difference);
+        built_levels = level + 1;
+    }
+    build_time = getTime() - start;
+}
+
+// the same rules for one block, see the header
+static uint16_t combine( const uint16_t block[4], const DepthPyramid::Method method, const int max_difference ){
+    if(method == DepthPyramid::MEDIAN){
+        uint16_t valid[4];
+        int count = 0;
+        for(int i = 0; i < 4; ++i)
+            if(block[i])
+                valid[count++] = block[i];
+        if(count == 0)
+            return 0;
+        sort(valid, valid + count);
+        return valid[(count - 1) / 2];
+    }
+    int reference = 0;
+    for(int i = 0; i < 4 && reference == 0; ++i)
+        reference = block[i];
+    int sum = 0, count = 0;
+    for(int i = 0; i < 4; ++i)
+        if(block[i] && abs(block[i] - reference) < max_difference){
+            sum += block[i];
+            ++count;
+        }
+    return count ? uint16_t((sum + count / 2) / count) : 0;
+}
+
+void DepthPyramid::downsampleReference( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, Method method, int max_difference ){
+    for(int y = 0; y < out.size().y; ++y)
+        for(int x = 0; x < out.size().x; ++x){
+            const uint16_t block[4] = { in[2 * y][2 * x], in[2 * y][2 * x + 1], in[2 * y + 1][2 * x], in[2 * y + 1][2 * x + 1] };
+            out[y][x] = combine(block, method, max_difference);
+        }
+}
+
+// the even and odd pixels of 16 depths as 8 signed 16 bit values each, the depths are below 32768
+static inline void deinterleave( const uint16_t * in, __m128i & even, __m128i & odd ){
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 8));
+    even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(low, 16), 16), _mm_srai_epi32(_mm_slli_epi32(high, 16), 16));
+    odd = _mm_packs_epi32(_mm_srai_epi32(low, 16), _mm_srai_epi32(high, 16));
+}
+
+static inline __m128i select( const __m128i mask, const __m128i a, const __m128i b ){
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// 8 averages of the blocks a, b, c, d
+static inline __m128i average8( const __m128i s[4], const __m128i threshold ){
+    const __m128i zero = _mm_setzero_si128();
+    __m128i reference = s[0];
+    for(int i = 1; i < 4; ++i)
+        reference = select(_mm_cmpeq_epi16(reference, zero), s[i], reference);
+
+    __m128i count = zero, sum_low = zero, sum_high = zero;
+    const __m128i negative = _mm_sub_epi16(zero, threshold);
+    for(int i = 0; i < 4; ++i){
+        const __m128i difference = _mm_sub_epi16(s[i], reference);
+        const __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi16(s[i], zero),
+                                               _mm_and_si128(_mm_cmplt_epi16(difference, threshold), _mm_cmpgt_epi16(difference, negative)));
+        const __m128i value = _mm_and_si128(s[i], valid);
+        count = _mm_sub_epi16(count, valid);
+        sum_low = _mm_add_epi32(sum_low, _mm_unpacklo_epi16(value, zero));
+        sum_high = _mm_add_epi32(sum_high, _mm_unpackhi_epi16(value, zero));
+    }
+
+    // (sum + count / 2) / count is exact in floats, blocks without a valid sample give 0 / 1
+    const __m128i divisor = _mm_max_epi16(count, _mm_set1_epi16(1));
+    const __m128i rounding = _mm_srli_epi16(count, 1);
+    const __m128 low = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(sum_low, _mm_unpacklo_epi16(rounding, zero))), _mm_cvtepi32_ps(_mm_unpacklo_epi16(divisor, zero)));
+    const __m128 high = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(sum_high, _mm_unpackhi_epi16(rounding, zero))), _mm_cvtepi32_ps(_mm_unpackhi_epi16(divisor, zero)));
+    return _mm_packs_epi32(_mm_cvttps_epi32(low), _mm_cvttps_epi32(high));
+}
+
+// 8 lower medians of the valid samples of the blocks a, b, c, d
+static inline __m128i median8( const __m128i s[4] ){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i invalid = _mm_set1_epi16(0x7fff);
+    __m128i v[4], count = zero;
+    for(int i = 0; i < 4; ++i){
+        const __m128i missing = _mm_cmpeq_epi16(s[i], zero);
+        // invalid samples sort behind all valid ones
+        v[i] = _mm_or_si128(s[i], _mm_and_si128(missing, invalid));
+        count = _mm_sub_epi16(count, _mm_andnot_si128(missing, _mm_set1_epi16(-1)));
+    }
+    // sorting network of 4 values, only the two smallest are needed
+    const __m128i low1 = _mm_min_epi16(v[0], v[1]), high1 = _mm_max_epi16(v[0], v[1]);
+    const __m128i low2 = _mm_min_epi16(v[2], v[3]), high2 = _mm_max_epi16(v[2], v[3]);
+    const __m128i first = _mm_min_epi16(low1, low2);
+    const __m128i second = _mm_min_epi16(_mm_max_epi16(low1, low2), _mm_min_epi16(high1, high2));
+    const __m128i median = select(_mm_cmpgt_epi16(count, _mm_set1_epi16(2)), second, first);
+    return _mm_andnot_si128(_mm_cmpeq_epi16(count, zero), median);
+}
+
+void DepthPyramid::downsample( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, Method method, int max_difference ){
+    const int W = out.size().x, H = out.size().y;
+    const __m128i threshold = _mm_set1_epi16(short(min(max_difference, 32767)));
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        const uint16_t * top = in[2 * y];
+        const uint16_t * bottom = in[2 * y + 1];
+        uint16_t * row = out[y];
+        int x = 0;
+        for(; x + 8 <= W; x += 8){
+            __m128i s[4];
+            deinterleave(top + 2 * x, s[0], s[1]);
+            deinterleave(bottom + 2 * x, s[2], s[3]);
+            const __m128i result = method == MEDIAN ? median8(s) : average8(s, threshold);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(row + x), result);
+        }
+        for(; x < W; ++x){
+            const uint16_t block[4] = { top[2 * x], top[2 * x + 1], bottom[2 * x], bottom[2 * x + 1] };
+            row[x] = combine(block, method, max_difference);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <vector>
+
+#include "helpers.h"
+
+// Multi-level pyramid of a depth image in millimetres, every level half the width and height
+// of the one before, for coarse to fine tracking and other steps that need less depth. A
+// pixel of a level combines the 2x2 block below it, skipping invalid pixels of depth 0, so
+// that holes neither grow nor pull the depth toward the camera. The average only includes
+// the samples within max_difference of the first valid one, so depth edges stay sharp instead
+// of producing points between the surfaces; the median picks one of the valid samples. Levels
+// are computed 8 pixels at a time with SSE2 and their rows split across threads with OpenMP,
+// into images allocated once for the size of the input.
+class DepthPyramid {
+public:
+    enum Method {
+        AVERAGE,    // mean of the valid samples on the surface of the first valid one
+        MEDIAN      // lower median of the valid samples
+    };
+
+    DepthPyramid( int levels = 4, Method method = AVERAGE, int max_difference = 30 );
+
+    void setLevels( int levels ) { level_count = levels; }
+    void setMethod( Method m ) { method = m; }
+
+    // Builds all levels from a depth image whose values shifted right by shift are millimetres,
+    // as with Intrinsics::depth_shift. Level 0 is the image itself in millimetres. Depths
+    // beyond 32767 mm are invalid. Levels smaller than 1x1 are left out.
+    void build( const SubImage<const uint16_t> & depth, int shift = 0 );
+
+    int levels() const { return built_levels; }
+    const Image<uint16_t> & operator[]( int level ) const { return pyramid[level]; }
+
+    // time taken by the last call to build in seconds
+    double buildTime() const { return build_time; }
+
+    // one level computed one pixel at a time, as the reference for tests and benchmarks
+    static void downsampleReference( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, Method method, int max_difference );
+
+protected:
+    static void downsample( const SubImage<const uint16_t> & in, SubImage<uint16_t> out, Method method, int max_difference );
+
+    int level_count, built_levels;
+    Method method;
+    int max_difference;
+    std::vector<Image<uint16_t> > pyramid;
+    double build_time;
+};
+
+#endif // PYRAMID_H
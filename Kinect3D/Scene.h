@@ -2,19 +2,29 @@
 #define SCENE_H
 
 #include "helpers.h"
+#include "Mesh.h"
 
 class Scene {
 public:
 	virtual void handle_events( const GLWindow::EventSummary & events) {}
-	virtual void render( DepthDevice & kinect ) {}
+	virtual void render( DepthDevice & kinect, const Frame & frame ) {}
+	// whether render uses the normals of the points
+	virtual bool needsNormals() const { return false; }
 };
 
 class KinectScene : public Scene {
 public:
-	vector<Point> points;
 	float point_size;
+	bool lod;
+	bool lit;
+	vector<uint32_t> visible;
+	unsigned rendered_points, total_points, octree_nodes;
+	MeshRenderer mesh;
+	unsigned rendered_triangles;
 
-	KinectScene() : point_size(2) {}
+	KinectScene() : point_size(2), lod(true), lit(false), rendered_points(0), total_points(0), octree_nodes(0), rendered_triangles(0) {}
+
+	bool needsNormals() const { return lit; }
 
 	void handle_events( const GLWindow::EventSummary & events){
 		if(events.key_up.count('1'))
@@ -27,16 +37,69 @@ public:
 			point_size = 4;
 		if(events.key_up.count('5'))
 			point_size = 5;
+		if(events.key_up.count('l')){
+			lod = !lod;
+			cout << "level of detail " << (lod ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('n')){
+			lit = !lit;
+			cout << "point lighting " << (lit ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('i')){
+			cout << "points\t" << rendered_points << " of " << total_points << " rendered\toctree " << octree_nodes << " nodes" << endl;
+			cout << "mesh\t" << rendered_triangles << " triangles\t" << mesh.uploadedBytes() << " bytes uploaded" << endl;
+		}
+	}
+
+	// a white light above and behind the viewer, colors set the material
+	void setupLighting(){
+		glEnable(GL_LIGHTING);
+		GLfloat LightAmbient[] = {0.1f, 0.1f, 0.1f, 1.0f};
+		GLfloat LightDiffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
+		GLfloat LightSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+		GLfloat LightPosition[] = {0.0f, 2.0f, 2.0f, 1.0f};
+
+		glLightfv(GL_LIGHT0, GL_AMBIENT, LightAmbient);
+		glLightfv(GL_LIGHT0, GL_DIFFUSE, LightDiffuse);
+		glLightfv(GL_LIGHT0, GL_SPECULAR, LightSpecular);
+		glLightfv(GL_LIGHT0, GL_POSITION, LightPosition);
+		glEnable(GL_LIGHT0);
+		glEnable(GL_COLOR_MATERIAL);
+		glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+		glShadeModel(GL_SMOOTH);
 	}
 
-	void render( DepthDevice & kinect ){
-		// get 3D points
-		kinect.make3DPoints(points);
-		// render 3D points
-		glPointSize(point_size);
-		if(points.size() > 0){
-			render_points_colored( points );
+	void render( DepthDevice & kinect, const Frame & frame ){
+		if(!frame.mesh.vertices.empty()){
+			// the lit surface mesh of the depth frame replaces the points
+			setupLighting();
+			rendered_triangles = mesh.render(frame.mesh);
+			glDisable(GL_LIGHTING);
+			rendered_points = 0;
+		} else if(!frame.foreground.empty()){
+			// only the foreground in front of the learned background
+			glPointSize(point_size);
+			if(lit)
+				setupLighting();
+			if(!frame.foreground_points.empty())
+				render_points_colored(frame.foreground_points, lit);
+			if(lit)
+				glDisable(GL_LIGHTING);
+			rendered_points = unsigned(frame.foreground_points.size());
+			rendered_triangles = 0;
+		} else {
+			// render the 3D points in the view frustum, thinned out where they overlap on screen,
+			// and lit by their normals if enabled
+			glPointSize(point_size);
+			if(lit)
+				setupLighting();
+			rendered_points = frame.octree.render(point_size, lod, lit, visible);
+			if(lit)
+				glDisable(GL_LIGHTING);
+			rendered_triangles = 0;
 		}
+		total_points = frame.octree.size();
+		octree_nodes = frame.octree.nodeCount();
 		// now render any valid skeletons
 		vector<int> valid_skeletons;
 		kinect.getTrackedSkeletons(valid_skeletons);
@@ -55,15 +118,17 @@ class Balls : public KinectScene {
 public:
 	struct State {
 		float x, y, z;
+		float vx, vy, vz;	// metres per frame
 		float r,g,b;
+		int age;			// frames
 	};
 
-	GLUquadric * sphere;
+	SphereBatch spheres;
 	vector<State> balls;
+	int draw_calls;
+	float radius;
 
-	Balls() {
-		sphere = gluNewQuadric();
-	}
+	Balls() : spheres(0.1f), draw_calls(0), radius(0.1f) {}
 
 	void handle_events(const GLWindow::EventSummary & events) {
 		KinectScene::handle_events(events);
@@ -76,50 +141,88 @@ public:
 			new_ball.r = 0.1f;
 			new_ball.g = 0.2f;
 			new_ball.b = 0.3f;
+			// thrown away from the viewer
+			new_ball.vx = new_ball.x / new_ball.z * 0.05f;
+			new_ball.vy = new_ball.y / new_ball.z * 0.05f;
+			new_ball.vz = 0.05f;
+			new_ball.age = 0;
 			balls.push_back(new_ball);
 		}
+		if(events.key_up.count('i')){
+			cout << "balls\t" << spheres.size() << "\ttriangles\t" << spheres.triangles() << "\tdraw calls\t" << draw_calls << "\t" << spheres.uploadedBytes() << " bytes uploaded" << endl;
+		}
 	}
 
-	void render( DepthDevice & kinect ){
+	void render( DepthDevice & kinect, const Frame & frame ){
 		// render the background first
-		KinectScene::render(kinect);
-
-		glEnable(GL_LIGHTING);
-		GLfloat LightAmbient[] = {0.1f, 0.1f, 0.1f, 1.0f};
-		GLfloat LightDiffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
-		GLfloat LightSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
-		GLfloat LightPosition[] = {0.0f, 2.0f, 2.0f, 1.0f};
-
-		glLightfv(GL_LIGHT0, GL_AMBIENT, LightAmbient);
-		glLightfv(GL_LIGHT0, GL_DIFFUSE, LightDiffuse);
-		glLightfv(GL_LIGHT0, GL_SPECULAR, LightSpecular);
-		glLightfv(GL_LIGHT0, GL_POSITION, LightPosition);
-		glEnable(GL_LIGHT0);
-		glEnable(GL_COLOR_MATERIAL);
-		glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-		glShadeModel(GL_SMOOTH);
+		KinectScene::render(kinect, frame);
 
+		setupLighting();
 		glColor3f(1,0,0);
+		spheres.clear();
+		const float gravity = 0.002f;	// metres per frame squared
+		const int max_age = 600;
+		// without plane detection the balls fly on in a straight line as they were thrown
+		const bool colliding = !frame.plane_mask.empty();
+		const Plane * floor = findFloor(frame.planes);
+		const Intrinsics intrinsics = kinect.getDepthIntrinsics();
 		for(unsigned int i = 0; i < balls.size();){
-			// render ball
-			glTranslatef(balls[i].x, balls[i].y, balls[i].z); 
-			gluSphere(sphere, 0.1, 15, 8);
-			glTranslatef(-balls[i].x, -balls[i].y, -balls[i].z);
-			// update position
-			balls[i].x += balls[i].x/balls[i].z * 0.05f;
-			balls[i].y += balls[i].y/balls[i].z * 0.05f;
-			balls[i].z += balls[i].z/balls[i].z * 0.05f;
-			// retire if beyond the far plane
-			if(balls[i].z > 5)
+			State & ball = balls[i];
+			// collect ball for rendering
+			spheres.add(ball.x, ball.y, ball.z);
+			// update position, falling toward the floor if there is one
+			if(colliding && floor){
+				ball.vx -= floor->normal[0] * gravity;
+				ball.vy -= floor->normal[1] * gravity;
+				ball.vz -= floor->normal[2] * gravity;
+			}
+			ball.x += ball.vx;
+			ball.y += ball.vy;
+			ball.z += ball.vz;
+			if(colliding)
+				for(unsigned p = 0; p < frame.planes.size(); ++p)
+					bounce(ball, frame.planes[p], p, frame.plane_mask, intrinsics);
+			// retire if beyond the far plane, or resting on the planes for too long
+			if(ball.z > 5 || (colliding && ++ball.age > max_age))
 				balls.erase(balls.begin()+i);
 			else 
 				++i;
 		}
+		// render all balls, one draw call per level of detail
+		draw_calls = spheres.render();
 		glDisable(GL_LIGHTING);
 	}
 
-	~Balls() {
-		gluDeleteQuadric(sphere);
+	// the largest plane facing up, NULL if none
+	static const Plane * findFloor( const vector<Plane> & planes ){
+		for(unsigned p = 0; p < planes.size(); ++p)
+			if(planes[p].normal[1] > 0.7f)
+				return &planes[p];
+		return NULL;
+	}
+
+	// Reflects a ball touching a plane and moving into it, losing some speed. Planes are
+	// unbounded, so the point of the plane below the ball has to be on its pixels.
+	void bounce( State & ball, const Plane & plane, unsigned index, const vector<uint8_t> & mask, const Intrinsics & intrinsics ){
+		const float distance = plane.distance(ball.x, ball.y, ball.z);
+		const float speed = plane.normal[0] * ball.vx + plane.normal[1] * ball.vy + plane.normal[2] * ball.vz;
+		if(distance > radius || speed >= 0)
+			return;
+		const float contact[3] = { ball.x - distance * plane.normal[0], ball.y - distance * plane.normal[1], ball.z - distance * plane.normal[2] };
+		if(contact[2] <= 0)
+			return;
+		float u, v;
+		intrinsics.project(contact[0], contact[1], contact[2], u, v);
+		const int px = int(u), py = int(v);
+		if(px < 0 || py < 0 || px >= intrinsics.width || py >= intrinsics.height || mask[py * intrinsics.width + px] != index + 1)
+			return;
+		const float restitution = 0.8f;
+		ball.vx -= (1 + restitution) * speed * plane.normal[0];
+		ball.vy -= (1 + restitution) * speed * plane.normal[1];
+		ball.vz -= (1 + restitution) * speed * plane.normal[2];
+		ball.x += (radius - distance) * plane.normal[0];
+		ball.y += (radius - distance) * plane.normal[1];
+		ball.z += (radius - distance) * plane.normal[2];
 	}
 };
 
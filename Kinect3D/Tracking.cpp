@@ -0,0 +1,284 @@
+#include "Tracking.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// Gauss-Newton iterations per pyramid level, from the finest to the coarsest level
+static const int level_iterations[IcpTracker::LEVELS] = { 2, 4, 6 };
+// maximal distance of corresponding points per level in metres, coarse levels allow larger motions
+static const float level_distance[IcpTracker::LEVELS] = { 0.05f, 0.10f, 0.15f };
+// iterations on a level stop when the pose changes by less than this, in metres and rotation matrix entries
+static const float converged = 1e-4f;
+// corresponding normals have to agree to within about 35 degrees
+static const float normal_threshold = 0.8f;
+// tracking fails with fewer correspondences than this fraction of the pixels of a level
+static const float min_correspondences = 0.05f;
+// depths closer than this are averaged when downsampling and smoothing, farther ones belong to another surface
+static const float downsample_threshold = 0.03f;
+// neighbourhood averaged to reduce the sensor noise before computing normals
+static const int smooth_radius = 2;
+// the finest pyramid level is at most this wide
+static const int max_width = 320;
+
+IcpTracker::IcpTracker() : pyramid(LEVELS, DepthPyramid::AVERAGE, int(downsample_threshold * 1000 + 0.5f)), have_previous(false), track_time(0), last_correspondences(0), last_error(0) {}
+
+void IcpTracker::reset(){
+    have_previous = false;
+    current_pose = Pose();
+}
+
+bool IcpTracker::track( const uint16_t * depth, const Intrinsics & intrinsics ){
+    const double start = getTime();
+    buildPyramid(depth, intrinsics, current);
+
+    bool tracked = true;
+    if(have_previous){
+        // maps the current camera coordinates into the previous camera coordinates
+        Pose increment;
+        for(int level = LEVELS - 1; level >= 0 && tracked; --level)
+            for(int i = 0; i < level_iterations[level] && tracked; ++i){
+                const Pose last = increment;
+                tracked = step(current[level], previous[level], increment, level_distance[level], last_correspondences, last_error);
+                // the remaining levels refine the estimate once it stops changing
+                float change = 0;
+                for(int k = 0; k < 9; ++k)
+                    change = max(change, float(fabs(increment.R[k] - last.R[k])));
+                for(int k = 0; k < 3; ++k)
+                    change = max(change, float(fabs(increment.t[k] - last.t[k])));
+                if(change < converged)
+                    break;
+            }
+        if(tracked)
+            current_pose = current_pose * increment;
+    }
+
+    // the new frame is the reference for the next one even if tracking failed, to recover from fast motions
+    for(int level = 0; level < LEVELS; ++level){
+        swap(previous[level].depth, current[level].depth);
+        swap(previous[level].vertices, current[level].vertices);
+        swap(previous[level].normals, current[level].normals);
+        previous[level].intrinsics = current[level].intrinsics;
+    }
+    have_previous = true;
+    track_time = getTime() - start;
+    return tracked;
+}
+
+void IcpTracker::buildPyramid( const uint16_t * depth, const Intrinsics & intrinsics, Level * levels ){
+    // the finest level is the first one at most max_width wide, 1280 wide frames need one more step
+    int first = 0;
+    Intrinsics finest = intrinsics;
+    while(finest.width > max_width){
+        finest = finest.downsampled();
+        ++first;
+    }
+    pyramid.setLevels(first + LEVELS);
+    pyramid.build(SubImage<const uint16_t>(depth, ImageRef(intrinsics.width, intrinsics.height)), intrinsics.depth_shift);
+
+    for(int level = 0; level < LEVELS; ++level){
+        levels[level].intrinsics = level == 0 ? finest : levels[level - 1].intrinsics.downsampled();
+        const Image<uint16_t> & millimetres = pyramid[first + level];
+        const int W = millimetres.size().x, H = millimetres.size().y;
+        levels[level].depth.resize(W * H);
+        for(int y = 0; y < H; ++y)
+            for(int x = 0; x < W; ++x)
+                levels[level].depth[y * W + x] = millimetres[y][x] * 0.001f;
+    }
+    smooth(levels[0], scratch);
+    for(int level = 0; level < LEVELS; ++level)
+        computeMaps(levels[level]);
+}
+
+void IcpTracker::smooth( Level & level, vector<float> & scratch ){
+    const int W = level.intrinsics.width, H = level.intrinsics.height;
+    scratch.resize(W * H);
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x){
+            const float center = level.depth[y * W + x];
+            float sum = 0;
+            int count = 0;
+            if(center > 0)
+                for(int dy = max(y - smooth_radius, 0); dy <= min(y + smooth_radius, H - 1); ++dy)
+                    for(int dx = max(x - smooth_radius, 0); dx <= min(x + smooth_radius, W - 1); ++dx){
+                        const float d = level.depth[dy * W + dx];
+                        if(d > 0 && fabs(d - center) < downsample_threshold){
+                            sum += d;
+                            ++count;
+                        }
+                    }
+            scratch[y * W + x] = count > 0 ? sum / count : 0;
+        }
+    level.depth.swap(scratch);
+}
+
+void IcpTracker::computeMaps( Level & level ){
+    const Intrinsics & intrinsics = level.intrinsics;
+    const int W = intrinsics.width, H = intrinsics.height;
+    level.vertices.resize(3 * W * H);
+    level.normals.resize(3 * W * H);
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x){
+            float * vertex = &level.vertices[3 * (y * W + x)];
+            vertex[2] = level.depth[y * W + x];
+            intrinsics.unproject(float(x), float(y), vertex[2], vertex[0], vertex[1]);
+        }
+
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x){
+            const int i = y * W + x;
+            float * normal = &level.normals[3 * i];
+            normal[0] = normal[1] = normal[2] = 0;
+            if(x + 1 >= W || y + 1 >= H || level.depth[i] == 0 || level.depth[i + 1] == 0 || level.depth[i + W] == 0)
+                continue;
+            const float * v = &level.vertices[3 * i];
+            const float * right = &level.vertices[3 * (i + 1)];
+            const float * down = &level.vertices[3 * (i + W)];
+            const float a[3] = { right[0] - v[0], right[1] - v[1], right[2] - v[2] };
+            const float b[3] = { down[0] - v[0], down[1] - v[1], down[2] - v[2] };
+            float n[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+            const float length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            if(length == 0)
+                continue;
+            // normals face the camera, whichever the handedness of the image axes
+            const float sign = (n[0]*v[0] + n[1]*v[1] + n[2]*v[2]) > 0 ? -1.0f : 1.0f;
+            for(int k = 0; k < 3; ++k)
+                normal[k] = sign * n[k] / length;
+        }
+}
+
+// solves the symmetric positive definite system A x = b with a Cholesky decomposition
+static bool solve6( double A[6][6], double b[6], double x[6] ){
+    double L[6][6] = { { 0 } };
+    for(int i = 0; i < 6; ++i){
+        for(int j = 0; j <= i; ++j){
+            double sum = A[i][j];
+            for(int k = 0; k < j; ++k)
+                sum -= L[i][k] * L[j][k];
+            if(i == j){
+                if(sum <= 1e-12)
+                    return false;
+                L[i][i] = sqrt(sum);
+            } else
+                L[i][j] = sum / L[j][j];
+        }
+    }
+    double y[6];
+    for(int i = 0; i < 6; ++i){
+        double sum = b[i];
+        for(int k = 0; k < i; ++k)
+            sum -= L[i][k] * y[k];
+        y[i] = sum / L[i][i];
+    }
+    for(int i = 5; i >= 0; --i){
+        double sum = y[i];
+        for(int k = i + 1; k < 6; ++k)
+            sum -= L[k][i] * x[k];
+        x[i] = sum / L[i][i];
+    }
+    return true;
+}
+
+bool IcpTracker::step( const Level & current, const Level & previous, Pose & increment, float distance_threshold, unsigned & count, float & error ) const {
+    const Intrinsics & intrinsics = previous.intrinsics;
+    const int W = intrinsics.width, H = intrinsics.height;
+    const float squared_threshold = distance_threshold * distance_threshold;
+
+    // upper triangle of the 6x6 normal matrix, the right hand side, the squared error and the count
+    enum { SUMS = 21 + 6 + 2 };
+    double total[SUMS] = { 0 };
+
+#pragma omp parallel
+    {
+        double sums[SUMS] = { 0 };
+#pragma omp for schedule(static)
+        for(int y = 0; y < H; ++y){
+            // sum each row in single precision first, then add it to the thread's total
+            float row[SUMS] = { 0 };
+            for(int x = 0; x < W; ++x){
+                const int i = y * W + x;
+                const float * n_current = &current.normals[3 * i];
+                if(n_current[0] == 0 && n_current[1] == 0 && n_current[2] == 0)
+                    continue;
+                float p[3];
+                increment.apply(&current.vertices[3 * i], p);
+                if(p[2] <= 0)
+                    continue;
+
+                // projective data association
+                float u, v;
+                intrinsics.project(p[0], p[1], p[2], u, v);
+                const int pu = int(u + 0.5f), pv = int(v + 0.5f);
+                if(u < -0.5f || v < -0.5f || pu >= W || pv >= H)
+                    continue;
+                const int j = pv * W + pu;
+                const float * n = &previous.normals[3 * j];
+                if(previous.depth[j] == 0 || (n[0] == 0 && n[1] == 0 && n[2] == 0))
+                    continue;
+                const float * q = &previous.vertices[3 * j];
+                const float d[3] = { p[0] - q[0], p[1] - q[1], p[2] - q[2] };
+                if(d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > squared_threshold)
+                    continue;
+                float rotated[3];
+                increment.rotate(n_current, rotated);
+                if(rotated[0]*n[0] + rotated[1]*n[1] + rotated[2]*n[2] < normal_threshold)
+                    continue;
+
+                // residual n.(p - q) and its derivative for a small rotation w and translation t, n.(w x p + t)
+                const float r = n[0]*d[0] + n[1]*d[1] + n[2]*d[2];
+                const float J[6] = { p[1]*n[2] - p[2]*n[1], p[2]*n[0] - p[0]*n[2], p[0]*n[1] - p[1]*n[0], n[0], n[1], n[2] };
+                int k = 0;
+                for(int a = 0; a < 6; ++a)
+                    for(int b = a; b < 6; ++b)
+                        row[k++] += J[a] * J[b];
+                for(int a = 0; a < 6; ++a)
+                    row[21 + a] += J[a] * r;
+                row[27] += r * r;
+                row[28] += 1;
+            }
+            for(int k = 0; k < SUMS; ++k)
+                sums[k] += row[k];
+        }
+#pragma omp critical
+        for(int k = 0; k < SUMS; ++k)
+            total[k] += sums[k];
+    }
+
+    count = unsigned(total[28]);
+    if(count < min_correspondences * W * H)
+        return false;
+    error = float(sqrt(total[27] / count));
+
+    double A[6][6], b[6], xi[6];
+    int k = 0;
+    for(int a = 0; a < 6; ++a)
+        for(int c = a; c < 6; ++c)
+            A[a][c] = A[c][a] = total[k++];
+    for(int a = 0; a < 6; ++a)
+        b[a] = -total[21 + a];
+    if(!solve6(A, b, xi))
+        return false;
+
+    // apply the small motion exp(xi) on top of the current estimate, rotation by Rodrigues' formula
+    Pose update;
+    const double theta = sqrt(xi[0]*xi[0] + xi[1]*xi[1] + xi[2]*xi[2]);
+    if(theta > 1e-12){
+        const double w[3] = { xi[0] / theta, xi[1] / theta, xi[2] / theta };
+        const double s = sin(theta), c = 1 - cos(theta);
+        const double K[9] = { 0, -w[2], w[1], w[2], 0, -w[0], -w[1], w[0], 0 };
+        for(int r = 0; r < 3; ++r)
+            for(int col = 0; col < 3; ++col){
+                double K2 = 0;
+                for(int m = 0; m < 3; ++m)
+                    K2 += K[r*3 + m] * K[m*3 + col];
+                update.R[r*3 + col] = float((r == col ? 1 : 0) + s * K[r*3 + col] + c * K2);
+            }
+    }
+    update.t[0] = float(xi[3]);
+    update.t[1] = float(xi[4]);
+    update.t[2] = float(xi[5]);
+    increment = update * increment;
+    return true;
+}
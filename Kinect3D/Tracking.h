@@ -0,0 +1,67 @@
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include <vector>
+
+#include "helpers.h"
+#include "Pyramid.h"
+
+// Camera tracking with point-to-plane ICP between consecutive depth frames, in the
+// style of KinectFusion (Newcombe et al., ISMAR 2011). Correspondences are found by
+// projective data association: every vertex of the new frame is projected into the
+// previous frame and paired with the vertex at that pixel. The pose is refined coarse
+// to fine over a three level depth pyramid, taken from a DepthPyramid of the frame, and
+// the 6x6 normal equations are summed over the image in parallel with OpenMP.
+class IcpTracker {
+public:
+    IcpTracker();
+
+    // forgets the previous frame and the accumulated pose
+    void reset();
+
+    // Estimates the motion from the previous depth frame to this one and accumulates
+    // it into the pose. The first frame after a reset keeps the current pose. Returns
+    // false if tracking failed, in which case the pose is left unchanged.
+    bool track( const uint16_t * depth, const Intrinsics & intrinsics );
+
+    // camera to world transform of the last tracked frame
+    const Pose & pose() const { return current_pose; }
+    void setPose( const Pose & pose ) { current_pose = pose; }
+
+    // statistics of the last call to track
+    double trackTime() const { return track_time; }
+    unsigned correspondences() const { return last_correspondences; }
+    float error() const { return last_error; }      // RMS point-to-plane distance in metres
+
+    enum { LEVELS = 3 };
+
+protected:
+    // a depth image turned into vertex and normal maps in camera coordinates
+    struct Level {
+        Intrinsics intrinsics;
+        std::vector<float> depth;       // metres, 0 for invalid pixels
+        std::vector<float> vertices;    // 3 floats per pixel
+        std::vector<float> normals;     // 3 floats per pixel, 0 where undefined
+    };
+
+    void buildPyramid( const uint16_t * depth, const Intrinsics & intrinsics, Level * levels );
+    // averages each depth with its neighbours on the same surface, scratch is overwritten
+    static void smooth( Level & level, std::vector<float> & scratch );
+    static void computeMaps( Level & level );
+
+    // one Gauss-Newton step aligning current to previous, increment maps current to previous camera coordinates
+    bool step( const Level & current, const Level & previous, Pose & increment, float distance_threshold, unsigned & count, float & error ) const;
+
+    DepthPyramid pyramid;           // the depth frame in millimetres, from full resolution to the coarsest level
+    std::vector<float> scratch;
+    Level previous[LEVELS];
+    Level current[LEVELS];
+    bool have_previous;
+    Pose current_pose;
+
+    double track_time;
+    unsigned last_correspondences;
+    float last_error;
+};
+
+#endif // TRACKING_H
@@ -20,9 +20,12 @@ public:
 		glMatrixMode(GL_MODELVIEW);
 		glLoadIdentity();
 
-		glPixelZoom(-1, -1);
+		// the video fills the left half at any resolution
+		int videoW, videoH;
+		kinect.getVideoSize(videoW, videoH);
+		glPixelZoom(-640.0f / videoW, -480.0f / videoH);
 		glRasterPos2i(640,0);
-		glDrawPixels(640, 480, GL_BGRA_EXT, GL_UNSIGNED_BYTE,  kinect.getVideoBuffer());
+		glDrawPixels(videoW, videoH, GL_BGRA_EXT, GL_UNSIGNED_BYTE,  kinect.getVideoBuffer());
 		if(kinect.isUsingSkeleton()){
 			glRasterPos2i(640+640,0);
 			glPixelZoom(-2,-2);
@@ -1,15 +1,33 @@
 #include "helpers.h"
+#include "Mesh.h"
 
 #include <Windows.h>
 #include <gl/GL.h>
 #include <NuiApi.h>
+#include <cmath>
+#include <algorithm>
 
-void render_points_colored( const std::vector<Point> & points ){
+double getTime(){
+    static LARGE_INTEGER frequency = { 0 };
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return double(counter.QuadPart) / double(frequency.QuadPart);
+}
+
+void render_points_colored( const std::vector<Point> & points, bool normals ){
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_COLOR_ARRAY);
     glVertexPointer(3, GL_FLOAT, sizeof(Point), points.data());
     glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Point), &points[0].color);
+    if(normals){
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, sizeof(Point), &points[0].nx);
+    }
     glDrawArrays(GL_POINTS, 0, points.size());
+    if(normals)
+        glDisableClientState(GL_NORMAL_ARRAY);
     glDisableClientState(GL_COLOR_ARRAY);
     glDisableClientState(GL_VERTEX_ARRAY);
 }
@@ -66,4 +84,359 @@ void render_skeleton( const float * skeleton){
     glDrawElements(GL_LINE_STRIP, 9, GL_UNSIGNED_INT, arm_list);
     glDrawElements(GL_LINE_STRIP, 9, GL_UNSIGNED_INT, leg_list);
     glDisableClientState(GL_VERTEX_ARRAY);
-}
\ No newline at end of file
+}
+// levels of detail as slices, stacks and the distance up to which they are used
+static const struct {
+    int slices, stacks;
+    float distance;
+} sphere_levels[] = {
+    { 24, 12, 0.5f },
+    { 15,  8, 2.0f },
+    {  8,  5, 1e30f }
+};
+
+SphereBatch::SphereBatch( float r ) : radius(r), count(0), initialized(false), use_buffers(false), uploaded_bytes(0) {
+    levels.resize(sizeof(sphere_levels)/sizeof(sphere_levels[0]));
+    for(unsigned i = 0; i < levels.size(); ++i){
+        tessellate(levels[i], sphere_levels[i].slices, sphere_levels[i].stacks);
+        levels[i].capacity = 0;
+    }
+}
+
+SphereBatch::~SphereBatch(){
+    if(use_buffers)
+        for(unsigned i = 0; i < levels.size(); ++i)
+            GLBuffers::release(3, levels[i].buffers);
+}
+
+void SphereBatch::tessellate( Level & level, int slices, int stacks ) const {
+    const float pi = 3.14159265f;
+    level.vertices.clear();
+    level.indices.clear();
+    // rings from the +z pole to the -z pole, like gluSphere, with a duplicated seam column
+    for(int j = 0; j <= stacks; ++j){
+        const float theta = pi * j / stacks;
+        for(int i = 0; i <= slices; ++i){
+            const float phi = 2 * pi * i / slices;
+            Vertex v;
+            v.nx = sin(theta) * cos(phi);
+            v.ny = sin(theta) * sin(phi);
+            v.nz = cos(theta);
+            v.x = v.nx * radius;
+            v.y = v.ny * radius;
+            v.z = v.nz * radius;
+            level.vertices.push_back(v);
+        }
+    }
+    for(int j = 0; j < stacks; ++j)
+        for(int i = 0; i < slices; ++i){
+            const uint32_t a = j * (slices+1) + i;
+            const uint32_t b = a + slices + 1;
+            level.indices.push_back(a);
+            level.indices.push_back(b);
+            level.indices.push_back(a+1);
+            level.indices.push_back(a+1);
+            level.indices.push_back(b);
+            level.indices.push_back(b+1);
+        }
+}
+
+int SphereBatch::selectLevel( float distance ) const {
+    int level = 0;
+    while(level + 1 < int(levels.size()) && distance > sphere_levels[level].distance)
+        ++level;
+    return level;
+}
+
+void SphereBatch::clear(){
+    for(unsigned i = 0; i < levels.size(); ++i)
+        levels[i].centers.clear();
+    count = 0;
+}
+
+void SphereBatch::add( float x, float y, float z ){
+    const Center center = { x, y, z };
+    levels[selectLevel(sqrt(x*x + y*y + z*z))].centers.push_back(center);
+    ++count;
+}
+
+unsigned SphereBatch::triangles() const {
+    unsigned total = 0;
+    for(unsigned i = 0; i < levels.size(); ++i)
+        total += unsigned(levels[i].centers.size() * levels[i].indices.size() / 3);
+    return total;
+}
+
+void SphereBatch::reserve( Level & level, unsigned spheres ){
+    // grows by doubling, so a growing batch rebuilds the buffers only a few times
+    const unsigned capacity = std::max(spheres, 2 * level.capacity);
+    const unsigned vertices = unsigned(level.vertices.size());
+    level.normals.resize(3 * vertices * capacity);
+    level.batch_indices.resize(level.indices.size() * capacity);
+    for(unsigned s = level.capacity; s < capacity; ++s){
+        for(unsigned v = 0; v < vertices; ++v){
+            float * normal = &level.normals[3 * (s * vertices + v)];
+            normal[0] = level.vertices[v].nx;
+            normal[1] = level.vertices[v].ny;
+            normal[2] = level.vertices[v].nz;
+        }
+        for(unsigned i = 0; i < level.indices.size(); ++i)
+            level.batch_indices[s * level.indices.size() + i] = s * vertices + level.indices[i];
+    }
+    level.capacity = capacity;
+    if(use_buffers){
+        GLBuffers::bind(GLBuffers::ARRAY, level.buffers[1]);
+        GLBuffers::upload(GLBuffers::ARRAY, level.normals.size() * sizeof(float), level.normals.data(), GLBuffers::STATIC_DRAW);
+        GLBuffers::bind(GLBuffers::ELEMENT_ARRAY, level.buffers[2]);
+        GLBuffers::upload(GLBuffers::ELEMENT_ARRAY, level.batch_indices.size() * sizeof(uint32_t), level.batch_indices.data(), GLBuffers::STATIC_DRAW);
+        uploaded_bytes += unsigned((level.normals.size() * sizeof(float)) + level.batch_indices.size() * sizeof(uint32_t));
+    }
+}
+
+int SphereBatch::render(){
+    uploaded_bytes = 0;
+    if(!initialized){
+        // the entry points can only be queried with a current context
+        initialized = true;
+        use_buffers = GLBuffers::load();
+        if(use_buffers)
+            for(unsigned i = 0; i < levels.size(); ++i)
+                GLBuffers::generate(3, levels[i].buffers);
+    }
+
+    int draw_calls = 0;
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    for(unsigned l = 0; l < levels.size(); ++l){
+        Level & level = levels[l];
+        const unsigned spheres = unsigned(level.centers.size());
+        if(spheres == 0)
+            continue;
+        if(spheres > level.capacity)
+            reserve(level, spheres);
+
+        // the vertices of every sphere moved to its center
+        const unsigned vertices = unsigned(level.vertices.size());
+        level.positions.resize(3 * vertices * spheres);
+        for(unsigned s = 0; s < spheres; ++s){
+            const Center & center = level.centers[s];
+            float * position = &level.positions[3 * s * vertices];
+            for(unsigned v = 0; v < vertices; ++v, position += 3){
+                position[0] = level.vertices[v].x + center.x;
+                position[1] = level.vertices[v].y + center.y;
+                position[2] = level.vertices[v].z + center.z;
+            }
+        }
+
+        // with buffers bound, the pointers are offsets into them
+        const uint32_t * indices = level.batch_indices.data();
+        if(use_buffers){
+            // new storage every frame, so the driver does not wait for the last frame to finish drawing
+            const size_t bytes = level.positions.size() * sizeof(float);
+            GLBuffers::bind(GLBuffers::ARRAY, level.buffers[0]);
+            GLBuffers::upload(GLBuffers::ARRAY, bytes, level.positions.data(), GLBuffers::STREAM_DRAW);
+            uploaded_bytes += unsigned(bytes);
+            glVertexPointer(3, GL_FLOAT, 0, NULL);
+            GLBuffers::bind(GLBuffers::ARRAY, level.buffers[1]);
+            glNormalPointer(GL_FLOAT, 0, NULL);
+            GLBuffers::bind(GLBuffers::ELEMENT_ARRAY, level.buffers[2]);
+            indices = NULL;
+        } else {
+            glVertexPointer(3, GL_FLOAT, 0, level.positions.data());
+            glNormalPointer(GL_FLOAT, 0, level.normals.data());
+        }
+        glDrawElements(GL_TRIANGLES, GLsizei(spheres * level.indices.size()), GL_UNSIGNED_INT, indices);
+        ++draw_calls;
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if(use_buffers){
+        GLBuffers::bind(GLBuffers::ARRAY, 0);
+        GLBuffers::bind(GLBuffers::ELEMENT_ARRAY, 0);
+    }
+    return draw_calls;
+}
+
+// nodes with fewer points are not subdivided further
+static const unsigned octree_leaf_points = 128;
+static const int octree_max_depth = 8;
+// points drawn per node area covered by one point on screen, a surface crossing a cube covers about half its projection
+static const float octree_lod_density = 2.0f;
+
+PointOctree::PointOctree() : build_time(0) {}
+
+void PointOctree::build( const std::vector<Point> & input ){
+    const double start = getTime();
+    points = input;
+    scratch.resize(points.size(), Point(0, 0, 0, 0));
+    nodes.clear();
+
+    if(!points.empty()){
+        float lower[3] = { points[0].x, points[0].y, points[0].z };
+        float upper[3] = { points[0].x, points[0].y, points[0].z };
+        for(unsigned i = 1; i < points.size(); ++i){
+            lower[0] = std::min(lower[0], points[i].x); upper[0] = std::max(upper[0], points[i].x);
+            lower[1] = std::min(lower[1], points[i].y); upper[1] = std::max(upper[1], points[i].y);
+            lower[2] = std::min(lower[2], points[i].z); upper[2] = std::max(upper[2], points[i].z);
+        }
+        Node root;
+        root.x = (lower[0] + upper[0]) * 0.5f;
+        root.y = (lower[1] + upper[1]) * 0.5f;
+        root.z = (lower[2] + upper[2]) * 0.5f;
+        root.half = std::max(upper[0] - lower[0], std::max(upper[1] - lower[1], upper[2] - lower[2])) * 0.5f + 1e-4f;
+        root.begin = 0;
+        root.end = uint32_t(points.size());
+        root.first_child = 0;
+        root.children = 0;
+        nodes.push_back(root);
+        subdivide(0, 0);
+    }
+    build_time = getTime() - start;
+}
+
+void PointOctree::subdivide( uint32_t index, int depth ){
+    // copy, pushing children may reallocate the nodes
+    const Node node = nodes[index];
+    if(node.end - node.begin <= octree_leaf_points || depth == octree_max_depth)
+        return;
+
+    // bucket the points of the node by octant
+    unsigned counts[8] = { 0 };
+    for(uint32_t i = node.begin; i < node.end; ++i){
+        const Point & p = points[i];
+        ++counts[(p.x >= node.x) | ((p.y >= node.y) << 1) | ((p.z >= node.z) << 2)];
+    }
+    unsigned offsets[8];
+    offsets[0] = node.begin;
+    for(int o = 1; o < 8; ++o)
+        offsets[o] = offsets[o-1] + counts[o-1];
+    for(uint32_t i = node.begin; i < node.end; ++i){
+        const Point & p = points[i];
+        scratch[offsets[(p.x >= node.x) | ((p.y >= node.y) << 1) | ((p.z >= node.z) << 2)]++] = p;
+    }
+    std::copy(scratch.begin() + node.begin, scratch.begin() + node.end, points.begin() + node.begin);
+
+    const uint32_t first = uint32_t(nodes.size());
+    const float quarter = node.half * 0.5f;
+    uint32_t begin = node.begin;
+    for(int o = 0; o < 8; ++o){
+        if(counts[o] == 0)
+            continue;
+        Node child;
+        child.x = node.x + ((o & 1) ? quarter : -quarter);
+        child.y = node.y + ((o & 2) ? quarter : -quarter);
+        child.z = node.z + ((o & 4) ? quarter : -quarter);
+        child.half = quarter;
+        child.begin = begin;
+        child.end = begin + counts[o];
+        child.first_child = 0;
+        child.children = 0;
+        nodes.push_back(child);
+        begin = child.end;
+    }
+    nodes[index].first_child = first;
+    nodes[index].children = uint32_t(nodes.size()) - first;
+    for(uint32_t c = first; c < nodes[index].first_child + nodes[index].children; ++c)
+        subdivide(c, depth + 1);
+}
+
+unsigned PointOctree::render( float point_size, bool lod, bool normals, std::vector<uint32_t> & indices ) const {
+    indices.clear();
+    if(nodes.empty())
+        return 0;
+
+    GLfloat modelview[16], projection[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // clip = projection * modelview, column major
+    float clip[16];
+    for(int c = 0; c < 4; ++c)
+        for(int r = 0; r < 4; ++r)
+            clip[c*4 + r] = projection[r] * modelview[c*4] + projection[4 + r] * modelview[c*4 + 1]
+                          + projection[8 + r] * modelview[c*4 + 2] + projection[12 + r] * modelview[c*4 + 3];
+    // frustum planes as the sum and difference of the last row with the other rows
+    float planes[6][4];
+    for(int p = 0; p < 6; ++p){
+        const int row = p / 2;
+        const float sign = (p & 1) ? -1.0f : 1.0f;
+        for(int c = 0; c < 4; ++c)
+            planes[p][c] = clip[c*4 + 3] + sign * clip[c*4 + row];
+    }
+
+    // pixels per unit length at unit distance in eye space, and the scale of the modelview matrix
+    const float focal = projection[5] * viewport[3] * 0.5f;
+    const float scale = sqrtf(modelview[0]*modelview[0] + modelview[1]*modelview[1] + modelview[2]*modelview[2]);
+
+    // nodes to visit with the planes that still need testing, children are fully inside of planes their parent is inside
+    struct Entry {
+        uint32_t node;
+        unsigned planes;
+    } stack[8 * octree_max_depth + 8];
+    int top = 0;
+    stack[top].node = 0;
+    stack[top].planes = 0x3f;
+    ++top;
+    while(top > 0){
+        --top;
+        const Node & node = nodes[stack[top].node];
+        unsigned mask = stack[top].planes;
+
+        bool outside = false;
+        for(int p = 0; p < 6 && !outside; ++p){
+            if(!(mask & (1 << p)))
+                continue;
+            const float distance = planes[p][0] * node.x + planes[p][1] * node.y + planes[p][2] * node.z + planes[p][3];
+            const float radius = node.half * (fabsf(planes[p][0]) + fabsf(planes[p][1]) + fabsf(planes[p][2]));
+            if(distance < -radius)
+                outside = true;
+            else if(distance > radius)
+                mask &= ~(1 << p);
+        }
+        if(outside)
+            continue;
+
+        const uint32_t count = node.end - node.begin;
+        uint32_t stride = 1;
+        if(lod){
+            const float ex = modelview[0] * node.x + modelview[4] * node.y + modelview[8] * node.z + modelview[12];
+            const float ey = modelview[1] * node.x + modelview[5] * node.y + modelview[9] * node.z + modelview[13];
+            const float ez = modelview[2] * node.x + modelview[6] * node.y + modelview[10] * node.z + modelview[14];
+            const float distance = std::max(sqrtf(ex*ex + ey*ey + ez*ez), 1e-3f);
+            const float pixels = 2 * node.half * scale * focal / distance / point_size;
+            const float needed = std::max(1.0f, octree_lod_density * pixels * pixels);
+            if(needed < count)
+                stride = uint32_t(ceilf(count / needed));
+        }
+
+        if(stride > 1 || node.children == 0){
+            for(uint32_t i = node.begin; i < node.end; i += stride)
+                indices.push_back(i);
+        } else {
+            for(uint32_t c = 0; c < node.children; ++c){
+                stack[top].node = node.first_child + c;
+                stack[top].planes = mask;
+                ++top;
+            }
+        }
+    }
+
+    if(!indices.empty()){
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Point), points.data());
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Point), &points[0].color);
+        if(normals){
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glNormalPointer(GL_FLOAT, sizeof(Point), &points[0].nx);
+        }
+        glDrawElements(GL_POINTS, GLsizei(indices.size()), GL_UNSIGNED_INT, indices.data());
+        if(normals)
+            glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+    return unsigned(indices.size());
+}
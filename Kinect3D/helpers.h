@@ -4,9 +4,13 @@
 #include <functional>
 #include <vector>
 
+#include "image.h"
+
 typedef unsigned __int8 uint8_t;
 typedef unsigned __int16 uint16_t;
 typedef unsigned __int32 uint32_t;
+typedef __int16 int16_t;
+typedef unsigned __int64 uint64_t;
 
 // transform object to shift data right
 template<class Type>
@@ -25,15 +29,224 @@ inline uint32_t flipColors( const uint32_t bgra ){
 }
 
 struct Point {
-    Point( float ax, float ay, float az, uint32_t ac ) : x(ax), y(ay), z(az), color(ac) 
+    Point( float ax, float ay, float az, uint32_t ac ) : x(ax), y(ay), z(az), color(ac), nx(0), ny(0), nz(0)
+        {} 
+    Point( float ax, float ay, float az, uint32_t ac, const float normal[3] ) : x(ax), y(ay), z(az), color(ac), nx(normal[0]), ny(normal[1]), nz(normal[2])
         {} 
     float x, y, z;
     uint32_t color;
+    float nx, ny, nz;       // unit surface normal, 0 if unknown
 };
 
-void render_points_colored( const std::vector<Point> & points );
+// Pinhole model of the depth camera in the coordinates used for 3D points: x to the
+// right (mirrored if mirror_x is -1), y up and z along the viewing direction in metres.
+struct Intrinsics {
+    int width, height;
+    float fx, fy, cx, cy;
+    float mirror_x;
+    int depth_shift;        // right shift turning raw depth values into millimetres
+
+    float depthInMetres( const uint16_t raw ) const { return (raw >> depth_shift) * 0.001f; }
+
+    void unproject( float u, float v, float z, float & x, float & y ) const {
+        x = mirror_x * (u - cx) * z / fx;
+        y = -(v - cy) * z / fy;
+    }
+    void project( float x, float y, float z, float & u, float & v ) const {
+        u = cx + mirror_x * fx * x / z;
+        v = cy - fy * y / z;
+    }
+    // the camera for an image of half the resolution, where pixel u covers pixels 2u and 2u+1
+    Intrinsics downsampled() const {
+        Intrinsics half = *this;
+        half.width = width / 2;
+        half.height = height / 2;
+        half.fx = fx * 0.5f;
+        half.fy = fy * 0.5f;
+        half.cx = (cx - 0.5f) * 0.5f;
+        half.cy = (cy - 0.5f) * 0.5f;
+        return half;
+    }
+};
+
+// Rigid transform p' = R p + t with R stored row major, used for camera poses
+// mapping camera coordinates to world coordinates.
+struct Pose {
+    float R[9];
+    float t[3];
+
+    Pose() {
+        for(int i = 0; i < 9; ++i)
+            R[i] = (i % 4 == 0) ? 1.0f : 0.0f;
+        t[0] = t[1] = t[2] = 0;
+    }
+
+    void apply( const float in[3], float out[3] ) const {
+        for(int r = 0; r < 3; ++r)
+            out[r] = R[r*3] * in[0] + R[r*3+1] * in[1] + R[r*3+2] * in[2] + t[r];
+    }
+    void rotate( const float in[3], float out[3] ) const {
+        for(int r = 0; r < 3; ++r)
+            out[r] = R[r*3] * in[0] + R[r*3+1] * in[1] + R[r*3+2] * in[2];
+    }
+    Pose inverse() const {
+        Pose result;
+        for(int r = 0; r < 3; ++r)
+            for(int c = 0; c < 3; ++c)
+                result.R[r*3+c] = R[c*3+r];
+        float minus_t[3] = { -t[0], -t[1], -t[2] };
+        result.rotate(minus_t, result.t);
+        return result;
+    }
+    // composition, (a * b).apply(p) == a.apply(b.apply(p))
+    Pose operator*( const Pose & b ) const {
+        Pose result;
+        for(int r = 0; r < 3; ++r)
+            for(int c = 0; c < 3; ++c)
+                result.R[r*3+c] = R[r*3] * b.R[c] + R[r*3+1] * b.R[3+c] + R[r*3+2] * b.R[6+c];
+        apply(b.t, result.t);
+        return result;
+    }
+};
+
+// Octree over a point cloud for view-frustum culling and level of detail rendering.
+// The points are copied in an order where every node covers a contiguous range, so a
+// node can be drawn at reduced detail by taking every k-th point of its range.
+class PointOctree {
+public:
+    PointOctree();
+
+    // rebuilds the octree over the given points
+    void build( const std::vector<Point> & points );
+
+    // Renders the points visible with the current OpenGL matrices and viewport. With lod
+    // enabled, nodes whose points would overlap on screen at the given point size are
+    // thinned out. With normals the point normals are passed on for lighting. Indices is
+    // scratch space for the selected points, returns their number.
+    unsigned render( float point_size, bool lod, bool normals, std::vector<uint32_t> & indices ) const;
+
+    unsigned size() const { return unsigned(points.size()); }
+    unsigned nodeCount() const { return unsigned(nodes.size()); }
+    // time taken by the last build in seconds
+    double buildTime() const { return build_time; }
+
+protected:
+    struct Node {
+        float x, y, z, half;        // cube center and half edge length
+        uint32_t begin, end;        // range of points in this node and its children
+        uint32_t first_child;       // children are stored consecutively, 0 for leaves
+        uint32_t children;
+    };
+
+    void subdivide( uint32_t index, int depth );
+
+    std::vector<Point> points;
+    std::vector<Point> scratch;
+    std::vector<Node> nodes;
+    double build_time;
+};
+
+// a triangle mesh over the pixels of a depth frame, see GridMesh
+struct MeshData {
+    MeshData() : version(0) {}
+    std::vector<Point> vertices;    // one per depth pixel, empty if no mesh was built
+    std::vector<uint32_t> indices;  // 3 per triangle
+    unsigned version;               // changes whenever the indices change, 0 before the first mesh
+};
+
+// a plane n.p + d = 0 in the coordinates of 3D points, see PlaneDetector
+struct Plane {
+    float normal[3];        // unit normal facing the camera
+    float d;                // distance of the camera in front of the plane, always positive
+    unsigned inliers;       // sampled depth pixels on the plane
+
+    // signed distance of a point in metres, positive on the side of the camera
+    float distance( float x, float y, float z ) const { return normal[0] * x + normal[1] * y + normal[2] * z + d; }
+};
+
+// a captured frame and the data derived from it while passing through the FramePipeline
+struct Frame {
+    Frame() : tracked(false), number(0), captured(0), processed(0) {}
+    Image<uint16_t> depth;
+    Image<uint32_t> rgb;
+    std::vector<Point> points;
+    std::vector<uint32_t> pixels;   // the depth pixel of every point, empty for the fused surface
+    PointOctree octree;     // over points, for rendering
+    MeshData mesh;          // over the depth pixels if enabled in the pipeline
+    std::vector<uint8_t> foreground;        // 255 for foreground depth pixels, empty unless enabled in the pipeline
+    std::vector<Point> foreground_points;   // the points of the foreground pixels
+    std::vector<Plane> planes;              // dominant planes, largest first, empty unless enabled in the pipeline
+    std::vector<uint8_t> plane_mask;        // per depth pixel the index of its plane + 1, 0 for none
+    Pose pose;              // camera to world transform tracked from frame to frame
+    bool tracked;           // false if tracking failed and pose is the one of the frame before
+    unsigned number;        // sequence number assigned by the capturing device
+    double captured;        // time stamps in seconds, see getTime()
+    double processed;
+};
+
+// returns a high resolution time stamp in seconds
+double getTime();
+
+// draws colored points, with their normals for lighting if normals is set
+void render_points_colored( const std::vector<Point> & points, bool normals = false );
 void render_points( const std::vector<Point> & points );
 void render_skeleton_points( const float * skeleton);
 void render_skeleton( const float * skeleton);
 
+// Sphere geometry tessellated once per level of detail. The spheres of a
+// level are drawn with a single indexed draw call: their vertices are
+// translated to the centers on the CPU and streamed into one vertex buffer
+// per frame, while the normals and the indices of the level only depend on
+// the number of spheres and stay in buffers that are rebuilt when the batch
+// outgrows them. Without buffer objects the same arrays are drawn from
+// client memory. Must be used from the thread owning the OpenGL context.
+class SphereBatch {
+public:
+    SphereBatch( float radius );
+    ~SphereBatch();
+
+    // clears the batch for the next frame
+    void clear();
+    // adds a sphere centered at (x,y,z), the level of detail is chosen by distance to the origin
+    void add( float x, float y, float z );
+    // renders all spheres in the batch, returns the number of draw calls issued
+    int render();
+
+    unsigned size() const { return count; }
+    unsigned triangles() const;
+    // bytes uploaded by the last call to render
+    unsigned uploadedBytes() const { return uploaded_bytes; }
+
+protected:
+    struct Vertex {
+        float nx, ny, nz;
+        float x, y, z;
+    };
+    struct Center {
+        float x, y, z;
+    };
+    // the mesh of a level and its spheres of this frame
+    struct Level {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<Center> centers;
+        std::vector<float> positions;           // the vertices of all spheres, translated
+        std::vector<float> normals;             // the normals of capacity spheres
+        std::vector<uint32_t> batch_indices;    // the indices of capacity spheres
+        unsigned capacity;
+        unsigned buffers[3];                    // positions, normals and indices
+    };
+
+    void tessellate( Level & level, int slices, int stacks ) const;
+    int selectLevel( float distance ) const;
+    // makes the normals and indices of a level for at least spheres spheres
+    void reserve( Level & level, unsigned spheres );
+
+    float radius;
+    std::vector<Level> levels;
+    unsigned count;
+    bool initialized, use_buffers;
+    unsigned uploaded_bytes;
+};
+
 #endif
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <vector>
 #include <cassert>
+#include <cmath>
 
 #include <Windows.h>
 #include <gl/GL.h>
@@ -12,10 +13,717 @@
 using namespace std;
 
 #include "Kinect3DDevice.h"
+#include "Pipeline.h"
+#include "PointStream.h"
 #include "Viewers.h"
 #include "Scene.h"
+#include "Pyramid.h"
+#include "Filter.h"
+#include "Tracking.h"
+#include "Background.h"
+#include "Normals.h"
+#include "Planes.h"
+#include "Fusion.h"
+
+// checks the SIMD levels of DepthPyramid against the reference and times building them from
+// frames of the simulated scene, with sensor noise and holes
+static int benchmarkPyramid(){
+	FakeDevice device;
+	Frame frame;
+	device.copyFrame(frame);
+	uint32_t state = 1;
+	for(int y = 0; y < frame.depth.size().y; ++y)
+		for(int x = 0; x < frame.depth.size().x; ++x){
+			state = state * 1664525u + 1013904223u;
+			if((state >> 24) < 20)
+				frame.depth[y][x] = 0;
+		}
+
+	const char * names[2] = { "average", "median" };
+	const DepthPyramid::Method methods[2] = { DepthPyramid::AVERAGE, DepthPyramid::MEDIAN };
+	int failed = 0;
+	for(int m = 0; m < 2; ++m){
+		DepthPyramid pyramid(4, methods[m]);
+		pyramid.build(frame.depth);
+		for(int level = 1; level < pyramid.levels(); ++level){
+			Image<uint16_t> reference(pyramid[level].size());
+			DepthPyramid::downsampleReference(pyramid[level - 1], reference, methods[m], 30);
+			int wrong = 0;
+			for(int y = 0; y < reference.size().y; ++y)
+				for(int x = 0; x < reference.size().x; ++x)
+					if(reference[y][x] != pyramid[level][y][x])
+						++wrong;
+			if(wrong)
+				cout << names[m] << " level " << level << ": " << wrong << " pixels differ from the reference" << endl;
+			failed += wrong;
+		}
+
+		const int runs = 500;
+		double total = 0, best = 1e9;
+		for(int i = 0; i < runs; ++i){
+			pyramid.build(frame.depth);
+			total += pyramid.buildTime();
+			best = min(best, pyramid.buildTime());
+		}
+		const double start = getTime();
+		Image<uint16_t> reference[4];
+		for(int i = 0; i < runs / 10; ++i){
+			reference[0].copy_from(pyramid[0]);
+			for(int level = 1; level < 4; ++level){
+				reference[level].resize(pyramid[level].size());
+				DepthPyramid::downsampleReference(reference[level - 1], reference[level], methods[m], 30);
+			}
+		}
+		const double scalar = (getTime() - start) / (runs / 10);
+		cout << fixed << setprecision(3) << names[m] << ": 4 levels from " << frame.depth.size().x << "x" << frame.depth.size().y
+			<< " in " << total / runs * 1000 << " ms, best " << best * 1000 << " ms, reference " << scalar * 1000 << " ms" << endl;
+	}
+	return failed ? 1 : 0;
+}
+
+// checks DepthFilter against the reference, with and without a player index in the lower bits,
+// and prints how much closer the filtered frames of the simulated scene come to the noise free
+// depth, and the time to filter them
+static int benchmarkFilter(){
+	FakeDevice device;
+	Frame frame;
+	device.copyFrame(frame);
+	const SubImage<const uint16_t> clean(device.getDepthBuffer(), frame.depth.size());
+	uint32_t state = 1;
+	for(int y = 0; y < frame.depth.size().y; ++y)
+		for(int x = 0; x < frame.depth.size().x; ++x){
+			state = state * 1664525u + 1013904223u;
+			if((state >> 24) < 20)
+				frame.depth[y][x] = 0;
+		}
+
+	DepthFilter filter;
+	int failed = 0;
+	for(int shift = 0; shift <= 3; shift += 3){
+		Image<uint16_t> raw(frame.depth.size()), filtered(frame.depth.size()), reference(frame.depth.size());
+		for(int y = 0; y < raw.size().y; ++y)
+			for(int x = 0; x < raw.size().x; ++x)
+				raw[y][x] = uint16_t((frame.depth[y][x] << shift) | ((x + y) & ((1 << shift) - 1)));
+		filtered.copy_from(raw);
+		filter.apply(filtered, shift);
+		DepthFilter::applyReference(raw, reference, shift, 30, 2);
+		int wrong = 0;
+		for(int y = 0; y < raw.size().y; ++y)
+			for(int x = 0; x < raw.size().x; ++x)
+				if(reference[y][x] != filtered[y][x])
+					++wrong;
+		if(wrong)
+			cout << "shift " << shift << ": " << wrong << " pixels differ from the reference" << endl;
+		failed += wrong;
+	}
+
+	// root mean square error against the depth before the noise, over the pixels valid in both
+	Image<uint16_t> filtered;
+	filtered.copy_from(frame.depth);
+	filter.apply(filtered);
+	double noisy_error = 0, filtered_error = 0;
+	int compared = 0, removed = 0;
+	for(int y = 0; y < clean.size().y; ++y)
+		for(int x = 0; x < clean.size().x; ++x){
+			if(frame.depth[y][x] && !filtered[y][x])
+				++removed;
+			if(!clean[y][x] || !frame.depth[y][x] || !filtered[y][x])
+				continue;
+			noisy_error += double(frame.depth[y][x] - clean[y][x]) * (frame.depth[y][x] - clean[y][x]);
+			filtered_error += double(filtered[y][x] - clean[y][x]) * (filtered[y][x] - clean[y][x]);
+			++compared;
+		}
+
+	const int runs = 500;
+	double total = 0, best = 1e9;
+	for(int i = 0; i < runs; ++i){
+		filtered.copy_from(frame.depth);
+		filter.apply(filtered);
+		total += filter.filterTime();
+		best = min(best, filter.filterTime());
+	}
+	const double start = getTime();
+	for(int i = 0; i < runs / 10; ++i)
+		DepthFilter::applyReference(frame.depth, filtered, 0, 30, 2);
+	const double scalar = (getTime() - start) / (runs / 10);
+	cout << fixed << setprecision(3) << "error " << sqrt(noisy_error / max(compared, 1)) << " mm noisy, " << sqrt(filtered_error / max(compared, 1))
+		<< " mm filtered, " << removed << " pixels removed" << endl;
+	cout << "filter " << frame.depth.size().x << "x" << frame.depth.size().y << " in " << total / runs * 1000 << " ms, best " << best * 1000
+		<< " ms, reference " << scalar * 1000 << " ms" << endl;
+	return failed ? 1 : 0;
+}
+
+// a frame of the simulated scene from a still or a moving sensor, with the noise of
+// FakeDevice and holes that change from frame to frame, filtered and turned into points as
+// the pipeline does
+static void simulatedFrame( FakeDevice & device, DepthFilter & filter, bool moving, Frame & frame ){
+	device.copyFrame(frame);
+	Image<uint16_t> still;
+	if(!moving)
+		FakeDevice::renderScene(device.getDepthIntrinsics(), FakeDevice::cameraPose(0), still);
+	uint32_t state = frame.number * 2654435761u + 1;
+	for(int y = 0; y < frame.depth.size().y; ++y)
+		for(int x = 0; x < frame.depth.size().x; ++x){
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			if(!moving)
+				frame.depth[y][x] = still[y][x] ? still[y][x] + (state % 9) - 4 : 0;
+			if((state >> 24) < 10)
+				frame.depth[y][x] = 0;
+		}
+	filter.apply(frame.depth);
+	device.make3DPoints(frame.depth.contiguous_data(), frame.rgb.contiguous_data(), frame.points, NULL, NULL, &frame.pixels);
+}
+
+// streams frames of the simulated scene over the loopback interface to several subscribers,
+// one of them joining halfway, checks that every subscriber decodes the points of every frame
+// and prints the sizes of the key and delta frames and the time from publishing a frame until
+// all subscribers decoded it, for a still and a moving sensor
+static int benchmarkStream(){
+	const int subscribers = 4, frames = 60;
+	FakeDevice device;
+	DepthFilter filter;
+	Frame frame;
+	int failed = 0;
+	for(int moving = 0; moving < 2 && !failed; ++moving){
+		const unsigned short port = (unsigned short)(5433 + moving);
+		PointStreamServer server(port);
+		if(!server.start())
+			return 1;
+
+		// without subscribers frames are neither copied nor encoded
+		simulatedFrame(device, filter, moving != 0, frame);
+		server.publish(frame, device);
+		Sleep(50);
+		const StreamStats idle = server.getStats();
+		if(idle.skipped != 1 || idle.encoded != 0){
+			cout << "frame without subscribers was encoded" << endl;
+			++failed;
+		}
+
+		PointStreamClient clients[subscribers + 1];
+		vector<Point> decoded[subscribers + 1];
+		vector<uint32_t> pixels[subscribers + 1];
+		vector<float> joints;
+		int connected = 0;
+		double total = 0, best = 1e9;
+		unsigned keys = 0, deltas = 0, wrong = 0;
+		for(int f = 0; f < frames && !failed; ++f){
+			const int wanted = f < frames / 2 ? subscribers : subscribers + 1;
+			for(; connected < wanted; ++connected)
+				if(!clients[connected].connect(port)){
+					cout << "could not connect to port " << port << endl;
+					return 1;
+				}
+			for(int wait = 0; wait < 1000 && int(server.subscriberCount()) < connected; ++wait)
+				Sleep(1);
+
+			simulatedFrame(device, filter, moving != 0, frame);
+			const double start = getTime();
+			server.publish(frame, device);
+			for(int c = 0; c < connected; ++c)
+				if(!clients[c].receive(decoded[c], joints, pixels[c])){
+					cout << "subscriber " << c << " could not decode frame " << f << endl;
+					++failed;
+				}
+			const double elapsed = getTime() - start;
+			total += elapsed;
+			best = min(best, elapsed);
+
+			for(int c = 0; c < connected && !failed; ++c){
+				// a new subscriber starts with a key frame and then only needs deltas
+				const bool first = (f == 0 && c < subscribers) || (f == frames / 2 && c == subscribers);
+				if(clients[c].wasDelta() == first){
+					cout << "subscriber " << c << " received a " << (first ? "delta" : "key") << " frame for frame " << f << endl;
+					++failed;
+				}
+				clients[c].wasDelta() ? ++deltas : ++keys;
+				if(decoded[c].size() != frame.points.size() || pixels[c] != frame.pixels){
+					cout << "subscriber " << c << " decoded " << decoded[c].size() << " of " << frame.points.size() << " points" << endl;
+					++failed;
+					continue;
+				}
+				for(unsigned i = 0; i < frame.points.size(); ++i){
+					const Point & p = frame.points[i], & q = decoded[c][i];
+					if(fabs(p.x - q.x) > 0.00051f || fabs(p.y - q.y) > 0.00051f || fabs(p.z - q.z) > 0.00051f || (p.color & 0xffffff) != q.color)
+						++wrong;
+				}
+			}
+		}
+		const StreamStats stats = server.getStats();
+		server.stop();
+		if(wrong){
+			cout << wrong << " points differ from the published ones" << endl;
+			++failed;
+		}
+		// a still sensor only changes the points of the depth noise and the holes
+		if(!moving && stats.delta_size > 0.75 * stats.key_size){
+			cout << "delta frames of the still sensor are not smaller than the key frames" << endl;
+			++failed;
+		}
+		cout << fixed << setprecision(3) << (moving ? "moving" : "still") << " sensor: " << frame.points.size() << " points to " << subscribers << "+1 subscribers, "
+			<< keys << " key and " << deltas << " delta frames received, " << stats.dropped << " dropped" << endl;
+		cout << "key " << stats.key_size / 1024 << " kB, delta " << stats.delta_size / 1024 << " kB, encode " << stats.encode_time * 1000
+			<< " ms, publish to all decoded " << total / frames * 1000 << " ms, best " << best * 1000 << " ms" << endl;
+	}
+	return failed ? 1 : 0;
+}
+
+// translation in millimetres and rotation in degrees between two poses
+static void poseError( const Pose & a, const Pose & b, float & translation, float & rotation ){
+	const Pose difference = a.inverse() * b;
+	translation = 1000 * sqrt(difference.t[0] * difference.t[0] + difference.t[1] * difference.t[1] + difference.t[2] * difference.t[2]);
+	// the angle from its sine and cosine, acos alone loses small angles
+	const double cosine = (double(difference.R[0]) + difference.R[4] + difference.R[8] - 1) / 2;
+	const double axis[3] = { difference.R[7] - difference.R[5], difference.R[2] - difference.R[6], difference.R[3] - difference.R[1] };
+	const double sine = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]) / 2;
+	rotation = float(atan2(sine, cosine) * 180 / 3.14159265358979);
+}
+
+// tracks filtered frames of FakeDevice, whose camera sways and turns, at 640x480 and 320x240,
+// compares the poses with the motion of the simulated camera and prints the errors and the
+// time to track a frame
+static int benchmarkTracking(){
+	const int frames = 100;
+	const int widths[2] = { 640, 320 };
+	int failed = 0;
+	for(int r = 0; r < 2; ++r){
+		FakeDevice device(widths[r], widths[r] * 3 / 4, widths[r], widths[r] * 3 / 4);
+		DepthFilter filter;
+		IcpTracker tracker;
+		Frame frame;
+		Pose first, previous_truth, previous_pose;
+		double total = 0, best = 1e9, step_translation = 0, step_rotation = 0;
+		float worst_translation = 0, worst_rotation = 0, translation = 0, rotation = 0;
+		unsigned lost = 0;
+		for(int f = 0; f < frames; ++f){
+			device.copyFrame(frame);
+			filter.apply(frame.depth, device.getDepthIntrinsics().depth_shift);
+			if(!tracker.track(frame.depth.contiguous_data(), device.getDepthIntrinsics()))
+				++lost;
+			total += tracker.trackTime();
+			best = min(best, tracker.trackTime());
+
+			// the tracked poses start at the camera of the first frame
+			const Pose truth = FakeDevice::cameraPose(frame.number - 1);
+			if(f == 0)
+				first = truth;
+			else {
+				// error of the motion since the frame before, and of the accumulated pose
+				float t, a;
+				poseError(previous_pose.inverse() * tracker.pose(), previous_truth.inverse() * truth, t, a);
+				step_translation += t;
+				step_rotation += a;
+				worst_translation = max(worst_translation, t);
+				worst_rotation = max(worst_rotation, a);
+				poseError(tracker.pose(), first.inverse() * truth, translation, rotation);
+			}
+			previous_truth = truth;
+			previous_pose = tracker.pose();
+		}
+		cout << fixed << setprecision(3) << widths[r] << "x" << widths[r] * 3 / 4 << ": " << frames << " frames, " << lost << " lost, per frame error "
+			<< step_translation / (frames - 1) << " mm " << step_rotation / (frames - 1) << " deg average, " << worst_translation << " mm "
+			<< worst_rotation << " deg worst, drift " << translation << " mm " << rotation << " deg" << endl;
+		cout << "track in " << total / frames * 1000 << " ms, best " << best * 1000 << " ms" << endl;
+		if(lost || step_translation / (frames - 1) > 2 || translation > 50 || rotation > 2)
+			++failed;
+	}
+	cout << (failed ? "tracking test failed" : "tracking test passed") << endl;
+	return failed ? 1 : 0;
+}
+
+// fuses filtered frames of FakeDevice at the tracked pose, from depth frames of 640x480 and
+// 320x240, raycasts the surface at 320x240 as the pipeline does and compares the depth of the
+// fused points with the noise free depth of the simulated camera. Fails if the fused surface
+// is off by more than 5 mm on average or covers less than 95% of the scene after the first
+// frames, and prints the time to integrate a frame and to raycast the surface.
+static int benchmarkFusion(){
+	const int warmup = 10, frames = 60;
+	const int widths[2] = { 640, 320 };
+	int failed = 0;
+	for(int r = 0; r < 2; ++r){
+		FakeDevice device(widths[r], widths[r] * 3 / 4, widths[r], widths[r] * 3 / 4);
+		const Intrinsics intrinsics = device.getDepthIntrinsics();
+		Intrinsics view = intrinsics;
+		while(view.width > 320)
+			view = view.downsampled();
+		DepthFilter filter;
+		IcpTracker tracker;
+		TsdfVolume volume;
+		Frame frame;
+		Image<uint16_t> clean;
+		vector<float> vertices, normals;
+		vector<Point> points;
+		double integrate_total = 0, raycast_total = 0, raycast_best = 1e9, error_sum = 0;
+		unsigned matched = 0, visible = 0, lost = 0;
+		for(int f = 0; f < warmup + frames; ++f){
+			device.copyFrame(frame);
+			filter.apply(frame.depth, intrinsics.depth_shift);
+			if(!tracker.track(frame.depth.contiguous_data(), intrinsics))
+				++lost;
+			const double start = getTime();
+			volume.integrate(frame.depth.contiguous_data(), intrinsics, tracker.pose());
+			const double integrated = getTime();
+			volume.raycast(view, tracker.pose(), vertices, normals);
+			TsdfVolume::makePoints(vertices, normals, tracker.pose(), points);
+			const double raycast = getTime();
+			if(f < warmup)
+				continue;
+			integrate_total += integrated - start;
+			raycast_total += raycast - integrated;
+			raycast_best = min(raycast_best, raycast - integrated);
+
+			// the fused points are in the coordinates of the tracked camera, compare them where
+			// the simulated camera sees the scene within the range of the fusion
+			FakeDevice::renderScene(view, FakeDevice::cameraPose(frame.number - 1), clean);
+			for(int y = 0; y < view.height; ++y)
+				for(int x = 0; x < view.width; ++x)
+					if(clean[y][x] >= 400 && clean[y][x] <= 4000)
+						++visible;
+			for(unsigned i = 0; i < points.size(); ++i){
+				float u, v;
+				view.project(points[i].x, points[i].y, points[i].z, u, v);
+				const int x = int(u + 0.5f), y = int(v + 0.5f);
+				if(x < 0 || x >= view.width || y < 0 || y >= view.height || clean[y][x] == 0)
+					continue;
+				error_sum += fabs(points[i].z - clean[y][x] * 0.001f);
+				++matched;
+			}
+		}
+		const double error = matched ? error_sum / matched * 1000 : 0;
+		const double coverage = visible ? double(matched) / visible : 0;
+		cout << fixed << setprecision(3) << widths[r] << "x" << widths[r] * 3 / 4 << ": " << frames << " frames, " << lost << " lost, "
+			<< volume.brickCount() << " bricks, surface error " << error << " mm, coverage " << coverage * 100 << "%" << endl;
+		cout << "integrate in " << integrate_total / frames * 1000 << " ms, raycast " << view.width << "x" << view.height << " in "
+			<< raycast_total / frames * 1000 << " ms, best " << raycast_best * 1000 << " ms" << endl;
+		if(lost || volume.full() || matched == 0 || error > 5 || coverage < 0.95)
+			++failed;
+	}
+	cout << (failed ? "fusion test failed" : "fusion test passed") << endl;
+	return failed ? 1 : 0;
+}
+
+// detects the planes of a room with a floor, a wall, a table and a ball, seen from a camera
+// pitching up and down, at 640x480 and 320x240 and with noise of up to 4 mm, and checks that
+// every frame finds the three planes and nothing else, with normals within 1 degree and
+// offsets within 5 mm. Prints the worst errors, the hypotheses scored and the detection time.
+static int benchmarkPlanes(){
+	const int frames = 100;
+	const int widths[2] = { 640, 320 };
+	// the known planes in world coordinates, the camera at the origin looks along z
+	const char * names[3] = { "floor", "wall", "table" };
+	const float known[3][4] = { { 0, 1, 0, 0.7f }, { 0, 0, -1, 2.5f }, { 0, 1, 0, 0.4f } };
+	const float table[4] = { -0.7f, 0.3f, 1.0f, 1.8f };		// x and z extent of the table top
+	const float ball[4] = { 0.6f, -0.45f, 1.4f, 0.25f };
+	int failed = 0;
+	for(int r = 0; r < 2; ++r){
+		FakeDevice device(widths[r], widths[r] * 3 / 4, widths[r], widths[r] * 3 / 4);
+		const Intrinsics intrinsics = device.getDepthIntrinsics();
+		Image<uint16_t> depth(ImageRef(intrinsics.width, intrinsics.height));
+		NormalEstimator normal_estimator;
+		PlaneDetector detector;
+		vector<float> normals;
+		vector<Plane> planes;
+		vector<uint8_t> mask;
+		uint32_t state = 1;
+		unsigned missed[3] = { 0, 0, 0 }, spurious = 0, hypotheses = 0;
+		float worst_angle = 0, worst_offset = 0;
+		double total = 0, best = 1e9;
+		for(int f = 0; f < frames; ++f){
+			// looking down by 6 to 14 degrees
+			const float pitch = 0.17f + 0.07f * sin(f * 0.1f);
+			Pose pose;
+			pose.R[4] = pose.R[8] = cos(pitch);
+			pose.R[5] = -sin(pitch);
+			pose.R[7] = sin(pitch);
+			for(int y = 0; y < intrinsics.height; ++y)
+				for(int x = 0; x < intrinsics.width; ++x){
+					// the hit at ray * z is at depth z in the camera
+					float ray[3], direction[3];
+					intrinsics.unproject(float(x), float(y), 1.0f, ray[0], ray[1]);
+					ray[2] = 1;
+					pose.rotate(ray, direction);
+					float z = 8;
+					if(direction[1] < 0)
+						z = min(z, -known[0][3] / direction[1]);
+					if(direction[2] > 0)
+						z = min(z, known[1][3] / direction[2]);
+					if(direction[1] < 0){
+						const float hit = -known[2][3] / direction[1];
+						if(hit * direction[0] > table[0] && hit * direction[0] < table[1] && hit * direction[2] > table[2] && hit * direction[2] < table[3])
+							z = min(z, hit);
+					}
+					const float a = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+					const float b = -2 * (direction[0] * ball[0] + direction[1] * ball[1] + direction[2] * ball[2]);
+					const float c = ball[0] * ball[0] + ball[1] * ball[1] + ball[2] * ball[2] - ball[3] * ball[3];
+					if(b * b - 4 * a * c >= 0)
+						z = min(z, (-b - sqrt(b * b - 4 * a * c)) / (2 * a));
+					state ^= state << 13;
+					state ^= state >> 17;
+					state ^= state << 5;
+					depth[y][x] = z < 8 ? uint16_t(int(z * 1000) + int(state % 9) - 4) : 0;
+				}
+			normal_estimator.compute(depth.contiguous_data(), intrinsics, normals);
+			detector.detect(depth.contiguous_data(), intrinsics, normals.data(), planes, mask);
+			total += detector.detectTime();
+			best = min(best, detector.detectTime());
+			hypotheses += detector.hypotheses();
+
+			// the known planes in the camera, facing it, matched by normal and offset
+			vector<bool> matched(planes.size(), false);
+			for(int k = 0; k < 3; ++k){
+				float normal[3];
+				pose.inverse().rotate(known[k], normal);
+				bool found = false;
+				for(unsigned p = 0; p < planes.size() && !found; ++p){
+					const double cosine = normal[0] * planes[p].normal[0] + normal[1] * planes[p].normal[1] + normal[2] * planes[p].normal[2];
+					const float angle = float(acos(min(cosine, 1.0)) * 180 / 3.14159265358979);
+					const float offset = 1000 * fabs(planes[p].d - known[k][3]);
+					if(matched[p] || angle > 1 || offset > 5)
+						continue;
+					matched[p] = found = true;
+					worst_angle = max(worst_angle, angle);
+					worst_offset = max(worst_offset, offset);
+				}
+				if(!found)
+					++missed[k];
+			}
+			for(unsigned p = 0; p < planes.size(); ++p)
+				if(!matched[p])
+					++spurious;
+		}
+		cout << fixed << setprecision(3) << intrinsics.width << "x" << intrinsics.height << ": " << frames << " frames, missed";
+		for(int k = 0; k < 3; ++k)
+			cout << " " << names[k] << " " << missed[k];
+		cout << ", " << spurious << " other planes, worst error " << worst_angle << " deg " << worst_offset << " mm" << endl;
+		cout << "detect in " << total / frames * 1000 << " ms, best " << best * 1000 << " ms, " << hypotheses / frames << " hypotheses per frame" << endl;
+		if(missed[0] || missed[1] || missed[2] || spurious)
+			++failed;
+	}
+	cout << (failed ? "plane test failed" : "plane test passed") << endl;
+	return failed ? 1 : 0;
+}
+
+// separates two balls moving in front of the still scene of FakeDevice with BackgroundModel at
+// 640x480 and 320x240, with the player index bits of the skeleton mode below the depth. The
+// model learns the empty scene for 30 frames, then the balls move for 100 frames and the
+// foreground is compared with the pixels the balls cover, printing precision, recall and the
+// time to classify a frame and update the model
+static int benchmarkBackground(){
+	const int learning = 30, frames = 100;
+	const int widths[2] = { 640, 320 };
+	int failed = 0;
+	for(int r = 0; r < 2; ++r){
+		FakeDevice device(widths[r], widths[r] * 3 / 4, widths[r], widths[r] * 3 / 4);
+		Intrinsics intrinsics = device.getDepthIntrinsics();
+		intrinsics.depth_shift = 3;
+		Image<uint16_t> scene, depth(ImageRef(intrinsics.width, intrinsics.height));
+		FakeDevice::renderScene(intrinsics, FakeDevice::cameraPose(0), scene);
+		BackgroundModel model;
+		vector<uint8_t> mask, truth(intrinsics.width * intrinsics.height);
+		uint32_t state = 1;
+		unsigned true_positives = 0, false_positives = 0, false_negatives = 0;
+		double total = 0, best = 1e9;
+		for(int f = 0; f < learning + frames; ++f){
+			// center and radius of the balls in camera coordinates, well in front of the scene
+			const float t = float(f - learning);
+			const float balls[2][4] = { { 0.5f * sin(t * 0.1f), 0.1f, 1.0f, 0.15f }, { -0.3f, 0.3f * sin(t * 0.13f), 1.3f, 0.2f } };
+			for(int y = 0; y < intrinsics.height; ++y)
+				for(int x = 0; x < intrinsics.width; ++x){
+					float z = scene[y][x] * 0.001f;
+					bool ball = false;
+					if(f >= learning){
+						float ray[3];
+						intrinsics.unproject(float(x), float(y), 1.0f, ray[0], ray[1]);
+						ray[2] = 1;
+						for(int i = 0; i < 2; ++i){
+							const float a = ray[0] * ray[0] + ray[1] * ray[1] + ray[2] * ray[2];
+							const float b = -2 * (ray[0] * balls[i][0] + ray[1] * balls[i][1] + ray[2] * balls[i][2]);
+							const float c = balls[i][0] * balls[i][0] + balls[i][1] * balls[i][1] + balls[i][2] * balls[i][2] - balls[i][3] * balls[i][3];
+							const float discriminant = b * b - 4 * a * c;
+							if(discriminant < 0)
+								continue;
+							const float hit = (-b - sqrt(discriminant)) / (2 * a);
+							if(z == 0 || hit < z){
+								z = hit;
+								ball = true;
+							}
+						}
+					}
+					// noise of up to 4 mm and holes, which are neither foreground nor background
+					state ^= state << 13;
+					state ^= state >> 17;
+					state ^= state << 5;
+					int value = z > 0 ? int(z * 1000) + int(state % 9) - 4 : 0;
+					if((state >> 24) < 10)
+						value = 0;
+					depth[y][x] = uint16_t(value << intrinsics.depth_shift);
+					truth[y * intrinsics.width + x] = ball && value != 0;
+				}
+			model.update(depth.contiguous_data(), intrinsics, mask);
+			if(f < learning)
+				continue;
+			total += model.updateTime();
+			best = min(best, model.updateTime());
+			for(size_t i = 0; i < truth.size(); ++i){
+				if(mask[i] && truth[i])
+					++true_positives;
+				else if(mask[i])
+					++false_positives;
+				else if(truth[i])
+					++false_negatives;
+			}
+		}
+		const double precision = true_positives / max(double(true_positives + false_positives), 1.0);
+		const double recall = true_positives / max(double(true_positives + false_negatives), 1.0);
+		cout << fixed << setprecision(3) << intrinsics.width << "x" << intrinsics.height << ": " << frames << " frames, precision " << precision
+			<< ", recall " << recall << ", " << false_positives << " false and " << false_negatives << " missed of " << true_positives + false_negatives
+			<< " foreground pixels" << endl;
+		cout << "update in " << total / frames * 1000 << " ms, best " << best * 1000 << " ms" << endl;
+		if(precision < 0.99 || recall < 0.99)
+			++failed;
+	}
+	cout << (failed ? "background test failed" : "background test passed") << endl;
+	return failed ? 1 : 0;
+}
+
+// renders 10, 100 and 1000 balls spread over all levels of detail in an offscreen window with
+// the AR view projection, as the Balls scene draws them, and prints the draw calls, the bytes
+// uploaded and the time per frame until the image is finished. Fails if a level takes more
+// than one draw call or nothing is drawn.
+static int benchmarkBalls(){
+	const int frames = 50;
+	const unsigned counts[3] = { 10, 100, 1000 };
+	int failed = 0;
+	try {
+		GLWindow window(ImageRef(640, 480), "balls", 24, "offscreen");
+		FakeDevice device;
+		ARViewer viewer;
+		KinectScene scene;
+		SphereBatch spheres(0.1f);
+		uint32_t state = 1;
+		for(int c = 0; c < 3; ++c){
+			// in the view from 0.3 to 4.5 metres, so every level of detail is used
+			spheres.clear();
+			for(unsigned i = 0; i < counts[c]; ++i){
+				float random[3];
+				for(int k = 0; k < 3; ++k){
+					state = state * 1664525u + 1013904223u;
+					random[k] = (state >> 8) / float(1 << 24);
+				}
+				const float z = 0.3f + 4.2f * random[2];
+				spheres.add((random[0] - 0.5f) * z, (random[1] - 0.5f) * 0.75f * z, z);
+			}
+			double total = 0, best = 1e9;
+			int draw_calls = 0;
+			unsigned uploaded = 0;
+			for(int f = 0; f < frames; ++f){
+				const double start = getTime();
+				viewer.render(device);
+				scene.setupLighting();
+				glColor3f(1, 0, 0);
+				draw_calls = spheres.render();
+				glDisable(GL_LIGHTING);
+				glFinish();
+				const double time = getTime() - start;
+				total += time;
+				best = min(best, time);
+				// the first frame also uploads the normals and indices
+				if(f > 0)
+					uploaded = spheres.uploadedBytes();
+			}
+			vector<unsigned char> rgb;
+			window.read_pixels(rgb);
+			unsigned covered = 0;
+			for(size_t i = 0; i < rgb.size(); i += 3)
+				if(rgb[i] || rgb[i + 1] || rgb[i + 2])
+					++covered;
+			cout << fixed << setprecision(3) << setw(4) << counts[c] << " balls: " << spheres.triangles() << " triangles, " << draw_calls << " draw calls, "
+				<< uploaded / 1024 << " kB uploaded, " << total / frames * 1000 << " ms per frame, best " << best * 1000 << " ms, "
+				<< covered << " pixels covered" << endl;
+			if(draw_calls > 3 || covered == 0)
+				++failed;
+		}
+	} catch(const Exceptions::All & error){
+		cout << "no offscreen window: " << error.what << endl;
+		++failed;
+	}
+	cout << (failed ? "balls test failed" : "balls test passed") << endl;
+	return failed ? 1 : 0;
+}
+
+// runs the pipeline on FakeDevice, which captures 30 frames per second, with the stages of the
+// views enabled in turn and prints the frames presented per second, the time to process a
+// frame, the capacity of the processing stage this allows and the latency
+static int benchmarkPipeline(){
+	struct Configuration {
+		const char * name;
+		bool normals, planes, mesh, background, fusion;
+	};
+	const Configuration configurations[] = {
+		{ "points", false, false, false, false, false },
+		{ "lit points", true, false, false, false, false },
+		{ "planes", false, true, false, false, false },
+		{ "mesh", false, false, true, false, false },
+		{ "background", false, false, false, true, false },
+		{ "fusion", false, false, false, false, true },
+	};
+	const double duration = 3;
+	FakeDevice device;
+	for(unsigned c = 0; c < sizeof(configurations) / sizeof(configurations[0]); ++c){
+		const Configuration & configuration = configurations[c];
+		FramePipeline pipeline(device);
+		pipeline.enableNormals(configuration.normals);
+		pipeline.enablePlanes(configuration.planes);
+		pipeline.enableMesh(configuration.mesh);
+		pipeline.enableBackground(configuration.background);
+		pipeline.enableFusion(configuration.fusion);
+		pipeline.start();
+
+		// present frames as the render loop does, the first second warms up the stages
+		bool measuring = false;
+		const double start = getTime();
+		double now = start;
+		while(now - start < duration + 1){
+			pipeline.signal().wait(100);
+			if(pipeline.update())
+				pipeline.presented();
+			now = getTime();
+			if(!measuring && now - start > 1){
+				pipeline.getStats();
+				measuring = true;
+			}
+		}
+		const PipelineStats stats = pipeline.getStats();
+		pipeline.stop();
+		cout << fixed << setprecision(2) << setw(12) << configuration.name << ": " << stats.rendered / duration << " frames/s, processing "
+			<< stats.processing_time * 1000 << " ms per frame, capacity " << (stats.processing_time > 0 ? 1 / stats.processing_time : 0)
+			<< " frames/s, copy " << stats.copy_time * 1000 << " ms, latency " << stats.latency * 1000 << " ms" << endl;
+	}
+	return 0;
+}
 
 int main(int argc, char ** argv){
+	if(argc > 1 && string(argv[1]) == "-pyramid")
+		return benchmarkPyramid();
+	if(argc > 1 && string(argv[1]) == "-filter")
+		return benchmarkFilter();
+	if(argc > 1 && string(argv[1]) == "-stream")
+		return benchmarkStream();
+	if(argc > 1 && string(argv[1]) == "-tracking")
+		return benchmarkTracking();
+	if(argc > 1 && string(argv[1]) == "-fusion")
+		return benchmarkFusion();
+	if(argc > 1 && string(argv[1]) == "-planes")
+		return benchmarkPlanes();
+	if(argc > 1 && string(argv[1]) == "-background")
+		return benchmarkBackground();
+	if(argc > 1 && string(argv[1]) == "-balls")
+		return benchmarkBalls();
+	if(argc > 1 && string(argv[1]) == "-pipeline")
+		return benchmarkPipeline();
+
 	// open OpenGL Window
 	GLWindow window(ImageRef(640+640, 480), "Kinect3D");
 	GLWindow::EventSummary events;
@@ -34,23 +742,39 @@ int main(int argc, char ** argv){
 	int viewer_mode = 0;
 	int scene_mode = 0;
 
-	// setup kinect;
-	MyKinect kinect(true);
+	// setup kinect, -high captures the color camera at 1280x960
+	const bool high_resolution = argc > 1 && string(argv[1]) == "-high";
+	MyKinect kinect(true, high_resolution);
 	//FakeDevice kinect;		// use this instead of MyKinect class for testing without a kinect
 
+	// process frames on a separate thread, the kinect captures on its own
+	FramePipeline pipeline(kinect);
+	pipeline.start();
+
+	// stream point clouds to other processes on this machine
+	PointStreamServer stream;
+	stream.start();
+
 	// run event loop and re-render if new buffers are received
 	while(!events.should_quit()){
+		// sleep until a processed frame or window messages arrive
+		window.wait_events(pipeline.signal(), 100);
 		events.clear();
 		window.get_events(events);
 		viewers[viewer_mode]->handle_events(events);
 		scenes[scene_mode]->handle_events(events);
 
-		if(kinect.haveVideoBuffer() || kinect.haveDepthBuffer()){
+		const bool new_frame = pipeline.update();
+		if(new_frame){
+			stream.publish(pipeline.latest(), kinect);
+		}
+		if(new_frame || kinect.haveVideoBuffer() || kinect.haveDepthBuffer()){
 			viewers[viewer_mode]->render(kinect);
 			if(viewer_mode > 0){
-				scenes[scene_mode]->render(kinect);
+				scenes[scene_mode]->render(kinect, pipeline.latest());
 			}
 			window.swap_buffers();
+			pipeline.presented();
 		}
 
 		if(events.key_up.count(' ')){
@@ -59,8 +783,42 @@ int main(int argc, char ** argv){
 		if(events.key_up.count('s')){
 			scene_mode = (++scene_mode) % scenes.size();
 		}
-		Sleep(1);
+		if(events.key_up.count('d')){
+			pipeline.enableFilter(!pipeline.filterEnabled());
+			cout << "depth filter " << (pipeline.filterEnabled() ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('f')){
+			pipeline.enableFusion(!pipeline.fusionEnabled());
+			cout << "fusion " << (pipeline.fusionEnabled() ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('r')){
+			pipeline.resetFusion();
+		}
+		if(events.key_up.count('b')){
+			pipeline.enableBackground(!pipeline.backgroundEnabled());
+			cout << "background subtraction " << (pipeline.backgroundEnabled() ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('p')){
+			pipeline.enablePlanes(!pipeline.planesEnabled());
+			cout << "plane detection " << (pipeline.planesEnabled() ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('m')){
+			pipeline.enableMesh(!pipeline.meshEnabled());
+			cout << "mesh " << (pipeline.meshEnabled() ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('a')){
+			kinect.enableAutoRange(!kinect.autoRangeEnabled());
+			cout << "depth auto-ranging " << (kinect.autoRangeEnabled() ? "on" : "off") << endl;
+		}
+		// only the lit points of the 3D views use the normals of the frame
+		pipeline.enableNormals(viewer_mode > 0 && scenes[scene_mode]->needsNormals());
+		if(events.key_up.count('i')){
+			cout << pipeline.getStats() << endl;
+			cout << stream.getStats() << endl;
+		}
 	}
 
+	stream.stop();
+	pipeline.stop();
 	return 0;
 }
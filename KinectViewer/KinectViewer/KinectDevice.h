@@ -30,6 +30,13 @@
 #include <libfreenect.h>
 #include <stdexcept>
 #include <map>
+#include <thread>
+#include <atomic>
+#ifdef _WIN32
+#include <windows.h>	// timeval, through winsock.h
+#else
+#include <sys/time.h>
+#endif
 	
 class FreenectTiltState {
 	friend class FreenectDevice;
@@ -52,17 +59,15 @@ private:
 
 class FreenectDevice {
 public:
-	FreenectDevice(int _index) : 
+	FreenectDevice(freenect_context *_ctx, int _index) : 
+	  m_index(_index),
 	  m_video_format(FREENECT_VIDEO_DUMMY), 
+	  m_video_resolution(FREENECT_RESOLUTION_MEDIUM),
 	  m_depth_format(FREENECT_DEPTH_DUMMY),
 	  is_video_active(false),
 	  is_depth_active(false) 
 	{
-		if(freenect_init(&m_ctx, NULL) < 0) throw std::runtime_error("Cannot initialize freenect library");
-		// We claim both the motor and camera devices, since this class exposes both.
-		// It does not support audio, so we do not claim it.
-		freenect_select_subdevices(m_ctx, static_cast<freenect_device_flags>(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
-		if(freenect_open_device(m_ctx, &m_dev, _index) < 0) throw std::runtime_error("Cannot open Kinect");
+		if(freenect_open_device(_ctx, &m_dev, _index) < 0) throw std::runtime_error("Cannot open Kinect");
 		freenect_set_user(m_dev, this);
 		setVideoFormat(FREENECT_VIDEO_RGB);
 		setDepthFormat(FREENECT_DEPTH_11BIT);
@@ -71,15 +76,12 @@ public:
 	}
 	virtual ~FreenectDevice() {
 		if(freenect_close_device(m_dev) < 0){} //FN_WARNING("Device did not shutdown in a clean fashion");
-		if(freenect_shutdown(m_ctx) < 0){} //FN_WARNING("Freenect did not shutdown in a clean fashion");
 	}
 
-	int deviceCount() {
-		return freenect_num_devices(m_ctx);
-	}
-	void process() {
-		if(freenect_process_events(m_ctx) < 0) throw std::runtime_error("Cannot process freenect events");
-	}
+	// the index the device was opened with
+	int index() const { return m_index; }
+	// the libfreenect device, for functions FreenectDevice does not wrap
+	freenect_device * device() { return m_dev; }
 	void startVideo() {
 		if(freenect_start_video(m_dev) < 0) throw std::runtime_error("Cannot start RGB callback");
 		is_video_active = true;
@@ -116,22 +118,32 @@ public:
 	FreenectTiltState getState() const {
 		return FreenectTiltState(freenect_get_tilt_state(m_dev));
 	}
-	void setVideoFormat(freenect_video_format requested_format) {
-		if (requested_format != m_video_format) {
+	// FREENECT_RESOLUTION_HIGH is 1280x1024 for the RGB, Bayer and infrared formats
+	void setVideoFormat(freenect_video_format requested_format, freenect_resolution requested_resolution = FREENECT_RESOLUTION_MEDIUM) {
+		if (requested_format != m_video_format || requested_resolution != m_video_resolution) {
 			bool was_active = isVideoActive();
 			if(was_active)
 				stopVideo();
-			freenect_frame_mode mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, requested_format);
+			freenect_frame_mode mode = freenect_find_video_mode(requested_resolution, requested_format);
 			if (!mode.is_valid) throw std::runtime_error("Cannot set video format: invalid mode");
 			if (freenect_set_video_mode(m_dev, mode) < 0) throw std::runtime_error("Cannot set video format");
 			if(was_active)
 				startVideo();
 			m_video_format = requested_format;
+			m_video_resolution = requested_resolution;
+			m_video_mode = mode;
 		}
 	}
 	freenect_video_format getVideoFormat() {
 		return m_video_format;
 	}
+	freenect_resolution getVideoResolution() {
+		return m_video_resolution;
+	}
+	// the current mode with the size of the frames, without asking libfreenect
+	const freenect_frame_mode & getVideoMode() const {
+		return m_video_mode;
+	}
 	void setDepthFormat(freenect_depth_format requested_format) {
 		if (requested_format != m_depth_format) {
 			bool was_active = isDepthActive();
@@ -143,11 +155,15 @@ public:
 			if(was_active)
 				startDepth();
 			m_depth_format = requested_format;
+			m_depth_mode = mode;
 		}
 	}
 	freenect_depth_format getDepthFormat() {
 		return m_depth_format;
 	}
+	const freenect_frame_mode & getDepthMode() const {
+		return m_depth_mode;
+	}
 	// Do not call directly even in child
 	virtual void VideoCallback(void *video, uint32_t timestamp) = 0;
 	// Do not call directly even in child
@@ -167,28 +183,20 @@ public:
 
 protected:
 	int getVideoBufferSize(){
-		switch(m_video_format) {
-			case FREENECT_VIDEO_RGB:
-			case FREENECT_VIDEO_BAYER:
-			case FREENECT_VIDEO_IR_8BIT:
-			case FREENECT_VIDEO_IR_10BIT:
-			case FREENECT_VIDEO_IR_10BIT_PACKED:
-			case FREENECT_VIDEO_YUV_RGB:
-			case FREENECT_VIDEO_YUV_RAW:
-				return freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, m_video_format).bytes;
-			default:
-				return 0;
-		}
+		return m_video_mode.bytes;
 	}
 	int getDepthBufferSize(){
-		return freenect_get_current_depth_mode(m_dev).bytes;
+		return m_depth_mode.bytes;
 	}
 
 private:
-	freenect_context *m_ctx;
+	int m_index;
 	freenect_device *m_dev;
 	freenect_video_format m_video_format;
+	freenect_resolution m_video_resolution;
+	freenect_frame_mode m_video_mode;
 	freenect_depth_format m_depth_format;
+	freenect_frame_mode m_depth_mode;
 	bool is_video_active;
 	bool is_depth_active;
 	static void freenect_depth_callback(freenect_device *dev, void *depth, uint32_t timestamp) {
@@ -201,4 +209,81 @@ private:
 	}
 };
 
+// Owns the freenect context shared by all devices and drives it from a single event thread.
+// freenect_process_events services every device opened on the context, so any number of
+// sensors is captured without a polling thread per device. The callbacks of all devices
+// run on the event thread, one after the other.
+class Freenect {
+public:
+	Freenect() : m_running(false), m_failed(false) {
+		if(freenect_init(&m_ctx, NULL) < 0) throw std::runtime_error("Cannot initialize freenect library");
+		// We claim both the motor and camera devices, since FreenectDevice exposes both.
+		// It does not support audio, so we do not claim it.
+		freenect_select_subdevices(m_ctx, static_cast<freenect_device_flags>(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+	}
+	~Freenect() {
+		stop();
+		for(std::map<int, FreenectDevice*>::iterator it = m_devices.begin(); it != m_devices.end(); ++it)
+			delete it->second;
+		if(freenect_shutdown(m_ctx) < 0){} //FN_WARNING("Freenect did not shutdown in a clean fashion");
+	}
+
+	int deviceCount() {
+		return freenect_num_devices(m_ctx);
+	}
+	// the shared libfreenect context, for functions Freenect does not wrap
+	freenect_context * context() { return m_ctx; }
+	// Opens the device with the given index on the shared context, replacing a device opened
+	// before with the same index. Open devices before calling start.
+	template <typename ConcreteDevice>
+	ConcreteDevice& createDevice(int _index) {
+		deleteDevice(_index);
+		ConcreteDevice * device = new ConcreteDevice(m_ctx, _index);
+		m_devices[_index] = device;
+		return *device;
+	}
+	void deleteDevice(int _index) {
+		std::map<int, FreenectDevice*>::iterator it = m_devices.find(_index);
+		if(it == m_devices.end())
+			return;
+		delete it->second;
+		m_devices.erase(it);
+	}
+
+	// starts the event thread processing the events of all devices
+	void start() {
+		if(m_running)
+			return;
+		m_running = true;
+		m_failed = false;
+		m_thread = std::thread([this]{
+			// the timeout keeps the thread responsive to stop while no device delivers data
+			while(m_running){
+				timeval timeout = { 0, 100000 };
+				if(freenect_process_events_timeout(m_ctx, &timeout) < 0){
+					m_failed = true;
+					break;
+				}
+			}
+		});
+	}
+	void stop() {
+		if(!m_thread.joinable())
+			return;
+		m_running = false;
+		m_thread.join();
+	}
+	// true if the event thread stopped because processing the events failed
+	bool failed() const { return m_failed; }
+
+private:
+	Freenect(const Freenect &);
+	Freenect & operator=(const Freenect &);
+
+	freenect_context *m_ctx;
+	std::map<int, FreenectDevice*> m_devices;
+	std::thread m_thread;
+	std::atomic<bool> m_running, m_failed;
+};
+
 #endif // KINECTDEVICE_H
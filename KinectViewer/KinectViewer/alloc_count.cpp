@@ -0,0 +1,28 @@
+#include "alloc_count.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+static atomic<long> allocations(0);
+
+long allocation_count(){
+    return allocations;
+}
+
+void * operator new( size_t size ){
+    ++allocations;
+    if(void * p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete( void * p ) throw() {
+    free(p);
+}
+
+void operator delete( void * p, size_t ) throw() {
+    free(p);
+}
@@ -0,0 +1,12 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+// The global operator new and delete of KinectViewer are replaced in alloc_count.cpp with ones
+// that count the allocations of the program, so that tests can check that a code path does not
+// allocate, as the event handling of GLWindow should not. Arrays and the sized forms end up in
+// the replaced functions as well. Counting costs one atomic increment per allocation.
+
+/// number of calls of operator new so far, by all threads
+long allocation_count();
+
+#endif // ALLOC_COUNT_H
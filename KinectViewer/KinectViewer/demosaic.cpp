@@ -0,0 +1,386 @@
+#include "demosaic.h"
+
+#include <emmintrin.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// reflects coordinates outside of the image, which keeps the color of the pixel at them. Images
+// narrower or shorter than 3 pixels have too few pixels to reflect at, there coordinates that
+// are still outside are clamped.
+static inline int mirror( const int i, const int n ){
+    const int reflected = i < 0 ? -i : (i >= n ? 2 * n - 2 - i : i);
+    return reflected < 0 ? 0 : (reflected >= n ? n - 1 : reflected);
+}
+
+// rounded average like _mm_avg_epu8, so that pixels converted one at a time match the SIMD blocks exactly
+static inline uint8_t average( const int a, const int b ){
+    return uint8_t((a + b + 1) >> 1);
+}
+
+static inline uint8_t clamp( const int value ){
+    return uint8_t(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// the color of a pixel of the pattern, 0 red, 1 green and 2 blue
+static inline int color( const int x, const int y ){
+    return (y & 1) == 0 ? ((x & 1) == 0 ? 1 : 0) : ((x & 1) == 0 ? 2 : 1);
+}
+
+// Bilinear conversion of a single pixel from the average of the neighbors of each color inside
+// the image, rounded to the nearest, as in libfreenect's converter. Used for the border.
+static void average_pixel( const uint8_t * bayer, const int W, const int H, const int x, const int y, uint8_t * out ){
+    int sum[3] = { 0, 0, 0 }, count[3] = { 0, 0, 0 };
+    const int own = color(x, y);
+    for(int dy = -1; dy <= 1; ++dy){
+        for(int dx = -1; dx <= 1; ++dx){
+            const int nx = x + dx, ny = y + dy;
+            if(nx < 0 || ny < 0 || nx >= W || ny >= H)
+                continue;
+            const int c = color(nx, ny);
+            // green pixels only take their direct neighbors
+            if(c == 1 && own != 1 && dx != 0 && dy != 0)
+                continue;
+            sum[c] += bayer[ny * W + nx];
+            ++count[c];
+        }
+    }
+    for(int i = 0; i < 3; ++i)
+        out[i] = i == own ? bayer[y * W + x] : uint8_t(count[i] ? (sum[i] + count[i] / 2) / count[i] : 0);
+}
+
+// bilinear conversion of a single pixel at any position, the interior averaged in pairs like
+// the SIMD blocks so that both give the same result, the border from the neighbors inside the image
+static void bilinear_pixel( const uint8_t * bayer, const int W, const int H, const int x, const int y, uint8_t * out ){
+    if(x == 0 || y == 0 || x >= W - 1 || y >= H - 1){
+        average_pixel(bayer, W, H, x, y, out);
+        return;
+    }
+    const uint8_t * row = bayer + y * W;
+    const uint8_t * up = row - W;
+    const uint8_t * down = row + W;
+    const int left = x - 1, right = x + 1;
+
+    const uint8_t c = row[x];
+    const uint8_t horizontal = average(row[left], row[right]);
+    const uint8_t vertical = average(up[x], down[x]);
+    const uint8_t cross = average(horizontal, vertical);
+    const uint8_t diagonal = average(average(up[left], up[right]), average(down[left], down[right]));
+
+    switch(color(x, y) + ((y & 1) << 2)){
+    case 1:     // green between red and blue
+        out[0] = horizontal; out[1] = c; out[2] = vertical;
+        break;
+    case 0:     // red
+        out[0] = c; out[1] = cross; out[2] = diagonal;
+        break;
+    case 6:     // blue
+        out[0] = diagonal; out[1] = cross; out[2] = c;
+        break;
+    default:    // green between blue and red
+        out[0] = vertical; out[1] = c; out[2] = horizontal;
+    }
+}
+
+// Hamilton-Adams green of a single red or blue pixel, mirrored at the border
+static uint8_t green_pixel( const uint8_t * bayer, const int W, const int H, const int x, const int y ){
+    const uint8_t * row = bayer + y * W;
+    const int c = row[x];
+    const int l = row[mirror(x - 1, W)], r = row[mirror(x + 1, W)];
+    const int ll = row[mirror(x - 2, W)], rr = row[mirror(x + 2, W)];
+    const int u = bayer[mirror(y - 1, H) * W + x], d = bayer[mirror(y + 1, H) * W + x];
+    const int uu = bayer[mirror(y - 2, H) * W + x], dd = bayer[mirror(y + 2, H) * W + x];
+    const int laplace_h = 2 * c - ll - rr, laplace_v = 2 * c - uu - dd;
+    const int gradient_h = abs(l - r) + abs(laplace_h), gradient_v = abs(u - d) + abs(laplace_v);
+    const int sum_h = 2 * (l + r) + laplace_h, sum_v = 2 * (u + d) + laplace_v;
+    if(gradient_h < gradient_v)
+        return clamp((sum_h + 2) >> 2);
+    if(gradient_v < gradient_h)
+        return clamp((sum_v + 2) >> 2);
+    return clamp((sum_h + sum_v + 4) >> 3);
+}
+
+// red and blue of a single pixel from the color differences to the green plane, mirrored at the border
+static void difference_pixel( const uint8_t * bayer, const uint8_t * green, const int W, const int H, const int x, const int y, uint8_t * out ){
+    const int row = y * W, up = mirror(y - 1, H) * W, down = mirror(y + 1, H) * W;
+    const int left = mirror(x - 1, W), right = mirror(x + 1, W);
+    const int g = green[row + x];
+    const int horizontal = g + ((bayer[row + left] - green[row + left] + bayer[row + right] - green[row + right] + 1) >> 1);
+    const int vertical = g + ((bayer[up + x] - green[up + x] + bayer[down + x] - green[down + x] + 1) >> 1);
+    const int diagonal = g + ((bayer[up + left] - green[up + left] + bayer[up + right] - green[up + right]
+                             + bayer[down + left] - green[down + left] + bayer[down + right] - green[down + right] + 2) >> 2);
+    const int c = bayer[row + x];
+
+    out[1] = uint8_t(g);
+    switch(color(x, y) + ((y & 1) << 2)){
+    case 1:     // green between red and blue
+        out[0] = clamp(horizontal); out[2] = clamp(vertical);
+        break;
+    case 0:     // red
+        out[0] = uint8_t(c); out[2] = clamp(diagonal);
+        break;
+    case 6:     // blue
+        out[0] = clamp(diagonal); out[2] = uint8_t(c);
+        break;
+    default:    // green between blue and red
+        out[0] = clamp(vertical); out[2] = clamp(horizontal);
+    }
+}
+
+// selects a where the mask is set and b elsewhere
+static inline __m128i select( const __m128i mask, const __m128i a, const __m128i b ){
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i load( const uint8_t * data ){
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+}
+
+// the lower or upper 8 bytes widened to 16 bits
+static inline __m128i low( const __m128i bytes ){
+    return _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+}
+static inline __m128i high( const __m128i bytes ){
+    return _mm_unpackhi_epi8(bytes, _mm_setzero_si128());
+}
+
+static inline __m128i absolute( const __m128i value ){
+    return _mm_max_epi16(value, _mm_sub_epi16(_mm_setzero_si128(), value));
+}
+
+// packs the RGB0 pixels of 4 32 bit lanes into 12 bytes
+static inline void store_rgb( uint8_t * out, const __m128i pixels ){
+    const __m128i low3 = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+    const __m128i next3 = _mm_set_epi32(0x0000ffff, 0xff000000, 0x0000ffff, 0xff000000);
+    // 6 bytes of two pixels at the start of each 64 bit half
+    const __m128i pairs = _mm_or_si128(_mm_and_si128(pixels, low3), _mm_and_si128(_mm_srli_epi64(pixels, 8), next3));
+    const __m128i packed = _mm_or_si128(_mm_and_si128(pairs, _mm_set_epi32(0, 0, 0x0000ffff, 0xffffffff)), _mm_slli_si128(_mm_srli_si128(pairs, 8), 6));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out), packed);
+    const int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    memcpy(out + 8, &last, 4);
+}
+
+// interleaves 16 pixels of separate color planes into packed RGB
+static inline void store_rgb( uint8_t * out, const __m128i red, const __m128i green, const __m128i blue ){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rg_low = _mm_unpacklo_epi8(red, green), rg_high = _mm_unpackhi_epi8(red, green);
+    const __m128i b_low = _mm_unpacklo_epi8(blue, zero), b_high = _mm_unpackhi_epi8(blue, zero);
+    store_rgb(out, _mm_unpacklo_epi16(rg_low, b_low));
+    store_rgb(out + 12, _mm_unpackhi_epi16(rg_low, b_low));
+    store_rgb(out + 24, _mm_unpacklo_epi16(rg_high, b_high));
+    store_rgb(out + 36, _mm_unpackhi_epi16(rg_high, b_high));
+}
+
+// bilinear conversion of 16 pixels starting at an even column of an interior row
+static inline void bilinear_block( const uint8_t * row, const int W, const bool even_row, uint8_t * out ){
+    const uint8_t * up = row - W, * down = row + W;
+    const __m128i c = load(row);
+    const __m128i horizontal = _mm_avg_epu8(load(row - 1), load(row + 1));
+    const __m128i vertical = _mm_avg_epu8(load(up), load(down));
+    const __m128i cross = _mm_avg_epu8(horizontal, vertical);
+    const __m128i diagonal = _mm_avg_epu8(_mm_avg_epu8(load(up - 1), load(up + 1)), _mm_avg_epu8(load(down - 1), load(down + 1)));
+
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    if(even_row)
+        store_rgb(out, select(even, horizontal, c), select(even, c, cross), select(even, vertical, diagonal));
+    else
+        store_rgb(out, select(even, diagonal, vertical), select(even, cross, c), select(even, c, horizontal));
+}
+
+// Hamilton-Adams green of 8 pixels, given as 16 bit values
+static inline __m128i green_half( const __m128i c, const __m128i l, const __m128i r, const __m128i ll, const __m128i rr,
+                                  const __m128i u, const __m128i d, const __m128i uu, const __m128i dd ){
+    const __m128i c2 = _mm_add_epi16(c, c);
+    const __m128i laplace_h = _mm_sub_epi16(c2, _mm_add_epi16(ll, rr)), laplace_v = _mm_sub_epi16(c2, _mm_add_epi16(uu, dd));
+    const __m128i gradient_h = _mm_add_epi16(absolute(_mm_sub_epi16(l, r)), absolute(laplace_h));
+    const __m128i gradient_v = _mm_add_epi16(absolute(_mm_sub_epi16(u, d)), absolute(laplace_v));
+    const __m128i lr = _mm_add_epi16(l, r), ud = _mm_add_epi16(u, d);
+    const __m128i sum_h = _mm_add_epi16(_mm_add_epi16(lr, lr), laplace_h), sum_v = _mm_add_epi16(_mm_add_epi16(ud, ud), laplace_v);
+    const __m128i along_h = _mm_srai_epi16(_mm_add_epi16(sum_h, _mm_set1_epi16(2)), 2);
+    const __m128i along_v = _mm_srai_epi16(_mm_add_epi16(sum_v, _mm_set1_epi16(2)), 2);
+    const __m128i both = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(sum_h, sum_v), _mm_set1_epi16(4)), 3);
+    const __m128i h_smaller = _mm_cmplt_epi16(gradient_h, gradient_v), v_smaller = _mm_cmplt_epi16(gradient_v, gradient_h);
+    return select(h_smaller, along_h, select(v_smaller, along_v, both));
+}
+
+// green plane of 16 pixels starting at an even column of a row at least 2 pixels from the border
+static inline void green_block( const uint8_t * row, const int W, const bool even_row, uint8_t * green ){
+    const __m128i c = load(row), l = load(row - 1), r = load(row + 1), ll = load(row - 2), rr = load(row + 2);
+    const __m128i u = load(row - W), d = load(row + W), uu = load(row - 2 * W), dd = load(row + 2 * W);
+    const __m128i low_half = green_half(low(c), low(l), low(r), low(ll), low(rr), low(u), low(d), low(uu), low(dd));
+    const __m128i high_half = green_half(high(c), high(l), high(r), high(ll), high(rr), high(u), high(d), high(uu), high(dd));
+    const __m128i interpolated = _mm_packus_epi16(low_half, high_half);
+    // green pixels are odd in even rows and even in odd rows
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(green), even_row ? select(even, c, interpolated) : select(even, interpolated, c));
+}
+
+// color differences to green of 8 pixels, the red and blue of the pixels are returned in the 16 bit lanes
+static inline void difference_half( const __m128i * b, const __m128i * g, const bool even_row, __m128i & red, __m128i & blue ){
+    // neighbors in the order center, left, right, up, down, up left, up right, down left, down right
+    __m128i diff[9];
+    for(int i = 1; i < 9; ++i)
+        diff[i] = _mm_sub_epi16(b[i], g[i]);
+    const __m128i horizontal = _mm_add_epi16(g[0], _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(diff[1], diff[2]), _mm_set1_epi16(1)), 1));
+    const __m128i vertical = _mm_add_epi16(g[0], _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(diff[3], diff[4]), _mm_set1_epi16(1)), 1));
+    const __m128i diagonals = _mm_add_epi16(_mm_add_epi16(diff[5], diff[6]), _mm_add_epi16(diff[7], diff[8]));
+    const __m128i diagonal = _mm_add_epi16(g[0], _mm_srai_epi16(_mm_add_epi16(diagonals, _mm_set1_epi16(2)), 2));
+    const __m128i even = _mm_set1_epi32(0x0000ffff);
+    if(even_row){
+        red = select(even, horizontal, b[0]);
+        blue = select(even, vertical, diagonal);
+    } else {
+        red = select(even, diagonal, vertical);
+        blue = select(even, b[0], horizontal);
+    }
+}
+
+// red and blue from the green plane for 16 pixels starting at an even column of an interior row
+static inline void difference_block( const uint8_t * row, const uint8_t * green, const int W, const bool even_row, uint8_t * out ){
+    const int offsets[9] = { 0, -1, 1, -W, W, -W - 1, -W + 1, W - 1, W + 1 };
+    __m128i bayer_bytes[9], green_bytes[9];
+    for(int i = 0; i < 9; ++i){
+        bayer_bytes[i] = load(row + offsets[i]);
+        green_bytes[i] = load(green + offsets[i]);
+    }
+    __m128i b[9], g[9], red[2], blue[2];
+    for(int i = 0; i < 9; ++i){
+        b[i] = low(bayer_bytes[i]);
+        g[i] = low(green_bytes[i]);
+    }
+    difference_half(b, g, even_row, red[0], blue[0]);
+    for(int i = 0; i < 9; ++i){
+        b[i] = high(bayer_bytes[i]);
+        g[i] = high(green_bytes[i]);
+    }
+    difference_half(b, g, even_row, red[1], blue[1]);
+    store_rgb(out, _mm_packus_epi16(red[0], red[1]), green_bytes[0], _mm_packus_epi16(blue[0], blue[1]));
+}
+
+void demosaic( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb, const DemosaicMethod method, vector<uint8_t> * green_buffer ){
+    const int W = size.x, H = size.y;
+    // blocks start at column 2 so that the neighbors up to 2 pixels left are inside the row and
+    // the first lane is even, and end at least 2 pixels before the end of the row
+    const int first = 2;
+    const int blocks = W >= first + 18 ? (W - first - 2) / 16 : 0;
+    const int end = first + 16 * blocks;
+    // pixels before the blocks, fewer in images narrower than that
+    const int head = min(first, W);
+
+    if(method == DEMOSAIC_BILINEAR){
+#pragma omp parallel for schedule(static)
+        for(int y = 0; y < H; ++y){
+            uint8_t * out = rgb + 3 * y * W;
+            const bool interior = y > 0 && y < H - 1;
+            for(int x = 0; x < (interior ? head : W); ++x)
+                bilinear_pixel(bayer, W, H, x, y, out + 3 * x);
+            if(!interior)
+                continue;
+            for(int x = first; x < end; x += 16)
+                bilinear_block(bayer + y * W + x, W, (y & 1) == 0, out + 3 * x);
+            for(int x = end; x < W; ++x)
+                bilinear_pixel(bayer, W, H, x, y, out + 3 * x);
+        }
+        return;
+    }
+
+    vector<uint8_t> local;
+    vector<uint8_t> & green_plane = green_buffer ? *green_buffer : local;
+    green_plane.resize(W * H);
+    uint8_t * green = green_plane.data();
+
+    // the green plane first, as red and blue need it at the neighbors
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        const uint8_t * row = bayer + y * W;
+        uint8_t * out = green + y * W;
+        const bool interior = y > 1 && y < H - 2;
+        for(int x = 0; x < (interior ? head : W); ++x)
+            out[x] = color(x, y) == 1 ? row[x] : green_pixel(bayer, W, H, x, y);
+        if(!interior)
+            continue;
+        for(int x = first; x < end; x += 16)
+            green_block(row + x, W, (y & 1) == 0, out + x);
+        for(int x = end; x < W; ++x)
+            out[x] = color(x, y) == 1 ? row[x] : green_pixel(bayer, W, H, x, y);
+    }
+
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < H; ++y){
+        uint8_t * out = rgb + 3 * y * W;
+        const bool interior = y > 0 && y < H - 1;
+        for(int x = 0; x < (interior ? head : W); ++x)
+            difference_pixel(bayer, green, W, H, x, y, out + 3 * x);
+        if(!interior)
+            continue;
+        for(int x = first; x < end; x += 16)
+            difference_block(bayer + y * W + x, green + y * W + x, W, (y & 1) == 0, out + 3 * x);
+        for(int x = end; x < W; ++x)
+            difference_pixel(bayer, green, W, H, x, y, out + 3 * x);
+    }
+}
+
+void demosaic_scalar( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb, const DemosaicMethod method ){
+    const int W = size.x, H = size.y;
+    if(method == DEMOSAIC_BILINEAR){
+        for(int y = 0; y < H; ++y)
+            for(int x = 0; x < W; ++x)
+                bilinear_pixel(bayer, W, H, x, y, rgb + 3 * (y * W + x));
+        return;
+    }
+    vector<uint8_t> green(W * H);
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x)
+            green[y * W + x] = color(x, y) == 1 ? bayer[y * W + x] : green_pixel(bayer, W, H, x, y);
+    for(int y = 0; y < H; ++y)
+        for(int x = 0; x < W; ++x)
+            difference_pixel(bayer, green.data(), W, H, x, y, rgb + 3 * (y * W + x));
+}
+
+void demosaic( const SubImage<const uint8_t> & bayer, SubImage<Rgb8> rgb, const DemosaicMethod method, vector<uint8_t> * green ){
+    assert(bayer.is_contiguous() && rgb.is_contiguous() && bayer.size() == rgb.size());
+    demosaic(bayer.data(), bayer.size(), &rgb.data()->red, method, green);
+}
+
+void demosaic_reference( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb ){
+    for(int y = 0; y < size.y; ++y)
+        for(int x = 0; x < size.x; ++x)
+            average_pixel(bayer, size.x, size.y, x, y, rgb + 3 * (y * size.x + x));
+}
+
+// file layout: magic, width, height, pixels; all little endian
+static const char bayer_magic[4] = { 'B', 'A', 'Y', '1' };
+
+bool save_bayer( const uint8_t * bayer, const ImageRef & size, const string & filename ){
+    FILE * file = fopen(filename.c_str(), "wb");
+    if(file == NULL)
+        return false;
+    const uint8_t header[12] = { uint8_t(bayer_magic[0]), uint8_t(bayer_magic[1]), uint8_t(bayer_magic[2]), uint8_t(bayer_magic[3]),
+                                 uint8_t(size.x), uint8_t(size.x >> 8), uint8_t(size.x >> 16), uint8_t(size.x >> 24),
+                                 uint8_t(size.y), uint8_t(size.y >> 8), uint8_t(size.y >> 16), uint8_t(size.y >> 24) };
+    const size_t bytes = size_t(size.x) * size.y;
+    const bool ok = fwrite(header, 1, 12, file) == 12 && fwrite(bayer, 1, bytes, file) == bytes;
+    return fclose(file) == 0 && ok;
+}
+
+bool load_bayer( vector<uint8_t> & bayer, ImageRef & size, const string & filename ){
+    FILE * file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+        return false;
+    uint8_t header[12];
+    bool ok = fread(header, 1, 12, file) == 12 && memcmp(header, bayer_magic, 4) == 0;
+    if(ok){
+        size = ImageRef(header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24),
+                        header[8] | (header[9] << 8) | (header[10] << 16) | (header[11] << 24));
+        ok = size.x > 0 && size.y > 0 && size.x <= 4096 && size.y <= 4096;
+    }
+    if(ok){
+        bayer.resize(size.x * size.y);
+        ok = fread(bayer.data(), 1, bayer.size(), file) == bayer.size();
+    }
+    fclose(file);
+    return ok;
+}
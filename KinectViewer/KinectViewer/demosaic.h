@@ -0,0 +1,48 @@
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "image.h"
+
+// Conversion of the raw Bayer images of the Kinect RGB camera to RGB. The camera delivers
+// the GRBG pattern: even rows alternate green and red, odd rows blue and green. Capturing in
+// FREENECT_VIDEO_BAYER mode transfers one byte per pixel instead of three and leaves the
+// interpolation to these functions instead of libfreenect's callback thread. The interior
+// of the image is converted 16 pixels at a time with SSE2 and the rows are split across
+// threads with OpenMP; the border pixels are converted one by one. On the border the bilinear
+// method averages the neighbors inside the image like demosaic_reference, the edge aware
+// method mirrors the image, and clamps in images narrower or shorter than 3 pixels.
+
+enum DemosaicMethod {
+    DEMOSAIC_BILINEAR,      ///< missing colors are averages of the nearest pixels of that color
+    /// Green is interpolated along the direction of the smaller gradient with a second order
+    /// correction from the center color (Hamilton and Adams), red and blue as the green at the
+    /// pixel plus the averaged color differences to green of their neighbors. Takes two passes.
+    DEMOSAIC_EDGE_AWARE
+};
+
+/// Converts a GRBG Bayer image to packed 8 bit RGB, the format KinectViewer displays. The
+/// edge aware method keeps the interpolated green plane in green, allocated per call if NULL.
+void demosaic( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb, const DemosaicMethod method = DEMOSAIC_BILINEAR,
+               std::vector<uint8_t> * green = NULL );
+/// The same for images, both must be contiguous and of the same size
+void demosaic( const SubImage<const uint8_t> & bayer, SubImage<Rgb8> rgb, const DemosaicMethod method = DEMOSAIC_BILINEAR,
+               std::vector<uint8_t> * green = NULL );
+
+/// The same conversion one pixel at a time on one thread, with the rules of the border for
+/// every pixel, which the SIMD interior of demosaic must match exactly
+void demosaic_scalar( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb, const DemosaicMethod method );
+
+/// Straightforward bilinear conversion one pixel at a time on one thread, in the way of
+/// libfreenect's own converter, as the baseline for benchmarks
+void demosaic_reference( const uint8_t * bayer, const ImageRef & size, uint8_t * rgb );
+
+/// Write a raw Bayer image with a small header to a file, returns false on error
+bool save_bayer( const uint8_t * bayer, const ImageRef & size, const std::string & filename );
+/// Read a Bayer image written by save_bayer, returns false on error
+bool load_bayer( std::vector<uint8_t> & bayer, ImageRef & size, const std::string & filename );
+
+#endif // DEMOSAIC_H
@@ -0,0 +1,197 @@
+#include "depth_codec.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+// collects 4 bit nibbles into 32 bit words, the first nibble in the most significant bits
+class NibbleWriter {
+public:
+    NibbleWriter( vector<uint8_t> & o ) : out(o), word(0), nibbles(0) {}
+
+    // variable length code, 3 bits per nibble and the high bit marks a continuation
+    void put( uint32_t value ){
+        do {
+            uint32_t nibble = value & 0x7;
+            value >>= 3;
+            if(value)
+                nibble |= 0x8;
+            word = (word << 4) | nibble;
+            if(++nibbles == 8)
+                flush();
+        } while(value);
+    }
+
+    void finish(){
+        if(nibbles > 0){
+            word <<= 4 * (8 - nibbles);
+            flush();
+        }
+    }
+
+private:
+    void flush(){
+        const uint8_t bytes[4] = { uint8_t(word), uint8_t(word >> 8), uint8_t(word >> 16), uint8_t(word >> 24) };
+        out.insert(out.end(), bytes, bytes + 4);
+        word = 0;
+        nibbles = 0;
+    }
+
+    vector<uint8_t> & out;
+    uint32_t word;
+    int nibbles;
+};
+
+class NibbleReader {
+public:
+    NibbleReader( const uint8_t * d, const size_t b ) : data(d), end(d + b), word(0), nibbles(0), overrun(false) {}
+
+    uint32_t get(){
+        uint32_t value = 0;
+        int shift = 0;
+        uint32_t nibble;
+        do {
+            if(nibbles == 0){
+                if(data + 4 > end){
+                    overrun = true;
+                    return 0;
+                }
+                word = uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+                data += 4;
+                nibbles = 8;
+            }
+            nibble = word >> 28;
+            word <<= 4;
+            --nibbles;
+            value |= (nibble & 0x7) << shift;
+            shift += 3;
+        } while((nibble & 0x8) && shift < 32);
+        return value;
+    }
+
+    bool failed() const { return overrun; }
+
+private:
+    const uint8_t * data;
+    const uint8_t * end;
+    uint32_t word;
+    int nibbles;
+    bool overrun;
+};
+
+}
+
+size_t compress_depth( const uint16_t * depth, const int count, vector<uint8_t> & out ){
+    const size_t start = out.size();
+    // typical indoor frames compress to well below a byte per pixel
+    out.reserve(start + count);
+    NibbleWriter writer(out);
+
+    const uint16_t * p = depth;
+    const uint16_t * end = depth + count;
+    int previous = 0;
+    while(p != end){
+        const uint16_t * zeros = p;
+        while(p != end && *p == 0)
+            ++p;
+        writer.put(uint32_t(p - zeros));
+
+        const uint16_t * values = p;
+        while(p != end && *p != 0)
+            ++p;
+        writer.put(uint32_t(p - values));
+
+        for(; values != p; ++values){
+            const int delta = int(*values) - previous;
+            previous = *values;
+            // zigzag coding maps small differences of either sign to small numbers
+            writer.put((uint32_t(delta) << 1) ^ uint32_t(delta >> 31));
+        }
+    }
+    writer.finish();
+    return out.size() - start;
+}
+
+bool decompress_depth( const uint8_t * data, const size_t bytes, uint16_t * depth, const int count ){
+    NibbleReader reader(data, bytes);
+    uint16_t * p = depth;
+    uint16_t * end = depth + count;
+    int previous = 0;
+    while(p != end){
+        uint32_t zeros = reader.get();
+        if(reader.failed() || zeros > uint32_t(end - p))
+            return false;
+        memset(p, 0, zeros * sizeof(uint16_t));
+        p += zeros;
+        if(p == end)
+            break;
+
+        uint32_t values = reader.get();
+        if(reader.failed() || values > uint32_t(end - p))
+            return false;
+        for(uint32_t i = 0; i < values; ++i){
+            const uint32_t zigzag = reader.get();
+            const int delta = int(zigzag >> 1) ^ -int(zigzag & 1);
+            previous += delta;
+            *p++ = uint16_t(previous);
+        }
+        if(reader.failed())
+            return false;
+    }
+    return true;
+}
+
+// file layout: magic, width, height, compressed size, compressed data; all little endian
+static const char depth_magic[4] = { 'R', 'V', 'L', '1' };
+
+static void put_uint32( vector<uint8_t> & out, const uint32_t value ){
+    const uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+static uint32_t get_uint32( const uint8_t * data ){
+    return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+bool save_depth( const uint16_t * depth, const ImageRef & size, const string & filename ){
+    vector<uint8_t> buffer(depth_magic, depth_magic + 4);
+    put_uint32(buffer, size.x);
+    put_uint32(buffer, size.y);
+    put_uint32(buffer, 0);
+    const size_t bytes = compress_depth(depth, size.x * size.y, buffer);
+    buffer[12] = uint8_t(bytes);
+    buffer[13] = uint8_t(bytes >> 8);
+    buffer[14] = uint8_t(bytes >> 16);
+    buffer[15] = uint8_t(bytes >> 24);
+
+    FILE * file = fopen(filename.c_str(), "wb");
+    if(file == NULL)
+        return false;
+    const bool ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    return fclose(file) == 0 && ok;
+}
+
+bool load_depth( vector<uint16_t> & depth, ImageRef & size, const string & filename ){
+    FILE * file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+        return false;
+    vector<uint8_t> buffer;
+    uint8_t chunk[65536];
+    size_t read;
+    while((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        buffer.insert(buffer.end(), chunk, chunk + read);
+    fclose(file);
+
+    if(buffer.size() < 16 || memcmp(buffer.data(), depth_magic, 4) != 0)
+        return false;
+    size = ImageRef(get_uint32(&buffer[4]), get_uint32(&buffer[8]));
+    const uint32_t bytes = get_uint32(&buffer[12]);
+    // the header is untrusted, sizes beyond any camera could overflow the pixel count
+    if(size.x < 0 || size.y < 0 || size.x > 4096 || size.y > 4096 || bytes > buffer.size() - 16)
+        return false;
+    depth.resize(size.x * size.y);
+    return decompress_depth(&buffer[16], bytes, depth.data(), int(depth.size()));
+}
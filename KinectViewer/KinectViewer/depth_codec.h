@@ -0,0 +1,27 @@
+#ifndef DEPTH_CODEC_H
+#define DEPTH_CODEC_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "image_ref.h"
+
+// Lossless compression for 16 bit depth images in the style of RVL (A. Wilson, "Fast Lossless
+// Depth Image Compression", ISS 2017). Runs of zero pixels and of valid pixels alternate. Valid
+// pixels are stored as zigzag coded differences to the previous valid pixel and all numbers
+// are written as variable length codes of 3 bit nibbles. Works for any 16 bit values, so
+// both the 11 bit disparity of libfreenect and the depth plus player index of the Kinect SDK
+// survive unchanged.
+
+/// Compress count depth values and append the result to out, returns the number of bytes appended
+size_t compress_depth( const uint16_t * depth, const int count, std::vector<uint8_t> & out );
+/// Decompress count depth values, returns false if the data is truncated
+bool decompress_depth( const uint8_t * data, const size_t bytes, uint16_t * depth, const int count );
+
+/// Write a compressed depth image with a small header to a file, returns false on error
+bool save_depth( const uint16_t * depth, const ImageRef & size, const std::string & filename );
+/// Read a depth image written by save_depth, returns false on error and for sizes beyond 4096 x 4096
+bool load_depth( std::vector<uint16_t> & depth, ImageRef & size, const std::string & filename );
+
+#endif // DEPTH_CODEC_H
@@ -0,0 +1,178 @@
+#include "depth_ingest.h"
+
+#include <emmintrin.h>
+#include <algorithm>
+#include <cstring>
+
+DepthIngest::DepthIngest(){
+    setFormat(0, 0xffff, 6, 8);
+    begin();
+    end();
+}
+
+void DepthIngest::setFormat( int values, uint16_t invalid_from, int bins, int display_shift ){
+    value_shift = values;
+    invalid = invalid_from;
+    bin_shift = bins;
+    for(int bin = 0; bin < BINS; ++bin){
+        const int level = std::min(((bin << bin_shift) >> display_shift), 255);
+        level_table[bin] = uint8_t(level);
+        colour_table[bin].red = colour_table[bin].green = colour_table[bin].blue = uint8_t(level);
+    }
+    level_table[INVALID] = 0;
+    colour_table[INVALID].red = colour_table[INVALID].green = colour_table[INVALID].blue = 0;
+}
+
+// the bin of a raw value, as computed below 16 values at a time
+static inline int bin_of( const uint16_t raw, const int value_shift, const uint16_t invalid, const int bin_shift ){
+    const uint16_t value = uint16_t(raw >> value_shift);
+    if(value == 0 || value >= invalid)
+        return DepthIngest::INVALID;
+    return std::min(value >> bin_shift, DepthIngest::BINS - 1);
+}
+
+void depth_ingest_reference( const uint16_t * raw, size_t count, int value_shift, uint16_t invalid, int bin_shift,
+                             const uint8_t * levels, const Rgb8 * colours, uint16_t * depth, uint8_t * display,
+                             Rgb8 * colour, uint8_t * players, uint32_t * histogram ){
+    for(size_t i = 0; i < count; ++i){
+        const int bin = bin_of(raw[i], value_shift, invalid, bin_shift);
+        if(depth)
+            depth[i] = raw[i];
+        if(display)
+            display[i] = levels[bin];
+        if(colour)
+            colour[i] = colours[bin];
+        if(players)
+            players[i] = uint8_t(raw[i] & ((1 << value_shift) - 1));
+        ++histogram[bin];
+    }
+}
+
+void DepthIngest::process( const SubImage<const uint16_t> & raw, SubImage<uint16_t> depth, SubImage<uint8_t> display,
+                           SubImage<Rgb8> colour, SubImage<uint8_t> players ){
+    assert(depth.data() == NULL || depth.size() == raw.size());
+    assert(display.data() == NULL || display.size() == raw.size());
+    assert(colour.data() == NULL || colour.size() == raw.size());
+    assert(players.data() == NULL || players.size() == raw.size());
+    begin();
+    for(int y = 0; y < raw.size().y; ++y)
+        row(raw[y], raw.size().x, depth.data() ? depth[y] : NULL, display.data() ? display[y] : NULL,
+            colour.data() ? colour[y] : NULL, players.data() ? players[y] : NULL);
+    end();
+}
+
+void DepthIngest::begin(){
+    memset(counters, 0, sizeof(counters));
+    min_depth = 0xffff;
+    max_depth = 0;
+}
+
+// unsigned 16 bit minimum and maximum, which SSE2 only has for signed values
+static inline __m128i min_epu16( const __m128i a, const __m128i b ){
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+}
+
+static inline __m128i max_epu16( const __m128i a, const __m128i b ){
+    return _mm_add_epi16(b, _mm_subs_epu16(a, b));
+}
+
+void DepthIngest::row( const uint16_t * raw, size_t count, uint16_t * depth, uint8_t * display, Rgb8 * colour, uint8_t * players ){
+    const __m128i values = _mm_cvtsi32_si128(value_shift);
+    const __m128i bins = _mm_cvtsi32_si128(bin_shift);
+    const __m128i zero = _mm_setzero_si128();
+    // unsigned comparisons as signed ones of the values with the top bit flipped
+    const __m128i sign = _mm_set1_epi16(short(0x8000));
+    const __m128i limit = _mm_set1_epi16(short(invalid ^ 0x8000));
+    const __m128i player_mask = _mm_set1_epi16(short((1 << value_shift) - 1));
+    const __m128i last_bin = _mm_set1_epi16(BINS - 1);
+    const __m128i invalid_bin = _mm_set1_epi16(INVALID);
+    __m128i low = _mm_set1_epi16(-1), high = zero;
+    __m128i index[2];
+    const uint16_t * bin = reinterpret_cast<const uint16_t *>(index);
+    if(depth == raw)
+        depth = NULL;
+    __m128i pattern[3];         // 16 pixels of the colour of pattern_bin
+    int pattern_bin = -1;
+
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16){
+        __m128i in[2];
+        for(int half = 0; half < 2; ++half){
+            in[half] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i + 8 * half));
+            if(depth)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(depth + i + 8 * half), in[half]);
+            const __m128i value = _mm_srl_epi16(in[half], values);
+            const __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi16(value, zero), _mm_cmplt_epi16(_mm_xor_si128(value, sign), limit));
+            low = min_epu16(low, _mm_or_si128(value, _mm_andnot_si128(valid, _mm_set1_epi16(-1))));
+            high = max_epu16(high, _mm_and_si128(value, valid));
+            const __m128i clamped = min_epu16(_mm_srl_epi16(value, bins), last_bin);
+            index[half] = _mm_or_si128(_mm_and_si128(valid, clamped), _mm_andnot_si128(valid, invalid_bin));
+        }
+        if(players)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(players + i), _mm_packus_epi16(_mm_and_si128(in[0], player_mask), _mm_and_si128(in[1], player_mask)));
+        // 16 pixels of one bin, common on walls, floors and in shadows, are counted at once and
+        // their outputs written with vector stores
+        const __m128i first = _mm_set1_epi16(short(bin[0]));
+        if(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(index[0], first), _mm_cmpeq_epi16(index[1], first))) == 0xffff){
+            counters[0][bin[0]] += 16;
+            if(display)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(display + i), _mm_set1_epi8(char(level_table[bin[0]])));
+            if(colour){
+                if(bin[0] != pattern_bin){
+                    Rgb8 * pixels = reinterpret_cast<Rgb8 *>(pattern);
+                    for(int k = 0; k < 16; ++k)
+                        pixels[k] = colour_table[bin[0]];
+                    pattern_bin = bin[0];
+                }
+                for(int k = 0; k < 3; ++k)
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(colour + i) + k, pattern[k]);
+            }
+            continue;
+        }
+        for(int k = 0; k < 16; k += COUNTERS)
+            for(int c = 0; c < COUNTERS; ++c)
+                ++counters[c][bin[k + c]];
+        if(display)
+            for(int k = 0; k < 16; ++k)
+                display[i + k] = level_table[bin[k]];
+        if(colour)
+            for(int k = 0; k < 16; ++k)
+                colour[i + k] = colour_table[bin[k]];
+    }
+
+    uint16_t lows[8], highs[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lows), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(highs), high);
+    for(int k = 0; k < 8; ++k){
+        min_depth = std::min(min_depth, lows[k]);
+        max_depth = std::max(max_depth, highs[k]);
+    }
+    for(; i < count; ++i){
+        const int b = bin_of(raw[i], value_shift, invalid, bin_shift);
+        if(b != INVALID){
+            const uint16_t value = uint16_t(raw[i] >> value_shift);
+            min_depth = std::min(min_depth, value);
+            max_depth = std::max(max_depth, value);
+        }
+        if(depth)
+            depth[i] = raw[i];
+        if(display)
+            display[i] = level_table[b];
+        if(colour)
+            colour[i] = colour_table[b];
+        if(players)
+            players[i] = uint8_t(raw[i] & ((1 << value_shift) - 1));
+        ++counters[0][b];
+    }
+}
+
+void DepthIngest::end(){
+    valid_count = 0;
+    for(int b = 0; b <= BINS; ++b){
+        counts[b] = 0;
+        for(int c = 0; c < COUNTERS; ++c)
+            counts[b] += counters[c][b];
+        if(b != INVALID)
+            valid_count += counts[b];
+    }
+}
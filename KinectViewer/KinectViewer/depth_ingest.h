@@ -0,0 +1,83 @@
+#ifndef DEPTH_INGEST_H
+#define DEPTH_INGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+// Everything the viewers derive from a new depth frame, in one pass over the frame of the
+// driver: the copy kept for saving and processing, the 8 bit display value, a colour for the
+// texture, the player index of the Kinect SDK's skeleton mode and a histogram with the range
+// of the valid depths, for ranging the display to the scene. Doing these in separate passes
+// reads the frame once per output, and the driver buffer is often no longer in the cache.
+//
+// Every pixel falls into one of BINS bins of its depth, or the bin of invalid pixels, and the
+// display value and colour come from tables per bin, so any curve or colour map costs the
+// same as the plain shift. The kernel loads, copies, splits off the player index, clamps the
+// bins and tracks the range 16 pixels at a time with SSE2, then counts and looks up the 16
+// bins, spreading the counts over two histograms so that runs of the same bin do not wait
+// for each other's increments. 16 pixels of the same bin, as on flat surfaces and in the
+// shadows, are counted with one addition and written with vector stores. Outputs that are
+// not needed are passed as NULL.
+
+class DepthIngest {
+public:
+    enum {
+        BINS = 1024,        ///< bins of valid depths
+        INVALID = BINS      ///< the bin of the pixels without a depth
+    };
+
+    DepthIngest();
+
+    /// Sets how raw values are read: the depth is raw >> value_shift and the player index
+    /// the lower value_shift bits. Depths of 0 and from invalid on are invalid, and a valid
+    /// depth falls into bin depth >> bin_shift, or the last bin. Resets the tables to a
+    /// display value of depth >> display_shift and a grey colour of it, and 0 and black for
+    /// invalid pixels.
+    void setFormat( int value_shift, uint16_t invalid, int bin_shift, int display_shift );
+
+    int valueShift() const { return value_shift; }
+    int binShift() const { return bin_shift; }
+
+    /// display value and colour of every bin, BINS + 1 entries with INVALID last
+    uint8_t * levels() { return level_table; }
+    Rgb8 * colours() { return colour_table; }
+
+    /// Processes a frame, the outputs must have the size of raw or be empty. depth may be
+    /// raw itself to only derive the other outputs from a frame already copied.
+    void process( const SubImage<const uint16_t> & raw, SubImage<uint16_t> depth, SubImage<uint8_t> display,
+                  SubImage<Rgb8> colour = SubImage<Rgb8>(), SubImage<uint8_t> players = SubImage<uint8_t>() );
+
+    /// The same one row at a time, between begin and end, for frames that arrive row by row
+    void begin();
+    void row( const uint16_t * raw, size_t count, uint16_t * depth, uint8_t * display, Rgb8 * colour, uint8_t * players );
+    void end();
+
+    /// statistics of the last frame, the counts of the BINS + 1 bins
+    const uint32_t * histogram() const { return counts; }
+    uint32_t valid() const { return valid_count; }
+    /// range of the valid depths, min > max without any
+    uint16_t minDepth() const { return min_depth; }
+    uint16_t maxDepth() const { return max_depth; }
+
+protected:
+    int value_shift, bin_shift;
+    uint16_t invalid;
+    uint8_t level_table[BINS + 1];
+    Rgb8 colour_table[BINS + 1];
+
+    enum { COUNTERS = 2 };
+    uint32_t counters[COUNTERS][BINS + 1];
+    uint32_t counts[BINS + 1];
+    uint32_t valid_count;
+    uint16_t min_depth, max_depth;
+};
+
+/// The outputs of DepthIngest one pass and one pixel at a time, as the reference for tests and
+/// benchmarks; histogram has BINS + 1 entries
+void depth_ingest_reference( const uint16_t * raw, size_t count, int value_shift, uint16_t invalid, int bin_shift,
+                             const uint8_t * levels, const Rgb8 * colours, uint16_t * depth, uint8_t * display,
+                             Rgb8 * colour, uint8_t * players, uint32_t * histogram );
+
+#endif // DEPTH_INGEST_H
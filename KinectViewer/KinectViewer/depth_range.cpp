@@ -0,0 +1,58 @@
+#include "depth_range.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+DepthAutoRange::DepthAutoRange( float low_percentile, float high_percentile, float drift_fraction )
+    : low(low_percentile), high(high_percentile), drift(drift_fraction), have_range(false), near_bin(0), far_bin(DepthIngest::BINS), change_count(0) {}
+
+bool DepthAutoRange::update( const DepthIngest & ingest ){
+    const uint32_t * counts = ingest.histogram();
+    const uint32_t valid = ingest.valid();
+    if(valid == 0 || uint64_t(valid) * 100 < valid + counts[DepthIngest::INVALID])
+        return false;
+
+    // the first bins reaching the two percentiles
+    const uint32_t low_count = uint32_t(low * valid), high_count = uint32_t(high * valid);
+    int lowest = -1, highest = DepthIngest::BINS - 1;
+    uint32_t sum = 0;
+    for(int bin = 0; bin < DepthIngest::BINS; ++bin){
+        sum += counts[bin];
+        if(lowest < 0 && sum > low_count)
+            lowest = bin;
+        if(lowest >= 0 && sum >= high_count){
+            highest = bin;
+            break;
+        }
+    }
+    int first = lowest, last = highest + 1;
+    if(last - first < MIN_SPAN){
+        last = std::min(first + MIN_SPAN, int(DepthIngest::BINS));
+        first = last - MIN_SPAN;
+    }
+
+    if(have_range){
+        const float tolerance = std::max(drift * (far_bin - near_bin), 1.0f);
+        if(abs(first - near_bin) <= tolerance && abs(last - far_bin) <= tolerance)
+            return false;
+    }
+    near_bin = first;
+    far_bin = last;
+    have_range = true;
+    ++change_count;
+    return true;
+}
+
+void DepthAutoRange::apply( DepthIngest & ingest, const Rgb8 * palette ) const {
+    uint8_t * levels = ingest.levels();
+    Rgb8 * colours = ingest.colours();
+    const int span = far_bin - near_bin;
+    for(int bin = 0; bin < DepthIngest::BINS; ++bin){
+        const int level = bin < near_bin ? 1 : bin >= far_bin ? 255 : 1 + (bin - near_bin) * 255 / span;
+        levels[bin] = uint8_t(level);
+        if(palette)
+            colours[bin] = palette[level];
+        else
+            colours[bin].red = colours[bin].green = colours[bin].blue = uint8_t(level);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef DEPTH_RANGE_H
+#define DEPTH_RANGE_H
+
+#include <stdint.h>
+
+#include "depth_ingest.h"
+
+// Auto-ranging of the depth display. A fixed scale such as the upper 8 bits of the depth leaves
+// most display levels to depths that an indoor scene does not have. DepthAutoRange instead
+// spreads the levels over the depths between two percentiles of the histogram that
+// DepthIngest counts anyway, so the few pixels far out or up close are clipped instead of
+// compressing everything else. It writes the range into the level and colour tables of the
+// ingest, which then applies it to the next frame as part of its single pass, so ranging
+// costs a walk over the 1024 bins per frame and nothing per pixel. The range only follows
+// the percentiles once they drift out of it by more than a fraction of its span, which keeps
+// the display from flickering with the noise of the sensor.
+
+class DepthAutoRange {
+public:
+    /// low and high are the percentiles mapped to the first and last level as fractions,
+    /// drift the fraction of the span they may move before the range follows
+    DepthAutoRange( float low = 0.02f, float high = 0.98f, float drift = 0.1f );
+
+    /// forgets the range, the next update takes the percentiles of its frame
+    void reset() { have_range = false; }
+
+    /// Checks the histogram of the last frame of ingest against the range, returns true if
+    /// the range moved. Frames with less than 1 % valid pixels keep the range.
+    bool update( const DepthIngest & ingest );
+
+    /// Writes the range into the tables of ingest: valid depths get levels 1 to 255 from the
+    /// near to the far end, clipped outside, and palette[level] as colour, or grey without a
+    /// palette. Invalid pixels keep 0 and black.
+    void apply( DepthIngest & ingest, const Rgb8 * palette = NULL ) const;
+
+    /// the range in the depth values of the ingest, near inclusive and far exclusive
+    int nearDepth( const DepthIngest & ingest ) const { return near_bin << ingest.binShift(); }
+    int farDepth( const DepthIngest & ingest ) const { return far_bin << ingest.binShift(); }
+    /// number of times the range moved, for statistics
+    unsigned changes() const { return change_count; }
+
+    /// the range spans at least this many bins, so the noise of a flat wall is not stretched
+    /// over all levels
+    enum { MIN_SPAN = 16 };
+
+protected:
+    float low, high, drift;
+    bool have_range;
+    int near_bin, far_bin;      // the range in bins, far_bin exclusive
+    unsigned change_count;
+};
+
+#endif // DEPTH_RANGE_H
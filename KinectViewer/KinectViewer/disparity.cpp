@@ -0,0 +1,105 @@
+#include "disparity.h"
+
+#include <cstdio>
+
+using namespace std;
+
+// depth in metres of a disparity, 0 if invalid
+static inline float depth_in_metres( const uint16_t disparity, const DisparityCalibration & calibration ){
+    if(disparity >= 2047)
+        return 0;
+    const float inverse = calibration.a * disparity + calibration.b;
+    if(inverse <= 0)
+        return 0;
+    const float z = 1.0f / inverse;
+    return z * 1000.0f > calibration.max_depth ? 0 : z;
+}
+
+DisparityConverter::DisparityConverter( const DisparityCalibration & calibration ) : table_mm(2048), table_m(2048) {
+    setCalibration(calibration);
+}
+
+void DisparityConverter::setCalibration( const DisparityCalibration & calibration ){
+    cal = calibration;
+    for(int d = 0; d < 2048; ++d){
+        table_m[d] = depth_in_metres(uint16_t(d), cal);
+        table_mm[d] = uint16_t(table_m[d] * 1000.0f + 0.5f);
+    }
+    // the factors depend on the intrinsics as well
+    factors_size = ImageRef();
+}
+
+void DisparityConverter::convert( const uint16_t * disparity, const size_t count, uint16_t * mm ) const {
+    const uint16_t * table = table_mm.data();
+    for(size_t i = 0; i < count; ++i)
+        mm[i] = table[disparity[i] & 2047];
+}
+
+size_t DisparityConverter::convert( const uint16_t * disparity, const ImageRef & size, float * xyz, uint16_t * mm ){
+    const int W = size.x, H = size.y;
+    if(factors_size != size){
+        const float sx = W / 640.0f, sy = H / 480.0f;
+        columns.resize(W);
+        rows.resize(H);
+        for(int u = 0; u < W; ++u)
+            columns[u] = (u - cal.cx * sx) / (cal.fx * sx);
+        for(int v = 0; v < H; ++v)
+            rows[v] = -(v - cal.cy * sy) / (cal.fy * sy);
+        factors_size = size;
+    }
+
+    const float * table = table_m.data();
+    const uint16_t * table_millimetres = table_mm.data();
+    long valid = 0;
+#pragma omp parallel for reduction(+:valid) schedule(static)
+    for(int v = 0; v < H; ++v){
+        const uint16_t * in = disparity + v * W;
+        float * out = xyz + 3 * v * W;
+        const float row = rows[v];
+        for(int u = 0; u < W; ++u){
+            const int d = in[u] & 2047;
+            const float z = table[d];
+            out[3 * u + 0] = z * columns[u];
+            out[3 * u + 1] = z * row;
+            out[3 * u + 2] = z;
+            valid += z > 0;
+        }
+        if(mm){
+            uint16_t * out_mm = mm + v * W;
+            for(int u = 0; u < W; ++u)
+                out_mm[u] = table_millimetres[in[u] & 2047];
+        }
+    }
+    return size_t(valid);
+}
+
+bool save_points( const float * xyz, const ImageRef & size, const string & filename ){
+    const int count = size.x * size.y;
+    int valid = 0;
+    for(int i = 0; i < count; ++i)
+        valid += xyz[3 * i + 2] > 0;
+
+    FILE * file = fopen(filename.c_str(), "wb");
+    if(file == NULL)
+        return false;
+    fprintf(file, "ply\nformat binary_little_endian 1.0\nelement vertex %d\nproperty float x\nproperty float y\nproperty float z\nend_header\n", valid);
+    bool ok = true;
+    for(int i = 0; i < count && ok; ++i)
+        if(xyz[3 * i + 2] > 0)
+            ok = fwrite(xyz + 3 * i, sizeof(float), 3, file) == 3;
+    return fclose(file) == 0 && ok;
+}
+
+void disparity_to_points_reference( const uint16_t * disparity, const ImageRef & size, const DisparityCalibration & calibration, float * xyz, uint16_t * mm ){
+    const float sx = size.x / 640.0f, sy = size.y / 480.0f;
+    for(int v = 0; v < size.y; ++v){
+        for(int u = 0; u < size.x; ++u){
+            const int i = v * size.x + u;
+            const float z = depth_in_metres(disparity[i] & 2047, calibration);
+            xyz[3 * i + 0] = (u - calibration.cx * sx) * z / (calibration.fx * sx);
+            xyz[3 * i + 1] = -(v - calibration.cy * sy) * z / (calibration.fy * sy);
+            xyz[3 * i + 2] = z;
+            mm[i] = uint16_t(z * 1000.0f + 0.5f);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef DISPARITY_H
+#define DISPARITY_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_ref.h"
+
+// Conversion of the 11 bit disparity of FREENECT_DEPTH_11BIT to metric depth and 3D points.
+// The depth of a disparity d is 1 / (a d + b) metres, which costs a division per pixel. As there
+// are only 2048 disparities, DisparityConverter evaluates it once per disparity into a table
+// and converts frames with one lookup per pixel. The fused conversion also unprojects every
+// pixel with the pinhole model of the depth camera, using per column and per row factors, so a
+// point costs a lookup and two multiplications.
+
+/// Calibration of the depth camera. The defaults are the commonly used fit of the disparity
+/// to depth by Stephane Magnenat and the intrinsics of the depth camera by Nicolas Burrus,
+/// good to a few percent for any Kinect; calibrate the device for better values.
+struct DisparityCalibration {
+    DisparityCalibration() : a(-0.0030711016f), b(3.3309495161f), max_depth(10000), fx(594.21f), fy(591.04f), cx(339.5f), cy(242.7f) {}
+
+    float a, b;             ///< depth in metres is 1 / (a * disparity + b)
+    uint16_t max_depth;     ///< millimetres, farther depths and the disparity 2047 are invalid
+    float fx, fy, cx, cy;   ///< pinhole model of the depth camera at 640x480
+};
+
+class DisparityConverter {
+public:
+    DisparityConverter( const DisparityCalibration & calibration = DisparityCalibration() );
+
+    void setCalibration( const DisparityCalibration & calibration );
+    const DisparityCalibration & calibration() const { return cal; }
+
+    /// depth of a disparity in millimetres, 0 if invalid
+    uint16_t millimetres( const uint16_t disparity ) const { return table_mm[disparity & 2047]; }
+
+    /// Converts count disparities to millimetres, invalid ones to 0
+    void convert( const uint16_t * disparity, const size_t count, uint16_t * mm ) const;
+
+    /// Converts a disparity image to 3D points in metres, 3 floats per pixel with x to the right,
+    /// y up and z along the viewing direction, and to millimetres as well if mm is not NULL.
+    /// Invalid pixels become 0, 0, 0. Returns the number of valid pixels. The intrinsics are
+    /// scaled to the size of the image.
+    size_t convert( const uint16_t * disparity, const ImageRef & size, float * xyz, uint16_t * mm = NULL );
+
+protected:
+    DisparityCalibration cal;
+    std::vector<uint16_t> table_mm;
+    std::vector<float> table_m;
+    // (u - cx) / fx per column and -(v - cy) / fy per row for the last image size
+    std::vector<float> columns, rows;
+    ImageRef factors_size;
+};
+
+/// Write the valid points of a point image as converted above to a binary PLY file, returns false on error
+bool save_points( const float * xyz, const ImageRef & size, const std::string & filename );
+
+/// Straightforward conversion evaluating the formula for every pixel, as the baseline for benchmarks
+void disparity_to_points_reference( const uint16_t * disparity, const ImageRef & size, const DisparityCalibration & calibration, float * xyz, uint16_t * mm );
+
+#endif // DISPARITY_H
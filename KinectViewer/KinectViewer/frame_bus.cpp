@@ -0,0 +1,292 @@
+#include "frame_bus.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+const char * const default_frame_bus = "KinectViewerFrames";
+
+namespace {
+
+const uint32_t bus_magic = 'K' | ('F' << 8) | ('B' << 16) | ('1' << 24);
+const size_t bus_align = 64;
+
+// layout at the start of the segment, followed by the slots
+struct BusHeader {
+    atomic<uint32_t> magic;     // written last by the writer, readers ignore segments without it
+    uint32_t slots;
+    uint32_t depth_capacity;    // bytes per slot
+    uint32_t video_capacity;
+    uint64_t slot_stride;
+    atomic<uint32_t> latest;    // index of the slot holding the newest frame
+    atomic<uint64_t> published; // number of frames published
+};
+
+// header of every slot, followed by the depth and video data
+struct SlotHeader {
+    atomic<uint32_t> sequence;  // odd while the writer modifies the slot
+    uint64_t number;
+    uint64_t time;
+    int32_t depth_width, depth_height;
+    int32_t video_width, video_height, video_channels;
+};
+
+size_t aligned( const size_t bytes ){
+    return (bytes + bus_align - 1) & ~(bus_align - 1);
+}
+
+const size_t header_bytes = aligned(sizeof(BusHeader));
+const size_t slot_header_bytes = aligned(sizeof(SlotHeader));
+
+// the segment is private to the session on Windows, POSIX names start with a slash
+string segment_name( const string & name ){
+#ifdef _WIN32
+    return "Local\\" + name;
+#else
+    return "/" + name;
+#endif
+}
+
+}
+
+string frame_bus_name( const int device ){
+    if(device == 0)
+        return default_frame_bus;
+    return default_frame_bus + to_string(device);
+}
+
+uint64_t frame_bus_time(){
+    // steady_clock is CLOCK_MONOTONIC on Linux and the performance counter on Windows, both system wide
+    return uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+FrameBusWriter::FrameBusWriter( const string & n, const ImageRef & max_depth, const ImageRef & max_video, const int slots ) : name(n), base(NULL), size(0), handle(NULL), count(0) {
+    const uint32_t depth_capacity = uint32_t(aligned(max_depth.x * max_depth.y * sizeof(uint16_t)));
+    const uint32_t video_capacity = uint32_t(aligned(max_video.x * max_video.y * 3));
+    const size_t stride = slot_header_bytes + depth_capacity + video_capacity;
+    const size_t bytes = header_bytes + slots * stride;
+
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(bytes) >> 32), DWORD(bytes), segment_name(name).c_str());
+    if(mapping == NULL)
+        return;
+    void * memory = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if(memory == NULL){
+        CloseHandle(mapping);
+        return;
+    }
+    handle = mapping;
+#else
+    // a segment left behind by a crashed writer could have a different layout
+    shm_unlink(segment_name(name).c_str());
+    const int fd = shm_open(segment_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0)
+        return;
+    if(ftruncate(fd, bytes) != 0){
+        close(fd);
+        shm_unlink(segment_name(name).c_str());
+        return;
+    }
+    void * memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED){
+        shm_unlink(segment_name(name).c_str());
+        return;
+    }
+#endif
+    base = static_cast<uint8_t *>(memory);
+    size = bytes;
+
+    BusHeader * header = new (base) BusHeader;
+    header->slots = slots;
+    header->depth_capacity = depth_capacity;
+    header->video_capacity = video_capacity;
+    header->slot_stride = stride;
+    header->latest.store(0, memory_order_relaxed);
+    header->published.store(0, memory_order_relaxed);
+    for(int i = 0; i < slots; ++i){
+        SlotHeader * slot = new (base + header_bytes + i * stride) SlotHeader;
+        slot->sequence.store(0, memory_order_relaxed);
+    }
+    header->magic.store(bus_magic, memory_order_release);
+}
+
+FrameBusWriter::~FrameBusWriter(){
+    if(base == NULL)
+        return;
+    reinterpret_cast<BusHeader *>(base)->magic.store(0, memory_order_release);
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(handle);
+#else
+    munmap(base, size);
+    shm_unlink(segment_name(name).c_str());
+#endif
+}
+
+void FrameBusWriter::publish( const uint16_t * depth, const ImageRef & depth_size, const uint8_t * video, const ImageRef & video_size, const int video_channels ){
+    if(base == NULL)
+        return;
+    BusHeader * header = reinterpret_cast<BusHeader *>(base);
+    const size_t depth_bytes = depth_size.x * depth_size.y * sizeof(uint16_t);
+    const size_t video_bytes = video_size.x * video_size.y * video_channels;
+    if(depth_bytes > header->depth_capacity || video_bytes > header->video_capacity)
+        return;
+
+    const uint32_t index = uint32_t(count % header->slots);
+    uint8_t * data = base + header_bytes + index * header->slot_stride;
+    SlotHeader * slot = reinterpret_cast<SlotHeader *>(data);
+
+    const uint32_t sequence = slot->sequence.load(memory_order_relaxed);
+    slot->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    ++count;
+    slot->number = count;
+    slot->time = frame_bus_time();
+    slot->depth_width = depth_size.x;
+    slot->depth_height = depth_size.y;
+    slot->video_width = video_size.x;
+    slot->video_height = video_size.y;
+    slot->video_channels = video_channels;
+    if(depth_bytes)
+        memcpy(data + slot_header_bytes, depth, depth_bytes);
+    if(video_bytes)
+        memcpy(data + slot_header_bytes + header->depth_capacity, video, video_bytes);
+
+    slot->sequence.store(sequence + 2, memory_order_release);
+    header->latest.store(index, memory_order_release);
+    header->published.store(count, memory_order_release);
+}
+
+FrameBusReader::FrameBusReader( const string & name ) : base(NULL), size(0), handle(NULL), retry_count(0) {
+#ifdef _WIN32
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, segment_name(name).c_str());
+    if(mapping == NULL)
+        return;
+    void * memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info;
+    if(memory == NULL || VirtualQuery(memory, &info, sizeof(info)) == 0){
+        if(memory != NULL)
+            UnmapViewOfFile(memory);
+        CloseHandle(mapping);
+        return;
+    }
+    const size_t bytes = info.RegionSize;
+    handle = mapping;
+#else
+    const int fd = shm_open(segment_name(name).c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        return;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || size_t(info.st_size) < header_bytes){
+        close(fd);
+        return;
+    }
+    const size_t bytes = info.st_size;
+    void * memory = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED)
+        return;
+#endif
+    base = static_cast<const uint8_t *>(memory);
+    size = bytes;
+
+    const BusHeader * header = reinterpret_cast<const BusHeader *>(base);
+    if(header->magic.load(memory_order_acquire) != bus_magic || header_bytes + header->slots * header->slot_stride > size)
+        detach();
+}
+
+FrameBusReader::~FrameBusReader(){
+    detach();
+}
+
+void FrameBusReader::detach(){
+    if(base == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(handle);
+#else
+    munmap(const_cast<uint8_t *>(base), size);
+#endif
+    base = NULL;
+    handle = NULL;
+}
+
+bool FrameBusReader::latest( FrameBusView & view ) const {
+    if(base == NULL)
+        return false;
+    const BusHeader * header = reinterpret_cast<const BusHeader *>(base);
+    if(header->published.load(memory_order_acquire) == 0)
+        return false;
+
+    const uint32_t index = header->latest.load(memory_order_acquire);
+    const uint8_t * data = base + header_bytes + index * header->slot_stride;
+    const SlotHeader * slot = reinterpret_cast<const SlotHeader *>(data);
+    view.sequence = slot->sequence.load(memory_order_acquire);
+    if(view.sequence & 1)
+        return false;
+
+    view.slot = index;
+    view.info.number = slot->number;
+    view.info.time = slot->time;
+    view.info.depth_size = ImageRef(slot->depth_width, slot->depth_height);
+    view.info.video_size = ImageRef(slot->video_width, slot->video_height);
+    view.info.video_channels = slot->video_channels;
+    view.depth = reinterpret_cast<const uint16_t *>(data + slot_header_bytes);
+    view.video = data + slot_header_bytes + header->depth_capacity;
+    return true;
+}
+
+bool FrameBusReader::valid( const FrameBusView & view ) const {
+    const BusHeader * header = reinterpret_cast<const BusHeader *>(base);
+    const SlotHeader * slot = reinterpret_cast<const SlotHeader *>(base + header_bytes + view.slot * header->slot_stride);
+    // orders the data accesses of the caller before the second sample of the sequence
+    atomic_thread_fence(memory_order_acquire);
+    return slot->sequence.load(memory_order_relaxed) == view.sequence;
+}
+
+bool FrameBusReader::read( FrameBusInfo & info, vector<uint16_t> & depth, vector<uint8_t> & video, const uint64_t after ){
+    FrameBusView view;
+    // the writer only overwrites the latest slot after lapping the ring, a few retries always suffice
+    for(int attempt = 0; attempt < 4; ++attempt){
+        if(!latest(view))
+            continue;
+        if(view.info.number <= after)
+            return false;
+        const size_t depth_count = view.info.depth_size.x * view.info.depth_size.y;
+        const size_t video_bytes = view.info.video_size.x * view.info.video_size.y * view.info.video_channels;
+        const BusHeader * header = reinterpret_cast<const BusHeader *>(base);
+        if(depth_count * sizeof(uint16_t) > header->depth_capacity || video_bytes > header->video_capacity){
+            // header fields torn by a concurrent write
+            ++retry_count;
+            continue;
+        }
+        depth.resize(depth_count);
+        video.resize(video_bytes);
+        if(depth_count)
+            memcpy(depth.data(), view.depth, depth_count * sizeof(uint16_t));
+        if(video_bytes)
+            memcpy(video.data(), view.video, video_bytes);
+        if(valid(view)){
+            info = view.info;
+            return true;
+        }
+        ++retry_count;
+    }
+    return false;
+}
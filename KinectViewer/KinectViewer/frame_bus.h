@@ -0,0 +1,108 @@
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "image_ref.h"
+
+// Shares captured frames with other processes on the same machine through a named shared
+// memory segment, POSIX shm_open/mmap or a Win32 file mapping. The writer owns a ring of slots
+// and publishes every frame into the next slot. Readers map the segment read-only and access
+// the latest slot in place, nothing is copied through the kernel.
+//
+// Every slot is guarded by a sequence lock. The writer makes the sequence odd before and even
+// after writing a slot; a reader samples the sequence before and after accessing the data and
+// discards the frame if the sequence changed or was odd. Readers never block the writer, and
+// with several slots in the ring a reader only loses a frame if it holds on to a slot while the
+// writer laps the whole ring.
+
+/// name of the segment published by KinectViewer
+extern const char * const default_frame_bus;
+
+/// name of the segment published for the device with the given index, the default for device 0
+std::string frame_bus_name( const int device );
+
+/// Description of a frame on the bus
+struct FrameBusInfo {
+    uint64_t number;        ///< frame counter of the writer, starts at 1
+    uint64_t time;          ///< publishing time in nanoseconds of frame_bus_time
+    ImageRef depth_size;    ///< 16 bit depth pixels
+    ImageRef video_size;
+    int video_channels;     ///< 3 for RGB, 1 for infrared
+};
+
+/// A frame accessed in place in the shared memory, see FrameBusReader::latest
+struct FrameBusView {
+    FrameBusInfo info;
+    const uint16_t * depth;
+    const uint8_t * video;
+    uint32_t slot;
+    uint32_t sequence;
+};
+
+/// monotonic clock in nanoseconds that is comparable between processes, for latency measurements
+uint64_t frame_bus_time();
+
+class FrameBusWriter {
+public:
+    /// creates the segment with room for the given maximal image sizes
+    FrameBusWriter( const std::string & name = default_frame_bus, const ImageRef & max_depth = ImageRef(640, 480), const ImageRef & max_video = ImageRef(1280, 1024), const int slots = 4 );
+    /// unmaps and removes the segment, attached readers keep their mapping
+    ~FrameBusWriter();
+
+    bool is_open() const { return base != NULL; }
+
+    /// copies a frame into the next slot of the ring, images larger than the bus are skipped
+    void publish( const uint16_t * depth, const ImageRef & depth_size, const uint8_t * video, const ImageRef & video_size, const int video_channels );
+
+    uint64_t published() const { return count; }
+
+private:
+    FrameBusWriter( const FrameBusWriter & );
+    FrameBusWriter & operator=( const FrameBusWriter & );
+
+    std::string name;
+    uint8_t * base;
+    size_t size;
+    void * handle;
+    uint64_t count;
+};
+
+class FrameBusReader {
+public:
+    /// attaches to an existing segment, check is_open as the writer may not be running
+    FrameBusReader( const std::string & name = default_frame_bus );
+    ~FrameBusReader();
+
+    bool is_open() const { return base != NULL; }
+
+    /// Zero copy access to the latest frame. The pointers in view point into shared memory and
+    /// may be overwritten at any time; call valid after using the data and discard all results
+    /// if it returns false.
+    /// @returns false if no frame was published yet or the writer was busy with the latest slot
+    bool latest( FrameBusView & view ) const;
+    /// @returns true if the slot of view was not modified since latest returned it
+    bool valid( const FrameBusView & view ) const;
+
+    /// Copies the latest frame if it is newer than frame number after, retrying if the writer
+    /// overwrote the slot during the copy.
+    /// @returns true if a new consistent frame was copied
+    bool read( FrameBusInfo & info, std::vector<uint16_t> & depth, std::vector<uint8_t> & video, const uint64_t after = 0 );
+
+    /// number of reads discarded by the sequence check
+    uint64_t retries() const { return retry_count; }
+
+private:
+    FrameBusReader( const FrameBusReader & );
+    FrameBusReader & operator=( const FrameBusReader & );
+    void detach();
+
+    const uint8_t * base;
+    size_t size;
+    void * handle;
+    uint64_t retry_count;
+};
+
+#endif // FRAME_BUS_H
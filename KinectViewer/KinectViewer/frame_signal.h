@@ -0,0 +1,92 @@
+#ifndef FRAME_SIGNAL_H
+#define FRAME_SIGNAL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#endif
+
+/// Signals the render loop that a new frame is available.
+/// On Windows this wraps an auto-reset event, so that GLWindow::wait_events can wait
+/// for frames and window messages with a single MsgWaitForMultipleObjects call.
+/// On Linux an eventfd is used, which the X11 backend polls together with the
+/// X connection. Other platforms fall back to a condition variable.
+class FrameSignal {
+public:
+#ifdef _WIN32
+    FrameSignal() { event = CreateEvent(NULL, FALSE, FALSE, NULL); }
+    ~FrameSignal() { CloseHandle(event); }
+
+    /// Wake up a waiting thread, called from the capture or processing thread
+    void notify() { SetEvent(event); }
+    /// Wait until notified or until timeout milliseconds elapsed, a negative timeout waits forever.
+    /// @returns true if the signal was notified
+    bool wait(int timeout) { return WaitForSingleObject(event, timeout < 0 ? INFINITE : timeout) == WAIT_OBJECT_0; }
+
+    /// the underlying event handle for use in wait functions
+    HANDLE handle() const { return event; }
+
+private:
+    HANDLE event;
+#elif defined(__linux__)
+    FrameSignal() { fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+    ~FrameSignal() { close(fd); }
+
+    void notify() {
+        const uint64_t one = 1;
+        if(write(fd, &one, sizeof(one)) < 0) {} // only fails if the counter is saturated, which is still signalled
+    }
+    bool wait(int timeout) {
+        pollfd p = { fd, POLLIN, 0 };
+        return poll(&p, 1, timeout) > 0 && consume();
+    }
+
+    /// file descriptor that becomes readable when notified, for use in poll
+    int descriptor() const { return fd; }
+    /// reset the signal after poll reported the descriptor readable
+    /// @returns true if the signal was notified
+    bool consume() {
+        uint64_t count;
+        return read(fd, &count, sizeof(count)) == sizeof(count);
+    }
+
+private:
+    int fd;
+#else
+    FrameSignal() : signalled(false) {}
+
+    void notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        signalled = true;
+        condition.notify_all();
+    }
+    bool wait(int timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(timeout < 0)
+            condition.wait(lock, [this]{ return signalled; });
+        else
+            condition.wait_for(lock, std::chrono::milliseconds(timeout), [this]{ return signalled; });
+        const bool result = signalled;
+        signalled = false;
+        return result;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool signalled;
+#endif
+
+    FrameSignal(const FrameSignal &);
+    FrameSignal & operator=(const FrameSignal &);
+};
+
+#endif // FRAME_SIGNAL_H
@@ -0,0 +1,592 @@
+#include "freenect_sim.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>	// timeval, through winsock.h
+#else
+#include <sys/time.h>
+#endif
+
+#include "depth_codec.h"
+#include "demosaic.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int WIDTH = 640, HEIGHT = 480, IR_HEIGHT = 488;
+// video of the high resolution, for all its formats
+static const int HIGH_WIDTH = 1280, HIGH_HEIGHT = 1024;
+// number of synthetic frames before the content repeats
+static const int CYCLE = 16;
+
+struct Stream {
+    Stream() : active(false), callback(NULL), buffer(NULL), next(0), period(0), jitter(0), late_sum(0), callback_sum(0) {
+        memset(&mode, 0, sizeof(mode));
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    bool active;
+    freenect_frame_mode mode;
+    freenect_video_cb callback;
+    void * buffer;                  // set by the application, NULL for the internal one
+    vector<uint8_t> internal;
+    Clock::time_point started;
+    uint64_t next;                  // number of the next frame to become due
+    double period, jitter;          // in seconds, fixed when the stream starts
+    double late_sum, callback_sum;
+    freenect_sim_stats stats;
+};
+
+struct _freenect_device {
+    freenect_context * context;
+    int index;
+    void * user;
+    Stream depth, video;
+    freenect_raw_tilt_state tilt;
+};
+
+struct _freenect_context {
+    int devices;
+    double rate, jitter;            // frames per second and seconds
+    uint64_t seed;
+    Clock::time_point epoch;        // time 0 of the timestamps
+    vector<vector<uint16_t> > recorded_depth;
+    vector<vector<uint8_t> > recorded_bayer;
+
+    recursive_mutex mutex;
+    condition_variable_any changed; // a stream started
+    vector<freenect_device *> open;
+    // the frames of every stream kind, resolution and format, shared by all devices and filled when first delivered
+    map<int, vector<vector<uint8_t> > > frames;
+};
+
+// frame modes of the real device, at 30 frames per second for the medium and 10 for the high resolution
+static freenect_frame_mode make_mode( const freenect_resolution resolution, const int format, const int bytes, const int width, const int height, const int data_bits, const int padding_bits ){
+    freenect_frame_mode mode;
+    memset(&mode, 0, sizeof(mode));
+    mode.reserved = (resolution << 8) | format;
+    mode.resolution = resolution;
+    mode.dummy = format;
+    mode.bytes = bytes;
+    mode.width = int16_t(width);
+    mode.height = int16_t(height);
+    mode.data_bits_per_pixel = int8_t(data_bits);
+    mode.padding_bits_per_pixel = int8_t(padding_bits);
+    mode.framerate = resolution == FREENECT_RESOLUTION_HIGH ? 10 : 30;
+    mode.is_valid = 1;
+    return mode;
+}
+
+static freenect_frame_mode invalid_mode(){
+    freenect_frame_mode mode;
+    memset(&mode, 0, sizeof(mode));
+    return mode;
+}
+
+// MSB first without padding, as the camera sends them
+static void pack( const uint16_t * values, const size_t count, const int bits, uint8_t * out ){
+    memset(out, 0, (count * bits + 7) / 8);
+    size_t bit = 0;
+    for(size_t i = 0; i < count; ++i)
+        for(int b = bits - 1; b >= 0; --b, ++bit)
+            if(values[i] & (1 << b))
+                out[bit / 8] |= uint8_t(0x80 >> (bit % 8));
+}
+
+// disparity of a wall with the floor in front of it and a ball swinging from left to right,
+// with the band of invalid pixels at the left border and the shadow left of the ball
+static void synthetic_disparity( const int frame, uint16_t * disparity ){
+    const float pi = 3.14159265f;
+    const int ball_x = int(320 + 180 * sin(2 * pi * frame / CYCLE)), ball_y = 220, radius = 70;
+    for(int y = 0; y < HEIGHT; ++y){
+        for(int x = 0; x < WIDTH; ++x){
+            int d = y > 300 ? 950 - (y - 300) : 950;
+            const int dx = x - ball_x, dy = y - ball_y;
+            if(dx * dx + dy * dy < radius * radius)
+                d = 780 - int(sqrt(float(radius * radius - dx * dx - dy * dy)) * 0.5f);
+            else if(dx < 0 && dx >= -radius - 12 && dy * dy < radius * radius && dx * dx + dy * dy < (radius + 12) * (radius + 12))
+                d = 2047;
+            if(x < 8)
+                d = 2047;
+            disparity[y * WIDTH + x] = uint16_t(d);
+        }
+    }
+}
+
+// a color gradient with a white bar moving to the right
+static void synthetic_rgb( const int frame, const int x, const int y, const int width, const int height, uint8_t * rgb ){
+    const int bar = (frame * width / CYCLE) % width;
+    if(x >= bar && x < bar + width / 26){
+        rgb[0] = rgb[1] = rgb[2] = 255;
+        return;
+    }
+    const int square = width / 16;
+    rgb[0] = uint8_t(x * 255 / width);
+    rgb[1] = uint8_t(y * 255 / height);
+    rgb[2] = uint8_t(128 + 64 * ((x / square + y / square + frame) & 1));
+}
+
+// speckles of the projected pattern, 10 bits
+static uint16_t synthetic_infrared( const int frame, const int x, const int y ){
+    uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(frame) * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return uint16_t((h & 0x3ff) > 900 ? 1023 : 100 + (h & 0xff));
+}
+
+// the recorded frames have the medium resolution, the high one is always synthetic
+static bool recorded_video( const freenect_context * ctx, const freenect_frame_mode & mode ){
+    return !ctx->recorded_bayer.empty() && mode.width == WIDTH && mode.height == HEIGHT;
+}
+
+static int frame_count( const freenect_context * ctx, const bool depth, const freenect_frame_mode & mode ){
+    if(depth)
+        return ctx->recorded_depth.empty() ? CYCLE : int(ctx->recorded_depth.size());
+    const int format = mode.dummy;
+    if((format == FREENECT_VIDEO_RGB || format == FREENECT_VIDEO_BAYER) && recorded_video(ctx, mode))
+        return ctx->recorded_bayer.empty() ? CYCLE : int(ctx->recorded_bayer.size());
+    return CYCLE;
+}
+
+static void make_depth_frame( const freenect_context * ctx, const int format, const int frame, vector<uint8_t> & out ){
+    vector<uint16_t> disparity(WIDTH * HEIGHT);
+    if(ctx->recorded_depth.empty())
+        synthetic_disparity(frame, disparity.data());
+    else
+        disparity = ctx->recorded_depth[frame];
+    switch(format){
+    case FREENECT_DEPTH_11BIT:
+        memcpy(out.data(), disparity.data(), out.size());
+        break;
+    case FREENECT_DEPTH_10BIT:
+        for(unsigned i = 0; i < disparity.size(); ++i)
+            disparity[i] >>= 1;
+        memcpy(out.data(), disparity.data(), out.size());
+        break;
+    case FREENECT_DEPTH_11BIT_PACKED:
+        pack(disparity.data(), disparity.size(), 11, out.data());
+        break;
+    case FREENECT_DEPTH_10BIT_PACKED:
+        for(unsigned i = 0; i < disparity.size(); ++i)
+            disparity[i] >>= 1;
+        pack(disparity.data(), disparity.size(), 10, out.data());
+        break;
+    }
+}
+
+static void make_video_frame( const freenect_context * ctx, const freenect_frame_mode & mode, const int frame, vector<uint8_t> & out ){
+    const int format = mode.dummy, width = mode.width, height = mode.height;
+    if(format == FREENECT_VIDEO_RGB || format == FREENECT_VIDEO_BAYER){
+        if(recorded_video(ctx, mode)){
+            const vector<uint8_t> & bayer = ctx->recorded_bayer[frame];
+            if(format == FREENECT_VIDEO_BAYER)
+                copy(bayer.begin(), bayer.end(), out.begin());
+            else
+                demosaic(bayer.data(), ImageRef(WIDTH, HEIGHT), out.data());
+            return;
+        }
+        for(int y = 0; y < height; ++y){
+            for(int x = 0; x < width; ++x){
+                uint8_t rgb[3];
+                synthetic_rgb(frame, x, y, width, height, rgb);
+                if(format == FREENECT_VIDEO_RGB){
+                    memcpy(out.data() + 3 * (y * width + x), rgb, 3);
+                } else {
+                    // GRBG
+                    const int color = (y & 1) == 0 ? ((x & 1) == 0 ? 1 : 0) : ((x & 1) == 0 ? 2 : 1);
+                    out[y * width + x] = rgb[color];
+                }
+            }
+        }
+        return;
+    }
+
+    vector<uint16_t> infrared(width * height);
+    for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+            infrared[y * width + x] = synthetic_infrared(frame, x, y);
+    switch(format){
+    case FREENECT_VIDEO_IR_8BIT:
+        for(unsigned i = 0; i < infrared.size(); ++i)
+            out[i] = uint8_t(infrared[i] >> 2);
+        break;
+    case FREENECT_VIDEO_IR_10BIT:
+        memcpy(out.data(), infrared.data(), out.size());
+        break;
+    case FREENECT_VIDEO_IR_10BIT_PACKED:
+        pack(infrared.data(), infrared.size(), 10, out.data());
+        break;
+    }
+}
+
+// the content of a frame of a device, made once and then copied for every delivery
+static const vector<uint8_t> & get_frame( freenect_context * ctx, const freenect_device * dev, const bool depth, const freenect_frame_mode & mode, const uint64_t number ){
+    const int count = frame_count(ctx, depth, mode);
+    vector<vector<uint8_t> > & frames = ctx->frames[(depth ? 1 << 16 : 0) + mode.reserved];
+    frames.resize(count);
+    // the devices show the same scene at different phases
+    const int frame = int((number + 3 * dev->index) % count);
+    vector<uint8_t> & out = frames[frame];
+    if(out.empty()){
+        out.resize(mode.bytes);
+        if(depth)
+            make_depth_frame(ctx, mode.dummy, frame, out);
+        else
+            make_video_frame(ctx, mode, frame, out);
+    }
+    return out;
+}
+
+// uniformly distributed in [-1, 1], the same for the same frame of the same stream in every run
+static double jitter_factor( const uint64_t seed, const int device, const bool depth, const uint64_t number ){
+    uint64_t z = seed ^ (uint64_t(device) << 40) ^ (uint64_t(depth) << 32) ^ number;
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (z >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static Clock::time_point due_time( const freenect_device * dev, const Stream & stream, const bool depth, const uint64_t number ){
+    const double seconds = number * stream.period + stream.jitter * jitter_factor(dev->context->seed, dev->index, depth, number);
+    return stream.started + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+}
+
+static void deliver( freenect_device * dev, Stream & stream, const bool depth, const Clock::time_point now ){
+    // all frames that became due since the last delivery but the newest are lost
+    uint64_t number = stream.next;
+    while(due_time(dev, stream, depth, number + 1) <= now)
+        ++number;
+    stream.stats.due += number - stream.next + 1;
+    stream.stats.dropped += number - stream.next;
+    stream.next = number + 1;
+
+    const Clock::time_point due = due_time(dev, stream, depth, number);
+    const vector<uint8_t> & frame = get_frame(dev->context, dev, depth, stream.mode, number);
+    void * target = stream.buffer ? stream.buffer : stream.internal.data();
+    memcpy(target, frame.data(), frame.size());
+    if(!stream.callback)
+        return;
+
+    const uint32_t timestamp = uint32_t(chrono::duration_cast<chrono::microseconds>(due - dev->context->epoch).count());
+    const double late = chrono::duration<double, milli>(now - due).count();
+    stream.callback(dev, target, timestamp);
+    const double busy = chrono::duration<double, milli>(Clock::now() - now).count();
+
+    ++stream.stats.delivered;
+    stream.late_sum += late;
+    stream.callback_sum += busy;
+    stream.stats.late_mean = stream.late_sum / stream.stats.delivered;
+    stream.stats.late_max = max(stream.stats.late_max, late);
+    stream.stats.callback_mean = stream.callback_sum / stream.stats.delivered;
+    stream.stats.callback_max = max(stream.stats.callback_max, busy);
+}
+
+static void start_stream( freenect_device * dev, Stream & stream ){
+    freenect_context * ctx = dev->context;
+    stream.active = true;
+    stream.started = Clock::now();
+    stream.next = 0;
+    stream.period = 1.0 / ctx->rate;
+    // frames stay in order
+    stream.jitter = min(ctx->jitter, stream.period * 0.5);
+    stream.internal.resize(stream.mode.bytes);
+    stream.late_sum = stream.callback_sum = 0;
+    memset(&stream.stats, 0, sizeof(stream.stats));
+    ctx->changed.notify_all();
+}
+
+static double environment( const char * name, const double fallback ){
+    const char * value = getenv(name);
+    return value ? atof(value) : fallback;
+}
+
+extern "C" {
+
+int freenect_init( freenect_context ** ctx, freenect_usb_context * /*usb_ctx*/ ){
+    freenect_context * context = new freenect_context;
+    context->devices = int(environment("FREENECT_SIM_DEVICES", 1));
+    context->rate = environment("FREENECT_SIM_RATE", 30);
+    if(context->rate <= 0)
+        context->rate = 30;
+    context->jitter = max(0.0, environment("FREENECT_SIM_JITTER", 0) * 0.001);
+    context->seed = uint64_t(environment("FREENECT_SIM_SEED", 1));
+    context->epoch = Clock::now();
+
+    const char * path = getenv("FREENECT_SIM_PATH");
+    if(path){
+        for(int i = 0; ; ++i){
+            char name[32];
+            sprintf(name, "/depth_%04d.rvl", i);
+            vector<uint16_t> depth;
+            ImageRef size;
+            if(!load_depth(depth, size, path + string(name)) || size != ImageRef(WIDTH, HEIGHT))
+                break;
+            context->recorded_depth.push_back(depth);
+        }
+        for(int i = 0; ; ++i){
+            char name[32];
+            sprintf(name, "/bayer_%04d.bayer", i);
+            vector<uint8_t> bayer;
+            ImageRef size;
+            if(!load_bayer(bayer, size, path + string(name)) || size != ImageRef(WIDTH, HEIGHT))
+                break;
+            context->recorded_bayer.push_back(bayer);
+        }
+    }
+    *ctx = context;
+    return 0;
+}
+
+int freenect_shutdown( freenect_context * ctx ){
+    while(!ctx->open.empty())
+        freenect_close_device(ctx->open.back());
+    delete ctx;
+    return 0;
+}
+
+void freenect_sim_configure( freenect_context * ctx, double rate, double jitter_ms ){
+    lock_guard<recursive_mutex> lock(ctx->mutex);
+    ctx->rate = rate > 0 ? rate : 30;
+    ctx->jitter = max(0.0, jitter_ms * 0.001);
+}
+
+int freenect_process_events_timeout( freenect_context * ctx, struct timeval * timeout ){
+    const Clock::time_point deadline = Clock::now() + (timeout
+        ? chrono::duration_cast<Clock::duration>(chrono::seconds(timeout->tv_sec) + chrono::microseconds(timeout->tv_usec))
+        : chrono::duration_cast<Clock::duration>(chrono::milliseconds(100)));
+
+    unique_lock<recursive_mutex> lock(ctx->mutex);
+    // wait for the first due frame of any stream, or until the timeout
+    while(true){
+        Clock::time_point earliest = deadline;
+        for(unsigned i = 0; i < ctx->open.size(); ++i){
+            freenect_device * dev = ctx->open[i];
+            if(dev->depth.active)
+                earliest = min(earliest, due_time(dev, dev->depth, true, dev->depth.next));
+            if(dev->video.active)
+                earliest = min(earliest, due_time(dev, dev->video, false, dev->video.next));
+        }
+        const Clock::time_point now = Clock::now();
+        if(earliest <= now)
+            break;
+        if(now >= deadline)
+            return 0;
+        ctx->changed.wait_until(lock, earliest);
+    }
+
+    // the callbacks may stop streams, so every stream is checked right before its delivery
+    const Clock::time_point now = Clock::now();
+    for(unsigned i = 0; i < ctx->open.size(); ++i){
+        freenect_device * dev = ctx->open[i];
+        if(dev->depth.active && due_time(dev, dev->depth, true, dev->depth.next) <= now)
+            deliver(dev, dev->depth, true, now);
+        if(i < ctx->open.size() && dev->video.active && due_time(dev, dev->video, false, dev->video.next) <= now)
+            deliver(dev, dev->video, false, now);
+    }
+    return 0;
+}
+
+int freenect_process_events( freenect_context * ctx ){
+    return freenect_process_events_timeout(ctx, NULL);
+}
+
+int freenect_num_devices( freenect_context * ctx ){
+    return ctx->devices;
+}
+
+void freenect_select_subdevices( freenect_context * /*ctx*/, freenect_device_flags /*subdevs*/ ){
+}
+
+int freenect_open_device( freenect_context * ctx, freenect_device ** dev, int index ){
+    lock_guard<recursive_mutex> lock(ctx->mutex);
+    if(index < 0 || index >= ctx->devices)
+        return -1;
+    for(unsigned i = 0; i < ctx->open.size(); ++i)
+        if(ctx->open[i]->index == index)
+            return -1;
+    freenect_device * device = new freenect_device;
+    device->context = ctx;
+    device->index = index;
+    device->user = NULL;
+    // the defaults of libfreenect
+    device->video.mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB);
+    device->depth.mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
+    memset(&device->tilt, 0, sizeof(device->tilt));
+    device->tilt.accelerometer_y = 819;     // 1 g
+    ctx->open.push_back(device);
+    *dev = device;
+    return 0;
+}
+
+int freenect_close_device( freenect_device * dev ){
+    freenect_context * ctx = dev->context;
+    lock_guard<recursive_mutex> lock(ctx->mutex);
+    ctx->open.erase(remove(ctx->open.begin(), ctx->open.end(), dev), ctx->open.end());
+    delete dev;
+    return 0;
+}
+
+void freenect_set_user( freenect_device * dev, void * user ){
+    dev->user = user;
+}
+
+void * freenect_get_user( freenect_device * dev ){
+    return dev->user;
+}
+
+void freenect_set_depth_callback( freenect_device * dev, freenect_depth_cb cb ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->depth.callback = cb;
+}
+
+void freenect_set_video_callback( freenect_device * dev, freenect_video_cb cb ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->video.callback = cb;
+}
+
+int freenect_start_depth( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    start_stream(dev, dev->depth);
+    return 0;
+}
+
+int freenect_start_video( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    start_stream(dev, dev->video);
+    return 0;
+}
+
+int freenect_stop_depth( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->depth.active = false;
+    return 0;
+}
+
+int freenect_stop_video( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->video.active = false;
+    return 0;
+}
+
+int freenect_set_depth_buffer( freenect_device * dev, void * buf ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->depth.buffer = buf;
+    return 0;
+}
+
+int freenect_set_video_buffer( freenect_device * dev, void * buf ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    dev->video.buffer = buf;
+    return 0;
+}
+
+int freenect_update_tilt_state( freenect_device * /*dev*/ ){
+    return 0;
+}
+
+freenect_raw_tilt_state * freenect_get_tilt_state( freenect_device * dev ){
+    return &dev->tilt;
+}
+
+double freenect_get_tilt_degs( freenect_raw_tilt_state * state ){
+    return state->tilt_angle / 2.0;
+}
+
+int freenect_set_tilt_degs( freenect_device * dev, double angle ){
+    dev->tilt.tilt_angle = int8_t(max(-31.0, min(31.0, angle)) * 2);
+    return 0;
+}
+
+int freenect_set_led( freenect_device * /*dev*/, freenect_led_options /*option*/ ){
+    return 0;
+}
+
+void freenect_get_mks_accel( freenect_raw_tilt_state * state, double * x, double * y, double * z ){
+    *x = state->accelerometer_x / 819.0 * 9.80665;
+    *y = state->accelerometer_y / 819.0 * 9.80665;
+    *z = state->accelerometer_z / 819.0 * 9.80665;
+}
+
+freenect_frame_mode freenect_find_video_mode( freenect_resolution res, freenect_video_format fmt ){
+    if(res == FREENECT_RESOLUTION_HIGH){
+        const int w = HIGH_WIDTH, h = HIGH_HEIGHT;
+        switch(fmt){
+        case FREENECT_VIDEO_RGB:                return make_mode(res, fmt, w * h * 3, w, h, 24, 0);
+        case FREENECT_VIDEO_BAYER:              return make_mode(res, fmt, w * h, w, h, 8, 0);
+        case FREENECT_VIDEO_IR_8BIT:            return make_mode(res, fmt, w * h, w, h, 8, 0);
+        case FREENECT_VIDEO_IR_10BIT:           return make_mode(res, fmt, w * h * 2, w, h, 10, 6);
+        case FREENECT_VIDEO_IR_10BIT_PACKED:    return make_mode(res, fmt, w * h * 10 / 8, w, h, 10, 0);
+        default:                                return invalid_mode();
+        }
+    }
+    if(res != FREENECT_RESOLUTION_MEDIUM)
+        return invalid_mode();
+    switch(fmt){
+    case FREENECT_VIDEO_RGB:                return make_mode(res, fmt, WIDTH * HEIGHT * 3, WIDTH, HEIGHT, 24, 0);
+    case FREENECT_VIDEO_BAYER:              return make_mode(res, fmt, WIDTH * HEIGHT, WIDTH, HEIGHT, 8, 0);
+    case FREENECT_VIDEO_IR_8BIT:            return make_mode(res, fmt, WIDTH * IR_HEIGHT, WIDTH, IR_HEIGHT, 8, 0);
+    case FREENECT_VIDEO_IR_10BIT:           return make_mode(res, fmt, WIDTH * IR_HEIGHT * 2, WIDTH, IR_HEIGHT, 10, 6);
+    case FREENECT_VIDEO_IR_10BIT_PACKED:    return make_mode(res, fmt, WIDTH * IR_HEIGHT * 10 / 8, WIDTH, IR_HEIGHT, 10, 0);
+    default:                                return invalid_mode();
+    }
+}
+
+freenect_frame_mode freenect_find_depth_mode( freenect_resolution res, freenect_depth_format fmt ){
+    if(res != FREENECT_RESOLUTION_MEDIUM)
+        return invalid_mode();
+    switch(fmt){
+    case FREENECT_DEPTH_11BIT:              return make_mode(res, fmt, WIDTH * HEIGHT * 2, WIDTH, HEIGHT, 11, 5);
+    case FREENECT_DEPTH_10BIT:              return make_mode(res, fmt, WIDTH * HEIGHT * 2, WIDTH, HEIGHT, 10, 6);
+    case FREENECT_DEPTH_11BIT_PACKED:       return make_mode(res, fmt, WIDTH * HEIGHT * 11 / 8, WIDTH, HEIGHT, 11, 0);
+    case FREENECT_DEPTH_10BIT_PACKED:       return make_mode(res, fmt, WIDTH * HEIGHT * 10 / 8, WIDTH, HEIGHT, 10, 0);
+    default:                                return invalid_mode();
+    }
+}
+
+freenect_frame_mode freenect_get_current_video_mode( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    return dev->video.mode;
+}
+
+freenect_frame_mode freenect_get_current_depth_mode( freenect_device * dev ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    return dev->depth.mode;
+}
+
+// like libfreenect, the mode can only change while the stream is stopped
+int freenect_set_video_mode( freenect_device * dev, const freenect_frame_mode mode ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    if(dev->video.active || !mode.is_valid)
+        return -1;
+    dev->video.mode = mode;
+    return 0;
+}
+
+int freenect_set_depth_mode( freenect_device * dev, const freenect_frame_mode mode ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    if(dev->depth.active || !mode.is_valid)
+        return -1;
+    dev->depth.mode = mode;
+    return 0;
+}
+
+int freenect_sim_get_stats( freenect_device * dev, int depth, freenect_sim_stats * stats ){
+    lock_guard<recursive_mutex> lock(dev->context->mutex);
+    *stats = depth ? dev->depth.stats : dev->video.stats;
+    return 0;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef FREENECT_SIM_H
+#define FREENECT_SIM_H
+
+#include <libfreenect.h>
+#include <stdint.h>
+
+// A simulated Kinect behind the C API of libfreenect. Compile freenect_sim.cpp instead of
+// linking libfreenect and define FREENECT_SIMULATED, and FreenectDevice, Freenect and the rest
+// of KinectViewer run unchanged without hardware, also on Linux. The simulation keeps the
+// contract of libfreenect: the callbacks run inside freenect_process_events on the thread
+// calling it, into the buffers set with freenect_set_depth_buffer and freenect_set_video_buffer
+// or internal ones, with the frame modes of the real device at the medium resolution and the
+// video modes at the high resolution of 1280x1024. The streams run at the configured rate in
+// every mode, also beyond the 10 frames per second of the high resolution on the real device.
+//
+// Frames become due at a fixed rate with a random jitter from a seeded generator, so the
+// schedule is the same in every run. A frame that is not delivered before the next one of its
+// stream becomes due is dropped, just as the USB transfers of a real device are lost when
+// the events are not processed in time. The content is synthetic, a moving ball in front of a
+// wall for depth and a color gradient with a moving bar for video, or the depth_XXXX.rvl and
+// bayer_XXXX.bayer snapshots of KinectViewer in a directory, played in a loop.
+//
+// freenect_init reads the configuration from the environment:
+//   FREENECT_SIM_DEVICES   number of simulated devices, 1 by default
+//   FREENECT_SIM_RATE      frames per second of every stream, 30 by default
+//   FREENECT_SIM_JITTER    largest deviation from the schedule in milliseconds, 0 by default
+//   FREENECT_SIM_SEED      seed of the jitter, 1 by default
+//   FREENECT_SIM_PATH      directory with recorded frames instead of the synthetic ones
+
+/// Statistics of a simulated stream since it was last started
+struct freenect_sim_stats {
+    uint64_t due;               ///< frames that became due
+    uint64_t delivered;         ///< frames passed to the callback
+    uint64_t dropped;           ///< frames replaced by a newer one before they were delivered
+    double late_mean, late_max;             ///< milliseconds from the due time to the delivery
+    double callback_mean, callback_max;     ///< milliseconds spent in the callback
+};
+
+extern "C" {
+/// Changes the frame rate and jitter of the streams started afterwards
+void freenect_sim_configure( freenect_context * ctx, double rate, double jitter_ms );
+/// Reads the statistics of the depth or the video stream of a device, returns 0 on success
+int freenect_sim_get_stats( freenect_device * dev, int depth, freenect_sim_stats * stats );
+}
+
+#endif // FREENECT_SIM_H
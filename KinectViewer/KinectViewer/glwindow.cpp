@@ -1,4 +1,7 @@
+#ifdef _WIN32
+
 #include "glwindow.h"
+#include "frame_signal.h"
 #include <exception>
 
 #include <windows.h>
@@ -10,16 +13,6 @@
 #include <iostream>
 using namespace std;
 
-Exceptions::GLWindow::CreationError::CreationError(std::string w)
-{
-    what="GLWindow creation error: " + w;
-}
-
-Exceptions::GLWindow::RuntimeError::RuntimeError(std::string w)
-{
-    what="GLWindow error: " + w;
-}
-
 struct GLWindow::State {
     ImageRef size;
     ImageRef position;
@@ -377,105 +370,20 @@ void GLWindow::handle_events(EventHandler& handler)
     currentHandler = NULL;
 }
 
-class SaveEvents : public GLWindow::EventHandler {
-private:
-    std::vector<GLWindow::Event>& events;
-public:
-    SaveEvents(std::vector<GLWindow::Event>& events_) : events(events_) {}
-    void on_key_down(GLWindow&, int key) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::KEY_DOWN;
-    e.which = key;
-    events.push_back(e);
-    }
-    void on_key_up(GLWindow&, int key) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::KEY_UP;
-    e.which = key;
-    events.push_back(e);
-    }
-
-    void on_mouse_move(GLWindow&, ImageRef where, int state) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::MOUSE_MOVE;
-    e.state = state;
-    e.where = where;
-    events.push_back(e);
-    }
-
-    void on_mouse_down(GLWindow&, ImageRef where, int state, int button) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::MOUSE_DOWN;
-    e.state = state;
-    e.which = button;
-    e.where = where;
-    events.push_back(e);
-    }
-
-    void on_mouse_up(GLWindow&, ImageRef where, int state, int button) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::MOUSE_UP;
-    e.state = state;
-    e.which = button;
-    e.where = where;
-    events.push_back(e);
-    }
-
-    void on_resize(GLWindow&, ImageRef size) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::RESIZE;
-    e.size = size;
-    events.push_back(e);
-    }
-
-    void on_event(GLWindow&, int event) {
-    GLWindow::Event e;
-    e.type = GLWindow::Event::EVENT;
-    e.which = event;
-    events.push_back(e);
-    }
-};
-
-void GLWindow::get_events(std::vector<Event>& events)
-{
-    SaveEvents saver(events);
-    handle_events(saver);
-}
-
-bool GLWindow::EventSummary::should_quit() const
-{
-    return key_down.count(VK_ESCAPE) || events.count(GLWindow::EVENT_CLOSE);
-}
-
-class MakeSummary : public GLWindow::EventHandler {
-private:
-    GLWindow::EventSummary& summary;
-public:
-    MakeSummary(GLWindow::EventSummary& summary_) : summary(summary_) {}
-
-    void on_key_down(GLWindow&, int key) {	++summary.key_down[key]; }
-    void on_key_up(GLWindow&, int key) { ++summary.key_up[key]; }
-    void on_mouse_move(GLWindow&, ImageRef where, int) { summary.cursor = where; summary.cursor_moved = true; }
-    void on_mouse_down(GLWindow&, ImageRef where, int state, int button) { summary.mouse_down[button] = std::make_pair(where,state); }
-    void on_mouse_up(GLWindow&, ImageRef where, int state, int button) { summary.mouse_up[button] = std::make_pair(where,state); }
-    void on_event(GLWindow&, int event) { ++summary.events[event]; }
-};
-
-void GLWindow::get_events(EventSummary& summary)
-{
-    summary.cursor = cursor_position();
-    MakeSummary ms(summary);
-    handle_events(ms);
-    summary.window_size = size();
-    summary.window_position = position();
-}
-
 bool GLWindow::has_events() const
 {
     MSG	msg;
     return PeekMessage(&msg, state->hWnd, 0, 0, PM_NOREMOVE) != 0;
 }
 
+bool GLWindow::wait_events(FrameSignal & signal, int timeout)
+{
+    HANDLE handle = signal.handle();
+    // MWMO_INPUTAVAILABLE also returns for messages that arrived before the call
+    DWORD result = MsgWaitForMultipleObjectsEx(1, &handle, timeout < 0 ? INFINITE : timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    return result == WAIT_OBJECT_0;
+}
+
 void GLWindow::activate()
 {
     if(!wglMakeCurrent(state->hDC,state->hRC))
@@ -511,3 +419,5 @@ LRESULT CALLBACK WndProc(	HWND	hWnd,			// Handle For This Window
     // Pass All Unhandled Messages To DefWindowProc
     return DefWindowProc(hWnd,uMsg,wParam,lParam);
 }
+
+#endif // _WIN32
@@ -3,9 +3,12 @@
 
 #include <string>
 #include <vector>
-#include <map>
+#include <utility>
+#include <algorithm>
 #include "image_ref.h"
 
+class FrameSignal;
+
 namespace Exceptions {
     /// %Exceptions specific to CVD::GLWindow
     /// @ingroup gException
@@ -67,19 +70,129 @@ public:
         ImageRef where, size;
     };
 
+    /// A key->frequency table with the query interface of std::map<int,int>, stored in a
+    /// fixed size array so that recording events never allocates. Keys outside of
+    /// [0, SIZE) are not recorded.
+    class KeyTable {
+    public:
+        enum { SIZE = 512 };
+        typedef std::pair<int,int> value_type;
+
+        /// Iterates over the recorded keys in ascending order
+        class const_iterator {
+        public:
+            const_iterator(const KeyTable * t, int k) : table(t), key(k) { skip(); }
+            const value_type & operator*() const { value = value_type(key, table->counts[key]); return value; }
+            const value_type * operator->() const { return &**this; }
+            const_iterator & operator++() { ++key; skip(); return *this; }
+            bool operator==(const const_iterator & other) const { return key == other.key; }
+            bool operator!=(const const_iterator & other) const { return key != other.key; }
+        private:
+            void skip() { while(key < SIZE && table->counts[key] == 0) ++key; }
+            const KeyTable * table;
+            int key;
+            mutable value_type value;
+        };
+
+        KeyTable() { clear(); }
+        /// Forget all recorded keys
+        void clear() { std::fill(counts, counts + SIZE, 0); }
+        /// @returns 1 if the key was recorded, 0 otherwise
+        int count(int key) const { return (key >= 0 && key < SIZE && counts[key] != 0) ? 1 : 0; }
+        /// Frequency of the key, keys out of range share a scratch entry
+        int & operator[](int key) { if(key >= 0 && key < SIZE) return counts[key]; scratch = 0; return scratch; }
+        const_iterator find(int key) const { return count(key) ? const_iterator(this, key) : end(); }
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, SIZE); }
+        bool empty() const { return begin() == end(); }
+
+    private:
+        int counts[SIZE];
+        int scratch;
+
+        friend class const_iterator;
+    };
+
+    /// A button->(position,state) table with the query interface of std::map, with one
+    /// fixed slot per MouseButton so that recording events never allocates.
+    class ButtonTable {
+    public:
+        enum { SIZE = 7 };
+        typedef std::pair<int,std::pair<ImageRef,int> > value_type;
+
+        /// Iterates over the recorded buttons in ascending order
+        class const_iterator {
+        public:
+            const_iterator(const ButtonTable * t, int s) : table(t), slot(s) { skip(); }
+            const value_type & operator*() const { return table->entries[slot]; }
+            const value_type * operator->() const { return &table->entries[slot]; }
+            const_iterator & operator++() { ++slot; skip(); return *this; }
+            bool operator==(const const_iterator & other) const { return slot == other.slot; }
+            bool operator!=(const const_iterator & other) const { return slot != other.slot; }
+        private:
+            void skip() { while(slot < SIZE && !table->present[slot]) ++slot; }
+            const ButtonTable * table;
+            int slot;
+        };
+
+        ButtonTable() {
+            for(int s = 0; s < SIZE; ++s)
+                entries[s].first = 1 << s;
+            clear();
+        }
+        /// Forget all recorded buttons
+        void clear() { std::fill(present, present + SIZE, false); }
+        /// @returns 1 if the button was recorded, 0 otherwise
+        int count(int button) const { const int s = slot(button); return (s >= 0 && present[s]) ? 1 : 0; }
+        /// Position and state of the button, marks it as recorded. Unknown buttons share a scratch entry.
+        std::pair<ImageRef,int> & operator[](int button) {
+            const int s = slot(button);
+            if(s < 0)
+                return scratch;
+            present[s] = true;
+            return entries[s].second;
+        }
+        const_iterator find(int button) const { return count(button) ? const_iterator(this, slot(button)) : end(); }
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, SIZE); }
+        bool empty() const { return begin() == end(); }
+
+    private:
+        /// maps a single MouseButton bit to its slot, -1 for anything else
+        static int slot(int button) {
+            for(int s = 0; s < SIZE; ++s)
+                if(button == (1 << s))
+                    return s;
+            return -1;
+        }
+        value_type entries[SIZE];
+        bool present[SIZE];
+        std::pair<ImageRef,int> scratch;
+
+        friend class const_iterator;
+    };
+
 /// A summary of multiple events
 struct EventSummary {
         EventSummary() : cursor(-1,-1), cursor_moved(false) {}
         /// key->frequency mapping for key presses and releases
-        std::map<int,int> key_down, key_up;
-        typedef std::map<int,int>::const_iterator key_iterator;
+        KeyTable key_down, key_up;
+        typedef KeyTable::const_iterator key_iterator;
         /// button->frequency mapping for mouse presses and releases
-        std::map<int,std::pair<ImageRef,int> > mouse_down, mouse_up;
-        typedef std::map<int,std::pair<ImageRef,int> >::const_iterator mouse_iterator;
+        ButtonTable mouse_down, mouse_up;
+        typedef ButtonTable::const_iterator mouse_iterator;
         /// Generic window events -> frequency
-        std::map<int,int> events;
-        /// Reset the summary
-        void clear() { *this = EventSummary(); }
+        KeyTable events;
+        /// Reset the summary, this does not allocate
+        void clear() {
+            key_down.clear();
+            key_up.clear();
+            mouse_down.clear();
+            mouse_up.clear();
+            events.clear();
+            cursor = ImageRef(-1,-1);
+            cursor_moved = false;
+        }
         /// Has escape been pressed or the close button pressed?
         bool should_quit() const;
         /// last seen cursor position from mouse_move
@@ -97,7 +210,8 @@ struct EventSummary {
     /// @param size    Window size
     /// @param bpp     Colour depth
     /// @param title   Window title
-    /// @param display X11 display string, passed to XOpenDisplay. "" Is used to indicate NULL. This is ignored for non X11 platforms. 
+    /// @param display X11 display string, passed to XOpenDisplay. "" Is used to indicate NULL. "offscreen" creates
+    ///                a headless EGL pbuffer surface without a window. This is ignored for non X11 platforms. 
     GLWindow(const ImageRef& size, int bpp=24, const std::string& title="GLWindow", const std::string& display="") {
       init(size, bpp, title, display);
     }
@@ -129,6 +243,8 @@ struct EventSummary {
     void set_title(const std::string& title);
     /// Swap the front and back buffers
     void swap_buffers();
+    /// Read back the current framebuffer as tightly packed RGB rows, top row first
+    void read_pixels(std::vector<unsigned char>& rgb) const;
     /// Handle events in the event queue by calling back to the specified handler.
     void handle_events(EventHandler& handler);
     /// Store all events in the event queue into Event objects.
@@ -137,6 +253,10 @@ struct EventSummary {
     void get_events(EventSummary& summary);
     /// @returns true if events are pending
     bool has_events() const;
+    /// Block until window events are pending, the signal was notified or timeout milliseconds elapsed.
+    /// A negative timeout waits forever.
+    /// @returns true if the signal was notified
+    bool wait_events(FrameSignal & signal, int timeout = -1);
     /// Make this GL context active
     void activate();
     /// Make this GL context active
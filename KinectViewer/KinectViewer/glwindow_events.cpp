@@ -0,0 +1,128 @@
+// Platform independent parts of GLWindow, the window system backends are
+// in glwindow.cpp (Win32/WGL) and glwindow_x11.cpp (X11/GLX and offscreen EGL).
+
+#include "glwindow.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <gl/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+// escape as reported by both backends (VK_ESCAPE and the ASCII code)
+static const int KEY_ESCAPE = 27;
+
+Exceptions::GLWindow::CreationError::CreationError(std::string w)
+{
+    what="GLWindow creation error: " + w;
+}
+
+Exceptions::GLWindow::RuntimeError::RuntimeError(std::string w)
+{
+    what="GLWindow error: " + w;
+}
+
+class SaveEvents : public GLWindow::EventHandler {
+private:
+    std::vector<GLWindow::Event>& events;
+public:
+    SaveEvents(std::vector<GLWindow::Event>& events_) : events(events_) {}
+    void on_key_down(GLWindow&, int key) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::KEY_DOWN;
+    e.which = key;
+    events.push_back(e);
+    }
+    void on_key_up(GLWindow&, int key) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::KEY_UP;
+    e.which = key;
+    events.push_back(e);
+    }
+
+    void on_mouse_move(GLWindow&, ImageRef where, int state) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::MOUSE_MOVE;
+    e.state = state;
+    e.where = where;
+    events.push_back(e);
+    }
+
+    void on_mouse_down(GLWindow&, ImageRef where, int state, int button) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::MOUSE_DOWN;
+    e.state = state;
+    e.which = button;
+    e.where = where;
+    events.push_back(e);
+    }
+
+    void on_mouse_up(GLWindow&, ImageRef where, int state, int button) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::MOUSE_UP;
+    e.state = state;
+    e.which = button;
+    e.where = where;
+    events.push_back(e);
+    }
+
+    void on_resize(GLWindow&, ImageRef size) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::RESIZE;
+    e.size = size;
+    events.push_back(e);
+    }
+
+    void on_event(GLWindow&, int event) {
+    GLWindow::Event e;
+    e.type = GLWindow::Event::EVENT;
+    e.which = event;
+    events.push_back(e);
+    }
+};
+
+void GLWindow::get_events(std::vector<Event>& events)
+{
+    SaveEvents saver(events);
+    handle_events(saver);
+}
+
+bool GLWindow::EventSummary::should_quit() const
+{
+    return key_down.count(KEY_ESCAPE) || events.count(GLWindow::EVENT_CLOSE);
+}
+
+class MakeSummary : public GLWindow::EventHandler {
+private:
+    GLWindow::EventSummary& summary;
+public:
+    MakeSummary(GLWindow::EventSummary& summary_) : summary(summary_) {}
+
+    void on_key_down(GLWindow&, int key) {	++summary.key_down[key]; }
+    void on_key_up(GLWindow&, int key) { ++summary.key_up[key]; }
+    void on_mouse_move(GLWindow&, ImageRef where, int) { summary.cursor = where; summary.cursor_moved = true; }
+    void on_mouse_down(GLWindow&, ImageRef where, int state, int button) { summary.mouse_down[button] = std::make_pair(where,state); }
+    void on_mouse_up(GLWindow&, ImageRef where, int state, int button) { summary.mouse_up[button] = std::make_pair(where,state); }
+    void on_event(GLWindow&, int event) { ++summary.events[event]; }
+};
+
+void GLWindow::get_events(EventSummary& summary)
+{
+    summary.cursor = cursor_position();
+    MakeSummary ms(summary);
+    handle_events(ms);
+    summary.window_size = size();
+    summary.window_position = position();
+}
+
+void GLWindow::read_pixels(std::vector<unsigned char>& rgb) const
+{
+    const ImageRef s = size();
+    std::vector<unsigned char> flipped(s.x * s.y * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, s.x, s.y, GL_RGB, GL_UNSIGNED_BYTE, flipped.data());
+    rgb.resize(flipped.size());
+    for(int y = 0; y < s.y; ++y)
+        std::copy(flipped.begin() + (s.y - 1 - y) * s.x * 3, flipped.begin() + (s.y - y) * s.x * 3, rgb.begin() + y * s.x * 3);
+}
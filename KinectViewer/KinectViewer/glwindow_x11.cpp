@@ -0,0 +1,413 @@
+#ifndef _WIN32
+
+#include "glwindow.h"
+#include "frame_signal.h"
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <GL/glx.h>
+#include <GL/gl.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <poll.h>
+
+#include <iostream>
+using namespace std;
+
+struct GLWindow::State {
+    ImageRef size;
+    ImageRef position;
+    ImageRef cursor;
+    std::string title;
+    bool offscreen;
+
+    // X11 window with a GLX context
+    Display *   display;
+    Window      window;
+    GLXContext  context;
+    Atom        delete_atom;
+    Cursor      blank_cursor;
+
+    // headless EGL pbuffer surface
+    EGLDisplay  egl_display;
+    EGLConfig   egl_config;
+    EGLSurface  egl_surface;
+    EGLContext  egl_context;
+};
+
+// same initial GL state as the Win32 backend, pixel coordinates with the origin top left
+static void setup_view(const ImageRef& size)
+{
+    glLoadIdentity();
+    glViewport(0, 0, size.x, size.y);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glColor3f(1.0f,1.0f,1.0f);
+    glOrtho(0, size.x, size.y, 0, -1 , 1);
+    glPixelZoom(1,-1);
+    glRasterPos2f(0, 0);
+}
+
+static EGLDisplay open_egl_display()
+{
+    // without an X server the default display may not be available, fall back to Mesa's surfaceless platform
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+        return display;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(getPlatformDisplay){
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if(display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+            return display;
+    }
+#endif
+    return EGL_NO_DISPLAY;
+}
+
+static EGLSurface create_pbuffer(GLWindow::State * state, const ImageRef& size)
+{
+    const EGLint attributes[] = { EGL_WIDTH, size.x, EGL_HEIGHT, size.y, EGL_NONE };
+    return eglCreatePbufferSurface(state->egl_display, state->egl_config, attributes);
+}
+
+static void init_offscreen(GLWindow::State * state, const ImageRef& size, int bpp)
+{
+    state->egl_display = open_egl_display();
+    if(state->egl_display == EGL_NO_DISPLAY)
+        throw Exceptions::GLWindow::CreationError("Cannot initialize EGL display.");
+
+    const EGLint channel = bpp >= 24 ? 8 : 5;
+    const EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, channel,
+        EGL_GREEN_SIZE, channel,
+        EGL_BLUE_SIZE, channel,
+        EGL_DEPTH_SIZE, 24,
+        EGL_STENCIL_SIZE, 8,
+        EGL_NONE
+    };
+    EGLint count = 0;
+    if(!eglChooseConfig(state->egl_display, config_attributes, &state->egl_config, 1, &count) || count == 0)
+        throw Exceptions::GLWindow::CreationError("Can't find a suitable EGL config.");
+
+    if(!eglBindAPI(EGL_OPENGL_API))
+        throw Exceptions::GLWindow::CreationError("EGL does not support OpenGL.");
+
+    state->egl_surface = create_pbuffer(state, size);
+    if(state->egl_surface == EGL_NO_SURFACE)
+        throw Exceptions::GLWindow::CreationError("Can't create an EGL pbuffer surface.");
+
+    state->egl_context = eglCreateContext(state->egl_display, state->egl_config, EGL_NO_CONTEXT, NULL);
+    if(state->egl_context == EGL_NO_CONTEXT)
+        throw Exceptions::GLWindow::CreationError("Can't create an EGL rendering context.");
+}
+
+static void init_window(GLWindow::State * state, const ImageRef& size, int bpp, const std::string& display)
+{
+    state->display = XOpenDisplay(display.empty() ? NULL : display.c_str());
+    if(state->display == NULL)
+        throw Exceptions::GLWindow::CreationError("Cannot open X display " + display);
+
+    const int channel = bpp >= 24 ? 8 : 5;
+    int visual_attributes[] = {
+        GLX_RGBA,
+        GLX_DOUBLEBUFFER,
+        GLX_RED_SIZE, channel,
+        GLX_GREEN_SIZE, channel,
+        GLX_BLUE_SIZE, channel,
+        GLX_DEPTH_SIZE, 24,
+        GLX_STENCIL_SIZE, 8,
+        None
+    };
+    XVisualInfo * visual = glXChooseVisual(state->display, DefaultScreen(state->display), visual_attributes);
+    if(visual == NULL)
+        throw Exceptions::GLWindow::CreationError("Can't find a suitable GLX visual.");
+
+    Window root = RootWindow(state->display, visual->screen);
+    XSetWindowAttributes attributes;
+    attributes.colormap = XCreateColormap(state->display, root, visual->visual, AllocNone);
+    attributes.event_mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | StructureNotifyMask | ExposureMask;
+    state->window = XCreateWindow(state->display, root, 0, 0, size.x, size.y, 0, visual->depth, InputOutput, visual->visual, CWColormap | CWEventMask, &attributes);
+
+    state->context = glXCreateContext(state->display, visual, NULL, True);
+    XFree(visual);
+    if(state->context == NULL)
+        throw Exceptions::GLWindow::CreationError("Can't create a GLX rendering context.");
+
+    XStoreName(state->display, state->window, state->title.c_str());
+    state->delete_atom = XInternAtom(state->display, "WM_DELETE_WINDOW", True);
+    XSetWMProtocols(state->display, state->window, &state->delete_atom, 1);
+
+    // an empty cursor for hide_cursor
+    static char empty[8] = { 0 };
+    XColor black;
+    black.red = black.green = black.blue = 0;
+    Pixmap pixmap = XCreateBitmapFromData(state->display, state->window, empty, 8, 8);
+    state->blank_cursor = XCreatePixmapCursor(state->display, pixmap, pixmap, &black, &black, 0, 0);
+    XFreePixmap(state->display, pixmap);
+
+    XMapWindow(state->display, state->window);
+    // wait until the window is visible
+    XEvent event;
+    do {
+        XWindowEvent(state->display, state->window, StructureNotifyMask, &event);
+    } while(event.type != MapNotify);
+}
+
+void GLWindow::init(const ImageRef& size, int bpp, const std::string& title, const std::string& display)
+{
+    state = new State;
+    state->size = size;
+    state->title = title;
+    state->offscreen = (display == "offscreen");
+    state->display = NULL;
+    state->window = 0;
+    state->context = NULL;
+    state->blank_cursor = 0;
+    state->egl_display = EGL_NO_DISPLAY;
+    state->egl_surface = EGL_NO_SURFACE;
+    state->egl_context = EGL_NO_CONTEXT;
+
+    if(state->offscreen)
+        init_offscreen(state, size, bpp);
+    else
+        init_window(state, size, bpp, display);
+
+    activate();
+    setup_view(size);
+
+    // handle events to make window appear
+    EventSummary summary;
+    get_events(summary);
+}
+
+GLWindow::~GLWindow()
+{
+    if(state->offscreen){
+        eglMakeCurrent(state->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(state->egl_display, state->egl_context);
+        eglDestroySurface(state->egl_display, state->egl_surface);
+        eglTerminate(state->egl_display);
+    } else {
+        if(glXGetCurrentContext() == state->context)
+            glXMakeCurrent(state->display, None, NULL);
+        glXDestroyContext(state->display, state->context);
+        XFreeCursor(state->display, state->blank_cursor);
+        XDestroyWindow(state->display, state->window);
+        XCloseDisplay(state->display);
+    }
+    delete state;
+    state = NULL;
+}
+
+ImageRef GLWindow::size() const { return state->size; }
+
+void GLWindow::set_size(const ImageRef & s_)
+{
+    if(state->offscreen){
+        // pbuffers have a fixed size, replace the surface
+        EGLSurface surface = create_pbuffer(state, s_);
+        if(surface == EGL_NO_SURFACE)
+            throw Exceptions::GLWindow::RuntimeError("Can't resize the EGL pbuffer surface.");
+        eglMakeCurrent(state->egl_display, surface, surface, state->egl_context);
+        eglDestroySurface(state->egl_display, state->egl_surface);
+        state->egl_surface = surface;
+        state->size = s_;
+        glViewport(0, 0, state->size.x, state->size.y);
+    } else {
+        // the size is updated once the ConfigureNotify event arrives
+        XResizeWindow(state->display, state->window, s_.x, s_.y);
+        XFlush(state->display);
+    }
+}
+
+ImageRef GLWindow::position() const { return state->position; }
+
+void GLWindow::set_position(const ImageRef & p_)
+{
+    state->position = p_;
+    if(!state->offscreen){
+        XMoveWindow(state->display, state->window, p_.x, p_.y);
+        XFlush(state->display);
+    }
+}
+
+void GLWindow::set_cursor_position(const ImageRef& where)
+{
+    state->cursor = where;
+    if(!state->offscreen){
+        XWarpPointer(state->display, None, state->window, 0, 0, 0, 0, where.x, where.y);
+        XFlush(state->display);
+    }
+}
+
+ImageRef GLWindow::cursor_position() const
+{
+    if(state->offscreen)
+        return state->cursor;
+    Window root, child;
+    int root_x, root_y, x, y;
+    unsigned int mask;
+    if(XQueryPointer(state->display, state->window, &root, &child, &root_x, &root_y, &x, &y, &mask))
+        state->cursor = ImageRef(x, y);
+    return state->cursor;
+}
+
+void GLWindow::show_cursor(bool show)
+{
+    if(state->offscreen)
+        return;
+    if (show)
+        XUndefineCursor(state->display, state->window);
+    else
+        XDefineCursor(state->display, state->window, state->blank_cursor);
+}
+
+std::string GLWindow::title() const
+{
+    return state->title;
+}
+
+void GLWindow::set_title(const std::string& title)
+{
+    state->title = title;
+    if(!state->offscreen)
+        XStoreName(state->display, state->window, state->title.c_str());
+}
+
+void GLWindow::swap_buffers()
+{
+    if(state->offscreen)
+        eglSwapBuffers(state->egl_display, state->egl_surface);
+    else
+        glXSwapBuffers(state->display, state->window);
+}
+
+inline int convertButtonState(const unsigned int state)
+{
+    int ret = 0;
+    if (state & Button1Mask) ret |= GLWindow::BUTTON_LEFT;
+    if (state & Button2Mask) ret |= GLWindow::BUTTON_MIDDLE;
+    if (state & Button3Mask) ret |= GLWindow::BUTTON_RIGHT;
+    if (state & ControlMask) ret |= GLWindow::BUTTON_MOD_CTRL;
+    if (state & ShiftMask)   ret |= GLWindow::BUTTON_MOD_SHIFT;
+    return ret;
+}
+
+inline int convertButton(const unsigned int button)
+{
+    switch(button){
+    case Button1: return GLWindow::BUTTON_LEFT;
+    case Button2: return GLWindow::BUTTON_MIDDLE;
+    case Button3: return GLWindow::BUTTON_RIGHT;
+    case Button4: return GLWindow::BUTTON_WHEEL_UP;
+    case Button5: return GLWindow::BUTTON_WHEEL_DOWN;
+    default: return 0;
+    }
+}
+
+// ASCII code for printable keys and escape, like ToAscii in the Win32 backend, the keysym otherwise
+inline int convertKey(XKeyEvent & event)
+{
+    char buffer[4];
+    KeySym keysym;
+    if(XLookupString(&event, buffer, sizeof(buffer), &keysym, NULL) == 1)
+        return (unsigned char)buffer[0];
+    return (int)keysym;
+}
+
+void GLWindow::handle_events(EventHandler& handler)
+{
+    if(state->offscreen)
+        return;
+
+    while(XPending(state->display)){
+        XEvent event;
+        XNextEvent(state->display, &event);
+        switch(event.type){
+        case ButtonPress:
+            // the wheel is reported as a single mouse up, like in the Win32 backend
+            if(event.xbutton.button != Button4 && event.xbutton.button != Button5)
+                handler.on_mouse_down(*this, ImageRef(event.xbutton.x, event.xbutton.y), convertButtonState(event.xbutton.state), convertButton(event.xbutton.button));
+            break;
+        case ButtonRelease:
+            handler.on_mouse_up(*this, ImageRef(event.xbutton.x, event.xbutton.y), convertButtonState(event.xbutton.state), convertButton(event.xbutton.button));
+            break;
+        case MotionNotify:
+            handler.on_mouse_move(*this, ImageRef(event.xmotion.x, event.xmotion.y), convertButtonState(event.xmotion.state));
+            break;
+        case KeyPress:
+            handler.on_key_down(*this, convertKey(event.xkey));
+            break;
+        case KeyRelease:
+            handler.on_key_up(*this, convertKey(event.xkey));
+            break;
+        case ConfigureNotify:
+            state->position = ImageRef(event.xconfigure.x, event.xconfigure.y);
+            if(ImageRef(event.xconfigure.width, event.xconfigure.height) != state->size){
+                state->size = ImageRef(event.xconfigure.width, event.xconfigure.height);
+                activate();
+                glViewport(0, 0, state->size.x, state->size.y);
+                handler.on_resize(*this, state->size);
+            }
+            break;
+        case ClientMessage:
+            if((Atom)event.xclient.data.l[0] == state->delete_atom)
+                handler.on_event(*this, EVENT_CLOSE);
+            break;
+        case Expose:
+            if(event.xexpose.count == 0)
+                handler.on_event(*this, EVENT_EXPOSE);
+            break;
+        }
+    }
+}
+
+bool GLWindow::has_events() const
+{
+    return !state->offscreen && XPending(state->display) > 0;
+}
+
+bool GLWindow::wait_events(FrameSignal & signal, int timeout)
+{
+    if(state->offscreen)
+        return signal.wait(timeout);
+
+    XFlush(state->display);
+#ifdef __linux__
+    pollfd fds[2] = {
+        { signal.descriptor(), POLLIN, 0 },
+        { ConnectionNumber(state->display), POLLIN, 0 }
+    };
+    // events may already be queued by Xlib, then only check the signal
+    const int wait = XPending(state->display) ? 0 : timeout;
+    if(poll(fds, 2, wait) > 0 && (fds[0].revents & POLLIN))
+        return signal.consume();
+    return false;
+#else
+    // without a pollable signal, wait on the condition variable in short slices
+    const int slice = 5;
+    for(int waited = 0; timeout < 0 || waited < timeout; waited += slice){
+        if(XPending(state->display))
+            return signal.wait(0);
+        if(signal.wait(timeout < 0 ? slice : min(slice, timeout - waited)))
+            return true;
+    }
+    return false;
+#endif
+}
+
+void GLWindow::activate()
+{
+    if(state->offscreen){
+        if(!eglMakeCurrent(state->egl_display, state->egl_surface, state->egl_surface, state->egl_context))
+            throw Exceptions::GLWindow::RuntimeError("eglMakeCurrent failed");
+    } else {
+        if(!glXMakeCurrent(state->display, state->window, state->context))
+            throw Exceptions::GLWindow::RuntimeError("glXMakeCurrent failed");
+    }
+}
+
+#endif // _WIN32
@@ -0,0 +1,168 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <xmmintrin.h>
+
+#include "image_ref.h"
+
+// Images with an explicit row stride, after the SubImage and Image classes of libCVD that
+// image_ref.h comes from. A SubImage is a view of pixels owned elsewhere, such as a region of
+// an Image or a frame of a driver, and costs nothing to create or copy. An Image owns its
+// pixels, with the first row on a cache line and every row starting on a multiple of
+// IMAGE_ROW_ALIGNMENT bytes, so a kernel that only ever works on whole rows of an Image may
+// use aligned loads and stores, as scale_to_8bit does. Kernels that also take the buffers of
+// a driver or read the neighbours of a pixel cannot, and use unaligned loads. At the frame
+// sizes of the Kinect the rows need no padding, so the pixels of an Image are contiguous as
+// well, as libfreenect, GL and the frame bus expect them. Code that takes them as one plain
+// array gets them from contiguous_data(), which asserts that. The pixel type must be a plain
+// type that can be copied with memcpy.
+
+/// first row of an Image, a cache line
+static const size_t IMAGE_ALIGNMENT = 64;
+/// every row of an Image, an AVX register
+static const size_t IMAGE_ROW_ALIGNMENT = 32;
+
+inline bool is_aligned( const void * pointer, const size_t alignment ){
+    return (reinterpret_cast<uintptr_t>(pointer) & (alignment - 1)) == 0;
+}
+
+/// A pixel of 8 bit RGB, packed like GL_RGB and the RGB frames of libfreenect
+struct Rgb8 {
+    uint8_t red, green, blue;
+};
+
+/// A view of width x height pixels, with rows row_stride pixels apart
+template <class T>
+class SubImage {
+public:
+    SubImage() : my_data(NULL), my_size(0, 0), my_stride(0) {}
+    SubImage( T * data, const ImageRef & size, const int stride ) : my_data(data), my_size(size), my_stride(stride) {}
+    /// a view of contiguous pixels
+    SubImage( T * data, const ImageRef & size ) : my_data(data), my_size(size), my_stride(size.x) {}
+    /// a view of non-const pixels is also a view of const ones
+    template <class U>
+    SubImage( const SubImage<U> & other ) : my_data(other.data()), my_size(other.size()), my_stride(other.row_stride()) {}
+
+    T * data() { return my_data; }
+    const T * data() const { return my_data; }
+    const ImageRef & size() const { return my_size; }
+    int row_stride() const { return my_stride; }
+    /// number of pixels, without the padding of the rows
+    size_t totalsize() const { return size_t(my_size.x) * my_size.y; }
+    /// true if the rows follow each other without padding, so that the pixels can be
+    /// passed on as one array of totalsize() pixels
+    bool is_contiguous() const { return my_stride == my_size.x || my_size.y <= 1; }
+    /// the pixels as one array of totalsize() pixels, for code without a row stride
+    T * contiguous_data() { assert(is_contiguous()); return my_data; }
+    const T * contiguous_data() const { assert(is_contiguous()); return my_data; }
+    bool in_image( const ImageRef & pos ) const { return pos.x >= 0 && pos.y >= 0 && pos.x < my_size.x && pos.y < my_size.y; }
+
+    T & operator[]( const ImageRef & pos ) { return my_data[pos.y * my_stride + pos.x]; }
+    const T & operator[]( const ImageRef & pos ) const { return my_data[pos.y * my_stride + pos.x]; }
+    /// the pixels of a row
+    T * operator[]( const int row ) { return my_data + row * my_stride; }
+    const T * operator[]( const int row ) const { return my_data + row * my_stride; }
+
+    /// a view of the region of the given size at start, which must lie inside the image
+    SubImage<T> sub_image( const ImageRef & start, const ImageRef & size ){
+        assert(in_image(start) && start.x + size.x <= my_size.x && start.y + size.y <= my_size.y);
+        return SubImage<T>(my_data + start.y * my_stride + start.x, size, my_stride);
+    }
+    SubImage<const T> sub_image( const ImageRef & start, const ImageRef & size ) const {
+        assert(in_image(start) && start.x + size.x <= my_size.x && start.y + size.y <= my_size.y);
+        return SubImage<const T>(my_data + start.y * my_stride + start.x, size, my_stride);
+    }
+
+    void fill( const T & value ){
+        for(int y = 0; y < my_size.y; ++y)
+            std::fill((*this)[y], (*this)[y] + my_size.x, value);
+    }
+
+protected:
+    T * my_data;
+    ImageRef my_size;
+    int my_stride;
+};
+
+/// Copies the pixels of from to to, which must have the same size
+template <class S, class T>
+void copy( const SubImage<S> & from, SubImage<T> to ){
+    assert(from.size() == to.size());
+    if(from.is_contiguous() && to.is_contiguous()){
+        memcpy(to.data(), from.data(), from.totalsize() * sizeof(T));
+        return;
+    }
+    for(int y = 0; y < from.size().y; ++y)
+        memcpy(to[y], from[y], from.size().x * sizeof(T));
+}
+
+/// An image owning its pixels, with aligned rows
+template <class T>
+class Image : public SubImage<T> {
+public:
+    Image() {}
+    /// an image of the given size with all pixels 0
+    explicit Image( const ImageRef & size ){
+        resize(size);
+    }
+    Image( const Image & other ) : SubImage<T>() {
+        copy_from(other);
+    }
+    ~Image(){
+        _mm_free(this->my_data);
+    }
+
+    Image & operator=( const Image & other ){
+        if(this != &other)
+            copy_from(other);
+        return *this;
+    }
+
+    /// Changes the size, reallocating the pixels only if the size changes, so this costs
+    /// nothing for every frame of the same size. New pixels are 0.
+    void resize( const ImageRef & size ){
+        if(size == this->my_size)
+            return;
+        const int stride = aligned_stride(size.x);
+        const size_t bytes = size_t(stride) * size.y * sizeof(T);
+        T * data = NULL;
+        if(bytes){
+            data = static_cast<T *>(_mm_malloc(bytes, IMAGE_ALIGNMENT));
+            if(data == NULL)
+                throw std::bad_alloc();
+            memset(data, 0, bytes);
+        }
+        _mm_free(this->my_data);
+        this->my_data = data;
+        this->my_size = size;
+        this->my_stride = stride;
+    }
+
+    /// resizes to the size of from and copies its pixels
+    void copy_from( const SubImage<const T> & from ){
+        resize(from.size());
+        copy(from, static_cast<SubImage<T> &>(*this));
+    }
+
+    void swap( Image & other ){
+        std::swap(this->my_data, other.my_data);
+        std::swap(this->my_size, other.my_size);
+        std::swap(this->my_stride, other.my_stride);
+    }
+
+    /// the smallest stride not below width that keeps every row aligned
+    static int aligned_stride( const int width ){
+        int stride = width;
+        while((stride * sizeof(T)) % IMAGE_ROW_ALIGNMENT)
+            ++stride;
+        return stride;
+    }
+};
+
+#endif // IMAGE_H
@@ -4,13 +4,15 @@
 
 using namespace std;
 
+#ifdef _WIN32
+
 #include <Windows.h>
 #include <Wincodecsdk.h>
 
 // see the following for reference on the API used here, would be cool in libcvd :)
 // http://msdn.microsoft.com/en-us/library/ee719902(v=VS.85).aspx
 
-int save_image( void * data, const ImageRef & size, const int depth, const std::wstring & filename ){
+int save_image( const void * data, const ImageRef & size, const int depth, const std::wstring & filename ){
 	// Initialize COM
     HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
 
@@ -114,3 +116,12 @@ int save_image( void * data, const ImageRef & size, const int depth, const std::
 
     return hr;
 }
+
+#else
+
+// WIC is only available on Windows, elsewhere no image is written
+int save_image( const void * /*data*/, const ImageRef & /*size*/, const int /*depth*/, const std::wstring & /*filename*/ ){
+    return -1;
+}
+
+#endif
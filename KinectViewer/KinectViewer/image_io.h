@@ -4,6 +4,6 @@
 #include <string>
 #include "image_ref.h"
 
-int save_image( void * data, const ImageRef & size, const int depth, const std::wstring & filename ); 
+int save_image( const void * data, const ImageRef & size, const int depth, const std::wstring & filename ); 
 
 #endif IMAGE_IO_H
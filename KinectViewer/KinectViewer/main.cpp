@@ -5,19 +5,46 @@
 #include <algorithm>
 #include <functional>
 #include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include <libfreenect.h>
 
+#ifdef _WIN32
 #include <Windows.h>
 #include <gl/GL.h>
+#else
+#include <GL/gl.h>
+#endif
 
 #include "glwindow.h"
+#include "frame_signal.h"
 #include "KinectDevice.h"
+#include "image.h"
 #include "image_io.h"
+#include "alloc_count.h"
+#include "depth_codec.h"
+#include "frame_bus.h"
+#include "demosaic.h"
+#include "unpack.h"
+#include "depth_ingest.h"
+#include "depth_range.h"
+#include "disparity.h"
+#ifdef FREENECT_SIMULATED
+#include "freenect_sim.h"
+#endif
 
 using namespace std;
 
-void transformDepth2Rgb( const uint16_t * depth, uint8_t * rgb ){
+// the colour map of the depth texture, from white up close over red, yellow, green, cyan and
+// blue to black far away and for invalid disparities
+Rgb8 depthColour( const uint16_t disparity ){
 	static vector<uint16_t> gamma;
 	if(gamma.empty()){
 		gamma.resize(2048);
@@ -28,129 +55,1459 @@ void transformDepth2Rgb( const uint16_t * depth, uint8_t * rgb ){
 		}
 	}
 
-	for( unsigned int i = 0 ; i < 640*480 ; i++) {
-		int pval = gamma[depth[i]];
-		int lb = pval & 0xff;
-		switch (pval>>8) {
-		case 0:
-			rgb[3*i+0] = 255;
-			rgb[3*i+1] = 255-lb;
-			rgb[3*i+2] = 255-lb;
-			break;
-		case 1:
-			rgb[3*i+0] = 255;
-			rgb[3*i+1] = lb;
-			rgb[3*i+2] = 0;
-			break;
-		case 2:
-			rgb[3*i+0] = 255-lb;
-			rgb[3*i+1] = 255;
-			rgb[3*i+2] = 0;
-			break;
-		case 3:
-			rgb[3*i+0] = 0;
-			rgb[3*i+1] = 255;
-			rgb[3*i+2] = lb;
-			break;
-		case 4:
-			rgb[3*i+0] = 0;
-			rgb[3*i+1] = 255-lb;
-			rgb[3*i+2] = 255;
-			break;
-		case 5:
-			rgb[3*i+0] = 0;
-			rgb[3*i+1] = 0;
-			rgb[3*i+2] = 255-lb;
-			break;
-		default:
-			rgb[3*i+0] = 0;
-			rgb[3*i+1] = 0;
-			rgb[3*i+2] = 0;
-			break;
-		}
+	const int pval = gamma[disparity & 2047];
+	const uint8_t lb = uint8_t(pval & 0xff);
+	Rgb8 rgb;
+	switch (pval>>8) {
+	case 0:
+		rgb.red = 255;
+		rgb.green = 255-lb;
+		rgb.blue = 255-lb;
+		break;
+	case 1:
+		rgb.red = 255;
+		rgb.green = lb;
+		rgb.blue = 0;
+		break;
+	case 2:
+		rgb.red = 255-lb;
+		rgb.green = 255;
+		rgb.blue = 0;
+		break;
+	case 3:
+		rgb.red = 0;
+		rgb.green = 255;
+		rgb.blue = lb;
+		break;
+	case 4:
+		rgb.red = 0;
+		rgb.green = 255-lb;
+		rgb.blue = 255;
+		break;
+	case 5:
+		rgb.red = 0;
+		rgb.green = 0;
+		rgb.blue = 255-lb;
+		break;
+	default:
+		rgb.red = 0;
+		rgb.green = 0;
+		rgb.blue = 0;
+		break;
 	}
+	return rgb;
+}
+
+// The colours of the auto-ranged depth view, the whole colour map of depthColour from level 1
+// up close to 255 far away, and black for level 0 of the invalid pixels
+void depthPalette( Rgb8 palette[256] ){
+	palette[0].red = palette[0].green = palette[0].blue = 0;
+	for(int level = 1; level < 256; ++level)
+		palette[level] = depthColour(uint16_t((level - 1) * 1120 / 254));
+}
+
+// Sets up ingest for 11 bit disparities, 2047 without a measurement: 1024 bins of 2 disparities,
+// display values of the upper 8 bits and the colours of depthColour
+void setupDisparityIngest( DepthIngest & ingest ){
+	ingest.setFormat(0, 2047, 1, 3);
+	for(int bin = 0; bin < DepthIngest::BINS; ++bin)
+		ingest.colours()[bin] = depthColour(uint16_t(bin << ingest.binShift()));
+}
+
+// when and from which device a buffer arrived
+struct FrameStamp {
+	FrameStamp() : device(-1), timestamp(0), received(0), count(0) {}
+	int device;
+	uint32_t timestamp;		// clock of the device
+	uint64_t received;		// host time of frame_bus_time
+	uint64_t count;			// buffers received so far
+};
+
+ostream & operator<<( ostream & out, const FrameStamp & stamp ){
+	return out << "device " << stamp.device << "\tframe " << stamp.count << "\ttimestamp " << stamp.timestamp << "\treceived " << stamp.received / 1000000 << " ms";
 }
 
+// One Kinect opened on the shared context of Freenect. The callbacks run on the event thread
+// of Freenect and copy the buffers of this device, tagged with a FrameStamp.
 class MyKinect : public FreenectDevice {
 public:
-	MyKinect(const int index ): FreenectDevice(index), rgb(640*488*3), depth(640*480), depth_texture(640*480*3) {
+	MyKinect(freenect_context * context, const int index ): FreenectDevice(context, index), auto_range(true), rgb_valid(false), depth_valid(false),
+		bayer_pending(false), demosaic_method(DEMOSAIC_BILINEAR), demosaic_time(0), bus(frame_bus_name(index)) {
+		setupDisparityIngest(ingest);
+		depthPalette(palette);
+		fitVideo();
+		fitDepth();
 	}
 
 	void VideoCallback(void *video, uint32_t timestamp){
 		//cout << "rgb\t" << timestamp << "\t" << getVideoBufferSize() << endl;
 		const uint8_t * data = static_cast<uint8_t *>(video);
-		copy(data, data + getVideoBufferSize(), rgb.data());
-		rgb_valid = true;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			fitVideo();
+			if(getVideoFormat() == FREENECT_VIDEO_BAYER){
+				// only keep the raw frame, the event thread is shared by all devices and the
+				// consumer converts it with demosaicPending
+				copy(SubImage<const uint8_t>(data, bayer.size()), bayer);
+				bayer_pending = true;
+			} else if(getVideoFormat() == FREENECT_VIDEO_IR_10BIT_PACKED){
+				// the full 10 bits for snapshots, and the upper 8 bits for display in the same pass
+				unpack_10bit(data, infrared.totalsize(), infrared.contiguous_data(), intensity.contiguous_data());
+			} else if(getVideoFormat() == FREENECT_VIDEO_IR_8BIT){
+				copy(SubImage<const uint8_t>(data, intensity.size()), intensity);
+			} else {
+				copy(SubImage<const Rgb8>(reinterpret_cast<const Rgb8 *>(data), rgb.size()), rgb);
+			}
+			rgb_valid = true;
+			stamp(video_stamp, timestamp);
+		}
+		signal.notify();
 	}
 
 	void DepthCallback(void *depth, uint32_t timestamp){
 		//cout << "depth\t" << timestamp << "\t" << getDepthBufferSize() << endl;
-		const uint16_t * data = static_cast<uint16_t *>(depth);
-		// copy raw depth data for saving later
-		copy(data, data + this->depth.size(), this->depth.data());
-		// alternatively, this scales the depth data to full 16 bit scale for visualization
-		// transform(data, data + this->depth.size(), this->depth.data(), bind1st(multiplies<unsigned short>(), 64));
-		// this creates a color map representing the texture for rendering
-		transformDepth2Rgb(data, this->getDepthTexture());
-		depth_valid = true;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			fitDepth();
+			if(getDepthFormat() == FREENECT_DEPTH_11BIT_PACKED){
+				// unpack the whole frame straight into the depth buffer and derive the display
+				// outputs from it, interleaving both per row measured no faster (see -ingest)
+				unpack_11bit(static_cast<uint8_t *>(depth), this->depth.totalsize(), this->depth.contiguous_data());
+				ingest.process(this->depth, SubImage<uint16_t>(), depth_scaled, depth_texture);
+			} else {
+				// copy the raw depth for saving later, with the 8 bit scaled depth, the colour
+				// map for rendering and the histogram in the same pass
+				ingest.process(SubImage<const uint16_t>(static_cast<uint16_t *>(depth), this->depth.size()), this->depth, depth_scaled, depth_texture);
+			}
+			// the display range follows the histogram of this frame from the next one on
+			if(auto_range && range.update(ingest))
+				range.apply(ingest, palette);
+			depth_valid = true;
+			stamp(depth_stamp, timestamp);
+
+			// share the frame with other processes, together with the latest video buffer
+			bus.publish(this->depth.contiguous_data(), this->depth.size(), getVideoBuffer(), videoSize(), videoChannels());
+		}
+		signal.notify();
 	}
 
-	void process(){
+	// guards the buffers and stamps against the event thread
+	std::mutex & bufferMutex() { return mutex; }
+	// notified by the event thread for every new buffer of this device
+	FrameSignal & frameSignal() { return signal; }
+
+	// returns whether new buffers arrived since the last call, call with the buffer mutex held
+	bool takeNewBuffers(){
+		const bool result = rgb_valid || depth_valid;
 		rgb_valid = false;
 		depth_valid = false;
-		FreenectDevice::process();
+		return result;
 	}
 
 	bool haveVideoBuffer() { return rgb_valid; }
 	bool haveDepthBuffer() { return depth_valid; }
 
-	uint8_t * getVideoBuffer() { return rgb.data(); }
-	uint16_t * getDepthBuffer() { return depth.data(); }
-	uint8_t * getDepthTexture() { return depth_texture.data(); }
+	// RGB or 8 bit infrared depending on the format of the last video frame, call with the buffer mutex held
+	const uint8_t * getVideoBuffer() const { return video_infrared ? intensity.contiguous_data() : &rgb.contiguous_data()->red; }
+	// the format of the last video frame, which the video buffers hold until the next one
+	// arrives even if the format was changed since, call with the buffer mutex held
+	freenect_video_format videoFormat() const { return video_format; }
+	bool isVideoInfrared() const { return video_infrared; }
+	// bytes per pixel of getVideoBuffer, call with the buffer mutex held
+	int videoChannels() const { return video_infrared ? 1 : 3; }
+	uint16_t * getDepthBuffer() { return depth.contiguous_data(); }
+	const Rgb8 * getDepthTexture() const { return depth_texture.contiguous_data(); }
+
+	// the size of the current buffers, call with the buffer mutex held
+	const ImageRef & videoSize() const { return video_infrared ? intensity.size() : rgb.size(); }
+	const ImageRef & depthSize() const { return depth.size(); }
+
+	const Image<Rgb8> & getRgbImage() const { return rgb; }
+	const Image<uint16_t> & getDepthImage() const { return depth; }
+
+	// when the current buffers arrived, call with the buffer mutex held
+	const FrameStamp & videoStamp() const { return video_stamp; }
+	const FrameStamp & depthStamp() const { return depth_stamp; }
+
+	const FrameBusWriter & frameBus() const { return bus; }
+
+	bool isInfrared() { return getVideoFormat() == FREENECT_VIDEO_IR_8BIT || getVideoFormat() == FREENECT_VIDEO_IR_10BIT_PACKED; }
+
+	// the 10 bit infrared image of the packed infrared mode, call with the buffer mutex held
+	const Image<uint16_t> & getInfraredImage() const { return infrared; }
+	// the upper 8 bits of the depth, call with the buffer mutex held
+	const Image<uint8_t> & getDepthScaled() const { return depth_scaled; }
+	// histogram and range of the last depth frame, call with the buffer mutex held
+	const DepthIngest & depthIngest() const { return ingest; }
+	// the range of the depth view and the 8 bit depth, call with the buffer mutex held
+	const DepthAutoRange & depthRange() const { return range; }
+
+	// ranges the depth view and the 8 bit depth to the depths of the scene instead of the
+	// fixed colour map and the upper 8 bits of the disparity
+	void enableAutoRange( const bool enable ){
+		lock_guard<std::mutex> lock(mutex);
+		auto_range = enable;
+		range.reset();
+		if(!enable)
+			setupDisparityIngest(ingest);
+	}
+	bool autoRangeEnabled() const { return auto_range; }
+
+	// the raw frame of the Bayer mode, call with the buffer mutex held
+	const Image<uint8_t> & getBayerBuffer() const { return bayer; }
+	void setDemosaicMethod( const DemosaicMethod method ){
+		lock_guard<std::mutex> lock(mutex);
+		demosaic_method = method;
+	}
+	// time taken by the last demosaic in milliseconds, call with the buffer mutex held
+	double demosaicTime() const { return demosaic_time; }
+
+	// Converts the last Bayer frame into the RGB buffer on the calling thread, if one arrived
+	// since the last call. The raw frame is copied under the buffer mutex and converted into a
+	// back buffer without it, which is swapped in afterwards, so neither the event thread nor
+	// readers of the other buffers wait for the conversion. Call without the buffer mutex held.
+	void demosaicPending(){
+		DemosaicMethod method;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if(!bayer_pending)
+				return;
+			bayer_pending = false;
+			bayer_work.resize(bayer.size());
+			copy(bayer, bayer_work);
+			method = demosaic_method;
+		}
+		rgb_work.resize(bayer_work.size());
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		demosaic(bayer_work, rgb_work, method, &green);
+		const double time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+		lock_guard<std::mutex> lock(mutex);
+		// a frame in another format or size may have arrived in the meantime
+		if(video_format == FREENECT_VIDEO_BAYER && rgb.size() == rgb_work.size())
+			rgb.swap(rgb_work);
+		demosaic_time = time;
+	}
 
 protected:
-	vector<uint8_t> rgb;
-	vector<uint16_t> depth;
-	vector<uint8_t> depth_texture;
+	// fit the buffers of the current format to the size of its frames, Image::resize only
+	// reallocates when the size changes, call with the buffer mutex held. The rows of the
+	// Kinect formats need no padding, so the images stay contiguous like the frames.
+	void fitVideo(){
+		const ImageRef size(getVideoMode().width, getVideoMode().height);
+		video_format = getVideoFormat();
+		video_infrared = isInfrared();
+		if(video_infrared){
+			intensity.resize(size);
+			if(getVideoFormat() == FREENECT_VIDEO_IR_10BIT_PACKED)
+				infrared.resize(size);
+		} else {
+			rgb.resize(size);
+			if(getVideoFormat() == FREENECT_VIDEO_BAYER)
+				bayer.resize(size);
+		}
+	}
+	void fitDepth(){
+		const ImageRef size(getDepthMode().width, getDepthMode().height);
+		depth.resize(size);
+		depth_texture.resize(size);
+		depth_scaled.resize(size);
+	}
+
+	void stamp( FrameStamp & stamp, uint32_t timestamp ){
+		stamp.device = index();
+		stamp.timestamp = timestamp;
+		stamp.received = frame_bus_time();
+		++stamp.count;
+	}
+
+	Image<Rgb8> rgb;
+	Image<uint8_t> intensity;	// 8 bit infrared for display
+	freenect_video_format video_format;	// the format of the last video frame
+	bool video_infrared;		// the last video frame went to intensity instead of rgb
+	Image<uint16_t> depth;
+	Image<Rgb8> depth_texture;
+	Image<uint16_t> infrared;
+	Image<uint8_t> depth_scaled;
+	DepthIngest ingest;
+	DepthAutoRange range;
+	bool auto_range;
+	Rgb8 palette[256];			// colours of the auto-ranged levels
 	bool rgb_valid, depth_valid;
+	FrameStamp video_stamp, depth_stamp;
+
+	Image<uint8_t> bayer;
+	bool bayer_pending;			// bayer holds a frame that is not converted yet
+	Image<uint8_t> bayer_work;	// the frame and RGB buffer demosaicPending works on without the mutex
+	Image<Rgb8> rgb_work;
+	vector<uint8_t> green;		// scratch plane of the edge aware demosaic
+	DemosaicMethod demosaic_method;
+	double demosaic_time;
+
+	std::mutex mutex;
+	FrameSignal signal;
+
+	FrameBusWriter bus;
 };
 
+// attaches to the frame bus of a device of a running KinectViewer and prints the received frame rate and latency
+int runBusReader( const int device ){
+	FrameBusReader reader(frame_bus_name(device));
+	if(!reader.is_open()){
+		cout << "no KinectViewer frame bus found" << endl;
+		return 1;
+	}
+	FrameBusInfo info;
+	vector<uint16_t> depth;
+	vector<uint8_t> video;
+	uint64_t last = 0;
+	unsigned frames = 0;
+	double latency = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while(true){
+		if(reader.read(info, depth, video, last)){
+			latency += (frame_bus_time() - info.time) * 1e-6;
+			last = info.number;
+			++frames;
+		} else {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if(elapsed >= 1.0){
+			cout << "frame " << last << "\t" << frames / elapsed << " frames/s\t" << (frames ? latency / frames : 0) << " ms latency\t" << reader.retries() << " retries" << endl;
+			frames = 0;
+			latency = 0;
+			start = chrono::steady_clock::now();
+		}
+	}
+	return 0;
+}
+
+// CPU time of the process in seconds, summed over its threads
+static double processTime(){
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	const uint64_t ticks = (uint64_t(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) + (uint64_t(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+	return ticks * 1e-7;
+#else
+	return double(clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// Measures what the render loop costs while it waits for frames. A thread notifies at the 30 Hz
+// of the Kinect, and the loop waits with GLWindow::wait_events as the render loop does, or
+// sleeps 1 ms and checks for a frame and window messages as the loops did before. Prints the
+// CPU usage of the process and the latency from the notification to the loop waking up.
+int runWaitTest( const double seconds ){
+	try {
+		GLWindow window(ImageRef(64, 64), "wait", 24, "offscreen");
+		GLWindow::EventSummary events;
+		FrameSignal signal;
+		const char * names[] = { "wait_events", "1 ms polling" };
+		for(int method = 0; method < 2; ++method){
+			atomic<bool> stop(false), pending(false);
+			atomic<uint64_t> notified(0);
+			thread producer([&](){
+				while(!stop){
+					this_thread::sleep_for(chrono::microseconds(33333));
+					notified = frame_bus_time();
+					if(method == 0)
+						signal.notify();
+					else
+						pending = true;
+				}
+			});
+
+			double latency_sum = 0, latency_max = 0;
+			int frames = 0, wakeups = 0;
+			const double cpu_start = processTime();
+			const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			double elapsed = 0;
+			while(elapsed < seconds){
+				bool frame;
+				if(method == 0){
+					frame = window.wait_events(signal, 100);
+				} else {
+					this_thread::sleep_for(chrono::milliseconds(1));
+					frame = pending.exchange(false);
+				}
+				events.clear();
+				window.get_events(events);
+				++wakeups;
+				if(frame){
+					const double latency = (frame_bus_time() - notified) * 1e-6;
+					latency_sum += latency;
+					latency_max = max(latency_max, latency);
+					++frames;
+				}
+				elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			}
+			const double cpu = (processTime() - cpu_start) / elapsed * 100;
+			stop = true;
+			producer.join();
+			cout << names[method] << "	" << frames << " frames	" << wakeups << " wake-ups	CPU " << cpu << " %	latency "
+				<< latency_sum / max(frames, 1) << " ms avg " << latency_max << " ms max" << endl;
+		}
+	} catch(const Exceptions::All & error){
+		cout << "no window: " << error.what << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// publishes synthetic frames as fast as possible and reads them with several reader threads,
+// every reader maps the segment separately like a reader process would
+int runBusBenchmark(){
+	FrameBusWriter writer("KinectViewerBenchmark");
+	if(!writer.is_open()){
+		cout << "could not create the frame bus" << endl;
+		return 1;
+	}
+	vector<uint16_t> depth(640*480);
+	vector<uint8_t> video(640*480*3);
+	for(unsigned i = 0; i < depth.size(); ++i)
+		depth[i] = uint16_t(i % 2048);
+
+	const int reader_counts[] = { 1, 2, 4, 8 };
+	for(int r = 0; r < 4; ++r){
+		const int readers = reader_counts[r];
+		atomic<bool> running(true);
+		vector<unsigned> frames(readers, 0);
+		vector<double> latency(readers, 0), max_latency(readers, 0);
+		vector<uint64_t> retries(readers, 0);
+		vector<thread> threads;
+		for(int i = 0; i < readers; ++i){
+			threads.push_back(thread([&, i]{
+				FrameBusReader reader("KinectViewerBenchmark");
+				FrameBusInfo info;
+				vector<uint16_t> d;
+				vector<uint8_t> v;
+				uint64_t last = 0;
+				while(running){
+					if(!reader.read(info, d, v, last)){
+						this_thread::yield();
+						continue;
+					}
+					const double ms = (frame_bus_time() - info.time) * 1e-6;
+					latency[i] += ms;
+					max_latency[i] = max(max_latency[i], ms);
+					last = info.number;
+					++frames[i];
+				}
+				retries[i] = reader.retries();
+			}));
+		}
+
+		const uint64_t published = writer.published();
+		const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		double elapsed = 0;
+		while(elapsed < 2.0){
+			writer.publish(depth.data(), ImageRef(640, 480), video.data(), ImageRef(640, 480), 3);
+			elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+		running = false;
+		for(int i = 0; i < readers; ++i)
+			threads[i].join();
+
+		unsigned total = 0;
+		double sum = 0, worst = 0;
+		uint64_t retry_sum = 0;
+		for(int i = 0; i < readers; ++i){
+			total += frames[i];
+			sum += latency[i];
+			worst = max(worst, max_latency[i]);
+			retry_sum += retries[i];
+		}
+		cout << readers << " readers\twriter " << (writer.published() - published) / elapsed << " frames/s\treader " << total / elapsed / readers << " frames/s\t"
+			<< "latency " << (total ? sum / total : 0) << " ms avg " << worst << " ms max\t" << retry_sum << " retries" << endl;
+	}
+	return 0;
+}
+
+// switches the video of all devices, the depth stream is restarted as well to keep the order of the streams
+void setVideoFormat( vector<MyKinect *> & kinects, const freenect_video_format format, const freenect_resolution resolution ){
+	for(unsigned i = 0; i < kinects.size(); ++i){
+		kinects[i]->stopVideo();
+		kinects[i]->stopDepth();
+		kinects[i]->setVideoFormat(format, resolution);
+		kinects[i]->startVideo();
+		kinects[i]->startDepth();
+	}
+}
+
+// switches the depth of all devices, the video stream is restarted as well to keep the order of the streams
+void setDepthFormat( vector<MyKinect *> & kinects, const freenect_depth_format format ){
+	for(unsigned i = 0; i < kinects.size(); ++i){
+		kinects[i]->stopVideo();
+		kinects[i]->stopDepth();
+		kinects[i]->setDepthFormat(format);
+		kinects[i]->startVideo();
+		kinects[i]->startDepth();
+	}
+}
+
+// compares the demosaic methods with the per pixel reference conversion on a raw Bayer frame
+static void benchmarkDemosaic( const vector<uint8_t> & bayer, const ImageRef & size ){
+	vector<uint8_t> rgb(size.x * size.y * 3), green;
+	const char * names[] = { "reference", "bilinear", "edge aware" };
+	for(int method = 0; method < 3; ++method){
+		const int runs = 100;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for(int i = 0; i < runs; ++i){
+			if(method == 0)
+				demosaic_reference(bayer.data(), size, rgb.data());
+			else
+				demosaic(bayer.data(), size, rgb.data(), method == 1 ? DEMOSAIC_BILINEAR : DEMOSAIC_EDGE_AWARE, &green);
+		}
+		const double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+		cout << names[method] << "\t" << size.x << " x " << size.y << "\t" << ms << " ms\t" << size.x * size.y / ms / 1000 << " Mpixel/s" << endl;
+	}
+}
+
+// Checks the SIMD conversion against the same rules applied one pixel at a time, which it
+// must match exactly, and the bilinear conversion against the per pixel reference, which it
+// must match on the border and within the rounding of its pairwise averages inside. Returns
+// the number of failed checks.
+static int checkDemosaic( const vector<uint8_t> & bayer, const ImageRef & size ){
+	int failures = 0;
+	const size_t bytes = size_t(size.x) * size.y * 3;
+	vector<uint8_t> rgb(bytes), expected(bytes);
+	for(int method = 0; method < 2; ++method){
+		const DemosaicMethod m = method == 0 ? DEMOSAIC_BILINEAR : DEMOSAIC_EDGE_AWARE;
+		demosaic(bayer.data(), size, rgb.data(), m);
+		demosaic_scalar(bayer.data(), size, expected.data(), m);
+		if(rgb != expected){
+			cout << (method == 0 ? "bilinear" : "edge aware") << "	" << size.x << " x " << size.y << "	differs from the scalar conversion" << endl;
+			++failures;
+		}
+	}
+	demosaic(bayer.data(), size, rgb.data(), DEMOSAIC_BILINEAR);
+	demosaic_reference(bayer.data(), size, expected.data());
+	int border = 0, interior = 0;
+	for(int y = 0; y < size.y; ++y)
+		for(int x = 0; x < size.x; ++x)
+			for(int c = 0; c < 3; ++c){
+				const size_t i = 3 * (size_t(y) * size.x + x) + c;
+				const int difference = abs(int(rgb[i]) - int(expected[i]));
+				int & largest = x == 0 || y == 0 || x == size.x - 1 || y == size.y - 1 ? border : interior;
+				largest = max(largest, difference);
+			}
+	if(border > 0 || interior > 1){
+		cout << "bilinear	" << size.x << " x " << size.y << "	differs from the reference by " << border << " on the border and "
+			<< interior << " inside" << endl;
+		++failures;
+	}
+	return failures;
+}
+
+// Tests and benchmarks the demosaic methods on a stored raw Bayer frame, or on synthetic frames
+// of colored stripes and rings at the medium and the high resolution if no file is given. The
+// tests also cover noise in sizes that are not a multiple of the blocks, down to a single pixel.
+// Returns the number of failed checks.
+int runDemosaicBenchmark( const char * filename ){
+	vector<uint8_t> bayer;
+	int failures = 0;
+	if(filename){
+		ImageRef size;
+		if(!load_bayer(bayer, size, filename)){
+			cout << "could not read " << filename << endl;
+			return 1;
+		}
+		failures += checkDemosaic(bayer, size);
+		benchmarkDemosaic(bayer, size);
+		cout << (failures ? "demosaic test failed" : "demosaic test passed") << endl;
+		return failures;
+	}
+	const ImageRef noise_sizes[] = { ImageRef(1, 1), ImageRef(2, 2), ImageRef(3, 3), ImageRef(1, 5), ImageRef(5, 1), ImageRef(2, 7),
+									 ImageRef(19, 4), ImageRef(37, 29), ImageRef(641, 481) };
+	uint32_t seed = 1;
+	for(int s = 0; s < 9; ++s){
+		const ImageRef & size = noise_sizes[s];
+		bayer.resize(size.x * size.y);
+		for(size_t i = 0; i < bayer.size(); ++i){
+			seed = seed * 1664525 + 1013904223;
+			bayer[i] = uint8_t(seed >> 24);
+		}
+		failures += checkDemosaic(bayer, size);
+	}
+	const ImageRef sizes[] = { ImageRef(640, 480), ImageRef(1280, 1024) };
+	for(int s = 0; s < 2; ++s){
+		const ImageRef & size = sizes[s];
+		bayer.resize(size.x * size.y);
+		for(int y = 0; y < size.y; ++y){
+			for(int x = 0; x < size.x; ++x){
+				const int dx = x - size.x / 2, dy = y - size.y / 2;
+				const int ring = ((dx * dx + dy * dy) >> 9) & 1;
+				const int value[3] = { ring ? 230 : 40, (x / 32) & 1 ? 200 : 60, ring ? 30 : 180 };
+				const int color = (y & 1) == 0 ? ((x & 1) == 0 ? 1 : 0) : ((x & 1) == 0 ? 2 : 1);
+				bayer[y * size.x + x] = uint8_t(value[color]);
+			}
+		}
+		failures += checkDemosaic(bayer, size);
+		benchmarkDemosaic(bayer, size);
+	}
+	cout << (failures ? "demosaic test failed" : "demosaic test passed") << endl;
+	return failures;
+}
+
+// Captures all devices without a window for the given time and prints the received frame rates
+// every second. The main thread takes the buffers of the first device like the render loop,
+// so the capture, copy and colorize paths run under the same locking as in the viewer. With the
+// simulated libfreenect, the streams run at the given rate and jitter, and the dropped frames,
+// the delays and the time spent in the callbacks are printed as well. With high, the video
+// streams at 1280x1024.
+int runLoadTest( const double seconds, const double rate, const double jitter, const bool high ){
+	Freenect freenect;
+#ifdef FREENECT_SIMULATED
+	freenect_sim_configure(freenect.context(), rate, jitter);
+#endif
+	const int device_count = freenect.deviceCount();
+	if(device_count == 0){
+		cout << "no Kinect found" << endl;
+		return 1;
+	}
+	vector<MyKinect *> kinects;
+	for(int i = 0; i < device_count; ++i){
+		MyKinect & device = freenect.createDevice<MyKinect>(i);
+		if(high)
+			device.setVideoFormat(FREENECT_VIDEO_RGB, FREENECT_RESOLUTION_HIGH);
+		device.startVideo();
+		device.startDepth();
+		kinects.push_back(&device);
+	}
+	freenect.start();
+
+	Image<Rgb8> display;
+	vector<uint64_t> video_count(device_count, 0), depth_count(device_count, 0);
+	unsigned shown = 0;
+	const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	chrono::steady_clock::time_point report = start;
+	while(!freenect.failed()){
+		MyKinect & kinect = *kinects[0];
+		if(kinect.frameSignal().wait(100)){
+			kinect.demosaicPending();
+			lock_guard<std::mutex> lock(kinect.bufferMutex());
+			if(kinect.takeNewBuffers()){
+				display.copy_from(kinect.getRgbImage());
+				++shown;
+			}
+		}
+		const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		const double elapsed = chrono::duration<double>(now - report).count();
+		if(elapsed < 1.0)
+			continue;
+		for(int i = 0; i < device_count; ++i){
+			uint64_t video, depth;
+			{
+				lock_guard<std::mutex> lock(kinects[i]->bufferMutex());
+				video = kinects[i]->videoStamp().count;
+				depth = kinects[i]->depthStamp().count;
+			}
+			cout << "device " << i << "\tvideo " << (video - video_count[i]) / elapsed << " frames/s\tdepth " << (depth - depth_count[i]) / elapsed << " frames/s";
+			video_count[i] = video;
+			depth_count[i] = depth;
+#ifdef FREENECT_SIMULATED
+			freenect_sim_stats stats[2];
+			freenect_sim_get_stats(kinects[i]->device(), 0, &stats[0]);
+			freenect_sim_get_stats(kinects[i]->device(), 1, &stats[1]);
+			for(int s = 0; s < 2; ++s)
+				cout << "\t" << (s ? "depth " : "video ") << stats[s].dropped << " of " << stats[s].due << " dropped, late " << stats[s].late_mean << " ms avg "
+					<< stats[s].late_max << " ms max, callback " << stats[s].callback_mean << " ms avg " << stats[s].callback_max << " ms max";
+#endif
+			cout << endl;
+		}
+		cout << "shown " << shown / elapsed << " frames/s" << endl;
+		shown = 0;
+		report = now;
+		if(chrono::duration<double>(now - start).count() >= seconds)
+			break;
+	}
+	freenect.stop();
+	for(unsigned i = 0; i < kinects.size(); ++i){
+		kinects[i]->stopDepth();
+		kinects[i]->stopVideo();
+	}
+	return freenect.failed() ? 1 : 0;
+}
+
+// compares the table based conversion of disparity to millimetres and points with evaluating
+// the formula per pixel, on a synthetic disparity image covering all valid disparities
+int runConvertBenchmark(){
+	const ImageRef size(640, 480);
+	vector<uint16_t> disparity(size.x * size.y);
+	for(int y = 0; y < size.y; ++y)
+		for(int x = 0; x < size.x; ++x)
+			disparity[y * size.x + x] = (x % 64 == 0) ? 2047 : uint16_t(400 + (x + y) % 700);
+
+	DisparityConverter converter;
+	vector<float> xyz(3 * disparity.size()), reference_xyz(3 * disparity.size());
+	vector<uint16_t> mm(disparity.size()), reference_mm(disparity.size());
+	const int runs = 100;
+	double ms[3];
+	for(int method = 0; method < 3; ++method){
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for(int i = 0; i < runs; ++i){
+			if(method == 0)
+				disparity_to_points_reference(disparity.data(), size, converter.calibration(), reference_xyz.data(), reference_mm.data());
+			else if(method == 1)
+				converter.convert(disparity.data(), disparity.size(), mm.data());
+			else
+				converter.convert(disparity.data(), size, xyz.data(), mm.data());
+		}
+		ms[method] = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+	}
+
+	int mm_difference = 0;
+	float xyz_difference = 0;
+	for(unsigned i = 0; i < mm.size(); ++i){
+		mm_difference = max(mm_difference, abs(int(mm[i]) - int(reference_mm[i])));
+		for(int c = 0; c < 3; ++c)
+			xyz_difference = max(xyz_difference, fabs(xyz[3 * i + c] - reference_xyz[3 * i + c]));
+	}
+	cout << "per pixel formula " << ms[0] << " ms\ttable to mm " << ms[1] << " ms\ttable to mm and points " << ms[2] << " ms\n"
+		<< "largest difference " << mm_difference << " mm, " << xyz_difference * 1000 << " mm in the points" << endl;
+	return 0;
+}
+
+// Checks that recording and querying window events in an EventSummary never allocates, by
+// counting the calls of operator new: events recorded the way GLWindow::get_events records them
+// and queried the way the render loop does, including keys and buttons the tables do not hold,
+// and get_events itself on an offscreen window. Returns the number of failed checks.
+int runEventTest(){
+	int failures = 0;
+	// the counter itself, a vector allocates once
+	long before = allocation_count();
+	{
+		vector<int> probe(1);
+	}
+	if(allocation_count() - before != 1){
+		cout << "allocations are not counted" << endl;
+		return 1;
+	}
+
+	GLWindow::EventSummary summary;
+	const int frames = 10000, per_frame = 16;
+	long checksum = 0;
+	before = allocation_count();
+	for(int frame = 0; frame < frames; ++frame){
+		summary.clear();
+		for(int i = 0; i < per_frame; ++i){
+			const int key = (frame * 7 + i * 31) % 600 - 40;
+			++summary.key_down[key];
+			++summary.key_up[key];
+			summary.mouse_down[1 << (i % 8)] = make_pair(ImageRef(i, frame), i);
+			summary.mouse_up[1 << (i % 8)] = make_pair(ImageRef(frame, i), i);
+			++summary.events[i % 2];
+			summary.cursor = ImageRef(i, frame);
+			summary.cursor_moved = true;
+		}
+		checksum += summary.key_up.count('a') + summary.should_quit();
+		for(GLWindow::EventSummary::key_iterator k = summary.key_down.begin(); k != summary.key_down.end(); ++k)
+			checksum += k->second;
+		for(GLWindow::EventSummary::mouse_iterator m = summary.mouse_up.begin(); m != summary.mouse_up.end(); ++m)
+			checksum += m->second.second;
+	}
+	const long recorded = allocation_count() - before;
+	cout << "recorded and queried " << frames * per_frame * 6 << " events in " << frames << " summaries: " << recorded << " allocations" << endl;
+	if(recorded != 0)
+		++failures;
+
+	// the tables record what they hold, and drop the rest
+	summary.clear();
+	++summary.key_down['q'];
+	++summary.key_down['q'];
+	++summary.key_down[-1];
+	++summary.key_down[GLWindow::KeyTable::SIZE];
+	summary.mouse_down[GLWindow::BUTTON_RIGHT] = make_pair(ImageRef(3, 4), 5);
+	summary.mouse_down[GLWindow::BUTTON_LEFT | GLWindow::BUTTON_RIGHT] = make_pair(ImageRef(6, 7), 8);
+	int keys = 0, buttons = 0;
+	for(GLWindow::EventSummary::key_iterator k = summary.key_down.begin(); k != summary.key_down.end(); ++k)
+		++keys;
+	for(GLWindow::EventSummary::mouse_iterator m = summary.mouse_down.begin(); m != summary.mouse_down.end(); ++m)
+		++buttons;
+	const bool ok = keys == 1 && summary.key_down.find('q')->second == 2 && !summary.key_down.count(-1) && buttons == 1
+		&& summary.mouse_down.find(GLWindow::BUTTON_RIGHT)->second.first == ImageRef(3, 4) && !summary.should_quit();
+	cout << "event tables " << (ok ? "record the expected events" : "FAILED") << endl;
+	if(!ok)
+		++failures;
+
+	// the event loop of a window, after a first call that may set up the backend
+	try {
+		GLWindow window(ImageRef(64, 64), "events", 24, "offscreen");
+		window.get_events(summary);
+		before = allocation_count();
+		for(int i = 0; i < 1000; ++i){
+			summary.clear();
+			window.get_events(summary);
+		}
+		const long polled = allocation_count() - before;
+		cout << "1000 calls of get_events: " << polled << " allocations" << endl;
+		if(polled != 0)
+			++failures;
+	} catch(const Exceptions::All & error){
+		cout << "no window for get_events: " << error.what << endl;
+	}
+	cout << (failures ? "events test failed" : "events test passed") << " (" << checksum << ")" << endl;
+	return failures;
+}
+
+// Draws a known pattern into an offscreen window, red with a green lower left quadrant, reads
+// it back with GLWindow::read_pixels and checks every pixel, at an odd size whose rows are not
+// multiples of 4 bytes and again after resizing the window. Returns the number of failed checks.
+int runWindowTest(){
+	int failures = 0;
+	try {
+		GLWindow window(ImageRef(67, 33), "window", 24, "offscreen");
+		const ImageRef sizes[2] = { ImageRef(67, 33), ImageRef(160, 90) };
+		for(int s = 0; s < 2; ++s){
+			if(s > 0){
+				window.set_size(sizes[s]);
+				// windows of a display are resized with their next events
+				GLWindow::EventSummary events;
+				window.get_events(events);
+			}
+			const ImageRef size = window.size();
+			glViewport(0, 0, size.x, size.y);
+			glDisable(GL_SCISSOR_TEST);
+			glClearColor(1, 0, 0, 1);
+			glClear(GL_COLOR_BUFFER_BIT);
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(0, 0, size.x / 2, size.y / 2);
+			glClearColor(0, 1, 0, 1);
+			glClear(GL_COLOR_BUFFER_BIT);
+			glDisable(GL_SCISSOR_TEST);
+			glFinish();
+
+			vector<unsigned char> rgb;
+			window.read_pixels(rgb);
+			int wrong = 0;
+			if(size != sizes[s] || rgb.size() != size_t(size.x * size.y * 3))
+				wrong = size.x * size.y;
+			else
+				for(int y = 0; y < size.y; ++y)
+					for(int x = 0; x < size.x; ++x){
+						// rows come top first, the quadrant is at the bottom of the image
+						const bool green = x < size.x / 2 && y >= size.y - size.y / 2;
+						const unsigned char * pixel = &rgb[(y * size.x + x) * 3];
+						if(pixel[0] != (green ? 0 : 255) || pixel[1] != (green ? 255 : 0) || pixel[2] != 0)
+							++wrong;
+					}
+			cout << size.x << "x" << size.y << ": " << wrong << " wrong pixels" << endl;
+			if(wrong)
+				++failures;
+		}
+	} catch(const Exceptions::All & error){
+		cout << "no offscreen window: " << error.what << endl;
+		++failures;
+	}
+	cout << (failures ? "window test failed" : "window test passed") << endl;
+	return failures;
+}
+
+// Checks that compressed depth images decompress to the original, also from a file, and that
+// truncated data and headers of impossible sizes are rejected, and compares the size and time
+// of compressing a frame with the png that the snapshots also write. Returns the number of
+// failed checks.
+int runCodecTest(){
+	int failures = 0;
+	const ImageRef size(640, 480);
+	const int count = size.x * size.y;
+	// a disparity scene with holes and shadows, noise over the 11 bits of the disparity, noise
+	// over all 16 bits like the depth and player index of the Kinect SDK, and a frame without depth
+	const char * names[] = { "scene", "11 bit noise", "16 bit noise", "no depth" };
+	vector<uint16_t> depth(count), decoded(count);
+	for(int pattern = 0; pattern < 4; ++pattern){
+		uint32_t seed = 1;
+		for(int i = 0; i < count; ++i){
+			seed = seed * 1664525 + 1013904223;
+			const int x = i % size.x, y = i / size.x;
+			switch(pattern){
+			case 0: depth[i] = (seed >> 24) < 20 || x % 97 < 4 ? 0 : uint16_t(y < 100 ? 900 : 600 + x / 2 + y / 4 + (seed >> 29)); break;
+			case 1: depth[i] = uint16_t((seed >> 16) & 2047); break;
+			case 2: depth[i] = uint16_t(seed >> 16); break;
+			default: depth[i] = 0;
+			}
+		}
+
+		vector<uint8_t> compressed;
+		const size_t bytes = compress_depth(depth.data(), count, compressed);
+		bool ok = bytes == compressed.size() && decompress_depth(compressed.data(), bytes, decoded.data(), count) && decoded == depth;
+		// a frame cut short anywhere within its last word, or at half its length, is rejected
+		for(size_t cut = 1; cut <= 4 && cut <= bytes && ok; ++cut)
+			ok = !decompress_depth(compressed.data(), bytes - cut, decoded.data(), count);
+		ok = ok && (bytes < 8 || !decompress_depth(compressed.data(), bytes / 2, decoded.data(), count));
+		// counts that end within a run
+		const int counts[] = { 0, 1, 2, 3, 17, 641 };
+		for(int c = 0; c < 6 && ok; ++c){
+			vector<uint8_t> part;
+			compress_depth(depth.data(), counts[c], part);
+			fill(decoded.begin(), decoded.end(), 0xdead);
+			ok = decompress_depth(part.data(), part.size(), decoded.data(), counts[c]) && equal(decoded.begin(), decoded.begin() + counts[c], depth.begin())
+				&& decoded[counts[c]] == 0xdead;
+		}
+
+		const int runs = 50;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for(int i = 0; i < runs; ++i){
+			compressed.clear();
+			compress_depth(depth.data(), count, compressed);
+		}
+		const double compress_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+		start = chrono::high_resolution_clock::now();
+		for(int i = 0; i < runs; ++i)
+			decompress_depth(compressed.data(), bytes, decoded.data(), count);
+		const double decompress_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+		cout << names[pattern] << "	" << bytes << " bytes, " << double(bytes) / count << " per pixel	compress " << compress_ms << " ms	decompress "
+			<< decompress_ms << " ms	" << (ok ? "round trip ok" : "round trip FAILED") << endl;
+		if(!ok)
+			++failures;
+	}
+
+	// the file format with the scene, and headers claiming more pixels than an int can count
+	for(int i = 0; i < count; ++i){
+		const int x = i % size.x, y = i / size.x;
+		depth[i] = x % 97 < 4 ? 0 : uint16_t(y < 100 ? 900 : 600 + x / 2 + y / 4);
+	}
+	const char * filename = "codec_test.rvl";
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	bool ok = save_depth(depth.data(), size, filename);
+	const double rvl_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	vector<uint16_t> loaded;
+	ImageRef loaded_size;
+	ok = ok && load_depth(loaded, loaded_size, filename) && loaded_size == size && loaded == depth;
+	long rvl_bytes = 0;
+	if(FILE * file = fopen(filename, "rb")){
+		fseek(file, 0, SEEK_END);
+		rvl_bytes = ftell(file);
+		fclose(file);
+	}
+	const int sizes[][2] = { { 65536, 65536 }, { 0x7fffffff, 2 }, { 4097, 1 } };
+	for(int s = 0; s < 3 && ok; ++s){
+		if(FILE * file = fopen(filename, "wb")){
+			const uint8_t header[16] = { 'R', 'V', 'L', '1', uint8_t(sizes[s][0]), uint8_t(sizes[s][0] >> 8), uint8_t(sizes[s][0] >> 16), uint8_t(sizes[s][0] >> 24),
+										 uint8_t(sizes[s][1]), uint8_t(sizes[s][1] >> 8), uint8_t(sizes[s][1] >> 16), uint8_t(sizes[s][1] >> 24), 0, 0, 0, 0 };
+			fwrite(header, 1, 16, file);
+			fclose(file);
+		}
+		ok = !load_depth(loaded, loaded_size, filename);
+	}
+	remove(filename);
+	cout << "file	" << rvl_bytes << " bytes written in " << rvl_ms << " ms	" << (ok ? "round trip ok" : "round trip FAILED") << endl;
+	if(!ok)
+		++failures;
+
+	// the png of the snapshots, written with WIC on Windows only
+	start = chrono::high_resolution_clock::now();
+	if(save_image(depth.data(), size, 2, L"codec_test.png") >= 0){
+		const double png_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+		long png_bytes = 0;
+		if(FILE * file = fopen("codec_test.png", "rb")){
+			fseek(file, 0, SEEK_END);
+			png_bytes = ftell(file);
+			fclose(file);
+		}
+		remove("codec_test.png");
+		cout << "png	" << png_bytes << " bytes written in " << png_ms << " ms	" << double(png_bytes) / max(rvl_bytes, 1L) << " times the size, "
+			<< png_ms / rvl_ms << " times the time" << endl;
+	} else {
+		cout << "png	not available on this platform" << endl;
+	}
+	cout << (failures ? "codec test failed" : "codec test passed") << endl;
+	return failures;
+}
+
+// checks the unpack kernels against the bit by bit reference on bit patterns and times both,
+// returns the number of failed checks
+int runUnpackTest(){
+	int failures = 0;
+	const int widths[] = { 11, 10 };
+	for(int w = 0; w < 2; ++w){
+		const int bits = widths[w];
+		const uint16_t mask = uint16_t((1 << bits) - 1);
+		// counts not a multiple of 16 or 8 exercise the scalar rest
+		const size_t counts[] = { 0, 1, 7, 8, 15, 16, 17, 31, 33, 100, 640*480, 640*488 };
+		for(int c = 0; c < 12; ++c){
+			const size_t count = counts[c];
+			const char * names[] = { "zeros", "ones", "alternating", "walking bit", "counting", "random" };
+			for(int pattern = 0; pattern < 6; ++pattern){
+				vector<uint16_t> expected(count);
+				uint32_t seed = 12345;
+				for(size_t i = 0; i < count; ++i){
+					switch(pattern){
+					case 0: expected[i] = 0; break;
+					case 1: expected[i] = mask; break;
+					case 2: expected[i] = (i & 1) ? uint16_t(0x5555 & mask) : uint16_t(0x2aaa & mask); break;
+					case 3: expected[i] = uint16_t(1 << (i % bits)); break;
+					case 4: expected[i] = uint16_t(i & mask); break;
+					default:
+						seed = seed * 1664525 + 1013904223;
+						expected[i] = uint16_t((seed >> 16) & mask);
+					}
+				}
+				// pack most significant bit first, with random bits after the last value
+				vector<uint8_t> packed(packed_size(bits, count) + 16, 0xa5);
+				fill(packed.begin(), packed.begin() + packed_size(bits, count), 0);
+				for(size_t i = 0; i < count; ++i)
+					for(int b = 0; b < bits; ++b)
+						if(expected[i] & (1 << (bits - 1 - b))){
+							const size_t bit = i * bits + b;
+							packed[bit / 8] |= uint8_t(0x80 >> (bit % 8));
+						}
+				if(count * bits % 8)
+					packed[count * bits / 8] |= uint8_t(0xff >> (count * bits % 8));
+
+				vector<uint16_t> reference(count + 1, 0xdead), values(count + 1, 0xdead);
+				vector<uint8_t> display(count + 1, 0xee);
+				unpack_reference(packed.data(), bits, count, reference.data());
+				if(bits == 11)
+					unpack_11bit(packed.data(), count, values.data(), display.data());
+				else
+					unpack_10bit(packed.data(), count, values.data(), display.data());
+				bool ok = values[count] == 0xdead && display[count] == 0xee;
+				for(size_t i = 0; i < count && ok; ++i)
+					ok = reference[i] == expected[i] && values[i] == expected[i] && display[i] == expected[i] >> (bits - 8);
+				if(!ok){
+					cout << bits << " bit\t" << count << " values\t" << names[pattern] << "\tFAILED" << endl;
+					++failures;
+				}
+			}
+		}
+
+		// throughput on a full frame
+		const size_t count = bits == 11 ? 640*480 : 640*488;
+		vector<uint8_t> packed(packed_size(bits, count));
+		uint32_t seed = 1;
+		for(size_t i = 0; i < packed.size(); ++i){
+			seed = seed * 1664525 + 1013904223;
+			packed[i] = uint8_t(seed >> 24);
+		}
+		vector<uint16_t> values(count);
+		vector<uint8_t> display(count);
+		const int runs = 200;
+		double ms[3];
+		for(int method = 0; method < 3; ++method){
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			for(int i = 0; i < runs; ++i){
+				if(method == 0)
+					unpack_reference(packed.data(), bits, count, values.data());
+				else if(bits == 11)
+					unpack_11bit(packed.data(), count, values.data(), method == 2 ? display.data() : NULL);
+				else
+					unpack_10bit(packed.data(), count, values.data(), method == 2 ? display.data() : NULL);
+			}
+			ms[method] = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+		}
+		cout << bits << " bit\t" << count << " values\treference " << ms[0] << " ms\tSSE2 " << ms[1] << " ms\twith display " << ms[2] << " ms\t"
+			<< packed.size() / ms[1] * 1e-3 << " MB/s" << endl;
+	}
+	cout << (failures ? "unpack test failed" : "unpack test passed") << endl;
+	return failures;
+}
+
+// checks the alignment, views and copies of Image and SubImage, and times unpacking a depth
+// frame into an Image against the same kernel writing to a view one pixel off the alignment
+template <class T>
+static bool checkAlignment( const char * name ){
+	bool ok = true;
+	for(int width = 1; width <= 100 && ok; ++width){
+		Image<T> image(ImageRef(width, 3));
+		ok = is_aligned(image.data(), IMAGE_ALIGNMENT) && image.row_stride() >= width;
+		for(int y = 0; y < 3 && ok; ++y)
+			ok = is_aligned(image[y], IMAGE_ROW_ALIGNMENT);
+	}
+	// the frame sizes of the Kinect need no padding
+	const ImageRef sizes[] = { ImageRef(320, 240), ImageRef(640, 480), ImageRef(640, 488), ImageRef(1280, 1024) };
+	for(int s = 0; s < 4 && ok; ++s)
+		ok = Image<T>(sizes[s]).is_contiguous();
+	if(!ok)
+		cout << name << "\talignment FAILED" << endl;
+	return ok;
+}
+
+int runImageTest(){
+	int failures = 0;
+	failures += !checkAlignment<uint8_t>("uint8_t");
+	failures += !checkAlignment<uint16_t>("uint16_t");
+	failures += !checkAlignment<Rgb8>("Rgb8");
+	failures += !checkAlignment<float>("float");
+
+	// resize keeps the pixels for the same size and clears new ones
+	Image<uint16_t> image(ImageRef(37, 11));
+	for(int y = 0; y < 11; ++y)
+		for(int x = 0; x < 37; ++x)
+			image[y][x] = uint16_t(y * 100 + x);
+	const uint16_t * pixels = image.data();
+	image.resize(ImageRef(37, 11));
+	if(image.data() != pixels || image[ImageRef(36, 10)] != 1036){
+		cout << "resize to the same size FAILED" << endl;
+		++failures;
+	}
+
+	// a view of a region shares the pixels and copies out with its stride
+	SubImage<uint16_t> view = image.sub_image(ImageRef(5, 3), ImageRef(20, 6));
+	view[ImageRef(0, 0)] = 7;
+	Image<uint16_t> crop;
+	crop.copy_from(view);
+	bool ok = image[ImageRef(5, 3)] == 7 && view.row_stride() == image.row_stride() && !view.is_contiguous()
+		&& crop.size() == ImageRef(20, 6) && crop[ImageRef(0, 0)] == 7;
+	for(int y = 0; y < 6 && ok; ++y)
+		for(int x = 1; x < 20 && ok; ++x)
+			ok = crop[y][x] == (y + 3) * 100 + x + 5;
+	// and copies back into another region
+	copy(crop, image.sub_image(ImageRef(10, 0), ImageRef(20, 6)));
+	for(int y = 0; y < 6 && ok; ++y)
+		for(int x = 1; x < 20 && ok; ++x)
+			ok = image[y][10 + x] == (y + 3) * 100 + x + 5;
+	Image<uint16_t> duplicate(image);
+	ok = ok && duplicate.data() != image.data() && duplicate[ImageRef(36, 10)] == 1036;
+	image.resize(ImageRef(38, 11));
+	for(int y = 0; y < 11 && ok; ++y)
+		for(int x = 0; x < 38 && ok; ++x)
+			ok = image[y][x] == 0;
+	if(!ok){
+		cout << "views and copies FAILED" << endl;
+		++failures;
+	}
+
+	// the aligned and unaligned stores of the unpacking give the same values
+	const ImageRef size(640, 480);
+	const size_t count = size.x * size.y;
+	vector<uint8_t> packed(packed_size(11, count));
+	uint32_t seed = 1;
+	for(size_t i = 0; i < packed.size(); ++i){
+		seed = seed * 1664525 + 1013904223;
+		packed[i] = uint8_t(seed >> 24);
+	}
+	Image<uint16_t> aligned(size), shifted(size + ImageRef(1, 0));
+	Image<uint8_t> display(size), shifted_display(size + ImageRef(1, 0));
+	// one pixel to the right with the row stride of a contiguous frame is off by 2 and 1 bytes
+	SubImage<uint16_t> unaligned(shifted.data() + 1, size);
+	SubImage<uint8_t> unaligned_display(shifted_display.data() + 1, size);
+	unpack_11bit(packed.data(), count, aligned.data(), display.data());
+	unpack_11bit(packed.data(), count, unaligned.data(), unaligned_display.data());
+	ok = true;
+	for(int y = 0; y < size.y && ok; ++y)
+		ok = equal(aligned[y], aligned[y] + size.x, unaligned[y]) && equal(display[y], display[y] + size.x, unaligned_display[y]);
+	if(!ok){
+		cout << "unpacking to unaligned images FAILED" << endl;
+		++failures;
+	}
+
+	// and so do the aligned and unaligned loads and stores of the scaling to 8 bits
+	scale_to_8bit(aligned.data(), count, 3, display.data());
+	scale_to_8bit(unaligned.data(), count, 3, unaligned_display.data());
+	for(int y = 0; y < size.y && ok; ++y)
+		ok = equal(display[y], display[y] + size.x, unaligned_display[y]);
+	for(int x = 0; x < size.x && ok; ++x)
+		ok = display[ImageRef(x, 7)] == min(aligned[ImageRef(x, 7)] >> 3, 255);
+	if(!ok){
+		cout << "scaling unaligned images FAILED" << endl;
+		++failures;
+	}
+
+	// alternate the runs, so that both see the same state of the caches and the clock, and
+	// compare the best runs as well, which are far less noisy than the means
+	const char * names[] = { "unpack 11 bit with display", "scale to 8 bit" };
+	for(int kernel = 0; kernel < 2; ++kernel){
+		const int runs = 500;
+		double ms[2] = { 0, 0 }, best[2] = { 1e9, 1e9 };
+		for(int i = 0; i < runs; ++i){
+			for(int method = 0; method < 2; ++method){
+				uint16_t * values = method == 0 ? aligned.data() : unaligned.data();
+				uint8_t * out = method == 0 ? display.data() : unaligned_display.data();
+				chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+				if(kernel == 0)
+					unpack_11bit(packed.data(), count, values, out);
+				else
+					scale_to_8bit(values, count, 3, out);
+				const double time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+				ms[method] += time / runs;
+				best[method] = min(best[method], time);
+			}
+		}
+		cout << names[kernel] << "\taligned " << ms[0] << " ms, best " << best[0] << " ms\tunaligned " << ms[1] << " ms, best " << best[1] << " ms\t"
+			<< (ms[1] / ms[0] - 1) * 100 << " % slower unaligned, " << (best[1] / best[0] - 1) * 100 << " % in the best runs" << endl;
+	}
+	cout << (failures ? "image test failed" : "image test passed") << endl;
+	return failures;
+}
+
+// checks the fused depth ingest against its reference and times it against separate passes
+// for the copy, the 8 bit depth, the colour map and the histogram
+int runIngestTest(){
+	int failures = 0;
+	// a flat and a slanted disparity surface with noise and holes, and a frame of the skeleton mode of the
+	// Kinect SDK, millimetres shifted left by 3 above a player index, at a width that leaves a rest
+	for(int format = 0; format < 2; ++format){
+		const ImageRef size(format == 0 ? 640 : 637, 480);
+		Image<uint16_t> raw(size);
+		uint32_t seed = 1;
+		for(int y = 0; y < size.y; ++y)
+			for(int x = 0; x < size.x; ++x){
+				seed = seed * 1664525 + 1013904223;
+				if(format == 0)
+					raw[y][x] = (seed >> 24) < 20 ? 2047 : uint16_t(y < 100 ? 900 : 600 + x / 2 + y / 4 + (seed >> 29));
+				else
+					raw[y][x] = (seed >> 24) < 20 ? 0 : uint16_t(((800 + 4 * x + y) << 3) | (seed >> 30));
+			}
+		DepthIngest ingest;
+		if(format == 0)
+			setupDisparityIngest(ingest);
+		else
+			ingest.setFormat(3, 8192, 3, 4);
+		Image<uint16_t> depth(size), expected_depth(size);
+		Image<uint8_t> display(size), players(size), expected_display(size), expected_players(size);
+		Image<Rgb8> colour(size), expected_colour(size);
+		vector<uint32_t> histogram(DepthIngest::BINS + 1);
+		ingest.process(raw, depth, display, colour, players);
+		for(int y = 0; y < size.y; ++y)
+			depth_ingest_reference(raw[y], size.x, ingest.valueShift(), format == 0 ? 2047 : 8192, ingest.binShift(), ingest.levels(), ingest.colours(),
+				expected_depth[y], expected_display[y], expected_colour[y], expected_players[y], histogram.data());
+		uint16_t low = 0xffff, high = 0;
+		for(int y = 0; y < size.y; ++y)
+			for(int x = 0; x < size.x; ++x){
+				const uint16_t value = raw[y][x] >> ingest.valueShift();
+				if(value != 0 && value < (format == 0 ? 2047 : 8192)){
+					low = min(low, value);
+					high = max(high, value);
+				}
+			}
+		bool ok = equal(histogram.begin(), histogram.end(), ingest.histogram()) && ingest.minDepth() == low && ingest.maxDepth() == high
+			&& ingest.valid() == size.x * size.y - histogram[DepthIngest::INVALID];
+		for(int y = 0; y < size.y && ok; ++y)
+			for(int x = 0; x < size.x && ok; ++x)
+				ok = depth[y][x] == expected_depth[y][x] && display[y][x] == expected_display[y][x] && players[y][x] == expected_players[y][x]
+					&& colour[y][x].red == expected_colour[y][x].red && colour[y][x].green == expected_colour[y][x].green && colour[y][x].blue == expected_colour[y][x].blue;
+		cout << (format == 0 ? "disparity" : "skeleton mode") << " ingest " << (ok ? "matches" : "FAILED against") << " the reference, depths "
+			<< ingest.minDepth() << " to " << ingest.maxDepth() << ", " << ingest.valid() << " valid" << endl;
+		failures += !ok;
+	}
+
+	// auto-ranging of a wall at disparity 900 behind an object at 650, with 1 % of outliers on
+	// both sides: the range spans wall and object, the outliers are clipped, and the next frame
+	// with other noise keeps the range
+	{
+		const ImageRef size(640, 480);
+		Image<uint16_t> raw(size), depth(size);
+		Image<uint8_t> display(size);
+		Image<Rgb8> colour(size);
+		DepthIngest ingest;
+		setupDisparityIngest(ingest);
+		Rgb8 palette[256];
+		depthPalette(palette);
+		DepthAutoRange range;
+		uint32_t seed = 7;
+		bool ok = true;
+		for(int frame = 0; frame < 3; ++frame){
+			for(int y = 0; y < size.y; ++y)
+				for(int x = 0; x < size.x; ++x){
+					seed = seed * 1664525 + 1013904223;
+					const int outlier = (seed >> 24) < 3 ? 400 : (seed >> 24) > 252 ? 1040 : 0;
+					raw[y][x] = uint16_t(outlier ? outlier : (x > 200 && x < 400 && y > 100 && y < 300 ? 650 : 900) + int(seed >> 29) - 4);
+				}
+			ingest.process(raw, depth, display, colour);
+			const bool moved = range.update(ingest);
+			if(moved)
+				range.apply(ingest, palette);
+			ok = ok && moved == (frame == 0);
+			// the frame after the first shows the range
+			if(frame > 0)
+				ok = ok && display[ImageRef(300, 200)] < 16 && display[ImageRef(10, 10)] > 240 && range.nearDepth(ingest) > 600 && range.farDepth(ingest) < 920;
+		}
+		const int runs = 1000;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for(int i = 0; i < runs; ++i){
+			range.reset();
+			range.update(ingest);
+			range.apply(ingest, palette);
+		}
+		const double us = chrono::duration<double, micro>(chrono::high_resolution_clock::now() - start).count() / runs;
+		cout << "auto range " << range.nearDepth(ingest) << " to " << range.farDepth(ingest) << (ok ? "" : " FAILED") << ", update and apply in " << us << " us" << endl;
+		failures += !ok;
+	}
+
+	// the passes of KinectViewer before the fused ingest, with a histogram pass for the same outputs
+	const ImageRef size(640, 480);
+	const size_t count = size.x * size.y;
+	Image<uint16_t> raw(size), depth(size);
+	Image<uint8_t> display(size);
+	Image<Rgb8> colour(size);
+	uint32_t seed = 1;
+	for(size_t i = 0; i < count; ++i){
+		seed = seed * 1664525 + 1013904223;
+		raw.data()[i] = (seed >> 24) < 20 ? 2047 : uint16_t(600 + (i % size.x) / 2 + (i / size.x) / 4 + (seed >> 29));
+	}
+	// packed most significant bit first as in FREENECT_DEPTH_11BIT_PACKED
+	vector<uint8_t> packed(packed_size(11, count), 0);
+	for(size_t i = 0; i < count; ++i)
+		for(int b = 0; b < 11; ++b)
+			if(raw.data()[i] & (1 << (10 - b)))
+				packed[(i * 11 + b) / 8] |= uint8_t(0x80 >> ((i * 11 + b) % 8));
+	vector<Rgb8> colours(2048);
+	for(int i = 0; i < 2048; ++i)
+		colours[i] = depthColour(uint16_t(i));
+	DepthIngest ingest;
+	setupDisparityIngest(ingest);
+	vector<uint32_t> histogram(DepthIngest::BINS + 1);
+
+	const char * names[] = { "separate passes", "fused ingest", "unpack, then separate passes", "unpack and ingest per row", "unpack, then fused ingest" };
+	const int runs = 200;
+	double ms[5] = { 0, 0, 0, 0, 0 };
+	for(int i = 0; i < runs; ++i)
+		for(int method = 0; method < 5; ++method){
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			if(method == 0 || method == 2){
+				if(method == 0)
+					copy(raw, depth);
+				else
+					unpack_11bit(packed.data(), count, depth.data());
+				scale_to_8bit(depth.data(), count, 3, display.data());
+				for(size_t k = 0; k < count; ++k)
+					colour.data()[k] = colours[depth.data()[k]];
+				fill(histogram.begin(), histogram.end(), 0);
+				for(size_t k = 0; k < count; ++k)
+					++histogram[depth.data()[k] == 2047 ? DepthIngest::INVALID : depth.data()[k] >> 1];
+			} else if(method == 1){
+				ingest.process(raw, depth, display, colour);
+			} else if(method == 4){
+				unpack_11bit(packed.data(), count, depth.data());
+				ingest.process(depth, SubImage<uint16_t>(), display, colour);
+			} else {
+				ingest.begin();
+				for(int y = 0; y < size.y; ++y){
+					unpack_11bit(packed.data() + packed_size(11, size_t(y) * size.x), size.x, depth[y]);
+					ingest.row(depth[y], size.x, NULL, display[y], colour[y], NULL);
+				}
+				ingest.end();
+			}
+			ms[method] += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / runs;
+		}
+	for(int method = 0; method < 5; ++method)
+		cout << names[method] << "\t" << ms[method] << " ms" << endl;
+	cout << (failures ? "ingest test failed" : "ingest test passed") << endl;
+	return failures;
+}
+
 int main(int argc, char ** argv){
 
+	if(argc > 1 && string(argv[1]) == "-reader")
+		return runBusReader(argc > 2 ? atoi(argv[2]) : 0);
+	if(argc > 1 && string(argv[1]) == "-bench")
+		return runBusBenchmark();
+	if(argc > 1 && string(argv[1]) == "-demosaic")
+		return runDemosaicBenchmark(argc > 2 ? argv[2] : NULL);
+	if(argc > 1 && string(argv[1]) == "-wait")
+		return runWaitTest(argc > 2 ? atof(argv[2]) : 5);
+	if(argc > 1 && string(argv[1]) == "-events")
+		return runEventTest();
+	if(argc > 1 && string(argv[1]) == "-window")
+		return runWindowTest();
+	if(argc > 1 && string(argv[1]) == "-codec")
+		return runCodecTest();
+	if(argc > 1 && string(argv[1]) == "-unpack")
+		return runUnpackTest();
+	if(argc > 1 && string(argv[1]) == "-image")
+		return runImageTest();
+	if(argc > 1 && string(argv[1]) == "-ingest")
+		return runIngestTest();
+	if(argc > 1 && string(argv[1]) == "-convert")
+		return runConvertBenchmark();
+	if(argc > 1 && string(argv[1]) == "-load")
+		return runLoadTest(argc > 2 ? atof(argv[2]) : 10, argc > 3 ? atof(argv[3]) : 30, argc > 4 ? atof(argv[4]) : 0, argc > 5 && string(argv[5]) == "high");
+
 	cout << "Welcome to KinectViewer for ARVU @ TU Graz, 2011\n"
 			"Usage:\n"
 			"a\tswitch to infrared mode\n"
 			"s\tswitch to RGB mode\n"
+			"r\tswitch to packed 10 bit infrared mode\n"
+			"b\tswitch to Bayer mode, demosaiced by KinectViewer\n"
+			"e\ttoggle edge aware demosaicing in Bayer mode\n"
+			"k\ttoggle packed 11 bit depth\n"
+			"g\ttoggle the auto-ranging of the depth view to the depths of the scene\n"
+			"h\ttoggle the high resolution video of 1280x1024\n"
+			"d\tshow the next device\n"
 			"Space\trecord a snapshot\n"
 			"i\tprint information\n"
-			"esc\texit\n" << endl;
+			"esc\texit\n"
+			"All connected devices are captured, every one publishes on its own frame bus.\n"
+			"Run with -reader [device] to attach to the frame bus of a running KinectViewer,\n"
+			"with -bench to measure the frame bus with several readers,\n"
+			"with -demosaic [file.bayer] to test and benchmark the Bayer conversion,\n"
+			"with -wait [seconds] to measure the CPU usage and latency of waiting for frames,\n"
+			"with -events to check that recording window events does not allocate,\n"
+			"with -window to check the readback of an offscreen window,\n"
+			"with -codec to test the depth compression and compare it with png,\n"
+			"with -unpack to test and time the unpacking of the packed formats,\n"
+			"with -image to test the aligned images and time an aligned kernel,\n"
+			"with -ingest to test and time the depth ingest and its auto-ranging,\n"
+			"with -convert to time the conversion of disparity to millimetres and points,\n"
+			"or with -load [seconds] [rate] [jitter] [high] to capture without a window and print the frame rates.\n" << endl;
+
+	// all devices share one context, whose events are processed on a single thread
+	Freenect freenect;
+	const int device_count = freenect.deviceCount();
+	if(device_count == 0){
+		cout << "no Kinect found" << endl;
+		return 1;
+	}
+	vector<MyKinect *> kinects;
+	for(int i = 0; i < device_count; ++i){
+		MyKinect & device = freenect.createDevice<MyKinect>(i);
+		device.startVideo();
+		device.startDepth();
+		kinects.push_back(&device);
+	}
+	freenect.start();
+	cout << device_count << " devices" << endl;
 
 	GLWindow window(ImageRef(640+640,488), "KinectViewer");
 	GLWindow::EventSummary events;
 
-	MyKinect kinect(0);
-
-	kinect.startVideo();
-	kinect.startDepth();
+	int mode = 0;			// 0 RGB, 1 infrared, 2 Bayer, 3 packed infrared
+	int shown = 0;
+	bool edge_aware = false;
+	bool packed_depth = false;
+	bool high_resolution = false;
+	DisparityConverter converter;
+	// latency from the arrival of the newest buffer to the swap, and the CPU usage since the last 'i'
+	double latency_sum = 0, latency_max = 0;
+	int rendered = 0;
+	double cpu_mark = processTime();
+	chrono::steady_clock::time_point wall_mark = chrono::steady_clock::now();
 
-	int mode = 0;
-
-	while(!events.should_quit()){
+	while(!events.should_quit() && !freenect.failed()){
+		MyKinect & kinect = *kinects[shown];
+		// sleep until the event thread delivers a buffer of the shown device or window messages arrive
+		window.wait_events(kinect.frameSignal(), 100);
 		events.clear();
 		window.get_events(events);
-		
-		if(kinect.haveVideoBuffer() || kinect.haveDepthBuffer()){
+
+		// a Bayer frame is converted here rather than on the event thread
+		kinect.demosaicPending();
+		unique_lock<std::mutex> lock(kinect.bufferMutex());
+		if(kinect.takeNewBuffers()){
+			// the video is scaled to fit the left half of the window at any resolution
+			const ImageRef & video_size = kinect.videoSize();
+			const float zoom = min(640.0f / video_size.x, 488.0f / video_size.y);
+			glClear(GL_COLOR_BUFFER_BIT);
 			glRasterPos2i(0,0);
-			if(!mode)
-				glDrawPixels(640, 480, GL_RGB, GL_UNSIGNED_BYTE,  kinect.getVideoBuffer());
-			else
-				glDrawPixels(640, 488, GL_LUMINANCE, GL_UNSIGNED_BYTE, kinect.getVideoBuffer());
+			glPixelZoom(zoom, -zoom);
+			// the buffer keeps the format of the last frame until one in a newly selected format arrives
+			glDrawPixels(video_size.x, video_size.y, kinect.isVideoInfrared() ? GL_LUMINANCE : GL_RGB, GL_UNSIGNED_BYTE, kinect.getVideoBuffer());
+			glPixelZoom(1, -1);
 			glRasterPos2i(640,0);
-			glDrawPixels(640, 480, GL_RGB, GL_UNSIGNED_BYTE, kinect.getDepthTexture());
+			glDrawPixels(kinect.depthSize().x, kinect.depthSize().y, GL_RGB, GL_UNSIGNED_BYTE, kinect.getDepthTexture());
+			const uint64_t newest = max(kinect.videoStamp().received, kinect.depthStamp().received);
+			// glDrawPixels has copied the buffers, don't block the capture thread during the swap
+			lock.unlock();
 			window.swap_buffers();
+			const double latency = (frame_bus_time() - newest) * 1e-6;
+			latency_sum += latency;
+			latency_max = max(latency_max, latency);
+			++rendered;
 		}
-
-		kinect.process();
+		if(lock.owns_lock())
+			lock.unlock();
 
 		// V D V D		ok
 		// D V V D		fail
@@ -158,47 +1515,128 @@ int main(int argc, char ** argv){
 		// D V D V		ok ?
 
 		if(events.key_up.count('a')){
-			kinect.stopVideo(); 
-			kinect.stopDepth();
-			kinect.setVideoFormat(FREENECT_VIDEO_IR_8BIT);
-			kinect.startVideo();
-			kinect.startDepth();
+			setVideoFormat(kinects, FREENECT_VIDEO_IR_8BIT, high_resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM);
 			cout << "set to infrared" << endl;
 			mode = 1;
 		}
 		if(events.key_up.count('s')){
-			kinect.stopVideo();
-			kinect.stopDepth();
-			kinect.setVideoFormat(FREENECT_VIDEO_RGB);
-			kinect.startVideo();
-			kinect.startDepth();
+			setVideoFormat(kinects, FREENECT_VIDEO_RGB, high_resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM);
 			cout << "set to rgb" << endl;
 			mode = 0;
 		}
+		if(events.key_up.count('r')){
+			setVideoFormat(kinects, FREENECT_VIDEO_IR_10BIT_PACKED, high_resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM);
+			cout << "set to packed infrared" << endl;
+			mode = 3;
+		}
+		if(events.key_up.count('k')){
+			packed_depth = !packed_depth;
+			setDepthFormat(kinects, packed_depth ? FREENECT_DEPTH_11BIT_PACKED : FREENECT_DEPTH_11BIT);
+			cout << "depth " << (packed_depth ? "packed" : "unpacked") << endl;
+		}
+		if(events.key_up.count('g')){
+			const bool auto_range = !kinect.autoRangeEnabled();
+			for(unsigned i = 0; i < kinects.size(); ++i)
+				kinects[i]->enableAutoRange(auto_range);
+			cout << "depth auto-ranging " << (auto_range ? "on" : "off") << endl;
+		}
+		if(events.key_up.count('b')){
+			setVideoFormat(kinects, FREENECT_VIDEO_BAYER, high_resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM);
+			cout << "set to bayer" << endl;
+			mode = 2;
+		}
+		if(events.key_up.count('h')){
+			// the current format again at the other resolution, the buffers follow with the next frames
+			const freenect_video_format formats[] = { FREENECT_VIDEO_RGB, FREENECT_VIDEO_IR_8BIT, FREENECT_VIDEO_BAYER, FREENECT_VIDEO_IR_10BIT_PACKED };
+			high_resolution = !high_resolution;
+			setVideoFormat(kinects, formats[mode], high_resolution ? FREENECT_RESOLUTION_HIGH : FREENECT_RESOLUTION_MEDIUM);
+			cout << "video " << (high_resolution ? "1280 x 1024" : "640 x 480") << endl;
+		}
+		if(events.key_up.count('e')){
+			edge_aware = !edge_aware;
+			for(unsigned i = 0; i < kinects.size(); ++i)
+				kinects[i]->setDemosaicMethod(edge_aware ? DEMOSAIC_EDGE_AWARE : DEMOSAIC_BILINEAR);
+			cout << "demosaic " << (edge_aware ? "edge aware" : "bilinear") << endl;
+		}
+		if(events.key_up.count('d')){
+			shown = (shown + 1) % device_count;
+			cout << "showing device " << shown << endl;
+		}
 
 		if(events.key_up.count(' ')){
 			static int counter = 0;
+			// copy the buffers and hand them back to the event thread before converting and
+			// writing, which takes far longer than a frame
+			kinect.demosaicPending();
+			unique_lock<std::mutex> lock(kinect.bufferMutex());
+			const ImageRef video_size = kinect.videoSize();
+			// what the buffers hold, which is the selected mode only once its first frame arrived
+			const freenect_video_format video_format = kinect.videoFormat();
+			const int video_channels = kinect.videoChannels();
+			const vector<uint8_t> video(kinect.getVideoBuffer(), kinect.getVideoBuffer() + video_size.x * video_size.y * video_channels);
+			Image<uint8_t> bayer;
+			Image<uint16_t> infrared;
+			if(video_format == FREENECT_VIDEO_BAYER)
+				bayer = kinect.getBayerBuffer();
+			if(video_format == FREENECT_VIDEO_IR_10BIT_PACKED)
+				infrared = kinect.getInfraredImage();
+			const Image<uint16_t> depth = kinect.getDepthImage();
+			const Image<uint8_t> depth_scaled = kinect.getDepthScaled();
+			lock.unlock();
+
 			wostringstream filename;
 			filename << setfill(L'0');
-
-			if(mode == 0){
+			const ImageRef depth_size = depth.size();
+			if(video_channels == 3){
 				filename << "rgb_" << setw(4) << counter << ".png";
-				save_image(kinect.getVideoBuffer(), ImageRef(640, 480), 3, filename.str());
+				save_image(video.data(), video_size, 3, filename.str());
+				if(video_format == FREENECT_VIDEO_BAYER){
+					// the raw frame, to benchmark the demosaic on later with -demosaic
+					ostringstream bayer_filename;
+					bayer_filename << "bayer_" << setfill('0') << setw(4) << counter << ".bayer";
+					save_bayer(bayer.contiguous_data(), bayer.size(), bayer_filename.str());
+				}
 			} else {
 				filename << "int_" << setw(4) << counter << ".png";
-				save_image(kinect.getVideoBuffer(), ImageRef(640, 488), 1, filename.str());
+				save_image(video.data(), video_size, 1, filename.str());
+				if(video_format == FREENECT_VIDEO_IR_10BIT_PACKED){
+					filename.str(L"");
+					filename << "int10_" << setw(4) << counter << ".png";
+					save_image(infrared.contiguous_data(), infrared.size(), 2, filename.str());
+				}
 			}
 			filename.str(L"");
 			filename << "depth_" << setw(4) << counter << ".png";
-			save_image(kinect.getDepthBuffer(), ImageRef(640, 480), 2, filename.str());
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			save_image(depth.contiguous_data(), depth_size, 2, filename.str());
+			const double png_time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
 
-			vector<uint8_t> depth_scaled(640*480);
-			for(unsigned int i = 0; i < depth_scaled.size(); ++i)
-				depth_scaled[i] = kinect.getDepthBuffer()[i] >> 3;
+			// the same depth image losslessly compressed, much faster to write than png
+			ostringstream rvl_filename;
+			rvl_filename << "depth_" << setfill('0') << setw(4) << counter << ".rvl";
+			start = chrono::high_resolution_clock::now();
+			save_depth(depth.contiguous_data(), depth_size, rvl_filename.str());
+			const double rvl_time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+			cout << "depth saved in " << png_time << " ms as png, " << rvl_time << " ms as rvl" << endl;
 
+			// the upper 8 bits of the depth come with every frame
 			filename.str(L"");
 			filename << "depth_scaled_" << setw(4) << counter << ".png";
-			save_image(depth_scaled.data(), ImageRef(640, 480), 1, filename.str());
+			save_image(depth_scaled.contiguous_data(), depth_size, 1, filename.str());
+
+			// metric depth and the point cloud
+			vector<uint16_t> depth_mm(depth_size.x * depth_size.y);
+			vector<float> points(3 * depth_mm.size());
+			start = chrono::high_resolution_clock::now();
+			const size_t valid = converter.convert(depth.contiguous_data(), depth_size, points.data(), depth_mm.data());
+			const double convert_time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+			filename.str(L"");
+			filename << "depth_mm_" << setw(4) << counter << ".png";
+			save_image(depth_mm.data(), depth_size, 2, filename.str());
+			ostringstream ply_filename;
+			ply_filename << "points_" << setfill('0') << setw(4) << counter << ".ply";
+			save_points(points.data(), depth_size, ply_filename.str());
+			cout << valid << " points converted in " << convert_time << " ms" << endl;
 
 			cout << "saved snapshots " << counter << endl;
 			++counter;
@@ -208,12 +1646,49 @@ int main(int argc, char ** argv){
 			kinect.getVideoSize(x,y);
 			cout << "rgb\t" << mode << "\t" << x << " , " << y << endl;
 			kinect.getDepthSize(x,y);
-			cout << "depth\t\t" << x << " , " << y << endl;
+			cout << "depth\t" << (packed_depth ? "packed" : "") << "\t" << x << " , " << y << endl;
+			{
+				lock_guard<std::mutex> lock(kinect.bufferMutex());
+				cout << "center\t\t" << converter.millimetres(kinect.getDepthImage()[kinect.depthSize() / 2]) << " mm" << endl;
+				const DepthIngest & ingest = kinect.depthIngest();
+				cout << "depths\t\t" << converter.millimetres(ingest.minDepth()) << " to " << converter.millimetres(ingest.maxDepth()) << " mm, "
+					<< ingest.valid() << " valid pixels" << endl;
+				if(kinect.autoRangeEnabled()){
+					const DepthAutoRange & range = kinect.depthRange();
+					cout << "depth view\t" << converter.millimetres(uint16_t(range.nearDepth(ingest))) << " to "
+						<< converter.millimetres(uint16_t(min(range.farDepth(ingest), 2046))) << " mm, moved " << range.changes() << " times" << endl;
+				}
+			}
+			const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			const double elapsed = chrono::duration<double>(now - wall_mark).count();
+			const double cpu = processTime();
+			cout << "render\t\t" << rendered / elapsed << " frames/s, " << latency_sum / max(rendered, 1) << " ms avg " << latency_max
+				<< " ms max from arrival to swap, CPU " << (cpu - cpu_mark) / elapsed * 100 << " %" << endl;
+			latency_sum = latency_max = 0;
+			rendered = 0;
+			cpu_mark = cpu;
+			wall_mark = now;
+			if(mode == 2){
+				lock_guard<std::mutex> lock(kinect.bufferMutex());
+				cout << "demosaic\t" << (edge_aware ? "edge aware" : "bilinear") << "\t" << kinect.demosaicTime() << " ms" << endl;
+			}
+			for(unsigned i = 0; i < kinects.size(); ++i){
+				lock_guard<std::mutex> lock(kinects[i]->bufferMutex());
+				cout << "rgb\t\t" << kinects[i]->videoStamp() << "\n"
+					<< "depth\t\t" << kinects[i]->depthStamp() << "\n"
+					<< "bus\t\t" << frame_bus_name(i) << "\t" << kinects[i]->frameBus().published() << " frames published" << endl;
+			}
 		}
 	}
+	if(freenect.failed())
+		cout << "processing the freenect events failed" << endl;
 
-	kinect.stopDepth();
-	kinect.stopVideo();
+	// no callbacks may run while the devices stop, they are closed with freenect
+	freenect.stop();
+	for(unsigned i = 0; i < kinects.size(); ++i){
+		kinects[i]->stopDepth();
+		kinects[i]->stopVideo();
+	}
 
 	return 0;
 }
@@ -0,0 +1,131 @@
+#include "unpack.h"
+
+#include <emmintrin.h>
+
+void unpack_reference( const uint8_t * packed, const int bits, const size_t count, uint16_t * values ){
+    const uint32_t mask = (1u << bits) - 1;
+    uint32_t buffer = 0;
+    int buffered = 0;
+    for(size_t i = 0; i < count; ++i){
+        while(buffered < bits){
+            buffer = (buffer << 8) | *(packed++);
+            buffered += 8;
+        }
+        buffered -= bits;
+        values[i] = uint16_t((buffer >> buffered) & mask);
+    }
+}
+
+// Unpacks 8 values of BITS bits from the BITS bytes at packed, reading 16 bytes. The 32 bit lane
+// j of the result takes the values 2j and 2j+1: the 4 bytes holding both are moved into the lane
+// and byte swapped, then shifted left by the offset of the first value within its first byte, so
+// that the first value sits in the top bits of every lane and the second one right below it.
+template <int BITS>
+static inline __m128i unpack8( const uint8_t * packed ){
+    // first byte and bit of the value pairs 1 to 3, pair 0 starts at bit 0
+    enum {
+        BYTE1 = 2 * BITS / 8, BYTE2 = 4 * BITS / 8, BYTE3 = 6 * BITS / 8,
+        BIT1 = 2 * BITS % 8, BIT2 = 4 * BITS % 8, BIT3 = 6 * BITS % 8
+    };
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed));
+    __m128i pairs = _mm_and_si128(bytes, _mm_set_epi32(0, 0, 0, -1));
+    pairs = _mm_or_si128(pairs, _mm_and_si128(_mm_slli_si128(bytes, 4 - BYTE1), _mm_set_epi32(0, 0, -1, 0)));
+    pairs = _mm_or_si128(pairs, _mm_and_si128(_mm_slli_si128(bytes, 8 - BYTE2), _mm_set_epi32(0, -1, 0, 0)));
+    pairs = _mm_or_si128(pairs, _mm_and_si128(_mm_slli_si128(bytes, 12 - BYTE3), _mm_set_epi32(-1, 0, 0, 0)));
+
+    // big endian to little endian in each 32 bit lane
+    pairs = _mm_or_si128(_mm_slli_epi16(pairs, 8), _mm_srli_epi16(pairs, 8));
+    pairs = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+
+    // shift every lane left by its bit offset, as the lower 32 bits of a multiplication as SSE2
+    // has neither variable shifts nor a 32 bit multiplication; the bits of the previous values
+    // fall out of the lane
+    const __m128i even = _mm_mul_epu32(pairs, _mm_set_epi32(0, 1 << BIT2, 0, 1));
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(pairs, 32), _mm_set_epi32(0, 1 << BIT3, 0, 1 << BIT1));
+    const __m128i aligned = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+
+    // the first value of the pair into the lower and the second into the upper 16 bits
+    const __m128i first = _mm_srli_epi32(aligned, 32 - BITS);
+    const __m128i second = _mm_and_si128(_mm_slli_epi32(aligned, 2 * BITS - 16), _mm_set1_epi32(((1 << BITS) - 1) << 16));
+    return _mm_or_si128(first, second);
+}
+
+template <bool ALIGNED>
+static inline void store( __m128i * out, const __m128i value ){
+    if(ALIGNED)
+        _mm_store_si128(out, value);
+    else
+        _mm_storeu_si128(out, value);
+}
+
+// ALIGNED stores with aligned instructions, for outputs on 16 byte boundaries such as the rows
+// of an Image; the packed input has no useful alignment as 16 values take 22 or 20 bytes
+template <int BITS, bool ALIGNED>
+static void unpack( const uint8_t * packed, const size_t count, uint16_t * values, uint8_t * display ){
+    const size_t bytes = packed_size(BITS, count);
+    size_t i = 0;
+    // 16 values at a time, as long as the 16 bytes read for the second 8 are inside the buffer
+    for(; i + 16 <= count && (i / 8 + 1) * BITS + 16 <= bytes; i += 16){
+        const uint8_t * in = packed + i / 8 * BITS;
+        const __m128i low = unpack8<BITS>(in);
+        const __m128i high = unpack8<BITS>(in + BITS);
+        store<ALIGNED>(reinterpret_cast<__m128i *>(values + i), low);
+        store<ALIGNED>(reinterpret_cast<__m128i *>(values + i + 8), high);
+        if(display)
+            store<ALIGNED>(reinterpret_cast<__m128i *>(display + i), _mm_packus_epi16(_mm_srli_epi16(low, BITS - 8), _mm_srli_epi16(high, BITS - 8)));
+    }
+    // the rest starts at a multiple of 8 values, which is a whole byte
+    unpack_reference(packed + i / 8 * BITS, BITS, count - i, values + i);
+    if(display)
+        for(; i < count; ++i)
+            display[i] = uint8_t(values[i] >> (BITS - 8));
+}
+
+// both buffers on 16 byte boundaries, a NULL display counts as aligned
+static inline bool aligned( const void * values, const void * display ){
+    return ((reinterpret_cast<uintptr_t>(values) | reinterpret_cast<uintptr_t>(display)) & 15) == 0;
+}
+
+void unpack_11bit( const uint8_t * packed, const size_t count, uint16_t * values, uint8_t * display ){
+    if(aligned(values, display))
+        unpack<11, true>(packed, count, values, display);
+    else
+        unpack<11, false>(packed, count, values, display);
+}
+
+void unpack_10bit( const uint8_t * packed, const size_t count, uint16_t * values, uint8_t * display ){
+    if(aligned(values, display))
+        unpack<10, true>(packed, count, values, display);
+    else
+        unpack<10, false>(packed, count, values, display);
+}
+
+template <bool ALIGNED>
+static inline __m128i load( const uint16_t * in ){
+    return ALIGNED ? _mm_load_si128(reinterpret_cast<const __m128i *>(in)) : _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+}
+
+template <bool ALIGNED>
+static void scale( const uint16_t * values, const size_t count, const int shift, uint8_t * display ){
+    const __m128i bits = _mm_cvtsi32_si128(shift);
+    size_t i = 0;
+    for(; i + 32 <= count; i += 32){
+        const __m128i a = _mm_srl_epi16(load<ALIGNED>(values + i), bits);
+        const __m128i b = _mm_srl_epi16(load<ALIGNED>(values + i + 8), bits);
+        const __m128i c = _mm_srl_epi16(load<ALIGNED>(values + i + 16), bits);
+        const __m128i d = _mm_srl_epi16(load<ALIGNED>(values + i + 24), bits);
+        store<ALIGNED>(reinterpret_cast<__m128i *>(display + i), _mm_packus_epi16(a, b));
+        store<ALIGNED>(reinterpret_cast<__m128i *>(display + i + 16), _mm_packus_epi16(c, d));
+    }
+    for(; i < count; ++i){
+        const int value = values[i] >> shift;
+        display[i] = uint8_t(value > 255 ? 255 : value);
+    }
+}
+
+void scale_to_8bit( const uint16_t * values, const size_t count, const int shift, uint8_t * display ){
+    if(aligned(values, display))
+        scale<true>(values, count, shift, display);
+    else
+        scale<false>(values, count, shift, display);
+}
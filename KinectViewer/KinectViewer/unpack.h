@@ -0,0 +1,34 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Unpacking of the packed depth and infrared formats of the Kinect. In FREENECT_DEPTH_11BIT_PACKED
+// and FREENECT_VIDEO_IR_10BIT_PACKED libfreenect hands over the bit stream of the camera as it
+// arrives: the values follow each other without padding, most significant bit first, so 8 depth
+// values take 11 bytes and 8 infrared values 10 bytes. Unpacking them here instead of in the
+// driver saves the unpack on the event thread and the copy of the unpacked frame. The kernels
+// convert 16 values at a time with SSE2 and optionally write 8 bit display values, the values
+// shifted down to 8 bits, in the same pass. Outputs on 16 byte boundaries, such as the pixels
+// of an Image, are written with aligned stores.
+
+/// Unpack count 11 bit depth values to values, and their upper 8 bits to display if not NULL
+void unpack_11bit( const uint8_t * packed, const size_t count, uint16_t * values, uint8_t * display = NULL );
+/// Unpack count 10 bit infrared values to values, and their upper 8 bits to display if not NULL
+void unpack_10bit( const uint8_t * packed, const size_t count, uint16_t * values, uint8_t * display = NULL );
+
+/// Shift count values right by shift and saturate them to 8 bits, the display values of frames
+/// that were not unpacked here, 32 values at a time with SSE2
+void scale_to_8bit( const uint16_t * values, const size_t count, const int shift, uint8_t * display );
+
+/// Unpack count values of the given bit width one bit at a time, in the way of libfreenect's
+/// own convert_packed_to_16bit, as the reference for tests and benchmarks
+void unpack_reference( const uint8_t * packed, const int bits, const size_t count, uint16_t * values );
+
+/// Number of bytes of count packed values of the given bit width
+inline size_t packed_size( const int bits, const size_t count ){
+    return (count * bits + 7) / 8;
+}
+
+#endif // UNPACK_H